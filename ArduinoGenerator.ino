@@ -166,14 +166,6 @@
 #include "Errors.h"
 #include "USART.h"
 
-//
-//	The CONSOLE device
-//	==================
-//
-static Byte_Queue<32>	console_in;
-static Byte_Queue<128>	console_out;
-static USART_IO		console;
-			
 
 //
 //	DCC Programming Confirmations
@@ -268,9 +260,34 @@ static USART_IO		console;
 //				data being return through the serial
 //				connection.
 //
+//	DEBUG_ISR_CYCLES	Define to include code which measures the
+//				number of clock cycles used by the signal
+//				generator and ADC interrupt routines,
+//				separated by the path taken through the
+//				signal generator (mid bit, bit change and
+//				buffer change).  A summary (min, mean and
+//				max) is output periodically and an error
+//				is raised for every period in which the
+//				longest path exceeds ISR_CYCLE_BUDGET
+//				percent of the interrupt window.  Also
+//				define USART_ISR_TIMING (in USART.h) to
+//				measure the USART interrupt routines.
+//				The summary is mixed in with the command
+//				replies, so (like the options above) this
+//				is for bench testing only.
+//
+//	DEBUG_ISR_PATH		Define to have the signal generator write
+//				the path it has taken (as above) into the
+//				GPIOR0 register as it exits.  This costs
+//				two instructions and is used by the
+//				simulator benchmark in extras/isr_bench
+//				to split the routine's timings by path.
+//
 //#define DEBUG_BUFFER_MANAGER	1
 //#define DEBUG_BIT_SLICER	1
 //#define DEBUG_CONFIRMATION	(SHIELD_OUTPUT_DRIVERS-1)
+//#define DEBUG_ISR_CYCLES	1
+//#define DEBUG_ISR_PATH	1
 
 //
 //	Define macro to simplify capturing the difference between
@@ -282,6 +299,131 @@ static USART_IO		console;
 #define SELECT_PROG(y,n)	n
 #endif
 
+//
+//	Signal Generation Timing
+//	========================
+//
+//	By default the DCC signal is generated from a fixed period
+//	interrupt (a "tick" of 14.5 us) with the interrupt service
+//	routine counting down ticks to find the end of each half bit.
+//	This places a hard limit on the time any other interrupt
+//	routine may block the signal generator (a single tick) and
+//	costs roughly 69,000 interrupts each second.
+//
+//	Defining SIGNAL_HALF_BIT_TIMER changes the way the timer
+//	hardware is used:  The timer compare register is reprogrammed
+//	by the interrupt service routine with the full duration of the
+//	next half bit (58 us or 100 us) so that an interrupt is only
+//	raised when the output actually needs to be flipped.  This
+//	reduces the interrupt rate to between 10,000 and 17,200 per
+//	second and extends the window other interrupts have before
+//	they distort the signal to the duration of a half bit.
+//
+//	The timer (and pre-scaler) selected is defined as part of the
+//	hardware specific configuration (following).
+//
+//#define SIGNAL_HALF_BIT_TIMER
+
+//
+//	Signal Data Encoding
+//	====================
+//
+//	By default each transmission buffer holds its DCC packet as
+//	a pre-computed series of "bit transitions" (the lengths of the
+//	alternating runs of "1"s and "0"s) which the interrupt service
+//	routine simply counts through.  This is quick for the interrupt
+//	routine but costs between 36 and 64 bytes of SRAM per buffer.
+//
+//	Defining SIGNAL_RAW_PACKETS keeps just the bytes of the packet
+//	(with its preamble and postamble lengths) in each buffer and
+//	has the interrupt service routine shift the bits out of the
+//	bytes as they are transmitted.  This is a little more work for
+//	the interrupt routine at the start of every bit, but uses only
+//	9 bytes per buffer, allowing (roughly) three times as many
+//	mobile decoder buffers in the same memory.
+//
+//#define SIGNAL_RAW_PACKETS
+
+//
+//	Programming Track Signal
+//	========================
+//
+//	Normally the programming track is driven from the same signal
+//	as the operations track, the circular buffer being reshaped to
+//	hold only the buffers for one track or the other, so only one
+//	of the tracks can be powered at a time.
+//
+//	Defining SIGNAL_PROG_STREAM gives the programming track its own
+//	signal "stream" (its own transmission buffer, bit position and
+//	direction pins) generated alongside the operations track signal
+//	by the same interrupt service routine.  Both tracks can then be
+//	powered together (see the 'P' command) so decoders can be
+//	programmed without stopping the railway.
+//
+//	The second stream is counted down in the same timer "tick" as
+//	the first, so this cannot be used with SIGNAL_HALF_BIT_TIMER.
+//
+//#define SIGNAL_PROG_STREAM
+
+#ifdef SIGNAL_PROG_STREAM
+#ifndef PROGRAMMING_TRACK
+#error "SIGNAL_PROG_STREAM requires PROGRAMMING_TRACK."
+#endif
+#ifdef SIGNAL_HALF_BIT_TIMER
+#error "SIGNAL_PROG_STREAM cannot be used with SIGNAL_HALF_BIT_TIMER."
+#endif
+#endif
+
+//
+//	District Signal Streams
+//	=======================
+//
+//	Normally every district of the operations track carries the
+//	same signal, so every packet is sent to every district and
+//	the districts share the available bandwidth.
+//
+//	Defining SIGNAL_DISTRICT_STREAMS gives each operations track
+//	district its own signal stream.  Accessory and new mobile
+//	commands are still sent to every district, but each district
+//	also has its own mobile refresh buffers which only refresh
+//	decoders the host has placed in that district (see the 'T'
+//	command).  Decoders which have not been placed are refreshed
+//	in every district.
+//
+//	This requires a shield with all the direction pins in one
+//	port (SHIELD_PORT_DIRECT), the programming track (if any)
+//	must have its own stream (SIGNAL_PROG_STREAM) and, like that
+//	option, it cannot be used with SIGNAL_HALF_BIT_TIMER.
+//
+//#define SIGNAL_DISTRICT_STREAMS
+
+#if defined( SIGNAL_DISTRICT_STREAMS )&& defined( SIGNAL_HALF_BIT_TIMER )
+#error "SIGNAL_DISTRICT_STREAMS cannot be used with SIGNAL_HALF_BIT_TIMER."
+#endif
+
+//
+//	Accessory State Store
+//	=====================
+//
+//	The firmware records the state last commanded for each
+//	accessory (see the 'Y' command).  Normally this record is
+//	held in RAM, starts empty after each restart and, on the
+//	smaller parts, only covers the lower accessory numbers (or,
+//	on the smallest, none at all).
+//
+//	Defining ACCESSORY_STATE_STORE keeps the record in the top
+//	of the EEPROM instead, covering every accessory on all parts
+//	and surviving a restart, so the host can read back the
+//	turnout positions instead of throwing them all again.  The
+//	EEPROM is written in the background by the main loop, and an
+//	EEPROM byte is only written when a state actually changes
+//	(repeated commands are not sent or recorded), but a layout
+//	which switches one accessory continuously will eventually
+//	wear out the EEPROM.  This reduces the space for storing the
+//	function states of forgotten decoders.
+//
+//#define ACCESSORY_STATE_STORE
+
 //
 //	Hardware Specific Configuration Definitions
 //	===========================================
@@ -401,6 +543,27 @@ static USART_IO		console;
 
 #endif
 
+//
+//	The CONSOLE device
+//	==================
+//
+//	Console input is held in the queue until the main loop
+//	takes it.  At the top line speeds (see the [B] command) a
+//	byte arrives every 10us (1000000 baud) to 40us (250000
+//	baud), so the queue covers a main loop pass of only 0.3ms
+//	to 1.3ms on the ATmega328, 0.6ms to 2.6ms on the ATmega32U4
+//	and 1.3ms to 5ms on the ATmega2560 and ATmega4809.  A byte arriving with the queue full is dropped and
+//	reported as USART_IO_ERR_DROPPED.  The queue cannot be more
+//	than 128 bytes on the AVR (data_size is a byte).
+//
+#define CONSOLE_INPUT	SELECT_SML( 32, 64, 128 )
+#define CONSOLE_OUTPUT	128
+
+static SPSC_Byte_Queue<CONSOLE_INPUT>	console_in;
+static SPSC_Byte_Queue<CONSOLE_OUTPUT>	console_out;
+static USART_IO		console;
+
+
 //
 //	Liquid Crystal Display
 //	======================
@@ -549,6 +712,13 @@ static unsigned long now;
 #define PROT_IN_CHAR		'['
 #define PROT_OUT_CHAR		']'
 
+//
+//	PROT_BINARY_CHAR	The start of a binary command frame (see
+//				the 'X' command).  This can never form
+//				part of a text command.
+//
+#define PROT_BINARY_CHAR	0x80
+
 //
 //	Define the Speed and buffer size used when accessing the
 //	serial port.
@@ -575,6 +745,13 @@ static unsigned long now;
 #define SERIAL_BAUD_RATE_STR	"38400"
 #endif
 
+//
+//	The host can change the line speed at run time (see the 'B'
+//	command).  If no command arrives at the new speed within this
+//	many milliseconds the firmware returns to the previous speed.
+//
+#define LINE_SPEED_CONFIRM	2000
+
 //
 //	High Level Configuration values.
 //	================================
@@ -591,12 +768,6 @@ static unsigned long now;
 //
 #define MAXIMUM_DCC_COMMAND	6
 
-//
-//	Define the maximum number of bytes that can be accepted as
-//	a complete input command.
-//
-#define MAXIMUM_DCC_CMD		32
-
 //
 //	Define a maximum number of characters that are required to
 //	formulate the host reply to a command being received successfully.
@@ -619,8 +790,29 @@ static unsigned long now;
 //		A .. A+M-1	Mobile, persistent DCC packets
 //		A+M .. A+M+P-1	Programming track buffers.
 //
+//	The far smaller raw packets (see SIGNAL_RAW_PACKETS) allow for
+//	more mobile buffers in the same memory.
+//
+//	With SIGNAL_DISTRICT_STREAMS the mobile buffers only carry new
+//	commands (the refresh being taken over by the per-district
+//	refresh buffers) so fewer are needed:
+//
+//		A+M .. A+M+R-1	District refresh buffers, R for
+//				each district stream in turn.
+//
 #define ACCESSORY_TRANS_BUFFERS	SELECT_SML( 5, 6, 8 )
+#ifdef SIGNAL_DISTRICT_STREAMS
+#define MOBILE_TRANS_BUFFERS	SELECT_SML( 3, 4, 6 )
+#define DISTRICT_REFRESH_BUFFERS	SELECT_SML( 1, 2, 3 )
+#define REFRESH_TRANS_BUFFERS	(DISTRICT_STREAMS*DISTRICT_REFRESH_BUFFERS)
+#else
+#ifdef SIGNAL_RAW_PACKETS
+#define MOBILE_TRANS_BUFFERS	SELECT_SML( 11, 16, 24 )
+#else
 #define MOBILE_TRANS_BUFFERS	SELECT_SML( 4, 6, 8 )
+#endif
+#define REFRESH_TRANS_BUFFERS	0
+#endif
 //
 //	Note, number of buffers for programming only valid as 1
 //	if a programming track is supported, or 0 if it is
@@ -634,7 +826,8 @@ static unsigned long now;
 //
 #define ACCESSORY_BASE_BUFFER	0
 #define MOBILE_BASE_BUFFER	(ACCESSORY_BASE_BUFFER+ACCESSORY_TRANS_BUFFERS)
-#define PROGRAMMING_BASE_BUFFER	(MOBILE_BASE_BUFFER+MOBILE_TRANS_BUFFERS)
+#define REFRESH_BASE_BUFFER	(MOBILE_BASE_BUFFER+MOBILE_TRANS_BUFFERS)
+#define PROGRAMMING_BASE_BUFFER	(REFRESH_BASE_BUFFER+REFRESH_TRANS_BUFFERS)
 
 //
 //	Define the total number of transmission buffers that will
@@ -643,7 +836,7 @@ static unsigned long now;
 //	This is a composition of the number of buffer allocated
 //	to each section.
 //
-#define TRANSMISSION_BUFFERS	(ACCESSORY_TRANS_BUFFERS+MOBILE_TRANS_BUFFERS+PROGRAMMING_BUFFERS)
+#define TRANSMISSION_BUFFERS	(ACCESSORY_TRANS_BUFFERS+MOBILE_TRANS_BUFFERS+REFRESH_TRANS_BUFFERS+PROGRAMMING_BUFFERS)
 
 //
 //	Various DCC protocol based values
@@ -971,6 +1164,41 @@ static const SHIELD_DRIVER shield_output[ SHIELD_OUTPUT_DRIVERS ] PROGMEM = {
 #endif
 #endif
 
+//
+//	Signal Streams
+//	--------------
+//
+//	The interrupt routine generates one DCC signal "stream" for
+//	the operations track and, with SIGNAL_PROG_STREAM, a second
+//	for the programming track.  With SIGNAL_DISTRICT_STREAMS the
+//	operations track has a stream for each of its districts (every
+//	driver other than the programming track driver), numbered in
+//	the order they appear in shield_output[].  Each stream works
+//	its way around its own circular buffer and drives its own
+//	direction pins.
+//
+#ifdef SIGNAL_DISTRICT_STREAMS
+#ifndef SHIELD_PORT_DIRECT
+#error "SIGNAL_DISTRICT_STREAMS requires a SHIELD_PORT_DIRECT motor shield."
+#endif
+#if defined( PROGRAMMING_TRACK )&& !defined( SIGNAL_PROG_STREAM )
+#error "SIGNAL_DISTRICT_STREAMS requires SIGNAL_PROG_STREAM with PROGRAMMING_TRACK."
+#endif
+#define DISTRICT_STREAMS	(SHIELD_OUTPUT_DRIVERS-PROGRAMMING_BUFFERS)
+#else
+#define DISTRICT_STREAMS	1
+#endif
+#ifdef SIGNAL_PROG_STREAM
+#define SIGNAL_STREAMS		(DISTRICT_STREAMS+1)
+#else
+#define SIGNAL_STREAMS		DISTRICT_STREAMS
+#endif
+#define MAIN_STREAM		0
+#define PROG_STREAM		DISTRICT_STREAMS
+#if SIGNAL_STREAMS > 8
+#error "Signal streams are flagged in a byte, so at most 8 are possible."
+#endif
+
 //
 //	Timing, Protocol and Data definitions.
 //	======================================
@@ -1008,6 +1236,8 @@ static const SHIELD_DRIVER shield_output[ SHIELD_OUTPUT_DRIVERS ] PROGMEM = {
 //	base starting point.
 //
 
+#ifndef SIGNAL_HALF_BIT_TIMER
+
 #if F_CPU == 16000000
 //
 //	Arduino Uno (or equivalent)
@@ -1085,6 +1315,90 @@ static const SHIELD_DRIVER shield_output[ SHIELD_OUTPUT_DRIVERS ] PROGMEM = {
 #define TICKS_FOR_ONE	4
 #define TICKS_FOR_ZERO	7
 
+#else
+
+//
+//	Half bit timing.
+//
+//	In this mode the interrupt timer is programmed with the
+//	duration of each half bit directly, so we need a timer clock
+//	where both 58 us and 100 us fit into the 8-bit compare
+//	register.  A pre-scaler of 8 is selected for all supported
+//	clock rates.
+//
+//	As the timer counts from zero up to *and including* the value
+//	in the compare register, the values used are one less than
+//	the number of timer clocks required.
+//
+#define TIMER_CLOCK_PRESCALER	8
+
+#if F_CPU == 16000000
+//
+//	Arduino Uno (or equivalent)
+//
+//		16 (MHz) / 8 (pre-scaler) = 2 timer clocks per microsecond
+//
+//		58 (microseconds) x 2 = 116 (0% error)
+//		100 (microseconds) x 2 = 200 (0% error)
+//
+#define TICKS_FOR_ONE	(116-1)
+#define TICKS_FOR_ZERO	(200-1)
+
+#else
+
+#if F_CPU == 20000000
+//
+//	Arduino Mega (or equivalent)
+//
+//		20 (MHz) / 8 (pre-scaler) = 2.5 timer clocks per microsecond
+//
+//		58 (microseconds) x 2.5 = 145 (0% error)
+//		100 (microseconds) x 2.5 = 250 (0% error)
+//
+#define TICKS_FOR_ONE	(145-1)
+#define TICKS_FOR_ZERO	(250-1)
+
+#else
+
+//
+//	The target MCU clock frequency has not been accounted for.
+//
+#error "Half bit timer values need to be calculated for this clock rate."
+
+#endif
+#endif
+
+#endif
+
+//
+//	Signal jitter measurement.
+//
+//	On entry to the signal generator interrupt routine the timer
+//	counter holds the number of timer clocks since the interrupt
+//	became due (the timer is restarted by the compare match).  This
+//	"lateness" is caused by other interrupt routines (or critical
+//	sections) running at the time and directly delays the edge
+//	of the DCC signal.
+//
+//	The lateness of every edge is counted into a short histogram
+//	of JITTER_BUCKETS buckets, each covering (1 << JITTER_SHIFT)
+//	timer clocks, with the final bucket catching everything later.
+//	The shift is chosen to give buckets close to 2 us wide.
+//
+#define JITTER_BUCKETS		8
+
+#if TIMER_CLOCK_PRESCALER == 1
+//
+//	16 timer clocks per microsecond: 32 clocks is 2 us.
+//
+#define JITTER_SHIFT		5
+#else
+//
+//	2 or 2.5 timer clocks per microsecond: 4 clocks is 2 or 1.6 us.
+//
+#define JITTER_SHIFT		2
+#endif
+
 
 //
 //	LCD structure
@@ -1211,7 +1525,12 @@ PENDING_PACKET {
 //	buffers mostly free for transient commands which by their nature
 //	only tie up pending packets for short periods of time.
 //
-#define PENDING_PACKETS	TRANSMISSION_BUFFERS
+//	On top of these are the records which can be held in the
+//	accessory command queue (see the 'A' command), where accessory
+//	commands wait while every accessory buffer is busy.
+//
+#define ACCESSORY_QUEUE	SELECT_SML( 6, 16, 32 )
+#define PENDING_PACKETS	( TRANSMISSION_BUFFERS + ACCESSORY_QUEUE )
 
 //
 //	Define the the pending packet records and the head of the free
@@ -1220,6 +1539,23 @@ PENDING_PACKET {
 static PENDING_PACKET pending_dcc_packet[ PENDING_PACKETS ];
 static PENDING_PACKET *free_pending_packets;
 
+//
+//	Accessory commands are appended to a queue of pending records
+//	and moved, in order, into the accessory buffers as these become
+//	available.  A route of turnouts can be sent as a single burst
+//	of commands, and each is confirmed (as before) when it is
+//	actually sent.
+//
+//	accessory_queue		First record in the queue (or NULL).
+//	accessory_queue_tail	Address of the pointer to fill in
+//				when a record is appended.
+//	accessory_queued	Number of records in the queue, no
+//				more than ACCESSORY_QUEUE.
+//
+static PENDING_PACKET	*accessory_queue,
+			**accessory_queue_tail;
+static byte		accessory_queued;
+
 //
 //	Copy a DCC command to a new location and append the parity data.
 //	Returns length of data in the target location.
@@ -1305,6 +1641,18 @@ static PENDING_PACKET *release_pending_recs( PENDING_PACKET *head, bool one ) {
 	return( head );
 }
 
+//
+//	Return true if there are at least count free pending
+//	packets, so a command needing that many can be checked
+//	before anything is changed.
+//
+static bool pending_recs_free( byte count ) {
+	PENDING_PACKET	*ptr;
+
+	for( ptr = free_pending_packets; count && ptr; ptr = ptr->next ) count--;
+	return( count == 0 );
+}
+
 //
 //	DCC Accessory Address conversion
 //	--------------------------------
@@ -1334,424 +1682,1232 @@ static int internal_acc_subadrs( int target ) {
 }
 
 //
-//	Decoder Function value cache
-//	----------------------------
+//	Accessory State Shadow
+//	----------------------
+//
+//	The last state commanded for each accessory, so that a command
+//	which would not change it can be acknowledged without being
+//	sent, and so that the host can read the states back (see the
+//	'Y' command).  Two bit arrays indexed by the external accessory
+//	number (less one): whether a state has been commanded, and that
+//	state.
+//
+//	Normally the arrays are held in RAM and start empty at each
+//	restart; the medium parts only have room to cover the lower
+//	accessory numbers and the small part cannot spare the RAM at
+//	all.  With ACCESSORY_STATE_STORE they are held in
+//	the EEPROM instead (reading the EEPROM is nearly as quick as
+//	RAM, except while a write is in progress) so every accessory
+//	is covered on every part and the states survive a restart.
+//
+#ifdef ACCESSORY_STATE_STORE
+#define ACCESSORY_SHADOW	MAX_ACCESSORY_EXT_ADDRESS
+#else
+#define ACCESSORY_SHADOW	SELECT_SML( 0, 1024, MAX_ACCESSORY_EXT_ADDRESS )
+#endif
+
+#define ACCESSORY_SHADOW_BYTES	( ACCESSORY_SHADOW >> 3 )
+#define ACCESSORY_KNOWN		0
+#define ACCESSORY_STATE		1
+
 //
-//	Native DCC Generator code requires a function status cache to
-//	support modification of an individual decoder function.  This
-//	is required as (as far as I can tell) there is no mechanism to
-//	allow individual function adjustment without setting/resetting
-//	between 3 to 7 other functions at the same time.
+//	The number of accessories reported in each 'Y' reply, sized
+//	so that a reply fits comfortably in the console output queue.
 //
+#define ACCESSORY_PAGE		64
+
+#ifdef ACCESSORY_STATE_STORE
+
+#include <EEPROM.h>
 
 //
-//	Define a number of cache records and bytes for bit storage in
-//	each record.  We calculate FUNCTION_BIT_ARRAY based on the
-//	MIN and MAX function numbers provided (the 7+ ensures correct
-//	rounding in boundary cases).
+//	Each EEPROM write cycle takes about 3.3 ms, so the store is
+//	never written while a command is being handled.  Instead:
 //
-//	We will base the function cache size on the maximum number of
-//	DCC mobile decoders we can have active in parallel.
+//	The accessories are divided into groups of 16, each kept in
+//	a record tagged with the "generation" (held in the store
+//	header) in which it was written.  Records of any other
+//	generation are treated as empty, so forgetting every state
+//	('Y 0') is simply a new generation, one word to write.
 //
-#define FUNCTION_CACHE_RECS	MOBILE_TRANS_BUFFERS
-#define FUNCTION_BIT_ARRAY	((( 1 + MAX_FUNCTION_NUMBER - MIN_FUNCTION_NUMBER )+7 ) >> 3 )
+//	The records being changed are held in a small RAM cache and
+//	written back from the main loop a byte at a time, whenever
+//	the EEPROM is ready (see service_accessory_store()).  The
+//	generation is last to be written, so a record only becomes
+//	valid once the rest of it is in place.
+//
+//	If every cache entry is waiting to be written an accessory
+//	command in another group is refused as busy (as when the
+//	accessory queue is full) until one has been written.
+//
+#define ACCESSORY_GROUP		16
+#define ACCESSORY_GROUP_BYTES	( ACCESSORY_GROUP >> 3 )
+#define ACCESSORY_GROUPS	( ACCESSORY_SHADOW / ACCESSORY_GROUP )
+#define ACCESSORY_CACHE_SIZE	SELECT_SML( 6, 8, 16 )
+#define ACCESSORY_NO_GROUP	0xff
 
 //
-//	The structure used to cache function values per decoder so that
-//	the "block" function setting DCC packet can be used.
+//	The store record for a group.
 //
-#define FUNCTION_CACHE struct func_cache
-FUNCTION_CACHE {
-	int		target;
-	byte		bits[ FUNCTION_BIT_ARRAY ];
-	FUNCTION_CACHE	*next,
-			**prev;
+#define ACCESSORY_RECORD struct accessory_record
+ACCESSORY_RECORD {
+	word		generation;
+	byte		bits[ 2 ][ ACCESSORY_GROUP_BYTES ];
 };
-static FUNCTION_CACHE	function_rec[ FUNCTION_CACHE_RECS ],
-			*function_cache;
-//
-//	Function to initialise the cache records empty.
+
 //
-//	We will "pre-fill" the cache with empty records so that the code can
-//	always assume that there are records in the cache, because there are.
+//	The store sits at the very top of the EEPROM: a header of a
+//	marker (showing the store has been set up) and the current
+//	generation, followed by the group records.
 //
-static void init_function_cache( void ) {
-	FUNCTION_CACHE	**tail, *ptr;
-	
-	tail = &function_cache;
-	for( byte i = 0; i < FUNCTION_CACHE_RECS; i++ ) {
-		//
-		//	Note current record.
-		//
-		ptr = function_rec + i;
-		//
-		//	Empty the record.
-		//
-		ptr->target = 0;
-		for( byte j = 0; j < FUNCTION_BIT_ARRAY; ptr->bits[ j++ ] = 0 );
-		//
-		//	Link in the record.
-		//
-		*tail = ptr;
-		ptr->prev = tail;
-		tail = &( ptr->next );
-	}
-	*tail = NULL;
-}
+#define ACCESSORY_STORE_MARKER	0xAC16
+#define ACCESSORY_STORE_BASE	( E2END + 1 - 2 * sizeof( word ) - ACCESSORY_GROUPS * sizeof( ACCESSORY_RECORD ))
+#define ACCESSORY_STORE_GEN	( ACCESSORY_STORE_BASE + sizeof( word ))
+#define ACCESSORY_STORE_ADRS(g)	( ACCESSORY_STORE_BASE + 2 * sizeof( word ) + ( g ) * sizeof( ACCESSORY_RECORD ))
+
+static_assert( ACCESSORY_GROUPS < ACCESSORY_NO_GROUP, "Too many accessory groups" );
 
 //
-//	Define the lookup and manage cache code.
+//	A cached group record.
 //
-static FUNCTION_CACHE *find_func_cache( int target ) {
-	FUNCTION_CACHE	**adrs,
-			*last,
-			*ptr;
+//	group		The group held, ACCESSORY_NO_GROUP if none.
+//	dirty		True until the store matches bits.
+//	bits		The known and state bits of the group.
+//
+#define ACCESSORY_CACHE_ENTRY struct accessory_cache_entry
+ACCESSORY_CACHE_ENTRY {
+	byte		group;
+	bool		dirty;
+	byte		bits[ 2 ][ ACCESSORY_GROUP_BYTES ];
+};
 
-	ASSERT( target >= MINIMUM_DCC_ADDRESS );
-	ASSERT( target <= MAXIMUM_DCC_ADDRESS );
+static ACCESSORY_CACHE_ENTRY	accessory_cache[ ACCESSORY_CACHE_SIZE ];
+static byte			accessory_cache_next;
+static word			accessory_generation;
+static bool			accessory_generation_dirty;
 
-	adrs = &function_cache;
-	last = NULL;
-	while(( ptr = *adrs ) != NULL ) {
-		//
-		//	Is this the one?
-		//
-		if( target == ptr->target ) {
-			//
-			//	Yes, so move to top of the list (if not already there)
-			//	so that access to this record is as quick as possible
-			//	for subsequent requests.
-			//
-			if( function_cache != ptr ) {
-				//
-				//	Detach from the list.
-				//
-				if(( *( ptr->prev ) = ptr->next )) ptr->next->prev = ptr->prev;
-				//
-				//	Add to head of list.
-				//
-				ptr->next = function_cache;
-				function_cache->prev = &( ptr->next );
-				function_cache = ptr;
-				ptr->prev = &function_cache;
+//
+//	Return the cache entry holding a group, or NULL.
+//
+static ACCESSORY_CACHE_ENTRY *find_accessory_cache( byte g ) {
+	for( byte i = 0; i < ACCESSORY_CACHE_SIZE; i++ ) if( accessory_cache[ i ].group == g ) return( accessory_cache + i );
+	return( NULL );
+}
+
+//
+//	Return the cache entry holding a group, bringing it in from
+//	the store (in place of an entry with nothing to write) if
+//	required.  Returns NULL if every entry is waiting to be
+//	written, or if the EEPROM is busy with a write (reading it
+//	would wait for the write to finish).
+//
+static ACCESSORY_CACHE_ENTRY *load_accessory_cache( byte g ) {
+	ACCESSORY_CACHE_ENTRY	*ptr;
+	ACCESSORY_RECORD	rec;
+
+	if(( ptr = find_accessory_cache( g ))) return( ptr );
+	if( !eeprom_is_ready()) return( NULL );
+	for( byte n = 0; n < ACCESSORY_CACHE_SIZE; n++ ) {
+		ptr = accessory_cache + accessory_cache_next;
+		if(( accessory_cache_next += 1 ) >= ACCESSORY_CACHE_SIZE ) accessory_cache_next = 0;
+		if( !ptr->dirty ) {
+			EEPROM.get( ACCESSORY_STORE_ADRS( g ), rec );
+			ptr->group = g;
+			for( byte t = 0; t < 2; t++ ) {
+				for( byte j = 0; j < ACCESSORY_GROUP_BYTES; j++ ) {
+					ptr->bits[ t ][ j ] = ( rec.generation == accessory_generation )? rec.bits[ t ][ j ]: 0;
+				}
 			}
 			return( ptr );
 		}
-		//
-		//	Note last record we saw.
-		//
-		last = ptr;
-		adrs = &( ptr->next );
 	}
-	//
-	//	Nothing found, so we re-use the oldest record in the list.
-	//	Start by unlinking it from the end of the list.
-	//
-	*( last->prev ) = NULL;
-	//
-	//	Replace with new target and empty function settings.
-	//
-	last->target = target;
-	for( byte i = 0; i < FUNCTION_BIT_ARRAY; last->bits[ i++ ] = 0 );
-	//
-	//	Link onto head of cache.
-	//
-	last->next = function_cache;
-	function_cache->prev = &( last->next );
-	function_cache = last;
-	last->prev = &function_cache;
-	//
-	//	Done.
-	//
-	return( last );
+	return( NULL );
 }
 
 //
-//	Routine applies a boolean value for a specified function
-//	on a specified target number.
-//
+//	Read a byte of a table, from the cache or the store.  Groups
+//	not in the cache are read from the EEPROM, so the caller must
+//	check eeprom_is_ready() first.
 //
-static bool update_function( int target, byte func, bool state ) {
-	FUNCTION_CACHE	*ptr;
-	byte		i, b; 
+static byte get_accessory_shadow( byte table, byte i ) {
+	ACCESSORY_CACHE_ENTRY	*ptr;
+	byte			g;
+	word			gen;
 
-	ASSERT( func <= MAX_FUNCTION_NUMBER );
+	g = i / ACCESSORY_GROUP_BYTES;
+	i %= ACCESSORY_GROUP_BYTES;
+	if(( ptr = find_accessory_cache( g ))) return( ptr->bits[ table ][ i ]);
+	EEPROM.get( ACCESSORY_STORE_ADRS( g ), gen );
+	if( gen != accessory_generation ) return( 0 );
+	return( EEPROM.read( ACCESSORY_STORE_ADRS( g ) + sizeof( word ) + table * ACCESSORY_GROUP_BYTES + i ));
+}
+static void set_accessory_shadow( byte table, byte i, byte v ) {
+	ACCESSORY_CACHE_ENTRY	*ptr;
 
-	ptr = find_func_cache( target );
-	i = ( func - MIN_FUNCTION_NUMBER ) >> 3;
-	b = 1 << (( func - MIN_FUNCTION_NUMBER ) & 7 );
+	ptr = load_accessory_cache( i / ACCESSORY_GROUP_BYTES );
 
-	if( state ) {
-		//
-		//	Bit set already?
-		//
-		if( ptr->bits[ i ] & b ) return( false );
-		//
-		//	Yes.
-		//
-		ptr->bits[ i ] |= b;
-		return( true );
+	ASSERT( ptr != NULL );
+
+	i %= ACCESSORY_GROUP_BYTES;
+	if( ptr->bits[ table ][ i ] != v ) {
+		ptr->bits[ table ][ i ] = v;
+		ptr->dirty = true;
 	}
-	//
-	//	Bit clear already?
-	//
-	if(!( ptr->bits[ i ] & b )) return( false );
-	//
-	//	Yes.
-	//
-	ptr->bits[ i ] &= ~b;
-	return( true );
 }
 
 //
-//	Routine returns 0 or the supplied value based on the
-//	supplied function number being off or on.
+//	Return true if the state of an accessory can be checked and
+//	recorded now (if its group is in, or can be brought into, the
+//	cache).  Once it has returned true, accessory_unchanged() and
+//	record_accessory() work from the cache without reading the
+//	EEPROM.
 //
-static byte get_function( int target, byte func, byte val ) {
-	FUNCTION_CACHE	*ptr;
-	byte		i, b; 
+static bool accessory_shadow_room( int target ) {
+	if(( target -= MIN_ACCESSORY_EXT_ADDRESS ) >= ACCESSORY_SHADOW ) return( true );
+	return( load_accessory_cache( target / ACCESSORY_GROUP ) != NULL );
+}
 
-	ASSERT( func <= MAX_FUNCTION_NUMBER );
+//
+//	Called on every pass through the main loop to write the next
+//	byte of the store which differs from the new generation or a
+//	cached record (working backwards through each record, so the
+//	generation is written last).
+//
+static void service_accessory_store( void ) {
+	ACCESSORY_RECORD	rec;
+	byte			*image;
+	word			adrs;
 
-	ptr = find_func_cache( target );
-	i = ( func - MIN_FUNCTION_NUMBER ) >> 3;
-	b = 1 << (( func - MIN_FUNCTION_NUMBER ) & 7 );
+	if( !eeprom_is_ready()) return;
+	if( accessory_generation_dirty ) {
+		image = (byte *)( &accessory_generation );
+		for( byte i = 0; i < sizeof( word ); i++ ) {
+			if( EEPROM.read( ACCESSORY_STORE_GEN + i ) != image[ i ]) {
+				EEPROM.write( ACCESSORY_STORE_GEN + i, image[ i ]);
+				return;
+			}
+		}
+		accessory_generation_dirty = false;
+	}
+	for( byte n = 0; n < ACCESSORY_CACHE_SIZE; n++ ) {
+		ACCESSORY_CACHE_ENTRY	*ptr;
+
+		ptr = accessory_cache + n;
+		if( !ptr->dirty ) continue;
+		rec.generation = accessory_generation;
+		for( byte t = 0; t < 2; t++ ) for( byte j = 0; j < ACCESSORY_GROUP_BYTES; j++ ) rec.bits[ t ][ j ] = ptr->bits[ t ][ j ];
+		adrs = ACCESSORY_STORE_ADRS( ptr->group );
+		image = (byte *)( &rec );
+		for( byte i = sizeof( ACCESSORY_RECORD ); i--; ) {
+			if( EEPROM.read( adrs + i ) != image[ i ]) {
+				EEPROM.write( adrs + i, image[ i ]);
+				return;
+			}
+		}
+		ptr->dirty = false;
+	}
+}
 
-	if( ptr->bits[ i ] & b ) return( val );
-	return( 0 );
+#elif ACCESSORY_SHADOW > 0
+
+static byte	accessory_shadow[ 2 ][ ACCESSORY_SHADOW_BYTES ];
+
+static byte get_accessory_shadow( byte table, byte i ) {
+	return( accessory_shadow[ table ][ i ]);
+}
+static void set_accessory_shadow( byte table, byte i, byte v ) {
+	accessory_shadow[ table ][ i ] = v;
 }
 
+#else
+
 //
-//	Storage of Transmission Data
-//	----------------------------
-//
-//	Output bit patterns are stored as an array of bytes
-//	where alternate bytes indicate the number of "1"s or "0"s
-//	to output (array index 0 represents an initial series of
-//	"1"s).
+//	No table; nothing is ever recorded.
 //
-//	While this method is less space efficient than simply
-//	storing the bytes required, it has the benefit that the
-//	inter-byte protocol "0"s and "1"s are easily captured, and
-//	interrupt code required to generate a DCC packet has fewer
-//	special case requirements and so will be faster.
+static byte get_accessory_shadow( UNUSED( byte table ), UNUSED( byte i )) {
+	return( 0 );
+}
+static void set_accessory_shadow( UNUSED( byte table ), UNUSED( byte i ), UNUSED( byte v )) {
+}
+
+#endif
+
+#ifdef ACCESSORY_STATE_STORE
+
 //
-//	This inevitably (and correctly) offloads processing work
-//	from the interrupt routine to the non-time-critical general
-//	IO code.
+//	Forget the states of every accessory by starting a new
+//	generation (never that of erased EEPROM).
 //
+static void clear_accessory_shadow( void ) {
+	if(( accessory_generation += 1 ) == 0xffff ) accessory_generation = 0;
+	accessory_generation_dirty = true;
+	for( byte i = 0; i < ACCESSORY_CACHE_SIZE; i++ ) {
+		accessory_cache[ i ].group = ACCESSORY_NO_GROUP;
+		accessory_cache[ i ].dirty = false;
+	}
+}
 
 //
-//	Define limits on the number of bit transitions which a
-//	transmission buffer can contain.
+//	Prepare the store at start up.  The first time (or after the
+//	store has moved) a generation which no record carries is
+//	chosen, so whatever the EEPROM held is treated as empty.
 //
-//	The maximum size for a DCC command that this program can
-//	process is defined as MAXIMUM_DCC_COMMAND, however this is
-//	and extreme case, and so the bit transition array will be
-//	based (for the moment) on a series of 4 bytes.
+static void init_accessory_shadow( void ) {
+	word	marker, gen;
+	byte	g;
+
+	for( byte i = 0; i < ACCESSORY_CACHE_SIZE; i++ ) {
+		accessory_cache[ i ].group = ACCESSORY_NO_GROUP;
+		accessory_cache[ i ].dirty = false;
+	}
+	accessory_cache_next = 0;
+	accessory_generation_dirty = false;
+	EEPROM.get( ACCESSORY_STORE_BASE, marker );
+	if( marker == ACCESSORY_STORE_MARKER ) {
+		EEPROM.get( ACCESSORY_STORE_GEN, accessory_generation );
+		return;
+	}
+	accessory_generation = 0;
+	g = 0;
+	while( g < ACCESSORY_GROUPS ) {
+		EEPROM.get( ACCESSORY_STORE_ADRS( g ), gen );
+		if( gen == accessory_generation ) {
+			accessory_generation++;
+			g = 0;
+		}
+		else {
+			g++;
+		}
+	}
+	EEPROM.put( ACCESSORY_STORE_GEN, accessory_generation );
+	marker = ACCESSORY_STORE_MARKER;
+	EEPROM.put( ACCESSORY_STORE_BASE, marker );
+}
+
+#else
+
 //
-//	Worst case scenario for a DCC packet is a long sequence of
-//	bytes of either 0xAA or 0x55 (individually alternating bits).
+//	Forget the states of every accessory.
 //
-//	In this case the bit array would be filled thus:
+static void clear_accessory_shadow( void ) {
+	for( word i = 0; i < ACCESSORY_SHADOW_BYTES; i++ ) set_accessory_shadow( ACCESSORY_KNOWN, i, 0 );
+}
+
 //
-//	Content					Ones	Zeros
-//	-------					----	-----
-//	Packets header of 'X' "1"s + 1 "0"	X	1
-//	(X is selected preamble length)
+//	Prepare the table at start up.
 //
-//	Byte 0xAA + 1 "0"			1	1
-//						1	1
-//						1	1
-//						1	2
+static void init_accessory_shadow( void ) {
+	clear_accessory_shadow();
+}
+
 //
-//	Byte 0xAA + 1 "0"			1	1
-//						1	1
-//						1	1
-//						1	2
+//	Every state can always be recorded.
 //
-//	Byte 0xAA + 1 "0"			1	1
-//						1	1
-//						1	1
-//						1	2
+static bool accessory_shadow_room( UNUSED( int target )) {
+	return( true );
+}
+
+#endif
+
 //
-//	Checksum 0xAA + 1 "1"			1	1
-//						1	1
-//						1	1
-//						1	1
+//	Return true if the accessory is known to be in the state
+//	supplied already.
 //
-//	End of packet "1"			1
-//	
+static bool accessory_unchanged( int target, int state ) {
+	byte	i, b;
+
+	ASSERT( target >= MIN_ACCESSORY_EXT_ADDRESS );
+	ASSERT( target <= MAX_ACCESSORY_EXT_ADDRESS );
+
+	if(( target -= MIN_ACCESSORY_EXT_ADDRESS ) >= ACCESSORY_SHADOW ) return( false );
+	i = target >> 3;
+	b = bit( target & 7 );
+	return(( get_accessory_shadow( ACCESSORY_KNOWN, i ) & b )&&((( get_accessory_shadow( ACCESSORY_STATE, i ) & b ) != 0 ) == ( state == ACCESSORY_ON )));
+}
+
 //
-//	In this situation a minimum 36 byte bit transition array would be
-//	required for the data (remember additional space required for end
-//	zero byte).
+//	Record the state commanded for an accessory.
 //
-//	Statistically this would normally hold a larger DCC packet than
-//	this.
+static void record_accessory( int target, int state ) {
+	byte	i, b, v;
+
+	ASSERT( target >= MIN_ACCESSORY_EXT_ADDRESS );
+	ASSERT( target <= MAX_ACCESSORY_EXT_ADDRESS );
+
+	if(( target -= MIN_ACCESSORY_EXT_ADDRESS ) >= ACCESSORY_SHADOW ) return;
+	i = target >> 3;
+	b = bit( target & 7 );
+	v = get_accessory_shadow( ACCESSORY_STATE, i );
+	set_accessory_shadow( ACCESSORY_STATE, i, (( state == ACCESSORY_ON )? ( v | b ): ( v & ~b )));
+	set_accessory_shadow( ACCESSORY_KNOWN, i, get_accessory_shadow( ACCESSORY_KNOWN, i ) | b );
+}
+
+//
+//	Mobile Decoder Roster
+//	---------------------
+//
+//	The firmware keeps a compact record of every mobile decoder
+//	it has been asked to control: the address, the speed and
+//	direction and the state of the decoder functions.
+//
+//	The speed and direction are required so that moving decoders
+//	can be continuously refreshed by the mobile transmission
+//	buffers, which no longer belong to one decoder each but are
+//	re-packed "just in time" with the next decoder in the roster
+//	each time they complete their transmission (see the buffer
+//	management code).  This allows the number of decoders in
+//	motion to far exceed the number of mobile buffers.
+//
+//	The function states are required as (as far as I can tell)
+//	there is no mechanism to allow individual function adjustment
+//	without setting/resetting between 3 to 7 other functions at
+//	the same time.
 //
-#define BIT_TRANSITIONS		SELECT_SML( 36, 48, 64 )
 
 //
-//	Define maximum bit iterations per byte of the bit transition array.
+//	Define the number of roster records and bytes for bit storage
+//	in each record.  We calculate FUNCTION_BIT_ARRAY based on the
+//	MIN and MAX function numbers provided (the 7+ ensures correct
+//	rounding in boundary cases).
 //
-//	It is possible to prove that this figure can never be reached as this
-//	would imply a a series of 28 byte containing just 0 bits which (apart
-//	from being an invalid DCC command, is over 4 times longer than the
-//	longest DCC command this code will handle.
+#define ROSTER_SIZE		SELECT_SML( 24, 48, 240 )
+
 //
-//	This value is applied inside verification assert statements.
+//	The number of times a moving decoder's speed and direction is
+//	sent each time it is picked up by a mobile buffer before the
+//	buffer moves on to the next moving decoder.
 //
-#define MAXIMUM_BIT_ITERATIONS	255
+#define ROSTER_REFRESH_REPEATS	1
+#define FUNCTION_BIT_ARRAY	((( 1 + MAX_FUNCTION_NUMBER - MIN_FUNCTION_NUMBER )+7 ) >> 3 )
 
 //
-//	Define the state information which is used to control the transmission
-//	buffers.
+//	The roster record.
 //
-//	The states are divided into a number of groups reflecting which section
-//	of code monitors or controls it.  The concept here is that (like a game
-//	of "ping pong") the responsibility for the buffers is handed back and
-//	forth between the bits of code.  The intention here is to avoid requiring
-//	locked out sections of code (using noInterrupts() and interrupts()) which
-//	might impact the over all timing of the firmware.
+//	target		The mobile decoder address, 0 if the record
+//			is not in use.
 //
-//	In the following table:
+//	speed		The speed and direction exactly as the DCC
+//			128 speed step command byte: direction in the
+//			top bit, 0 for stop, 1 for emergency stop or
+//			the speed plus 1.
 //
-//		State		The name of the state in this code.
-//		Monitor		Which Code section operates in this state
-//				(i.e. acts upon a buffer in that state).
-//		Role		Briefly what is going when a buffer is moved
-//				from its initial to result state).
-//		Result		State into which the code moves the buffer.
+//	bits		The function states.
 //
-//	Trying to capture state transitions here:
+//	districts	(District streams only) The district streams
+//			which refresh the decoder, as a bit mask of
+//			stream numbers.  Zero (the default) has every
+//			district refresh it.
 //
-//	State		Monitor		Role			Result
-//	-----		-------		----			------
-//	TBS_RUN		ISR		Continuous packet	TBS_RUN
-//					transmission
-//					(duration is zero)
+#define ROSTER_ENTRY struct roster_entry
+ROSTER_ENTRY {
+	int		target;
+	byte		speed,
+			bits[ FUNCTION_BIT_ARRAY ];
+#ifdef SIGNAL_DISTRICT_STREAMS
+	byte		districts;
+#endif
+};
+static ROSTER_ENTRY	roster[ ROSTER_SIZE ];
+
 //
-//	TBS_RUN		ISR		Limited packet		TBS_RUN
-//					transmission
-//					(--duration > 0 )
+//	Does a district stream refresh a roster record?
 //
-//	TBS_RUN		ISR		Limited packet		TBS_LOAD
-//					transmission
-//					(--duration == 0 )
+#ifdef SIGNAL_DISTRICT_STREAMS
+#define ROSTER_DISTRICT(r,t)	((( r )->districts == 0 )||(( r )->districts & bit( t )))
+#else
+#define ROSTER_DISTRICT(r,t)	true
+#endif
+
 //
-//	TBS_LOAD	Manager		Pending pointer not	TBS_RUN
-//					NULL, load next bit
-//					sequence from record
-//					and drop pending record
+//	The index of the next roster record to be considered for
+//	refreshing, for each district stream.
 //
-//	TBS_LOAD	Manager		Pending pointer is	TBS_EMPTY
-//					NULL.
+static byte		roster_refresh[ DISTRICT_STREAMS ];
+
 //
-//	TBS_EMPTY	IO		Create a list of	TBS_LOAD
-//					pending records and
-//					attach to a buffer
+//	Function states are refreshed too, so a decoder which has
+//	lost power (dirty track) gets its lights and sound back
+//	without the host resending them.  One function group packet
+//	is sent for every FUNCTION_REFRESH_INTERVAL speed and direction
+//	refreshes (a tunable constant, zero stops the function refresh),
+//	working through every function group with a function on, of
+//	every decoder in the roster.  For each district stream:
 //
-//	TBS_RELOAD	ISR		Synchronised load	TBS_LOAD
-//					initiated by IO code
-//					on a TBS_RUN buffer
+//	function_refresh	The index of the roster record being
+//				refreshed.
 //
-#define TBS_EMPTY	0
-#define TBS_LOAD	1
-#define TBS_RUN		2
-#define TBS_RELOAD	3
+//	function_group_refresh	The next function group of that
+//				record to consider.
+//
+//	function_refresh_due	The number of speed and direction
+//				refreshes since the last function
+//				group refresh.
+//
+static byte		function_refresh[ DISTRICT_STREAMS ],
+			function_group_refresh[ DISTRICT_STREAMS ],
+			function_refresh_due[ DISTRICT_STREAMS ];
 
 //
-//	Define a Transmission Buffer which contains the following
-//	elements:
+//	Convert between the external speed and direction values
+//	and the DCC speed byte.
 //
-//	state		The current state of this buffer.  Primary method
-//			synchronise activities between the interrupt driven
-//			signal generator code and the iteratively called
-//			management code.
+#define ROSTER_SPEED(s,d)	(byte)((( d ) << 7 )|((( s ) == EMERGENCY_STOP )? 1: ((( s ) == MINIMUM_DCC_SPEED )? 0: (( s ) + 1 ))))
+#define ROSTER_DIR(b)		((int)(( b ) >> 7 ))
+#define ROSTER_STEP(b)		((int)(( b ) & 0x7f ))
+
 //
-//	Live Transmission fields:
-//	-------------------------
+//	A decoder is moving (and so requires refreshing) if its speed
+//	step is neither stop nor emergency stop.
 //
-//	target		The DCC ID being targetted by the buffer:
-//			+ve -> mobile ID, -ve ->  negated External
-//			Accessory ID, 0 Broadcast address or programming
-//			track.
+#define ROSTER_MOVING(b)	( ROSTER_STEP( b ) > 1 )
+
 //
-//	duration	Provides a mechanism between the main IO code
-//			and the Interrupt driven DCC transmission code
-//			for scheduling the disabling the buffer.
+//	Function State Store.
+//	---------------------
 //
-//			If set as zero the buffer will run continuously.
+//	When the roster is full a stationary decoder is forgotten to
+//	make room for another, losing its function states.  Instead
+//	the function states of a forgotten decoder are kept in the
+//	EEPROM (above the constants) and restored when the decoder
+//	returns to the roster, so the host does not have to restore
+//	the functions of every decoder it has used with 'W'.
+//
+//	The store is an open addressing (linear probing) table of
+//	records.  Which records have been written since the last
+//	restart is kept in RAM, so the store is emptied at each
+//	restart without writing to it, and an empty record is found
+//	without reading the EEPROM.  A target is only looked for in
+//	the FUNCTION_STORE_PROBE records from its home record, which
+//	bounds the time a search can take.
+//
+//	If no record is free within the probe the functions of a
+//	forgotten decoder are lost (reported as FUNCTION_STORE_FULL).
+//
+//	Writing a record takes one EEPROM write cycle (about 3.3 ms)
+//	per byte, far too long to hold up the command which forgot
+//	the decoder, so records are queued in RAM until the main loop
+//	has written them a byte at a time (whenever the EEPROM is
+//	ready).  A command which would forget a decoder while the
+//	queue is full, or which needs to read a record while the
+//	EEPROM is being written, is refused as busy (the command
+//	changes nothing, so the host can simply send it again).
+//
+//	The store is sized to hold more records than the roster.
+//	The exception is ACCESSORY_STATE_STORE on the 32U4, where
+//	the top of its 1K of EEPROM holds the accessory states and
+//	the store has room for only 31 records against a roster of 48.
+//	With more decoders in use than that the store fills.
+//
+#ifdef ACCESSORY_STATE_STORE
+#define FUNCTION_STORE_RECORDS	SELECT_SML( 31, 31, 480 )
+#define FUNCTION_STORE_LIMIT	ACCESSORY_STORE_BASE
+#else
+#define FUNCTION_STORE_RECORDS	SELECT_SML( 96, 96, 480 )
+#define FUNCTION_STORE_LIMIT	( E2END + 1 )
+#endif
+
+#if FUNCTION_STORE_RECORDS > 0
+
+#include <EEPROM.h>
+
+#define FUNCTION_STORE_BASE	64
+#define FUNCTION_STORE_PROBE	8
+#define FUNCTION_STORE_PENDING	SELECT_SML( 2, 4, 8 )
+#define FUNCTION_STORE_RECORD	struct function_store_record
+FUNCTION_STORE_RECORD {
+	int		target;
+	byte		bits[ FUNCTION_BIT_ARRAY ];
+};
+#define FUNCTION_STORE_ADRS(i)	( FUNCTION_STORE_BASE + ( i ) * sizeof( FUNCTION_STORE_RECORD ))
+
 //
-//			If set to a non-zero value, the content
-//			of duration will be decreased each time the buffer
-//			is sent.  When it reaches zero the buffer is
-//			then disabled and made empty.
+//	Returned by find_function_store() when the EEPROM is busy.
 //
-//	bits		The bit definition of a the DCC command string which
-//			is to be broadcast as a series of 1/0 transitions.
-//			Terminated with a zero byte.
+#define FUNCTION_STORE_BUSY	( FUNCTION_STORE_RECORDS + 1 )
+
+static_assert( sizeof( constant ) <= FUNCTION_STORE_BASE, "Constants overlap the function store" );
+static_assert( FUNCTION_STORE_ADRS( FUNCTION_STORE_RECORDS ) <= FUNCTION_STORE_LIMIT, "Function store does not fit the EEPROM" );
+static_assert( FUNCTION_STORE_PROBE <= FUNCTION_STORE_RECORDS, "Function store probe longer than the store" );
+
 //
-//	Pending Transmission Fields:
-//	----------------------------
+//	One bit per record, set once the record has been used
+//	since the last restart.
 //
-//	pending		Address of the pending data record containing the next
-//			command to load after this one is completed.  There is
-//			an implication that if duration is 0 then this must
-//			be NULL.
+static byte			function_store_used[( FUNCTION_STORE_RECORDS + 7 ) >> 3 ];
+
 //
-//	Confirmation reply data.
-//	------------------------
+//	The queue of records waiting to be written: the record
+//	number (at) and its contents.
 //
-//	reply		Define how the system should manage/generate a reply
-//			to the host computer.
+#define FUNCTION_STORE_WRITE	struct function_store_write
+FUNCTION_STORE_WRITE {
+	word			at;
+	FUNCTION_STORE_RECORD	rec;
+};
+static FUNCTION_STORE_WRITE	function_store_pending[ FUNCTION_STORE_PENDING ];
+static byte			function_store_head,
+				function_store_count;
+
 //
-//			NO_REPLY_REQUIRED	No reply required.
+//	Start afresh, emptying the store.
 //
-//			REPLY_ON_CONFIRM	On detection of response
-//						from the decoder.  This is
-//						sent when the duration count
-//						reaches zero and there are no
-//						more pending packets to send.
-//						At this point a check is made
-//						to see if a confirmation has
-//						been noted and a suitable
-//						reply sent.
+static void init_function_store( void ) {
+	for( word i = 0; i < sizeof( function_store_used ); function_store_used[ i++ ] = 0 );
+	function_store_head = 0;
+	function_store_count = 0;
+}
+
 //
-//			REPLY_ON_SEND		Send the reply once the
-//						last pending record has been
-//						loaded into the bit buffer
-//						and is about to be sent.
+//	Return the index of the queued write to record i, or
+//	FUNCTION_STORE_PENDING if there is none.
 //
-#define			NO_REPLY_REQUIRED	0
-#define			REPLY_ON_CONFIRM	1
-#define			REPLY_ON_SEND		2
+static byte function_store_queued( word i ) {
+	byte	p;
+
+	p = function_store_head;
+	for( byte n = 0; n < function_store_count; n++ ) {
+		if( function_store_pending[ p ].at == i ) return( p );
+		if(( p += 1 ) == FUNCTION_STORE_PENDING ) p = 0;
+	}
+	return( FUNCTION_STORE_PENDING );
+}
+
 //
-//	contains	The (EOS terminated) reply string which should
-//			form the reply sent.  If this contains a HASH in
-//			it and the reply is confirmation based the HASH
-//			will be replaced with 1 if there was a confirmation
-//			or 0 otherwise.  If there is no HASH in the reply
-//			then it is only sent if a confirmation was seen.
+//	Find the record for a target (setting found to true) or
+//	the empty record where it would be kept (setting found to
+//	false).  Returns the record number, FUNCTION_STORE_RECORDS
+//	if the target is not in the store and there is no room for
+//	it, or FUNCTION_STORE_BUSY if a record had to be read while
+//	the EEPROM was being written.
 //
-//	Link to the next buffer, circular fashion:
-//	------------------------------------------
+static word find_function_store( int target, FUNCTION_STORE_RECORD *rec, bool *found ) {
+	word	i;
+	byte	p;
+
+	*found = false;
+	i = (word)target % FUNCTION_STORE_RECORDS;
+	for( byte n = 0; n < FUNCTION_STORE_PROBE; n++ ) {
+		if( !( function_store_used[ i >> 3 ] & ( 1 << ( i & 7 )))) return( i );
+		if(( p = function_store_queued( i )) < FUNCTION_STORE_PENDING ) {
+			*rec = function_store_pending[ p ].rec;
+		}
+		else {
+			if( !eeprom_is_ready()) return( FUNCTION_STORE_BUSY );
+			EEPROM.get( FUNCTION_STORE_ADRS( i ), *rec );
+		}
+		if( rec->target == target ) {
+			*found = true;
+			return( i );
+		}
+		if(( i += 1 ) >= FUNCTION_STORE_RECORDS ) i = 0;
+	}
+	return( FUNCTION_STORE_RECORDS );
+}
+
 //
-//	next		The address of the next transmission buffer in
-//			the loop
+//	Called on every pass through the main loop to write the next
+//	byte of the queued record which is not already in place.
 //
-#define TRANS_BUFFER struct trans_buffer
-TRANS_BUFFER {
-	//
-	//	The current state of this buffer.  Primary method used to
-	//	synchronise activities between the interrupt driven signal
-	//	generator code and the iteratively called management code.
-	//
-	byte		state;
-	//
-	//	Live Transmission fields:
-	//	-------------------------
+static void service_function_store( void ) {
+	FUNCTION_STORE_WRITE	*w;
+	word			adrs;
+	byte			*image;
+
+	if(( function_store_count == 0 )|| !eeprom_is_ready()) return;
+	w = function_store_pending + function_store_head;
+	adrs = FUNCTION_STORE_ADRS( w->at );
+	image = (byte *)( &w->rec );
+	for( byte i = 0; i < sizeof( FUNCTION_STORE_RECORD ); i++ ) {
+		if( EEPROM.read( adrs + i ) != image[ i ]) {
+			EEPROM.write( adrs + i, image[ i ]);
+			return;
+		}
+	}
+	if(( function_store_head += 1 ) == FUNCTION_STORE_PENDING ) function_store_head = 0;
+	function_store_count -= 1;
+}
+
+//
+//	Keep the function states of a roster record which is about
+//	to be forgotten.  Returns false, with nothing changed, if the
+//	record cannot be kept yet (the EEPROM is busy or the write
+//	queue is full).
+//
+static bool save_functions( ROSTER_ENTRY *ptr ) {
+	FUNCTION_STORE_RECORD	rec;
+	bool			found;
+	byte			any,
+				p;
+	word			i;
+
+	any = 0;
+	for( byte j = 0; j < FUNCTION_BIT_ARRAY; any |= ptr->bits[ j++ ]);
+	if(( i = find_function_store( ptr->target, &rec, &found )) == FUNCTION_STORE_BUSY ) return( false );
+	if( i == FUNCTION_STORE_RECORDS ) {
+		if( any ) errors.log_error( FUNCTION_STORE_FULL, ptr->target );
+		return( true );
+	}
+	//
+	//	All functions off is the default, so only needs
+	//	writing to replace an existing record.
+	//
+	if( !found && !any ) return( true );
+	//
+	//	Update a write already queued for this record, or
+	//	queue a new one.
+	//
+	if(( p = function_store_queued( i )) == FUNCTION_STORE_PENDING ) {
+		if( function_store_count == FUNCTION_STORE_PENDING ) return( false );
+		if(( p = function_store_head + function_store_count ) >= FUNCTION_STORE_PENDING ) p -= FUNCTION_STORE_PENDING;
+		function_store_pending[ p ].at = i;
+		function_store_count += 1;
+		function_store_used[ i >> 3 ] |= 1 << ( i & 7 );
+	}
+	function_store_pending[ p ].rec.target = ptr->target;
+	for( byte j = 0; j < FUNCTION_BIT_ARRAY; j++ ) function_store_pending[ p ].rec.bits[ j ] = ptr->bits[ j ];
+	return( true );
+}
+
+#endif
+
+//
+//	Function to initialise the roster empty.
+//
+static void init_roster( void ) {
+#if FUNCTION_STORE_RECORDS > 0
+	init_function_store();
+#endif
+	for( byte i = 0; i < DISTRICT_STREAMS; i++ ) {
+		roster_refresh[ i ] = 0;
+		function_refresh[ i ] = 0;
+		function_group_refresh[ i ] = 0;
+		function_refresh_due[ i ] = 0;
+	}
+	for( byte i = 0; i < ROSTER_SIZE; i++ ) {
+		roster[ i ].target = 0;
+		roster[ i ].speed = 0;
+#ifdef SIGNAL_DISTRICT_STREAMS
+		roster[ i ].districts = 0;
+#endif
+		for( byte j = 0; j < FUNCTION_BIT_ARRAY; roster[ i ].bits[ j++ ] = 0 );
+	}
+}
+
+//
+//	Create a speed and direction packet for a specified target.
+//	Returns the number of bytes in the buffer.
+//
+static byte compose_motion_packet( byte *command, int adrs, int speed, int dir ) {
+	byte	len;
+
+	ASSERT( command != NULL );
+	ASSERT(( adrs >= MINIMUM_DCC_ADDRESS )&&( adrs <= MAXIMUM_DCC_ADDRESS ));
+	ASSERT(( speed == EMERGENCY_STOP )||(( speed >= MINIMUM_DCC_SPEED )&&( speed <= MAXIMUM_DCC_SPEED )));
+	ASSERT(( dir == DCC_FORWARDS )||( dir == DCC_BACKWARDS ));
+
+	if( adrs > MAXIMUM_SHORT_ADDRESS ) {
+		command[ 0 ] = 0b11000000 | ( adrs >> 8 );
+		command[ 1 ] = adrs & 0b11111111;
+		len = 2;
+	}
+	else {
+		command[ 0 ] = adrs;
+		len = 1;
+	}
+	command[ len++ ] = 0b00111111;
+	switch( speed ) {
+		case 0: {
+			command[ len++ ] = ( dir << 7 );
+			break;
+		}
+		case EMERGENCY_STOP: {
+			command[ len++ ] = ( dir << 7 ) | 1;
+			break;
+		}
+		default: {
+			command[ len++ ] = ( dir << 7 )|( speed + 1 );
+			break;
+		}
+	}
+	//
+	//	Done.
+	//
+	return( len );
+}
+
+//
+//	The DCC function group instructions, in the order they are
+//	sent by compose_function_block() and refreshed.
+//
+//	last		The highest function number in the group.
+//
+//	first		The function number in the bottom bit of the
+//			group bits (F0, the odd one out, is handled
+//			separately).
+//
+//	mask		The group bits: 0x0f for a group of four carried
+//			in the instruction byte, 0xff for a group of
+//			eight carried in a second byte.
+//
+//	opcode		The instruction byte.
+//
+#define FUNCTION_GROUP struct function_group
+FUNCTION_GROUP {
+	byte	last,
+		first,
+		mask,
+		opcode;
+};
+#define FUNCTION_GROUPS		5
+static const FUNCTION_GROUP function_group[ FUNCTION_GROUPS ] PROGMEM = {
+	{ 4,	1,	0x0f,	0x80 },		// F0-F4	100[F0][F4][F3][F2][F1]
+	{ 8,	5,	0x0f,	0xb0 },		// F5-F8	1011[F8][F7][F6][F5]
+	{ 12,	9,	0x0f,	0xa0 },		// F9-F12	1010[F12][F11][F10][F9]
+	{ 20,	13,	0xff,	0xde },		// F13-F20	11011110, [F20][F19][F18][F17][F16][F15][F14][F13]
+	{ 28,	21,	0xff,	0xdf }		// F21-F28	11011111, [F28][F27][F26][F25][F24][F23][F22][F21]
+};
+
+//
+//	Return the bits of a function group, from a function bit array
+//	(in the same form as the roster function bits), in the order
+//	they are carried by the group instruction.  Zero if all of the
+//	functions in the group are off.
+//
+static byte function_group_bits( byte group, const byte *bits ) {
+	const FUNCTION_GROUP	*g;
+	byte			f,
+				value;
+
+	ASSERT( group < FUNCTION_GROUPS );
+	ASSERT( bits != NULL );
+
+	g = function_group + group;
+	f = pgm_read_byte( &( g->first )) - MIN_FUNCTION_NUMBER;
+	//
+	//	The group bits are contiguous in the bit array
+	//	and never span more than two bytes of it.
+	//
+	value = (byte)(((word)bits[ ( f >> 3 ) + 1 ] << 8 | bits[ f >> 3 ]) >> ( f & 7 )) & pgm_read_byte( &( g->mask ));
+	//
+	//	F0 is carried above F1-F4 in the first group.
+	//
+	if( group == 0 ) value |= ( bits[ 0 ] & 1 ) << 4;
+	return( value );
+}
+
+//
+//	Create a function group packet for a specified target, taking
+//	the function states from the bit array supplied.  Returns the
+//	number of bytes in the buffer.
+//
+static byte compose_function_packet( byte *command, int adrs, byte group, const byte *bits ) {
+	byte	len,
+		opcode;
+
+	ASSERT( command != NULL );
+	ASSERT(( adrs >= MINIMUM_DCC_ADDRESS )&&( adrs <= MAXIMUM_DCC_ADDRESS ));
+	ASSERT( group < FUNCTION_GROUPS );
+
+	if( adrs > MAXIMUM_SHORT_ADDRESS ) {
+		command[ 0 ] = 0b11000000 | ( adrs >> 8 );
+		command[ 1 ] = adrs & 0b11111111;
+		len = 2;
+	}
+	else {
+		command[ 0 ] = adrs;
+		len = 1;
+	}
+	opcode = pgm_read_byte( &( function_group[ group ].opcode ));
+	if( pgm_read_byte( &( function_group[ group ].mask )) == 0xff ) {
+		command[ len++ ] = opcode;
+		command[ len++ ] = function_group_bits( group, bits );
+	}
+	else {
+		command[ len++ ] = opcode | function_group_bits( group, bits );
+	}
+	//
+	//	Done.
+	//
+	return( len );
+}
+
+//
+//	Storage of Transmission Data
+//	----------------------------
+//
+//	Output bit patterns are stored as an array of bytes
+//	where alternate bytes indicate the number of "1"s or "0"s
+//	to output (array index 0 represents an initial series of
+//	"1"s).
+//
+//	While this method is less space efficient than simply
+//	storing the bytes required, it has the benefit that the
+//	inter-byte protocol "0"s and "1"s are easily captured, and
+//	interrupt code required to generate a DCC packet has fewer
+//	special case requirements and so will be faster.
+//
+//	This inevitably (and correctly) offloads processing work
+//	from the interrupt routine to the non-time-critical general
+//	IO code.
+//
+
+//
+//	Define limits on the number of bit transitions which a
+//	transmission buffer can contain.
+//
+//	The maximum size for a DCC command that this program can
+//	process is defined as MAXIMUM_DCC_COMMAND, however this is
+//	and extreme case, and so the bit transition array will be
+//	based (for the moment) on a series of 4 bytes.
+//
+//	Worst case scenario for a DCC packet is a long sequence of
+//	bytes of either 0xAA or 0x55 (individually alternating bits).
+//
+//	In this case the bit array would be filled thus:
+//
+//	Content					Ones	Zeros
+//	-------					----	-----
+//	Packets header of 'X' "1"s + 1 "0"	X	1
+//	(X is selected preamble length)
+//
+//	Byte 0xAA + 1 "0"			1	1
+//						1	1
+//						1	1
+//						1	2
+//
+//	Byte 0xAA + 1 "0"			1	1
+//						1	1
+//						1	1
+//						1	2
+//
+//	Byte 0xAA + 1 "0"			1	1
+//						1	1
+//						1	1
+//						1	2
+//
+//	Checksum 0xAA + 1 "1"			1	1
+//						1	1
+//						1	1
+//						1	1
+//
+//	End of packet "1"			1
+//	
+//
+//	In this situation a minimum 36 byte bit transition array would be
+//	required for the data (remember additional space required for end
+//	zero byte).
+//
+//	Statistically this would normally hold a larger DCC packet than
+//	this.
+//
+#define BIT_TRANSITIONS		SELECT_SML( 36, 48, 64 )
+
+//
+//	Each transmission buffer owns a single bit transition array
+//	(the "live" bit string) and can borrow a second (the "shadow")
+//	from a small pool of spare arrays while a replacement packet
+//	is being prepared.  This allows the replacement to be built
+//	while the live bit string continues to be transmitted, with
+//	the two being swapped over by the interrupt routine between
+//	packets.
+//
+//	Define the number of spare bit transition arrays.  When all
+//	spares are in use a buffer waiting for a replacement simply
+//	continues transmitting its live bit string until one is
+//	returned.
+//
+#define SPARE_BIT_STRINGS	SELECT_SML( 2, 4, 8 )
+
+//
+//	Buffers which have just been loaded with a new command (a
+//	speed change, function change, accessory operation and so
+//	on) are placed in a short priority queue by the management
+//	code so that the interrupt routine can transmit them ahead
+//	of the background refresh of the other buffers.
+//
+//	PRIORITY_QUEUE	The number of slots in the queue (one is
+//			always left free).  If the queue is full
+//			the buffer is sent in its normal turn.
+//
+//	PRIORITY_BURST	The maximum number of priority packets which
+//			can be sent consecutively before the next
+//			buffer in the circular buffer must be sent.
+//			This keeps the refresh of every other decoder
+//			going however busy the priority queue is.
+//
+#define PRIORITY_QUEUE		8
+#define PRIORITY_BURST		2
+
+//
+//	Define the number of buffers ahead of the interrupt routine's
+//	position in the circular buffer which the management code
+//	will prepare on every pass of the main loop.
+//
+#define LOOK_AHEAD_BUFFERS	SELECT_SML( 2, 3, 3 )
+
+//
+//	Define the number of slots in the ready queue through which
+//	the interrupt routine passes buffers that it has moved to
+//	TBS_LOAD directly to the management code (one slot is always
+//	left free).  If the queue is full the buffer is found by the
+//	management code in its normal rotation.
+//
+#define READY_QUEUE		8
+
+//
+//	Define maximum bit iterations per byte of the bit transition array.
+//
+//	It is possible to prove that this figure can never be reached as this
+//	would imply a a series of 28 byte containing just 0 bits which (apart
+//	from being an invalid DCC command, is over 4 times longer than the
+//	longest DCC command this code will handle.
+//
+//	This value is applied inside verification assert statements.
+//
+#define MAXIMUM_BIT_ITERATIONS	255
+
+#ifdef SIGNAL_RAW_PACKETS
+//
+//	When sending raw packets the bit pattern is just the bytes of
+//	the DCC packet and the number of "1"s around them:
+//
+//	preamble	The number of "1"s sent before the first byte.
+//
+//	len		The number of bytes in the packet (including
+//			the checksum).
+//
+//	trailer		The number of "1"s sent after the last byte,
+//			the end of packet bit plus the postamble.
+//
+//	packet		The bytes of the packet.
+//
+#define BIT_PATTERN struct bit_pattern
+BIT_PATTERN {
+	byte		preamble,
+			len,
+			trailer,
+			packet[ MAXIMUM_DCC_COMMAND ];
+};
+
+//
+//	The interrupt routine transmits the whole bit pattern.
+//
+#define BIT_STRING(p)	(p)
+
+#else
+//
+//	Each bit transition array is kept with a copy of the DCC
+//	packet it was created from, and where in the array the last
+//	data byte of the packet starts.  When a new packet only differs
+//	from this in its last data byte (and so its checksum), which is
+//	the case for a change of speed or function, the bit transitions
+//	up to that point are kept (or copied) and only the final bytes
+//	are sliced again (see pack_command()).
+//
+//	bits		The bit transitions.
+//
+//	len		The number of bytes in the packet (including
+//			the checksum), 0 if the bits do not hold a
+//			valid packet.
+//
+//	preamble,	The preamble and postamble lengths the packet
+//	postamble	was created with.
+//
+//	mark		The index into bits where the last data byte
+//			of the packet starts.
+//
+//	zeros		The number of "0" bits (from the inter-byte
+//			bit) already counted at mark.
+//
+//	packet		The bytes of the packet.
+//
+#define BIT_PATTERN struct bit_pattern
+BIT_PATTERN {
+	byte		bits[ BIT_TRANSITIONS ];
+	byte		len,
+			preamble,
+			postamble,
+			mark,
+			zeros,
+			packet[ MAXIMUM_DCC_COMMAND ];
+};
+
+//
+//	The interrupt routine transmits the bit transitions.
+//
+#define BIT_STRING(p)	((p)->bits)
+
+#endif
+
+//
+//	Define the state information which is used to control the transmission
+//	buffers.
+//
+//	The states are divided into a number of groups reflecting which section
+//	of code monitors or controls it.  The concept here is that (like a game
+//	of "ping pong") the responsibility for the buffers is handed back and
+//	forth between the bits of code.  The intention here is to avoid requiring
+//	locked out sections of code (using noInterrupts() and interrupts()) which
+//	might impact the over all timing of the firmware.
+//
+//	In the following table:
+//
+//		State		The name of the state in this code.
+//		Monitor		Which Code section operates in this state
+//				(i.e. acts upon a buffer in that state).
+//		Role		Briefly what is going when a buffer is moved
+//				from its initial to result state).
+//		Result		State into which the code moves the buffer.
+//
+//	Trying to capture state transitions here:
+//
+//	State		Monitor		Role			Result
+//	-----		-------		----			------
+//	TBS_RUN		ISR		Continuous packet	TBS_RUN
+//					transmission
+//					(duration is zero)
+//
+//	TBS_RUN		ISR		Limited packet		TBS_RUN
+//					transmission
+//					(--duration > 0 )
+//
+//	TBS_RUN		ISR		Limited packet		TBS_LOAD
+//					transmission
+//					(--duration == 0 )
+//
+//	TBS_LOAD	Manager		Pending pointer not	TBS_RUN
+//					NULL, load next bit
+//					sequence from record
+//					and drop pending record
+//
+//	TBS_LOAD	Manager		Pending pointer is	TBS_EMPTY
+//					NULL.
+//
+//	TBS_EMPTY	IO		Create a list of	TBS_LOAD
+//					pending records and
+//					attach to a buffer
+//
+//	TBS_RELOAD	Manager		Replacement packet	TBS_SWAP
+//					initiated by IO code
+//					on a TBS_RUN buffer
+//					is loaded into the
+//					shadow bit string
+//					(the live bit string
+//					is still transmitted)
+//
+//	TBS_SWAP	ISR		Synchronised swap of	TBS_RUN
+//					the live and shadow
+//					bit strings at the
+//					start of the packet
+//
+#define TBS_EMPTY	0
+#define TBS_LOAD	1
+#define TBS_RUN		2
+#define TBS_RELOAD	3
+#define TBS_SWAP	4
+
+//
+//	Define a Transmission Buffer which contains the following
+//	elements:
+//
+//	state		The current state of this buffer.  Primary method
+//			synchronise activities between the interrupt driven
+//			signal generator code and the iteratively called
+//			management code.
+//
+//	Live Transmission fields:
+//	-------------------------
+//
+//	target		The DCC ID being targetted by the buffer:
+//			+ve -> mobile ID, -ve ->  negated External
+//			Accessory ID, 0 Broadcast address or programming
+//			track.
+//
+//	duration	Provides a mechanism between the main IO code
+//			and the Interrupt driven DCC transmission code
+//			for scheduling the disabling the buffer.
+//
+//			If set as zero the buffer will run continuously.
+//
+//			If set to a non-zero value, the content
+//			of duration will be decreased each time the buffer
+//			is sent.  When it reaches zero the buffer is
+//			then disabled and made empty.
+//
+//	bits		The bit definition of a the DCC command string which
+//			is to be broadcast as a series of 1/0 transitions.
+//			Terminated with a zero byte.
+//
+//	shadow		A spare bit string being used to prepare the
+//			replacement for bits, or (once swapped) the
+//			previous bit string waiting to be returned to the
+//			spare pool.  NULL if not in use.
+//
+//	priority	True while the buffer is waiting in the priority
+//			queue to be transmitted out of turn.
+//
+//	refresh		True while the buffer holds a packet re-packed
+//			from the roster (rather than a new command).
+//
+//	Pending Transmission Fields:
+//	----------------------------
+//
+//	pending		Address of the pending data record containing the next
+//			command to load after this one is completed.  There is
+//			an implication that if duration is 0 then this must
+//			be NULL.
+//
+//	Confirmation reply data.
+//	------------------------
+//
+//	reply		Define how the system should manage/generate a reply
+//			to the host computer.
+//
+//			NO_REPLY_REQUIRED	No reply required.
+//
+//			REPLY_ON_CONFIRM	On detection of response
+//						from the decoder.  This is
+//						sent when the duration count
+//						reaches zero and there are no
+//						more pending packets to send.
+//						At this point a check is made
+//						to see if a confirmation has
+//						been noted and a suitable
+//						reply sent.
+//
+//			REPLY_ON_SEND		Send the reply once the
+//						last pending record has been
+//						loaded into the bit buffer
+//						and is about to be sent.
+//
+#define			NO_REPLY_REQUIRED	0
+#define			REPLY_ON_CONFIRM	1
+#define			REPLY_ON_SEND		2
+//
+//	contains	The (EOS terminated) reply string which should
+//			form the reply sent.  If this contains a HASH in
+//			it and the reply is confirmation based the HASH
+//			will be replaced with 1 if there was a confirmation
+//			or 0 otherwise.  If there is no HASH in the reply
+//			then it is only sent if a confirmation was seen.
+//
+//	Link to the next buffer, circular fashion:
+//	------------------------------------------
+//
+//	next		The address of the next transmission buffer in
+//			the loop
+//
+#define TRANS_BUFFER struct trans_buffer
+TRANS_BUFFER {
+	//
+	//	The current state of this buffer.  Primary method used to
+	//	synchronise activities between the interrupt driven signal
+	//	generator code and the iteratively called management code.
+	//
+	byte		state;
+	//
+	//	Live Transmission fields:
+	//	-------------------------
 	//
 	//
 	//	The target ID of the packet.  Note the following usage:
@@ -1776,7 +2932,41 @@ TRANS_BUFFER {
 	//	Bit transitions are zero byte terminated, no length
 	//	need be maintained.
 	//
-	byte		bits[ BIT_TRANSITIONS ];
+	//	The shadow bit string is only exchanged with the live
+	//	bit string by the interrupt routine when the buffer is
+	//	in TBS_SWAP state.
+	//
+	BIT_PATTERN	*bits,
+			*shadow;
+	//
+	//	Set by the management code when the buffer is added to
+	//	the priority queue, to the bit mask of the signal streams
+	//	which send the buffer (see STREAM_BIT), each bit cleared by
+	//	the interrupt routine when that stream next transmits the
+	//	buffer (priority or not).
+	//
+	byte		priority;
+	//
+	//	Set when the packet is a refresh from the roster, which
+	//	a new command can take the buffer over from.
+	//
+	bool		refresh;
+#if SIGNAL_STREAMS > 1
+	//
+	//	The bit mask of the signal streams whose circular buffer
+	//	contains this buffer.
+	//
+	byte		streams;
+#endif
+#ifdef SIGNAL_DISTRICT_STREAMS
+	//
+	//	The bit mask of the district streams which have still to
+	//	send the packet before its duration is counted down.  A
+	//	buffer shared by all of the districts is only counted as
+	//	sent once every district has sent it.
+	//
+	byte		owed;
+#endif
 	//
 	//	Pending Transmission Fields:
 	//	----------------------------
@@ -1963,6 +3153,189 @@ static int queue_amps( word v ) {
 #endif
 
 
+//
+//	Interrupt cycle profiling.
+//	==========================
+//
+//	When DEBUG_ISR_CYCLES is defined the signal generator and ADC
+//	interrupt routines record how long they took using the counter
+//	of the signal generator timer.
+//
+//	As the timer is restarted from zero by the compare match which
+//	raised the signal generator interrupt, the counter value read
+//	as the routine exits is the time taken since the interrupt was
+//	due.  This includes any delay in starting the routine (the
+//	interrupt latency and register saving) and is the figure that
+//	needs to stay within the interrupt window.  Register
+//	restoration on exit is not included.
+//
+//	The ADC routine is timed from its first to last statement
+//	(correcting for the timer being restarted between the two),
+//	as are the USART routines when USART_ISR_TIMING is defined
+//	in USART.h.  These routines delay the signal generator, so
+//	are held to the same budget.
+//
+//	All figures are held in timer clocks and converted into
+//	machine cycles (using the timer pre-scaler) when reported.
+//
+//	A cycle accurate measurement of every configuration, made
+//	under a simulator rather than on the target, is provided by
+//	the benchmark in extras/isr_bench (see DEBUG_ISR_PATH).
+//
+#if defined( USART_ISR_TIMING )&& !defined( DEBUG_ISR_CYCLES )
+#error "USART_ISR_TIMING requires DEBUG_ISR_CYCLES."
+#endif
+
+#if defined( DEBUG_ISR_CYCLES )|| defined( DEBUG_ISR_PATH )
+//
+//	The paths through the signal generator.
+//
+#define ISR_PATH_MID_BIT	0
+#define ISR_PATH_BIT_CHANGE	1
+#define ISR_PATH_BUFFER_CHANGE	2
+#define ISR_PATH_TRACKING
+#endif
+
+#ifdef DEBUG_ISR_CYCLES
+
+//
+//	The percentage of the interrupt window the longest path through
+//	the signal generator is allowed to use before an error is
+//	raised.
+//
+#define ISR_CYCLE_BUDGET	75
+
+//
+//	The window (in timer clocks) the signal generator has to
+//	complete within.
+//
+#ifdef SIGNAL_HALF_BIT_TIMER
+#define ISR_CYCLE_WINDOW	TICKS_FOR_ONE
+#else
+#define ISR_CYCLE_WINDOW	TIMER_INTERRUPT_CYCLES
+#endif
+#define ISR_CYCLE_LIMIT		((word)(((dword)ISR_CYCLE_WINDOW * ISR_CYCLE_BUDGET ) / 100 ))
+
+//
+//	How often (in milliseconds) are the figures reported.
+//
+#define ISR_PROFILE_INTERVAL	5000
+
+//
+//	The other paths being measured.
+//
+#define ISR_PATH_ADC		3
+#define ISR_PATH_USART_RX	4
+#define ISR_PATH_USART_TX	5
+#define ISR_PATHS		6
+
+//
+//	Figures gathered for each path.
+//
+#define ISR_PROFILE struct isr_profile
+ISR_PROFILE {
+	word	min,
+		max;
+	dword	total,
+		count;
+};
+
+static ISR_PROFILE	isr_profile[ ISR_PATHS ];
+static unsigned long	isr_profile_report;
+
+//
+//	Record a single measurement against a path.  This is called
+//	from within the interrupt routines.
+//
+static inline void record_isr_cycles( byte path, word clocks ) {
+	ISR_PROFILE	*p;
+
+	p = &( isr_profile[ path ]);
+	if(( p->count == 0 )||( clocks < p->min )) p->min = clocks;
+	if( clocks > p->max ) p->max = clocks;
+	p->total += clocks;
+	p->count++;
+}
+
+//
+//	Return a time stamp for an interrupt routine to time itself
+//	against: the timer counter (low byte) and the length of the
+//	timer period it was taken in (high byte).
+//
+//	The length is captured with the count because it is the
+//	period that wraps if the routine runs on past its end.  With
+//	the half bit timer the compare register is rewritten for
+//	every period, so by the time the routine finishes it may no
+//	longer hold the length of the period that wrapped.
+//
+static inline word isr_time_stamp( void ) {
+	return(((word)HW_OCRnA << 8 )| HW_TCNTn );
+}
+
+//
+//	Return the timer clocks since a time stamp, allowing for the
+//	timer being restarted in between.
+//
+static inline word isr_clocks_since( word stamp ) {
+	byte	start,
+		finish;
+
+	start = (byte)stamp;
+	if(( finish = HW_TCNTn ) < start ) return((word)finish + ( stamp >> 8 ) + 1 - start );
+	return( finish - start );
+}
+
+#ifdef USART_ISR_TIMING
+//
+//	The timing calls made by the USART interrupt routines.
+//
+word usart_isr_enter( void ) {
+	return( isr_time_stamp());
+}
+void usart_isr_leave( byte isr, word stamp ) {
+	record_isr_cycles( ISR_PATH_USART_RX + isr, isr_clocks_since( stamp ));
+}
+#endif
+
+//
+//	Called from the main loop to (periodically) output and reset
+//	the gathered figures, checking the longest time taken by each
+//	path against the budget.  Every path over budget is reported
+//	in every period.
+//
+static void report_isr_cycles( void ) {
+	ISR_PROFILE	copy[ ISR_PATHS ];
+
+	if( now < isr_profile_report ) return;
+	isr_profile_report = now + ISR_PROFILE_INTERVAL;
+	{
+		Critical code;
+
+		for( byte i = 0; i < ISR_PATHS; i++ ) {
+			copy[ i ] = isr_profile[ i ];
+			isr_profile[ i ].count = 0;
+			isr_profile[ i ].total = 0;
+			isr_profile[ i ].max = 0;
+		}
+	}
+	for( byte i = 0; i < ISR_PATHS; i++ ) {
+		if( copy[ i ].max > ISR_CYCLE_LIMIT ) errors.log_error( ISR_OVER_BUDGET, copy[ i ].max * TIMER_CLOCK_PRESCALER );
+		if( copy[ i ].count ) {
+			console.print( "ISR " );
+			console.print( i );
+			console.print( SPACE );
+			console.print( (word)( copy[ i ].min * TIMER_CLOCK_PRESCALER ));
+			console.print( SPACE );
+			console.print( (word)(( copy[ i ].total * TIMER_CLOCK_PRESCALER ) / copy[ i ].count ));
+			console.print( SPACE );
+			console.print( (word)( copy[ i ].max * TIMER_CLOCK_PRESCALER ));
+			console.println();
+		}
+	}
+}
+
+#endif
+
 //
 //	Current monitoring code.
 //	========================
@@ -1999,6 +3372,11 @@ static volatile bool	reading_is_ready;
 ISR( ADC_vect ) {
 	byte	low, high;
 
+#ifdef DEBUG_ISR_CYCLES
+	word	start;
+
+	start = isr_time_stamp();
+#endif
 	//
 	//	We have to read ADCL first; doing so locks both ADCL
 	//	and ADCH until ADCH is read.  reading ADCL second would
@@ -2012,6 +3390,10 @@ ISR( ADC_vect ) {
 	//
 	track_load_reading = ( high << 8 ) | low;
 	reading_is_ready = true;
+
+#ifdef DEBUG_ISR_CYCLES
+	record_isr_cycles( ISR_PATH_ADC, isr_clocks_since( start ));
+#endif
 }
 
 //
@@ -2024,91 +3406,390 @@ ISR( ADC_vect ) {
 //
 static TRANS_BUFFER circular_buffer[ TRANSMISSION_BUFFERS ];
 
+//
+//	Define the bit transition arrays: one for each transmission
+//	buffer and the pool of spares.  The spares are held as a
+//	simple stack which is only accessed by the management code.
+//
+static BIT_PATTERN bit_transitions[ TRANSMISSION_BUFFERS + SPARE_BIT_STRINGS ];
+static BIT_PATTERN *spare_bit_string[ SPARE_BIT_STRINGS ];
+static byte spare_bit_strings;
+
 //
 //	The following variables direct the actions of the interrupt
 //	routine.
 //
 
 //
-//	Define the pointer into the circular buffer
-//	used (and updated by) the interrupt routine.
+//	The priority queue of freshly loaded buffers.  This is only
+//	added to by the management code and only removed from by
+//	the interrupt routine, so the queue indexes are only ever
+//	updated by one side each.
+//
+//	Each signal stream has its own index (priority_out) of the
+//	next entry it will read from the queue, and skips those
+//	entries which it does not send.
+//
+static TRANS_BUFFER	*priority_queue[ PRIORITY_QUEUE ];
+static volatile byte	priority_in;
+
+//
+//	The ready queue of buffers which the interrupt routine has
+//	moved into TBS_LOAD.  This is the reverse of the priority
+//	queue: only added to by the interrupt routine and only removed
+//	from by the management code.
+//
+static TRANS_BUFFER	*ready_queue[ READY_QUEUE ];
+static volatile byte	ready_in,
+			ready_out;
+
+#ifndef SHIELD_PORT_DIRECT
+//
+//	If we are not using direct port access then each signal
+//	stream (below) has a short array (with associated length)
+//	of the output ports containing direction pins which need to
+//	be flipped.
+//
+//	Each record holds the address of the port output register
+//	and a pair of masks for the "in phase" and "anti-phase" pins
+//	in that port.  As the port will also contain pins not part of
+//	the signal the "keep" mask identifies those bits which must
+//	not be changed by the interrupt routine.
+//
+//	port		Address of the port output register
 //
-//	This always points to the buffer currently being transmitted.
+//	keep		Bit mask of pins to leave unchanged
 //
-static TRANS_BUFFER	*current;
+//	on		bit mask for "in phase" pins
+//
+//	off		bit mask for "anti-phase" pins
+//
+#define OUTPUT_PORT struct output_port
+OUTPUT_PORT {
+	volatile byte	*port;
+	volatile byte	keep,
+			on,
+			off;
+};
+#endif
 
 //
-//	Define a variable to control the direction output
+//	Define a signal stream:
+//
+//	current		The buffer currently being transmitted.
+//
+//	refresh		The position of the background refresh in the
+//			circular buffer.  This is normally the same as
+//			current, but is left behind while a buffer from
+//			the priority queue is transmitted.
+//
+//	side		Flips between true and false and lets the
+//			routine know which "side" of the signal was
+//			being generated.
+//
+//	remaining	The number of ticks before the next "side"
+//			transition.
+//
+//	reload		The value that should be reloaded into
+//			remaining if we are only half way through
+//			generating a bit.  When using the half bit timer
+//			this is the timer compare value for the duration
+//			of the next half bit, written into the compare
+//			register every time the signal is flipped.
+//
+//	priority_out	The index of the next priority queue entry
+//			for this stream.
+//
+//	priority_run	The number of consecutive priority packets
+//			sent.
+//
+//	bit		The bit mask for this stream, as used in the
+//			buffer priority and streams fields (only needed
+//			with more than one stream).
+//
+//	District streams:
+//
+//	The buffers shared by every district (accessory and mobile
+//	buffers) form one circular buffer and the refresh buffers
+//	of each district another.  The refresh of a district stream
+//	sends a shared buffer after every pass of its own buffers:
+//
+//	fork		The last of the district's own buffers, after
+//			which the next shared buffer is sent.
+//
+//	branch		The first of the district's own buffers, which
+//			follows the shared buffer.
+//
+//	shared		The last shared buffer sent by this stream.
+//
+//	Run length bit transitions:
+//
+//	one		Indicates if we are currently transmitting a
+//			series of ones (true) or zeros (false).
+//
+//	left		The number of ones or zeros which still need to
+//			be sent before we start transmitting the next
+//			series of zeros or ones (or the end of this bit
+//			transmission).
+//
+//	bit_string	The pointer the interrupt routine uses to collect
+//			the bit stream data from inside the transmission
+//			buffer.  This can point to data outside the bit
+//			buffer if the current buffer contains no valid bit
+//			stream to transmit.
+//
+//	Raw packets:
+//
+//	left		The number of "1"s (of the preamble or trailer)
+//			which still need to be sent after the current bit.
+//
+//	bit_shift	The remaining bits of the packet byte being sent
+//			(most significant first), and bit_count the number
+//			of them still to send.
+//
+//	byte_count	The number of packet bytes still to send and
+//			bit_tail the length of the trailer to send after
+//			them (zero once it has been started).
+//
+//	bit_string	The bit pattern being transmitted, which can be
+//			one of the fixed patterns (below) if the current
+//			buffer contains no valid packet to transmit, and
+//			bit_data the pointer to the next byte of its packet.
+//
+//	Direct port outputs:
+//
+//	mask_on		bit mask for "in phase" pins
 //
+//	mask_off	bit mask for "anti-phase" pins
+//
+//	keep		bit mask of the pins belonging to other streams
+//			(only needed with more than one stream).
+//
+//	Output port records:
+//
+//	port		The individual port records
+//
+//	ports		Number of ports being controlled
+//
+#define SIGNAL_STREAM struct signal_stream
+SIGNAL_STREAM {
+	TRANS_BUFFER	*current,
+			*refresh;
+	byte		side;
+#ifndef SIGNAL_HALF_BIT_TIMER
+	byte		remaining;
+#endif
+	byte		reload;
+	volatile byte	priority_out;
+	byte		priority_run;
+#if SIGNAL_STREAMS > 1
+	byte		bit;
+#endif
+#ifdef SIGNAL_DISTRICT_STREAMS
+	TRANS_BUFFER	*fork,
+			*branch,
+			*shared;
+#endif
+#ifdef SIGNAL_RAW_PACKETS
+	byte		left,
+			bit_shift,
+			bit_count,
+			byte_count,
+			bit_tail;
+	BIT_PATTERN	*bit_string;
+	byte		*bit_data;
+#else
+	byte		one,
+			left;
+	byte		*bit_string;
+#endif
 #ifdef SHIELD_PORT_DIRECT
+	volatile byte	mask_on,
+			mask_off;
+#if SIGNAL_STREAMS > 1
+	volatile byte	keep;
+#endif
+#else
+	OUTPUT_PORT	port[ SHIELD_OUTPUT_DRIVERS ];
+	volatile byte	ports;
+#endif
+};
+
+static SIGNAL_STREAM	signal_stream[ SIGNAL_STREAMS ];
+
+//
+//	The bit mask of a signal stream and the streams sending a
+//	buffer.  With one stream these are constant.
+//
+#if SIGNAL_STREAMS > 1
+#define STREAM_BIT(s)		((s)->bit)
+#define BUFFER_STREAMS(b)	((b)->streams)
+#else
+#define STREAM_BIT(s)		1
+#define BUFFER_STREAMS(b)	1
+#endif
+
+//
+//	The buffer following b in the refresh of stream s.
+//
+#ifdef SIGNAL_DISTRICT_STREAMS
+#define STREAM_NEXT(s,b)	(((b) == (s)->fork)? (s)->shared->next: (((b) == (s)->shared)? (s)->branch: (b)->next ))
+#else
+#define STREAM_NEXT(s,b)	((b)->next)
+#endif
+
+#if defined( SHIELD_PORT_DIRECT )&&( SIGNAL_STREAMS > 1 )
+//
+//	With more than one stream driving the one port, the value
+//	last written to the port, so that each stream can change
+//	just its own pins.
+//
+static byte		output_level;
+#endif
+
+#if SIGNAL_STREAMS > 1
+//
+//	Return the signal stream which drives a driver of the shield.
+//
+static byte driver_stream( byte d ) {
+	if( !pgm_read_byte( &( shield_output[ d ].main ))) return( PROG_STREAM );
+
+#ifdef SIGNAL_DISTRICT_STREAMS
+	{
+		byte	t;
+
+		//
+		//	The district streams are numbered in the order
+		//	of the operations track drivers.
+		//
+		t = MAIN_STREAM;
+		for( byte i = 0; i < d; i++ ) if( pgm_read_byte( &( shield_output[ i ].main ))) t++;
+		return( t );
+	}
+#else
+	return( MAIN_STREAM );
+#endif
+}
+#endif
+
+#ifndef SHIELD_PORT_DIRECT
+//
+//	Find the output port record for the supplied pin, return
+//	NULL if the pin's port is not being controlled by the
+//	stream.
+//
+static OUTPUT_PORT *find_output_port( SIGNAL_STREAM *s, byte pin ) {
+	volatile byte	*port;
+	OUTPUT_PORT	*op;
+	byte		oc;
+
+	port = portOutputRegister( digitalPinToPort( pin ));
+	for( op = s->port, oc = s->ports; oc--; op++ ) if( op->port == port ) return( op );
+	return( NULL );
+}
+
+//
+//	Add a direction pin to the output port records of a stream
+//	in the "normal" phase alignment.
+//
+//	The record being changed is only made visible to the
+//	interrupt routine (by increasing ports) once it is complete.
+//
+static void add_output_pin( SIGNAL_STREAM *s, byte pin ) {
+	OUTPUT_PORT	*op;
+	byte		mask;
+
+	mask = digitalPinToBitMask( pin );
+	if(( op = find_output_port( s, pin ))) {
+		op->on |= mask;
+		op->keep &= ~mask;
+	}
+	else {
+		op = &( s->port[ s->ports ]);
+		op->port = portOutputRegister( digitalPinToPort( pin ));
+		op->keep = ~mask;
+		op->on = mask;
+		op->off = 0;
+		s->ports++;
+	}
+}
 
 //
-//	We are controlling the output signal using direct port
-//	and bitmap control.  We define a pair of variables which
-//	each hold one side of the output pattern so that
-//	the Interrupt Service Routine has a simple task flipping
-//	all direction pins on/off as quickly as possible.
+//	Invert the phase of the supplied direction pin.
 //
-//	output_mask_on		bit mask for "in phase" pins
+static void flip_output_pin( SIGNAL_STREAM *s, byte pin ) {
+	OUTPUT_PORT	*op;
+	byte		mask;
+
+	if(( op = find_output_port( s, pin ))) {
+		mask = digitalPinToBitMask( pin );
+		op->on ^= mask;
+		op->off ^= mask;
+	}
+}
+#endif
+
 //
-//	output_mask_off		bit mask for "anti-phase" pins
+//	The signal jitter histogram and largest lateness observed (both
+//	in timer clocks), gathered by the interrupt routine and returned
+//	(and reset) by the 'J' command.
 //
-static volatile byte	output_mask_on,
-			output_mask_off;
-
-#else
+static word		jitter_bucket[ JITTER_BUCKETS ];
+static byte		jitter_max;
 
 //
-//	If we are not using direct port access then we define
-//	a short array (with associated length) of the pin numbers
-//	which need to be flipped.
+//	Packet statistics (all stop counting at 65535):
 //
-//	output_pin		The individual pin numbers
+//	packets_sent		Total packets sent
 //
-//	output_phase		"in phase" or "anti-phase"
+//	idles_sent		Idle packets sent (for any reason)
 //
-//	output_pins		Number of pins being controlled
-//
-static byte		output_pin[ SHIELD_OUTPUT_DRIVERS ];
-static bool		output_phase[ SHIELD_OUTPUT_DRIVERS ];
-static byte		output_pins;
-
-#endif
-
+//	waiting_idles		Idle packets sent in place of a buffer
+//				which was waiting to be loaded
 //
-//	"side" flips between true and false and lets the routine know
-//	which "side" of the signal was being generated.
+//	waiting_fillers		Filler data sent in place of a buffer
+//				which was waiting to load the next packet
+//				of a series
 //
-static byte		side;
+static word		packets_sent,
+			idles_sent,
+			waiting_idles,
+			waiting_fillers;
 
 //
-//	"remaining" The number of ticks before the next "side" transition.
+//	The number of commands acknowledged without being sent, as
+//	they would not have changed the state of the decoder (also
+//	returned and reset by the 'I' command, but not counted by the
+//	interrupt routine).
 //
-//	"reload" is the value that should be reloaded into remaining if we are
-//	only half way through generating a bit.
-//
-static byte		remaining,
-			reload;
+static word		suppressed_commands;
 
+#ifdef SIGNAL_RAW_PACKETS
 //
-//	"one" is a boolean variable which indicates if we are currently
-//	transmitting a series of ones (true) or zeros (false).
+//	The "DCC Idle Packet" (address 0xff, data 0x00), sent without
+//	a postamble.
 //
-//	"left" is the number of ones or zeros which still need to be sent
-//	before we start transmitting the next series of zeros or ones (or
-//	the end of this bit transmission).
+//	These are declared as single element arrays so that they can
+//	be used in exactly the same way as the bit transition arrays.
 //
-static byte		one,
-			left;
+static BIT_PATTERN dcc_idle_packet[ 1 ] = {{
+	DCC_SHORT_PREAMBLE,	// 1s
+	3,			// bytes
+	1,			// End of packet
+	{ 0xff, 0x00, 0xff }
+}};
 
 //
-//	This is the pointer the interrupt routine uses to collect the
-//	bit stream data from inside the transmission buffer.  This can
-//	point to data outside the bit buffer if the current buffer
-//	contains no valid bit stream to transmit.
+//	A filler of a single "1" which is required while working with
+//	decoders in service mode.
 //
-static byte		*bit_string;
-
+static BIT_PATTERN dcc_filler_data[ 1 ] = {{
+	1,			// 1s
+	0,			// No bytes
+	0,			// No end of packet
+	{ 0 }			// No data
+}};
+#else
 //
 //	The following array of bit transitions define the "DCC Idle Packet".
 //
@@ -2140,210 +3821,571 @@ static byte dcc_filler_data[] = {
 	1,			// 1s
 	0
 };
+#endif
 
 //
-//	The Interrupt Service Routine which generates the DCC signal.
+//	The following routines carry out the work of the interrupt
+//	service routine on a single signal stream.  They are declared
+//	inline so that they are built into the interrupt routine with
+//	the address of the stream already known.
 //
-ISR( HW_TIMERn_COMPA_vect ) {
+
+//
+//	Flip the output pins driven by a stream.
+//
+static inline void flip_stream_outputs( SIGNAL_STREAM *s ) __attribute__(( always_inline ));
+static inline void flip_stream_outputs( SIGNAL_STREAM *s ) {
+#ifdef SHIELD_PORT_DIRECT
 	//
-	//	The interrupt routine should be as short as possible, but
-	//	in this case the necessity to drive forwards the output
-	//	of the DCC signal is paramount.  So (while still time
-	//	critical) the code has some work to achieve.
+	//	Code supporting the DCC Generator Driver hardware accessed
+	//	via a single port variable:
 	//
-	//	If "remaining" is greater than zero we are still counting down
-	//	through half of a bit.  If it reaches zero it is time to
-	//	flip the signal over.
+	//	We flip all pins in the port according to the value of 'side'.
 	//
-	if(!( --remaining )) {
-		//
-		//	Time is up for the current side.  Flip over and if
-		//	a whole bit has been transmitted, the find the next
-		//	bit to send.
+	//	The in/out phase (as a result of auto-phase adjustment) are all
+	//	handled by modifying the values found in mask_on and mask_off.
+	//
+	//	(With more than one stream the interrupt routine composes
+	//	the port value from all of the streams itself.)
+	//
+	SHIELD_PORT_DIRECT = s->side? s->mask_on: s->mask_off;
+#else
+	//
+	//	Code supporting the Arduino Motor Shield hardware where
+	//	the direction pins may be spread across a number of ports.
+	//
+	//	The data necessary to do the task is gathered into the
+	//	array port[] where each record contains the port register
+	//	to update, the pins to leave unchanged and the in/out phase
+	//	masks for this port.  ports gives the number of ports which
+	//	are captured in this array.
+	//
+	//	We run through the array as fast as possible.
+	//
+	register OUTPUT_PORT	*op;
+	register byte		oc;
+
+	op = s->port;
+	oc = s->ports;
+	//
+	//	Replicated code is used to remove unnecessary computation
+	//	from inside the loop to maximise speed through the port
+	//	adjustments.
+	//
+	//	Use side to select broad logic choice..
+	//
+	if( s->side ) {
+		while( oc-- ) {
+			*op->port = ( *op->port & op->keep )| op->on;
+			op++;
+		}
+	}
+	else {
+		while( oc-- ) {
+			*op->port = ( *op->port & op->keep )| op->off;
+			op++;
+		}
+	}
+#endif
+}
+
+//
+//	Move a stream on to its next bit, setting reload with the tick
+//	count for the bit.  Returns false if there are no more bits to
+//	transmit from the current buffer.
+//
+static inline bool next_stream_bit( SIGNAL_STREAM *s ) __attribute__(( always_inline ));
+static inline bool next_stream_bit( SIGNAL_STREAM *s ) {
+#ifdef SIGNAL_RAW_PACKETS
+	//
+	//	Is it another "1" of the preamble or trailer?
+	//
+	if( s->left ) {
 		//
-		//	We "flip" the output DCC signal now as this is the most
-		//	time consistent position to do so.
+		//	Yes, reload is already set for a "1".
 		//
+		s->left--;
+		return( true );
+	}
+	if( s->bit_count ) {
+		register byte	v;
 
-#ifdef SHIELD_PORT_DIRECT
 		//
-		//	Code supporting the DCC Generator Driver hardware accessed
-		//	via a single port variable:
+		//	The next bit of the current byte.
+		//
+		s->bit_count--;
+		v = s->bit_shift;
+		s->reload = ( v & 0x80 )? TICKS_FOR_ONE: TICKS_FOR_ZERO;
+		s->bit_shift = v << 1;
+		return( true );
+	}
+	if( s->byte_count ) {
+		//
+		//	The "0" start bit of the next byte.
 		//
-		//	We flip all pins in the port according to the value of 'side'.
+		s->byte_count--;
+		s->bit_shift = *s->bit_data++;
+		s->bit_count = 8;
+		s->reload = TICKS_FOR_ZERO;
+		return( true );
+	}
+	if( s->bit_tail ) {
 		//
-		//	The in/out phase (as a result of auto-phase adjustment) are all
-		//	handled by modifying the values found in output_mask_on and
-		//	output_mask_off.
+		//	The end of packet bit, and any postamble.
 		//
-		SHIELD_PORT_DIRECT = side? output_mask_on: output_mask_off;
+		s->left = s->bit_tail - 1;
+		s->bit_tail = 0;
+		s->reload = TICKS_FOR_ONE;
+		return( true );
+	}
+	return( false );
 #else
+	//
+	//	Is it more of the same?
+	//
+	if( --s->left ) return( true );
+	//
+	//	No! It is now time to output a series of the alternate
+	//	bits (assignment intentional).
+	//
+	if(( s->left = *s->bit_string++ )) {
 		//
-		//	Code supporting the Arduino Motor Shield hardware where
-		//	all pins need to individually flipped.
+		//	More bits to send.
 		//
-		//	The data necessary to do the task is gathered into the two
-		//	arrays output_pin[] (containing the actual pin numbers to
-		//	change) and output_phase[] which details if the pin is in/out of
-		//	phase.  output_pins gives the number of pins which are captured
-		//	in these arrays.
+		//	Select the correct tick count for the next
+		//	next bit (again the assignment is intentional).
 		//
-		{
+		s->reload = ( s->one = !s->one )? TICKS_FOR_ONE: TICKS_FOR_ZERO;
+		return( true );
+	}
+	return( false );
+#endif
+}
+
+//
+//	A stream has transmitted the packet in its current buffer, but
+//	before we move on we check the duration flag and act upon it.
+//
+//	If the current buffer is in RUN mode and duration is greater than
+//	0 then we decrease duration and if zero, reset state to LOAD and
+//	pass the buffer to the management code through the ready queue.
+//	This will cause the buffer management code to check for any
+//	pending DCC commands.
+//
+static inline void end_stream_packet( SIGNAL_STREAM *s ) __attribute__(( always_inline ));
+static inline void end_stream_packet( SIGNAL_STREAM *s ) {
+	register TRANS_BUFFER	*b;
+
+	b = s->current;
+	if( b->duration && ( b->state == TBS_RUN )) {
+
+#ifdef SIGNAL_DISTRICT_STREAMS
+		//
+		//	Only count the packet once every district sending
+		//	the buffer has sent it.
+		//
+		if(( b->owed &= ~STREAM_BIT( s ))) return;
+		b->owed = BUFFER_STREAMS( b );
+#endif
+
+		if(!( --b->duration )) {
+			register byte	next;
+
+			b->state = TBS_LOAD;
+			//
+			//	Tell the management code.
+			//
+			if(( next = ready_in + 1 ) >= READY_QUEUE ) next = 0;
+			if( next != ready_out ) {
+				ready_queue[ ready_in ] = b;
+				ready_in = next;
+			}
+		}
+	}
+}
+
+//
+//	Move a stream onto its next buffer.  This is the next entry
+//	of the priority queue for the stream if there is one, unless
+//	too many priority packets have been sent in a row or it is
+//	the buffer just sent (giving the decoder a packet's worth of
+//	gap between packets to the same address).
+//
+static inline void next_stream_buffer( SIGNAL_STREAM *s ) __attribute__(( always_inline ));
+static inline void next_stream_buffer( SIGNAL_STREAM *s ) {
+	register TRANS_BUFFER	*next;
+
+	next = NULL;
+	if(( s->priority_out != priority_in )&&( s->priority_run < PRIORITY_BURST )) {
+		next = priority_queue[ s->priority_out ];
+		if( next == s->current ) {
+			//
+			//	Leave it for the next packet.
+			//
+			next = NULL;
+		}
+		else {
+			if(( s->priority_out += 1 ) >= PRIORITY_QUEUE ) s->priority_out = 0;
+			//
+			//	Drop entries which have since been
+			//	sent by this stream as part of the refresh,
+			//	which this stream does not send or which
+			//	are no longer being transmitted.
+			//
+			if(!( next->priority & STREAM_BIT( s ))||( next->state < TBS_RUN )) next = NULL;
+		}
+	}
+	if( next ) {
+		s->current = next;
+		s->priority_run++;
+	}
+	else {
+		//
+		//	Continue the refresh, skipping the
+		//	next buffer if it has just been sent
+		//	out of turn.
+		//
+		if(( next = STREAM_NEXT( s, s->refresh )) == s->current ) next = STREAM_NEXT( s, next );
+
+#ifdef SIGNAL_DISTRICT_STREAMS
+		//
+		//	Note our position in the shared buffers.
+		//
+		if( BUFFER_STREAMS( next ) != STREAM_BIT( s )) s->shared = next;
+#endif
+
+		s->current = s->refresh = next;
+		s->priority_run = 0;
+	}
+}
+
+//
+//	Start a stream transmitting from the buffer it has moved on to.
+//
+static inline void start_stream_packet( SIGNAL_STREAM *s ) __attribute__(( always_inline ));
+static inline void start_stream_packet( SIGNAL_STREAM *s ) {
+	register TRANS_BUFFER	*b;
+
+	b = s->current;
+	b->priority &= ~STREAM_BIT( s );
+
+#ifdef LCD_DISPLAY_ENABLE
+	//
+	//	Count a successful packet transmission for LCD display
+	//
+	lcd_statistic_packets++;
+#endif
+
+	if(!( ++packets_sent )) packets_sent--;
+
+	//
+	//	Actions related to the current state of the new
+	//	buffer (select bits to output and optional state
+	//	change).
+	//
+	switch( b->state ) {
+		case TBS_RUN:
+		case TBS_RELOAD: {
+			//
+			//	We just transmit the packet found in
+			//	the bit data.  If a replacement is being
+			//	prepared (RELOAD) we continue with the
+			//	existing packet until it is ready.
+			//
+			s->bit_string = BIT_STRING( b->bits );
+			break;
+		}
+		case TBS_SWAP: {
+			register BIT_PATTERN	*swap;
+
 			//
-			//	We run through the array as fast as possible.
+			//	The replacement packet is ready in the
+			//	shadow bit string; exchange it with the
+			//	live bit string and transmit it.  The
+			//	manager will return the old bit string
+			//	to the spare pool.
 			//
-			register byte *op, oc;
-			register bool *ob;
+			swap = b->bits;
+			b->bits = b->shadow;
+			b->shadow = swap;
+			b->state = TBS_RUN;
 
-			op = output_pin;
-			oc = output_pins;
-			ob = output_phase;
+#ifdef SIGNAL_DISTRICT_STREAMS
+			//
+			//	Every district now owes the new packet.
 			//
-			//	Replicated code is used to remove unnecessary computation
-			//	from inside the loop to maximise speed through the pin
-			//	adjustments.
+			b->owed = BUFFER_STREAMS( b );
+#endif
+
+			s->bit_string = BIT_STRING( b->bits );
+			break;
+		}
+		case TBS_LOAD: {
 			//
-			//	Question: Can we remove the "?:" code and use the boolean
-			//	value in the output_phase array directly?  Maybe, but not yet.
+			//	This is a little tricky.  While we do not
+			//	(and cannot) do anything with a buffer in
+			//	load state, there is a requirement for the
+			//	signal generator code NOT to output an idle
+			//	packet if we are in the middle of a series
+			//	of packets on the programming track.
 			//
-			//	Use side to select broad logic choice..
+			//	To this end, if (and only if) the pending
+			//	pointer is not NULL, then we will output
+			//	the dcc filler data instead of the idle
+			//	packet
 			//
-			if( side ) {
-				while( oc-- ) digitalWrite( *op++, ( *ob++? HIGH: LOW ));
+			if( b->pending ) {
+				s->bit_string = dcc_filler_data;
+				if(!( ++waiting_fillers )) waiting_fillers--;
 			}
 			else {
-				while( oc-- ) digitalWrite( *op++, ( *ob++? LOW: HIGH ));
+				s->bit_string = dcc_idle_packet;
+				if(!( ++waiting_idles )) waiting_idles--;
+				if(!( ++idles_sent )) idles_sent--;
 			}
+			break;
+		}
+		default: {
+			//
+			//	If we find any other state we ignore the
+			//	buffer and output an idle packet.
+			//
+			s->bit_string = dcc_idle_packet;
+			if(!( ++idles_sent )) idles_sent--;
+			break;
 		}
+	}
+	//
+	//	Initialise the remaining variables required to
+	//	output the selected bit stream.
+	//
+#ifdef SIGNAL_RAW_PACKETS
+	s->bit_data = s->bit_string->packet;
+	s->byte_count = s->bit_string->len;
+	s->bit_tail = s->bit_string->trailer;
+	s->reload = TICKS_FOR_ONE;
+	s->left = s->bit_string->preamble - 1;
+#else
+	s->one = true;
+	s->reload = TICKS_FOR_ONE;
+	s->left = *s->bit_string++;
+#endif
+}
+
+//
+//	The Interrupt Service Routine which generates the DCC signal.
+//
+ISR( HW_TIMERn_COMPA_vect ) {
+	//
+	//	Capture how late this interrupt has started as the
+	//	very first action.
+	//
+	byte	late = HW_TCNTn;
+
+	register SIGNAL_STREAM	*s;
+
+#ifdef ISR_PATH_TRACKING
+	byte	path = ISR_PATH_MID_BIT;
 #endif
 
+	//
+	//	The interrupt routine should be as short as possible, but
+	//	in this case the necessity to drive forwards the output
+	//	of the DCC signal is paramount.  So (while still time
+	//	critical) the code has some work to achieve.
+	//
+	//	If "remaining" is greater than zero we are still counting down
+	//	through half of a bit.  If it reaches zero it is time to
+	//	flip the signal over.
+	//
+	//	When using the half bit timer every interrupt marks the end
+	//	of a half bit, so there is nothing to count down.
+	//
+
+#if SIGNAL_STREAMS > 1
+	{
+		register byte	m,
+				flipped;
+
 		//
-		//	Now undertake the logical flip and subsequent actions.
+		//	With more than one stream we count down every
+		//	stream first, flipping the outputs of those which
+		//	have reached the end of a half bit, so that all of
+		//	the edges due in this tick are generated together
+		//	(in a single port write where the shield allows).
 		//
-		if(( side = !side )) {
+		flipped = 0;
+
+#ifdef SHIELD_PORT_DIRECT
+		{
+			register byte	level;
+
+			level = output_level;
+			for( s = signal_stream, m = 1; m < bit( SIGNAL_STREAMS ); s++, m <<= 1 ) {
+				if(!( --s->remaining )) {
+					level = ( level & s->keep )|( s->side? s->mask_on: s->mask_off );
+					flipped |= m;
+				}
+			}
+			if( flipped ) SHIELD_PORT_DIRECT = output_level = level;
+		}
+#else
+		for( s = signal_stream, m = 1; m < bit( SIGNAL_STREAMS ); s++, m <<= 1 ) {
+			if(!( --s->remaining )) {
+				flip_stream_outputs( s );
+				flipped |= m;
+			}
+		}
+#endif
+
+		if( flipped ) {
 			//
-			//	Starting a new bit, is it more of the same?
+			//	With the edges generated, note how late they were.
+			//	The histogram buckets saturate rather than wrap.
 			//
-			if(!( --left )) {
-				//
-				//	No! It is now time to output a series
-				//	of the alternate bits (assignment intentional).
-				//
-				if(( left = *bit_string++ )) {
-					//
-					//	More bits to send.
-					//
-					//	Select the correct tick count for the next
-					//	next bit (again the assignment is intentional).
-					//
-					reload = ( one = !one )? TICKS_FOR_ONE: TICKS_FOR_ZERO;
-				}
-				else {
-					//
-					//	There are no more bits to transmit
-					//	from this buffer, but before we move
-					//	on we check the duration flag and act
-					//	upon it.
-					//
-					//	If the current buffer is in RUN mode and duration
-					//	is greater than 0 then we decrease duration and
-					//	if zero, reset state to LOAD.  This will cause the
-					//	buffer management code to check for any pending
-					//	DCC commands.
-					//
-					if( current->duration && ( current->state == TBS_RUN )) {
-						if(!( --current->duration )) current->state = TBS_LOAD;
-					}
-					//
-					//	Move onto the next buffer.
-					//
-					current = current->next;
+			{
+				register byte	b;
 
-#ifdef LCD_DISPLAY_ENABLE
-					//
-					//	Count a successful packet transmission for LCD display
-					//
-					lcd_statistic_packets++;
+				if(( b = late >> JITTER_SHIFT ) >= JITTER_BUCKETS ) b = JITTER_BUCKETS-1;
+				if(!( ++jitter_bucket[ b ])) jitter_bucket[ b ]--;
+				if( late > jitter_max ) jitter_max = late;
+			}
+
+			//
+			//	Now undertake the logical flip and subsequent
+			//	actions for each stream flipped.
+			//
+			for( s = signal_stream; flipped; s++, flipped >>= 1 ) {
+				if(!( flipped & 1 )) continue;
+				if(( s->side = !s->side )) {
+
+#ifdef ISR_PATH_TRACKING
+					if( path == ISR_PATH_MID_BIT ) path = ISR_PATH_BIT_CHANGE;
 #endif
 
 					//
-					//	Actions related to the current state of the new
-					//	buffer (select bits to output and optional state
-					//	change).
+					//	Starting a new bit, or are there no more bits to
+					//	transmit from this buffer?
 					//
-					switch( current->state ) {
-						case TBS_RUN: {
-							//
-							//	We just transmit the packet found in
-							//	the bit data
-							//
-							bit_string = current->bits;
-							break;
-						}
-						case TBS_RELOAD: {
-							//
-							//	We have been asked to drop this buffer
-							//	so we output an idle packet while changing
-							//	the state of buffer to LOAD so the manager
-							//	can deal with it.
-							//
-							bit_string = dcc_idle_packet;
-							current->state = TBS_LOAD;
-							break;
-						}
-						case TBS_LOAD: {
-							//
-							//	This is a little tricky.  While we do not
-							//	(and cannot) do anything with a buffer in
-							//	load state, there is a requirement for the
-							//	signal generator code NOT to output an idle
-							//	packet if we are in the middle of a series
-							//	of packets on the programming track.
-							//
-							//	To this end, if (and only if) the pending
-							//	pointer is not NULL, then we will output
-							//	the dcc filler data instead of the idle
-							//	packet
-							//
-							bit_string = current->pending? dcc_filler_data: dcc_idle_packet;
-							break;
-						}
-						default: {
-							//
-							//	If we find any other state we ignore the
-							//	buffer and output an idle packet.
-							//
-							bit_string = dcc_idle_packet;
-							break;
-						}
+					if( !next_stream_bit( s )) {
+						end_stream_packet( s );
+						next_stream_buffer( s );
+
+#ifdef ISR_PATH_TRACKING
+						path = ISR_PATH_BUFFER_CHANGE;
+#endif
+
+						start_stream_packet( s );
 					}
-					//
-					//	Initialise the remaining variables required to
-					//	output the selected bit stream.
-					//
-					one = true;
-					reload = TICKS_FOR_ONE;
-					left = *bit_string++;
 				}
+				//
+				//	Reload "remaining" with the next half bit
+				//	tick count down from "reload".  If there has been
+				//	a change of output bit "reload" will already have
+				//	been modified appropriately.
+				//
+				s->remaining = s->reload;
+			}
+		}
+	}
+#else
+	s = signal_stream + MAIN_STREAM;
+#ifndef SIGNAL_HALF_BIT_TIMER
+	if(!( --s->remaining )) {
+#else
+	{
+#endif
+		//
+		//	Time is up for the current side.  Flip over and if
+		//	a whole bit has been transmitted, the find the next
+		//	bit to send.
+		//
+		//	We "flip" the output DCC signal now as this is the most
+		//	time consistent position to do so.
+		//
+		flip_stream_outputs( s );
+
+		//
+		//	With the edge generated, note how late it was.  The
+		//	histogram buckets saturate rather than wrap.
+		//
+		{
+			register byte	b;
+
+			if(( b = late >> JITTER_SHIFT ) >= JITTER_BUCKETS ) b = JITTER_BUCKETS-1;
+			if(!( ++jitter_bucket[ b ])) jitter_bucket[ b ]--;
+			if( late > jitter_max ) jitter_max = late;
+		}
+
+		//
+		//	Now undertake the logical flip and subsequent actions.
+		//
+		if(( s->side = !s->side )) {
+
+#ifdef ISR_PATH_TRACKING
+			path = ISR_PATH_BIT_CHANGE;
+#endif
+
+			//
+			//	Starting a new bit, or are there no more bits to
+			//	transmit from this buffer?
+			//
+			if( !next_stream_bit( s )) {
+				end_stream_packet( s );
+				next_stream_buffer( s );
+
+#ifdef ISR_PATH_TRACKING
+				path = ISR_PATH_BUFFER_CHANGE;
+#endif
+
+				start_stream_packet( s );
 			}
 		}
+#ifdef SIGNAL_HALF_BIT_TIMER
+		//
+		//	Program the timer with the duration of the next
+		//	half bit.  The timer has only just restarted from
+		//	zero so the new value will always be ahead of the
+		//	count.
+		//
+		HW_OCRnA = s->reload;
+#else
 		//
 		//	Reload "remaining" with the next half bit
 		//	tick count down from "reload".  If there has been
 		//	a change of output bit "reload" will already have
 		//	been modified appropriately.
 		//
-		remaining = reload;
+		s->remaining = s->reload;
+#endif
 	}
+#endif
+
+#ifdef DEBUG_ISR_CYCLES
+	//
+	//	The timer counter now holds the time since this
+	//	interrupt became due.
+	//
+	record_isr_cycles( path, HW_TCNTn );
+#endif
+#ifdef DEBUG_ISR_PATH
+	//
+	//	Leave the path taken where the simulator can see it.
 	//
-	//	In ALL cases this routine needs to complete in less than TIMER_INTERRUPT_CYCLES
-	//	(currently 232 for a 16 MHz machine).  This is (huge guestimation) approximately
+	GPIOR0 = path;
+#endif
+
+	//
+	//	In ALL cases (using the tick timer) this routine needs to complete in less
+	//	than TIMER_INTERRUPT_CYCLES (currently 232 for a 16 MHz machine).  This is (huge guestimation) approximately
 	//	100 actual instructions (assuming most instructions take 1 cycle with some taking
 	//	2 or 3).
 	//
 	//	The above code, on the "longest path" through the code (when moving
 	//	between transmission buffers) I am estimating that this uses no more
-	//	than 50 to 75% of this window.
+	//	than 50 to 75% of this window.  With more than one stream, several
+	//	streams can (occasionally) change buffers in the same tick, and the
+	//	following ticks will then start late.
 	//
 	//	This routine would be so much better written in assembler when deployed
 	//	on an AVR micro-controller, however this C does work and produces the
@@ -2356,6 +4398,39 @@ ISR( HW_TIMERn_COMPA_vect ) {
 //	--------------------------------------------
 //
 
+#ifdef SIGNAL_RAW_PACKETS
+//
+//	With raw packets the supplied series of bytes is simply placed
+//	into the bit pattern dest, with the preamble and postamble
+//	lengths, for the interrupt routine to shift out.  There is
+//	nothing to be gained from the previous packet (prev).
+//
+//	Returns true on success, false otherwise.
+//
+static bool pack_command( byte *cmd, byte clen, byte preamble, byte postamble, BIT_PATTERN *dest, UNUSED( BIT_PATTERN *prev )) {
+
+	ASSERT( preamble >= DCC_SHORT_PREAMBLE );
+	ASSERT( postamble >= 1 );
+	ASSERT(( clen >= 2 )&&( clen <= MAXIMUM_DCC_COMMAND ));
+
+#ifdef DEBUG_BIT_SLICER
+	console.print( "PACK:" );
+	for( byte l = 0; l < clen; queue_byte( cmd[ l++ ]));
+	console.print( "\n" );
+#endif
+
+	//
+	//	As with the bit transitions, trim rather than reject
+	//	a postamble which is too long.
+	//
+	if( postamble >= MAXIMUM_BIT_ITERATIONS ) postamble = MAXIMUM_BIT_ITERATIONS-1;
+	dest->preamble = preamble;
+	dest->len = clen;
+	dest->trailer = postamble + 1;
+	memcpy( dest->packet, cmd, clen );
+	return( true );
+}
+#else
 //
 //	Define a routine which will convert a supplied series of bytes
 //	into a DCC packet defined as a series of bit transitions (as used
@@ -2365,16 +4440,20 @@ ISR( HW_TIMERn_COMPA_vect ) {
 //	of the bytes themselves, but *is* required to construct the complete
 //	DCC packet formation including the preamble and inter-byte bits.
 //
-//	The code assumes it is being placed into a buffer of BIT_TRANSITIONS
-//	bytes (as per the transmission buffers).
+//	The packet is placed into the bit pattern dest.  If prev (which
+//	can be the same as dest) holds a packet which only differs from
+//	the new one in its last data byte and checksum then the bit
+//	transitions for the unchanged bytes are re-used from prev and
+//	only the last two bytes are sliced.
 //
 //	Returns true on success, false otherwise.
 //
-static bool pack_command( byte *cmd, byte clen, byte preamble, byte postamble, byte *buf ) {
-	byte	l, b, c, v, s;
+static bool pack_command( byte *cmd, byte clen, byte preamble, byte postamble, BIT_PATTERN *dest, BIT_PATTERN *prev ) {
+	byte	*buf, n, l, b, c, v, s;
 
 	ASSERT( preamble >= DCC_SHORT_PREAMBLE );
 	ASSERT( postamble >= 1 );
+	ASSERT(( clen >= 2 )&&( clen <= MAXIMUM_DCC_COMMAND ));
 
 #ifdef DEBUG_BIT_SLICER
 	console.print( "PACK:" );
@@ -2384,24 +4463,70 @@ static bool pack_command( byte *cmd, byte clen, byte preamble, byte postamble, b
 #endif
 
 	//
-	//	Start with a preamble of "1"s.
+	//	Can the previous packet be patched?  The bytes before the
+	//	last data byte must be the same (and the packet framing).
 	//
-	*buf++ = preamble;
-	l = BIT_TRANSITIONS-1;
+	s = 0;
+	if(( prev->len == clen )&&( prev->preamble == preamble )&&( prev->postamble == postamble )) {
+		while(( s < clen-2 )&&( cmd[ s ] == prev->packet[ s ])) s++;
+	}
+	if( s == clen-2 ) {
+		//
+		//	Yes.  Carry on from the start of the last data byte,
+		//	with the "0"s of the inter-byte bit already counted.
+		//
+		if( dest != prev ) {
+			memcpy( dest->bits, prev->bits, prev->mark );
+			dest->mark = prev->mark;
+			dest->zeros = prev->zeros;
+		}
+		buf = dest->bits + dest->mark;
+		l = BIT_TRANSITIONS - dest->mark;
+		b = 0;
+		c = dest->zeros;
+	}
+	else {
+		//
+		//	No.  Start with a preamble of "1"s.
+		//
+		buf = dest->bits;
+		*buf++ = preamble;
+		l = BIT_TRANSITIONS-1;
 
+		//
+		//	Prime pump with the end of header "0" bit.
+		//
+		b = 0;			// Looking for "0"s. Will
+					// be value 0x80 when looking
+					// for "1"s.
+		c = 1;			// 1 zero found already.
+		s = 0;
+	}
 	//
-	//	Prime pump with the end of header "0" bit.
+	//	Record the packet being created (invalid until it is
+	//	complete).
 	//
-	b = 0;			// Looking for "0"s. Will
-				// be value 0x80 when looking
-				// for "1"s.
-	c = 1;			// 1 zero found already.
+	n = clen;
+	dest->len = 0;
+	dest->preamble = preamble;
+	dest->postamble = postamble;
+	memcpy( dest->packet, cmd, clen );
+	cmd += s;
+	clen -= s;
 
 	//
 	//	Step through each of the source bytes one at
 	//	a time..
 	//
 	while( clen-- ) {
+		//
+		//	Note where the last data byte starts (we are
+		//	always counting "0"s at this point).
+		//
+		if( clen == 1 ) {
+			dest->mark = buf - dest->bits;
+			dest->zeros = c;
+		}
 		//
 		//	Get this byte value.
 		//
@@ -2504,8 +4629,10 @@ static bool pack_command( byte *cmd, byte clen, byte preamble, byte postamble, b
 #endif
 
 	*buf = 0;
+	dest->len = n;
 	return( true );
 }
+#endif
 
 //
 //	Reply Construction routines.
@@ -2603,6 +4730,16 @@ static void reply_3( char *buf, char code, int a1, int a2, int a3 ) {
 	*buf = EOS;
 }
 
+//
+//	Send the reply to a command which is not being sent as it would
+//	not change the state of the decoder (throttles repeat commands to
+//	keep them alive), leaving the transmission buffers untouched.
+//
+static void reply_unchanged( char *reply, char cmd ) {
+	if( !console.print( reply )) errors.log_error( COMMAND_REPORT_FAIL, cmd );
+	if(!( ++suppressed_commands )) suppressed_commands--;
+}
+
 //
 //	Error Reporting Code.
 //	---------------------
@@ -2747,6 +4884,9 @@ DRIVER_STATUS {
 #define DRIVER_LOAD struct driver_load
 DRIVER_LOAD {
 	bool		prog;
+#if SIGNAL_STREAMS > 1
+	byte		stream;
+#endif
 	word		compound_value[ COMPOUNDED_VALUES ];
 	DRIVER_STATUS	status;
 	unsigned long	recheck;
@@ -2758,6 +4898,15 @@ DRIVER_LOAD {
 //
 static DRIVER_LOAD	output_load[ SHIELD_OUTPUT_DRIVERS ];
 
+//
+//	Return the signal stream driving the supplied driver.
+//
+#if SIGNAL_STREAMS > 1
+#define DRIVER_STREAM(d)	(output_load[(d)].stream)
+#else
+#define DRIVER_STREAM(d)	MAIN_STREAM
+#endif
+
 //
 //	This is the phase flipping code lock flag.  Normally
 //	NULL, set to the address of a load record when a district
@@ -2807,6 +4956,9 @@ static void init_driver_load( void ) {
 	//
 	for( byte d = 0; d < SHIELD_OUTPUT_DRIVERS; d++ ) {
 		output_load[ d ].prog = !pgm_read_byte( &( shield_output[ d ].main ));
+#if SIGNAL_STREAMS > 1
+		output_load[ d ].stream = driver_stream( d );
+#endif
 		for( byte c = 0; c < COMPOUNDED_VALUES; c++ ) {
 			output_load[ d ].compound_value[ c ] = 0;
 		}
@@ -3008,26 +5160,28 @@ static void monitor_current_load( int amps ) {
 						//	can initiate the phase flipping logic.
 						//
 					
+						SIGNAL_STREAM	*s = signal_stream + DRIVER_STREAM( output_index );
+
 #ifdef SHIELD_PORT_DIRECT
 						byte	mask;
 
 						//
 						//	For a direct port shield we simply "flip" the corresponding
-						//	bits in the output_mask_on and output_mask_off bit masks, once
+						//	bits in the stream's mask_on and mask_off bit masks, once
 						//	we have worked out which bits to flip.
 						//
 						mask = pgm_read_byte( &( shield_output[ output_index ].direction ));
 						//
 						//	.. and flip.
 						//
-						output_mask_on ^= mask;
-						output_mask_off ^= mask;
+						s->mask_on ^= mask;
+						s->mask_off ^= mask;
 #else
 						//
-						//	For an Arduino motor shield solution we simply invert the
-						//	corresponding output_phase[] value.
+						//	For an Arduino motor shield solution we invert the
+						//	direction pin within its output port record.
 						//
-						output_phase[ output_index ] ^= true;
+						flip_output_pin( s, pgm_read_byte( &( shield_output[ output_index ].direction )));
 #endif
 						//
 						//	Lock the flip code and note change of state.
@@ -3117,23 +5271,25 @@ static void monitor_current_load( int amps ) {
 						//
 						//	We can phase flip because the flip lock has become free.
 						//
+						SIGNAL_STREAM	*s = signal_stream + DRIVER_STREAM( output_index );
+
 #ifdef SHIELD_PORT_DIRECT
 						byte	mask;
 
 						//
 						//	For a direct port shield we simply "flip" the corresponding
-						//	bits in the output_mask_on and output_mask_off bit masks, once
+						//	bits in the stream's mask_on and mask_off bit masks, once
 						//	we have worked out which bit to flip.
 						//
 						mask = pgm_read_byte( &( shield_output[ output_index ].direction ));
-						output_mask_on ^= mask;
-						output_mask_off ^= mask;
+						s->mask_on ^= mask;
+						s->mask_off ^= mask;
 #else
 						//
-						//	For an Arduino motor shield solution we simply invert the
-						//	corresponding output_phase[] value.
+						//	For an Arduino motor shield solution we invert the
+						//	direction pin within its output port record.
 						//
-						output_phase[ output_index ] ^= true;
+						flip_output_pin( s, pgm_read_byte( &( shield_output[ output_index ].direction )));
 #endif
 						//
 						//	Lock the flip code and note change of state but
@@ -3375,309 +5531,660 @@ static void report_track_power( void ) {
 //	or programming track, "[P2]"), and not directly between using the
 //	operations track and programming track.
 //
+//	With SIGNAL_PROG_STREAM the two tracks are driven by separate
+//	signal streams and so can be powered independently; "[P3]"
+//	powers both and any state can be selected from any other.
+//
+
+//
+//	Power ON/OFF status values.  These double as a bit mask of
+//	the tracks which are powered.
+//
+#define POWER_STATE enum power_state
+POWER_STATE {
+	GLOBAL_POWER_OFF = 0,
+	GLOBAL_POWER_MAIN = 1,
+	GLOBAL_POWER_PROG = 2,
+	GLOBAL_POWER_BOTH = 3
+};
+
+static POWER_STATE global_power_state = GLOBAL_POWER_OFF;
+
+//
+//	Routine to power the tracks selected by the supplied state
+//	and power off the others.  Return true if this actually
+//	changed the state of the power.
+//
+//	Only the drivers whose power is changing are touched, and the
+//	outputs of a signal stream are only rebuilt if one of its
+//	drivers is changing.  This leaves a track which remains powered
+//	(and any phase flip applied to its districts) undisturbed.
+//
+static byte set_track_power( POWER_STATE state ) {
+	POWER_STATE	prev;
+	byte		changed;
+
+	prev = global_power_state;
+	changed = 0;
+	
+	for( byte i = 0; i < SHIELD_OUTPUT_DRIVERS; i++ ) {
+		byte	track;
+
+		track = output_load[ i ].prog? GLOBAL_POWER_PROG: GLOBAL_POWER_MAIN;
+		if(( state & track ) == ( prev & track )) continue;
+		//
+		//	This driver's power is changing, note its stream.
+		//
+		changed |= bit( DRIVER_STREAM( i ));
+		if( state & track ) {
+			//
+			//	Enable the specific track driver..
+			//
+			digitalWrite( pgm_read_byte( &( shield_output[ i ].enable )), HIGH );
+			output_load[ i ].status = DRIVER_ON_GRACE;
+			output_load[ i ].recheck = now + POWER_GRACE_PERIOD;
+		}
+		else {
+			//
+			//	.. or disable it.
+			//
+			digitalWrite( pgm_read_byte( &( shield_output[ i ].enable )), LOW );
+			output_load[ i ].status = DRIVER_DISABLED;
+			output_load[ i ].recheck = 0;
+		}
+		//
+		//	Clear load array.
+		//
+		for( byte j = 0; j < COMPOUNDED_VALUES; j++ ) {
+			output_load[ i ].compound_value[ j ] = 0;
+		}
+	}
+	//
+	//	Now rebuild the outputs of any stream with a changed driver.
+	//
+	for( byte t = 0; t < SIGNAL_STREAMS; t++ ) {
+		SIGNAL_STREAM	*s;
+
+		if(!( changed & bit( t ))) continue;
+		s = signal_stream + t;
+
+#ifdef SHIELD_PORT_DIRECT
+		{
+			byte	new_mask;
+
+			//
+			//	Rebuild the output mask to reflect the new output
+			//	pin mask.  We "buffer" the change to the mask
+			//	value to ensure that it moves directly from its old value
+			//	to zero then to its completed new value without containing
+			//	any intermediate values.  This ensures that the ISR
+			//	only ever sees valid and complete bit masks.
+			//
+			//	When we power on the track we assume *all* districts are
+			//	in "forward" mode (all the same phase) so mask_on
+			//	contains all "1"s and mask_off "0"s.  If a phase
+			//	change condition is detected the distict impacted will move
+			//	its "1" from _on to _off (or the otherway).
+			//
+			s->mask_on = s->mask_off = new_mask = 0;
+			for( byte i = 0; i < SHIELD_OUTPUT_DRIVERS; i++ ) {
+				if(( DRIVER_STREAM( i ) == t )&&( output_load[ i ].status != DRIVER_DISABLED )) {
+					new_mask |= pgm_read_byte( &( shield_output[ i ].direction ));
+				}
+			}
+			s->mask_on = new_mask;
+		}
+#else
+		//
+		//	Set up the output port array for the stream, adding
+		//	each direction pin in the "normal" phase alignment.
+		//
+		s->ports = 0;
+		for( byte i = 0; i < SHIELD_OUTPUT_DRIVERS; i++ ) {
+			if(( DRIVER_STREAM( i ) == t )&&( output_load[ i ].status != DRIVER_DISABLED )) {
+				add_output_pin( s, pgm_read_byte( &( shield_output[ i ].direction )));
+			}
+		}
+#endif
+	}
+
+#ifdef PROGRAMMING_TRACK
+	if(( state & GLOBAL_POWER_PROG )&&!( prev & GLOBAL_POWER_PROG )) reset_confirmation( true );
+#endif
+	report_driver_status();
+	global_power_state = state;
+	return( prev != state );
+}
+
+//
+//	Target Lookup.
+//	--------------
+//
+//	The roster records and the accessory and mobile transmission
+//	buffers are all looked up by their DCC target on every command
+//	(and every function packet composed).  Rather than scanning them
+//	a small open addressing (linear probing) hash table, keyed on
+//	the kind of record and its target, holds the "slot" number of
+//	every record with a target:
+//
+//		0 .. R-1	The roster records.
+//
+//		R .. R+B-1	The accessory then mobile transmission
+//				buffers (in circular_buffer[] order).
+//
+//	There is only one slot for each kind and target, so a buffer
+//	taking a target takes it over from any other buffer left with
+//	the same (out of date) target.
+//
+//	The table is only used by the command and management code, and
+//	must always have some empty cells to terminate a search.
+//
+#define TARGET_ROSTER		0
+#define TARGET_ACCESSORY	1
+#define TARGET_MOBILE		2
+
+#define HASHED_BUFFERS		(MOBILE_BASE_BUFFER+MOBILE_TRANS_BUFFERS)
+#define TARGET_SLOTS		(ROSTER_SIZE+HASHED_BUFFERS)
+#if TARGET_SLOTS < 255
+#define TARGET_SLOT		byte
+#else
+#define TARGET_SLOT		word
+#endif
+#define NO_TARGET_SLOT		((TARGET_SLOT)~0)
+
+#define TARGET_HASH_BITS	SELECT_SML( 6, 7, 9 )
+#define TARGET_HASH_SIZE	(1<<TARGET_HASH_BITS)
+#define TARGET_HASH_MASK	(TARGET_HASH_SIZE-1)
+#if TARGET_HASH_SIZE <= TARGET_SLOTS
+#error "TARGET_HASH_SIZE must be larger than TARGET_SLOTS."
+#endif
+
+static TARGET_SLOT	target_hash[ TARGET_HASH_SIZE ];
+
+//
+//	Empty the table.
+//
+static void init_target_hash( void ) {
+	for( word i = 0; i < TARGET_HASH_SIZE; target_hash[ i++ ] = NO_TARGET_SLOT );
+}
+
+//
+//	The kind and target of the record in a slot.
+//
+static byte slot_kind( TARGET_SLOT s ) {
+	if( s < ROSTER_SIZE ) return( TARGET_ROSTER );
+	if( s < ROSTER_SIZE + MOBILE_BASE_BUFFER ) return( TARGET_ACCESSORY );
+	return( TARGET_MOBILE );
+}
+
+static int slot_target( TARGET_SLOT s ) {
+	if( s < ROSTER_SIZE ) return( roster[ s ].target );
+	return( circular_buffer[ s - ROSTER_SIZE ].target );
+}
+
+//
+//	The table cell where the search for a kind and target starts
+//	(multiplicative hashing, taking the top bits of the 16 bit
+//	product).
+//
+static word target_home( byte kind, int target ) {
+	return(((((word)target + kind * 0x5555U ) * 0x9E37U ) >> ( 16 - TARGET_HASH_BITS )) & TARGET_HASH_MASK );
+}
+
+//
+//	Return the table cell holding the slot of the kind and target
+//	supplied, or NULL if there is no such record.
+//
+static TARGET_SLOT *find_target( byte kind, int target ) {
+	TARGET_SLOT	s;
+	word		i;
+
+	for( i = target_home( kind, target ); ( s = target_hash[ i ]) != NO_TARGET_SLOT; i = ( i + 1 ) & TARGET_HASH_MASK ) {
+		if(( slot_kind( s ) == kind )&&( slot_target( s ) == target )) return( target_hash + i );
+	}
+	return( NULL );
+}
+
+//
+//	Enter a slot, which has just been given its target, into the
+//	table (taking over the cell of any other slot with the same
+//	kind and target).
+//
+static void claim_target( TARGET_SLOT s ) {
+	TARGET_SLOT	t;
+	byte		kind;
+	int		target;
+	word		i;
+
+	kind = slot_kind( s );
+	target = slot_target( s );
+	for( i = target_home( kind, target ); ( t = target_hash[ i ]) != NO_TARGET_SLOT; i = ( i + 1 ) & TARGET_HASH_MASK ) {
+		if(( slot_kind( t ) == kind )&&( slot_target( t ) == target )) break;
+	}
+	target_hash[ i ] = s;
+}
+
+//
+//	Remove a slot from the table before its target is changed.
+//	The slot is only removed if it still holds the cell for its
+//	target.  The following cells of the run are shuffled back
+//	to fill the gap so that no search can stop short.
+//
+static void release_target( TARGET_SLOT s ) {
+	TARGET_SLOT	*cell,
+			t;
+	word		i,
+			j;
+
+	if((( cell = find_target( slot_kind( s ), slot_target( s ))) == NULL )||( *cell != s )) return;
+	i = j = cell - target_hash;
+	while(( t = target_hash[( j = ( j + 1 ) & TARGET_HASH_MASK )]) != NO_TARGET_SLOT ) {
+		//
+		//	Move the slot back unless its search starts
+		//	after the gap.
+		//
+		if((( j - target_home( slot_kind( t ), slot_target( t ))) & TARGET_HASH_MASK ) >= (( j - i ) & TARGET_HASH_MASK )) {
+			target_hash[ i ] = t;
+			i = j;
+		}
+	}
+	target_hash[ i ] = NO_TARGET_SLOT;
+}
+
+//
+//	Change the target of a transmission buffer, keeping the table
+//	up to date.
+//
+static void set_buffer_target( TRANS_BUFFER *buf, int target ) {
+	TARGET_SLOT	s;
+
+	if(( s = buf - circular_buffer ) >= HASHED_BUFFERS ) {
+		buf->target = target;
+		return;
+	}
+	s += ROSTER_SIZE;
+	if( buf->target ) release_target( s );
+	if(( buf->target = target )) claim_target( s );
+}
+
+//
+//	Find the roster record for a target.  If create is true and
+//	the target is not in the roster then a record is created for
+//	it, re-using the record of a stationary decoder if the roster
+//	is full.  Returns NULL if no record is found (or can be made).
+//
+static ROSTER_ENTRY *find_roster( int target, bool create ) {
+	TARGET_SLOT	*cell;
+	ROSTER_ENTRY	*ptr,
+			*spare,
+			*stopped;
+#if FUNCTION_STORE_RECORDS > 0
+	FUNCTION_STORE_RECORD	stored;
+	bool			found;
+#endif
+
+	ASSERT( target >= MINIMUM_DCC_ADDRESS );
+	ASSERT( target <= MAXIMUM_DCC_ADDRESS );
+
+	if(( cell = find_target( TARGET_ROSTER, target ))) return( roster + *cell );
+	if( !create ) return( NULL );
+#if FUNCTION_STORE_RECORDS > 0
+	//
+	//	Look for stored functions first, so a busy store
+	//	refuses the target before anything has changed.
+	//
+	if( find_function_store( target, &stored, &found ) == FUNCTION_STORE_BUSY ) return( NULL );
+#endif
+	//
+	//	Use an empty record, or failing that, forget a
+	//	stationary decoder.
+	//
+	spare = NULL;
+	stopped = NULL;
+	ptr = roster;
+	for( byte i = 0; i < ROSTER_SIZE; i++ ) {
+		if( ptr->target == 0 ) {
+			spare = ptr;
+			break;
+		}
+		if(( stopped == NULL )&& !ROSTER_MOVING( ptr->speed )) stopped = ptr;
+		ptr++;
+	}
+	if( spare == NULL ) {
+		if(( spare = stopped ) == NULL ) return( NULL );
+#if FUNCTION_STORE_RECORDS > 0
+		if( !save_functions( spare )) return( NULL );
+#endif
+		release_target( spare - roster );
+	}
+	spare->target = target;
+	claim_target( spare - roster );
+	spare->speed = 0;
+#ifdef SIGNAL_DISTRICT_STREAMS
+	spare->districts = 0;
+#endif
+	for( byte i = 0; i < FUNCTION_BIT_ARRAY; spare->bits[ i++ ] = 0 );
+#if FUNCTION_STORE_RECORDS > 0
+	if( found ) for( byte i = 0; i < FUNCTION_BIT_ARRAY; i++ ) spare->bits[ i ] = stored.bits[ i ];
+#endif
+	return( spare );
+}
+
+//
+//	Routine applies a boolean value for a specified function
+//	on a specified target number.  Returns true if the function
+//	has changed state.
+//
+static bool update_function( int target, byte func, bool state ) {
+	ROSTER_ENTRY	*ptr;
+	byte		i, b; 
+
+	ASSERT( func <= MAX_FUNCTION_NUMBER );
+
+	if(( ptr = find_roster( target, true )) == NULL ) return( false );
+	i = ( func - MIN_FUNCTION_NUMBER ) >> 3;
+	b = 1 << (( func - MIN_FUNCTION_NUMBER ) & 7 );
+
+	if( state ) {
+		//
+		//	Bit set already?
+		//
+		if( ptr->bits[ i ] & b ) return( false );
+		//
+		//	Yes.
+		//
+		ptr->bits[ i ] |= b;
+		return( true );
+	}
+	//
+	//	Bit clear already?
+	//
+	if(!( ptr->bits[ i ] & b )) return( false );
+	//
+	//	Yes.
+	//
+	ptr->bits[ i ] &= ~b;
+	return( true );
+}
+
+//
+//	Return true if the roster records the function of the decoder
+//	in the state supplied already (false if the decoder is not in
+//	the roster).
+//
+static bool function_unchanged( int target, byte func, bool state ) {
+	ROSTER_ENTRY	*ptr;
+
+	ASSERT( func <= MAX_FUNCTION_NUMBER );
+
+	if(( ptr = find_roster( target, false )) == NULL ) return( false );
+	func -= MIN_FUNCTION_NUMBER;
+	return((( ptr->bits[ func >> 3 ] & bit( func & 7 )) != 0 ) == state );
+}
+
+//
+//	Buffer Control and Management Code.
+//	-----------------------------------
+//
+
+//
+//	The following variable is used by the "Management Processing" code which
+//	continuously loops through the transmission buffers looking for buffers
+//	which need some processing.
+//
+static TRANS_BUFFER	*manage;
 
 //
-//	Power ON/OFF status values.
+//	Add a buffer which has just been given a new packet to the
+//	priority queue so that the interrupt routine sends it ahead
+//	of the background refresh.  If the buffer is already queued,
+//	or the queue is full, the buffer is left to be sent in turn.
 //
-#define POWER_STATE enum power_state
-POWER_STATE {
-	GLOBAL_POWER_OFF,
-	GLOBAL_POWER_MAIN,
-	GLOBAL_POWER_PROG
-};
+static void schedule_buffer( TRANS_BUFFER *buf ) {
+	byte	next;
 
-static POWER_STATE global_power_state = GLOBAL_POWER_OFF;
+	if( buf->priority ) return;
+#ifdef SIGNAL_PROG_STREAM
+	//
+	//	The programming track buffer has a signal stream to
+	//	itself, and must not be sent on the operations track.
+	//
+	if( buf >= circular_buffer + PROGRAMMING_BASE_BUFFER ) return;
+#endif
+#ifdef SIGNAL_DISTRICT_STREAMS
+	//
+	//	District refresh buffers are only ever sent in turn.
+	//
+	if( buf >= circular_buffer + REFRESH_BASE_BUFFER ) return;
+#endif
+	if(( next = priority_in + 1 ) >= PRIORITY_QUEUE ) next = 0;
+	//
+	//	The queue is full if any stream has still to read
+	//	the entry we would overwrite.
+	//
+	for( byte t = 0; t < SIGNAL_STREAMS; t++ ) {
+		if( next == signal_stream[ t ].priority_out ) return;
+	}
+	//
+	//	The entry and flags must be in place before the queue
+	//	index makes them visible to the interrupt routine.
+	//
+	priority_queue[ priority_in ] = buf;
+	buf->priority = BUFFER_STREAMS( buf );
+	priority_in = next;
+}
 
 //
-//	Routine to turn ON the operating track.
-//	Return true if this actually changed the
-//	state of the power.
+//	Return true if the target is being sent by a refreshing buffer
+//	(of the same district) other than the one supplied.
 //
-//
-static byte power_on_main_track( void ) {
-	POWER_STATE	prev;
+static bool mobile_buffer_target( TRANS_BUFFER *buf, int target ) {
+	TRANS_BUFFER	*b;
 
-	prev = global_power_state;
-	
-#ifdef SHIELD_PORT_DIRECT
-	{
-		byte	new_mask;
-		
-		//
-		//	Rebuild the output mask to reflect the new output
-		//	pin mask.  We "buffer" the change to the output_mask
-		//	value to ensure that it moves directly from its old value
-		//	to zero then to its completed new value without containing
-		//	any intermediate values.  This ensures that the ISR
-		//	only ever sees valid and complete bit masks.
-		//
-		//	When we power on the track we assume *all* districts are
-		//	in "forward" mode (all the same phase) so output_mask_on
-		//	contains all "1"s and output_mask_off "0"s.  If a phase
-		//	change condition is detected the distict impacted will move
-		//	its "1" from _on to _off (or the otherway).
-		//
-		output_mask_on = output_mask_off = new_mask = 0;
-		for( byte i = 0; i < SHIELD_OUTPUT_DRIVERS; i++ ) {
-			if( pgm_read_byte( &( shield_output[ i ].main ))) {
-				//
-				//	Enable the specific operating track driver..
-				//
-				digitalWrite( pgm_read_byte( &( shield_output[ i ].enable )), HIGH );
-				output_load[ i ].status = DRIVER_ON_GRACE;
-				output_load[ i ].recheck = now + POWER_GRACE_PERIOD;
-				//
-				//	Add the pin to the mask
-				//
-				new_mask |= pgm_read_byte( &( shield_output[ i ].direction ));
-			}
-			else {
-				//
-				//	Disable the specific programming track driver.
-				//
-				digitalWrite( pgm_read_byte( &( shield_output[ i ].enable )), LOW );
-				output_load[ i ].status = DRIVER_DISABLED;
-			}
-			//
-			//	Clear load array.
-			//
-			for( byte j = 0; j < COMPOUNDED_VALUES; j++ ) {
-				output_load[ i ].compound_value[ j ] = 0;
-			}
-			output_load[ i ].recheck = 0;
-		}
-		output_mask_on = new_mask;
+#ifdef SIGNAL_DISTRICT_STREAMS
+	b = circular_buffer + ( REFRESH_BASE_BUFFER + ( buf - ( circular_buffer + REFRESH_BASE_BUFFER )) / DISTRICT_REFRESH_BUFFERS * DISTRICT_REFRESH_BUFFERS );
+	for( byte i = 0; i < DISTRICT_REFRESH_BUFFERS; i++ ) {
+		if(( b != buf )&&( b->state != TBS_EMPTY )&&( b->target == target )) return( true );
+		b++;
 	}
+	return( false );
 #else
-	{
-		//
-		//	Set up the output pin array for the main track.
-		//
-		output_pins = 0;
-		for( byte i = 0; i < SHIELD_OUTPUT_DRIVERS; i++ ) {
-			if( pgm_read_byte( &( shield_output[ i ].main ))) {
-				//
-				//	Enable the specific operating track driver..
-				//
-				digitalWrite( pgm_read_byte( &( shield_output[ i ].enable )), HIGH );
-				output_load[ i ].status = DRIVER_ON_GRACE;
-				output_load[ i ].recheck = now + POWER_GRACE_PERIOD;
-				//
-				//	Add the direction pin to the output array..
-				//
-				output_pin[ output_pins ] = pgm_read_byte( &( shield_output[ i ].direction ));
-				//
-				//	Kick off in the "normal" phase alignment.
-				//
-				output_phase[ output_pins ] = true;
-				//
-				//	..and then (after updating the arrays) increase the pin count.
-				//
-				output_pins++;
-			}
-			else {
-				//
-				//	Disable the specific programming track driver.
-				//
-				digitalWrite( pgm_read_byte( &( shield_output[ i ].enable )), LOW );
-				output_load[ i ].status = DRIVER_DISABLED;
-			}
-			//
-			//	Clear load array.
-			//
-			for( byte j = 0; j < COMPOUNDED_VALUES; j++ ) {
-				output_load[ i ].compound_value[ j ] = 0;
-			}
-			output_load[ i ].recheck = 0;
-		}
-	}
-#endif
+	TARGET_SLOT	*cell;
 
-	report_driver_status();
-	global_power_state = GLOBAL_POWER_MAIN;
-	return( prev != GLOBAL_POWER_MAIN );
+	if(( cell = find_target( TARGET_MOBILE, target )) == NULL ) return( false );
+	b = circular_buffer + ( *cell - ROSTER_SIZE );
+	return(( b != buf )&&( b->state != TBS_EMPTY ));
+#endif
 }
 
 //
-//	Routine to turn ON the programming track.
-//	Return true if this actually changed the
-//	state of the power.
+//	Pack a refreshing buffer with a packet composed from the roster.
 //
-//
-
-#ifdef PROGRAMMING_TRACK
+static bool pack_refresh( TRANS_BUFFER *buf, int target, byte *command, byte len ) {
+	byte		packet[ MAXIMUM_DCC_COMMAND ];
 
-static byte power_on_prog_track( void ) {
-	POWER_STATE	prev;
+	len = copy_with_parity( packet, command, len );
+	if( !pack_command( packet, len, DCC_SHORT_PREAMBLE, 1, buf->bits, buf->bits )) {
+		errors.log_error( BIT_TRANS_OVERFLOW, target );
+		return( false );
+	}
+	//
+	//	As a refresh this is not sent out of turn.
+	//
+	set_buffer_target( buf, target );
+	buf->duration = ROSTER_REFRESH_REPEATS;
+	buf->refresh = true;
+	buf->state = TBS_RUN;
+	return( true );
+}
 
-	prev = global_power_state;
+//
+//	Re-pack a refreshing buffer with the next function group (with
+//	a function on) of the decoders in the roster, for district
+//	stream t.  Returns false if there is nothing to refresh.
+//
+static bool refresh_functions( TRANS_BUFFER *buf, byte t ) {
+	ROSTER_ENTRY	*r;
+	byte		command[ MAXIMUM_DCC_COMMAND ],
+			g;
 
-#ifdef SHIELD_PORT_DIRECT
-	{
-		byte	new_mask;
-		
-		//
-		//	Same code as the above.
-		//
-		output_mask_on = output_mask_off = new_mask = 0;
-		for( byte i = 0; i < SHIELD_OUTPUT_DRIVERS; i++ ) {
-			if( pgm_read_byte( &( shield_output[ i ].main ))) {
-				//
-				//	Disable the specific operating track driver.
-				//
-				digitalWrite( pgm_read_byte( &( shield_output[ i ].enable )), LOW );
-				output_load[ i ].status = DRIVER_DISABLED;
-			}
-			else {
-				//
-				//	Enable the specific programming track driver..
-				//
-				digitalWrite( pgm_read_byte( &( shield_output[ i ].enable )), HIGH );
-				output_load[ i ].status = DRIVER_ON_GRACE;
-				output_load[ i ].recheck = now + POWER_GRACE_PERIOD;
-				//
-				//	Add the pin to the mask
-				//
-				new_mask |= pgm_read_byte( &( shield_output[ i ].direction ));
-			}
-			//
-			//	Clear load array.
-			//
-			for( byte j = 0; j < COMPOUNDED_VALUES; j++ ) {
-				output_load[ i ].compound_value[ j ] = 0;
+	//
+	//	One more than the roster size as the search can finish
+	//	with the earlier groups of the record it started in.
+	//
+	for( byte i = 0; i <= ROSTER_SIZE; i++ ) {
+		r = roster + function_refresh[ t ];
+		if( r->target && ROSTER_DISTRICT( r, t ) && !mobile_buffer_target( buf, r->target )) {
+			while(( g = function_group_refresh[ t ]++ ) < FUNCTION_GROUPS ) {
+				if( function_group_bits( g, r->bits )) return( pack_refresh( buf, r->target, command, compose_function_packet( command, r->target, g, r->bits )));
 			}
-			output_load[ i ].recheck = 0;
 		}
-		output_mask_on = new_mask;
+		function_group_refresh[ t ] = 0;
+		if(( function_refresh[ t ] += 1 ) >= ROSTER_SIZE ) function_refresh[ t ] = 0;
 	}
+	return( false );
+}
+
+//
+//	Re-pack a mobile buffer, which has completed its transmission,
+//	with a speed and direction packet for the next moving decoder
+//	in the roster that is not already being sent by another mobile
+//	buffer.  This is how the small number of mobile buffers cycle
+//	through all of the moving decoders in the roster.  Every
+//	FUNCTION_REFRESH_INTERVAL refreshes, and whenever no decoder is
+//	moving, a function group is refreshed instead.
+//
+//	With district streams it is the refresh buffers of each district
+//	which are re-packed, and only with decoders in that district.
+//
+//	Returns false if the buffer is not a refreshing buffer or there
+//	is nothing to refresh, in which case the buffer can be emptied.
+//
+static bool refresh_roster( TRANS_BUFFER *buf ) {
+	ROSTER_ENTRY	*r;
+	byte		command[ MAXIMUM_DCC_COMMAND ],
+			t;
+	bool		moving;
+
+#ifdef SIGNAL_DISTRICT_STREAMS
+	if(( buf < circular_buffer + REFRESH_BASE_BUFFER )||( buf >= circular_buffer + PROGRAMMING_BASE_BUFFER )) return( false );
+	t = ( buf - ( circular_buffer + REFRESH_BASE_BUFFER )) / DISTRICT_REFRESH_BUFFERS;
 #else
-	{
-		//
-		//	Set up the output pin array for the main track.
-		//
-		output_pins = 0;
-		for( byte i = 0; i < SHIELD_OUTPUT_DRIVERS; i++ ) {
-			if( pgm_read_byte( &( shield_output[ i ].main ))) {
-				//
-				//	Disable the specific operating track driver.
-				//
-				digitalWrite( pgm_read_byte( &( shield_output[ i ].enable )), LOW );
-				output_load[ i ].status = DRIVER_DISABLED;
-			}
-			else {
-				//
-				//	Enable the specific programming track driver..
-				//
-				digitalWrite( pgm_read_byte( &( shield_output[ i ].enable )), HIGH );
-				output_load[ i ].status = DRIVER_ON_GRACE;
-				output_load[ i ].recheck = now + POWER_GRACE_PERIOD;
-				//
-				//	Add the direction pin to the output array..
-				//
-				output_pin[ output_pins ] = pgm_read_byte( &( shield_output[ i ].direction ));
-				//
-				//	Kick off in the "normal" phase alignment.
-				//
-				output_phase[ output_pins ] = true;
-				//
-				//	..and then (after updating the arrays) increase the pin count.
-				//
-				output_pins++;
-			}
-			//
-			//	Clear load array.
-			//
-			for( byte j = 0; j < COMPOUNDED_VALUES; j++ ) {
-				output_load[ i ].compound_value[ j ] = 0;
+	if(( buf < circular_buffer + MOBILE_BASE_BUFFER )||( buf >= circular_buffer + PROGRAMMING_BASE_BUFFER )) return( false );
+	t = MAIN_STREAM;
+#endif
+	if( buf->reply != NO_REPLY_REQUIRED ) return( false );
+	if( FUNCTION_REFRESH_INTERVAL &&( function_refresh_due[ t ] >= FUNCTION_REFRESH_INTERVAL )) {
+		function_refresh_due[ t ] = 0;
+		if( refresh_functions( buf, t )) return( true );
+	}
+	moving = false;
+	for( byte i = 0; i < ROSTER_SIZE; i++ ) {
+		r = roster + roster_refresh[ t ];
+		if(( roster_refresh[ t ] += 1 ) >= ROSTER_SIZE ) roster_refresh[ t ] = 0;
+		if( r->target && ROSTER_MOVING( r->speed ) && ROSTER_DISTRICT( r, t )) {
+			if( !mobile_buffer_target( buf, r->target )) {
+				if( function_refresh_due[ t ] < FUNCTION_REFRESH_INTERVAL ) function_refresh_due[ t ] += 1;
+				return( pack_refresh( buf, r->target, command, compose_motion_packet( command, r->target, ROSTER_STEP( r->speed ) - 1, ROSTER_DIR( r->speed ))));
 			}
-			output_load[ i ].recheck = 0;
+			moving = true;
 		}
 	}
-#endif
-	reset_confirmation( true );
-	report_driver_status();
-	global_power_state = GLOBAL_POWER_PROG;
-	return( prev != GLOBAL_POWER_PROG );
+	//
+	//	If nothing is moving the function refresh need
+	//	not wait its turn.
+	//
+	return( !moving && FUNCTION_REFRESH_INTERVAL && refresh_functions( buf, t ));
 }
 
-#endif
-
 //
-//	Routine to power OFF tracks, return true
-//	if this actually changed the state of the
-//	power.
+//	A new command makes any refresh of the decoder already packed
+//	into a refreshing buffer out of date.  Return such buffers to
+//	LOAD (unless being transmitted right now) so they are re-packed
+//	from the updated roster rather than sending the old speed or
+//	functions after the new ones.
 //
-static byte power_off_tracks( void ) {
-	POWER_STATE	prev;
+static void drop_refresh( int target ) {
+	TRANS_BUFFER	*b;
 
-	prev = global_power_state;
-	
-#ifdef SHIELD_PORT_DIRECT
-	//
-	//	Clear the output pin mask.
-	//
-	output_mask_on = 0;
-	output_mask_off = 0;
+#ifdef SIGNAL_DISTRICT_STREAMS
+	b = circular_buffer + REFRESH_BASE_BUFFER;
+	for( byte i = 0; i < REFRESH_TRANS_BUFFERS; i++ ) {
+		if( b->target == target ) {
+			Critical code;
+
+			if(( b->state == TBS_RUN )&&( b != signal_stream[ i / DISTRICT_REFRESH_BUFFERS ].current )) b->state = TBS_LOAD;
+		}
+		b++;
+	}
 #else
+	TARGET_SLOT	*cell;
+
 	//
-	//	Mark the output pin array as empty.
+	//	Only a mobile buffer which is refreshing the decoder
+	//	(not one with a new command for it).
 	//
-	output_pins = 0;
-#endif
+	if(( cell = find_target( TARGET_MOBILE, target )) == NULL ) return;
+	b = circular_buffer + ( *cell - ROSTER_SIZE );
+	{
+		Critical code;
 
-	for( byte i = 0; i < SHIELD_OUTPUT_DRIVERS; i++ ) {
-		digitalWrite( pgm_read_byte( &( shield_output[ i ].enable )), LOW );
-		for( byte j = 0; j < COMPOUNDED_VALUES; j++ ) {
-			output_load[ i ].compound_value[ j ] = 0;
-		}
-		output_load[ i ].status = DRIVER_DISABLED;
-		output_load[ i ].recheck = 0;
+		if( b->refresh &&( b->state == TBS_RUN )&&( b->pending == NULL )&&( b != signal_stream[ MAIN_STREAM ].current )) b->state = TBS_LOAD;
 	}
-	report_driver_status();
-	global_power_state = GLOBAL_POWER_OFF;
-	return( prev != GLOBAL_POWER_OFF);
+#endif
 }
 
+#ifdef SIGNAL_DISTRICT_STREAMS
 //
-//	Buffer Control and Management Code.
-//	-----------------------------------
+//	With district streams a buffer which one district has finished
+//	with may still be being transmitted by another.  Return true
+//	if any stream is transmitting from the supplied buffer, in
+//	which case its bits must be left untouched.
 //
+static bool buffer_in_use( TRANS_BUFFER *buf ) {
+	Critical code;
 
-//
-//	The following variable is used by the "Management Processing" code which
-//	continuously loops through the transmission buffers looking for buffers
-//	which need some processing.
-//
-static TRANS_BUFFER	*manage;
+	for( byte t = 0; t < DISTRICT_STREAMS; t++ ) if( signal_stream[ t ].current == buf ) return( true );
+	return( false );
+}
+#endif
 
 //
 //	This is the routine which controls (and synchronises with the interrupt routine)
-//	the transition of buffers between various state.
+//	the transition of the supplied buffer between various state.
 //
-static void management_service_routine( void ) {
+static void service_buffer( TRANS_BUFFER *buf ) {
 	//
 	//	This routine only handles the conversion of byte encoded DCC packets into
 	//	bit encoded packets and handing the buffer off to the ISR for transmission.
 	//
 	//	Consequently we are only interested in buffers with a state of LOAD.
 	//
-	if( manage->state == TBS_LOAD ) {
+	if( buf->state == TBS_LOAD ) {
 		PENDING_PACKET	*pp;
 
+#ifdef SIGNAL_DISTRICT_STREAMS
+		//
+		//	Come back once every district has moved on.
+		//
+		if( buffer_in_use( buf )) return;
+#endif
+
 		//
 		//	Pending DCC packets to process? (assignment intentional)
 		//
-		if(( pp = manage->pending )) {
+		if(( pp = buf->pending )) {
 			//
 			//	Our only task here is to convert the pending data into live
 			//	data and set the state to RUN.
 			//
-			if( pack_command( pp->command, pp->len, pp->preamble, pp->postamble, manage->bits )) {
+			if( pack_command( pp->command, pp->len, pp->preamble, pp->postamble, buf->bits, buf->bits )) {
 				//
 				//	Good, set up the remainder of the live parameters.
 				//
-				manage->target = pp->target;
-				manage->duration = pp->duration;
+				set_buffer_target( buf, pp->target );
+				buf->duration = pp->duration;
+				buf->refresh = false;
 				//
 				//	We set state now as this is the trigger for the
 				//	interrupt routine to start processing the content of this
@@ -3688,26 +6195,27 @@ static void management_service_routine( void ) {
 				//	this might (in a case of bad timing) cause the ISR to output
 				//	an idle packet when we do not want it to.
 				//
-				manage->state = TBS_RUN;
+				buf->state = TBS_RUN;
+				schedule_buffer( buf );
 				//
 				//	Now we dispose of the one pending record we have used.
 				//
-				manage->pending = release_pending_recs( manage->pending, true );
+				buf->pending = release_pending_recs( buf->pending, true );
 				//
 				//	Finally, if this had a "reply on send" confirmation and
 				//	the command we have just lined up is the last one in the
 				//	list, then send the confirmation now.
 				//
-				if(( manage->reply == REPLY_ON_SEND )&&( manage->pending == NULL )) {
-					if( !console.print( manage->contains )) {
-						errors.log_error( COMMAND_REPORT_FAIL, manage->target );
+				if(( buf->reply == REPLY_ON_SEND )&&( buf->pending == NULL )) {
+					if( !console.print( buf->contains )) {
+						errors.log_error( COMMAND_REPORT_FAIL, buf->target );
 					}
-					manage->reply = NO_REPLY_REQUIRED;
+					buf->reply = NO_REPLY_REQUIRED;
 				}
 
 #ifdef DEBUG_BUFFER_MANAGER
 				console.print( "LOAD:" );
-				queue_int( manage->target );
+				queue_int( buf->target );
 				console.print( "\n" );
 #endif
 
@@ -3716,31 +6224,40 @@ static void management_service_routine( void ) {
 				//
 				//	Failed to complete as the bit translation failed.
 				//
-				errors.log_error( BIT_TRANS_OVERFLOW, manage->pending->target );
+				errors.log_error( BIT_TRANS_OVERFLOW, buf->pending->target );
 				//
 				//	We push this buffer back to EMPTY, there is nothing
 				//	else we can do with it.
 				//
-				manage->state = TBS_EMPTY;
+				buf->state = TBS_EMPTY;
 				//
 				//	Finally, we scrap all pending records.
 				//
-				manage->pending = release_pending_recs( manage->pending, false );
+				buf->pending = release_pending_recs( buf->pending, false );
 
 #ifdef DEBUG_BUFFER_MANAGER
 				console.print( "FAIL:" );
-				queue_int( manage->target );
+				queue_int( buf->target );
 				console.print( "\n" );
 #endif
 
 			}
 		}
-		else {
+		else if( !refresh_roster( buf )) {
+
+#ifdef SIGNAL_DISTRICT_STREAMS
+			//
+			//	A district refresh buffer is left waiting in LOAD.
+			//
+			if(( buf >= circular_buffer + REFRESH_BASE_BUFFER )&&( buf < circular_buffer + PROGRAMMING_BASE_BUFFER )) return;
+#endif
+
 			//
-			//	The pending field is empty.  Before marking the buffer as empty
+			//	The pending field is empty (and, for a mobile buffer, there
+			//	is no moving decoder to refresh).  Before marking the buffer as empty
 			//	for re-use, we should check to see if a confirmation is required.
 			//
-			if( manage->reply == REPLY_ON_CONFIRM ) {
+			if( buf->reply == REPLY_ON_CONFIRM ) {
 				bool	confirmed;
 				char	*hash;
 
@@ -3768,39 +6285,219 @@ static void management_service_routine( void ) {
 				//
 				//	Look for the HASH symbol
 				//
-				if(( hash = strchr( manage->contains, HASH )) != NULL ) {
+				if(( hash = strchr( buf->contains, HASH )) != NULL ) {
 					//
 					//	Found, so update hash and send.
 					//
 					*hash = confirmed? '1': '0';
-					if( !console.print( manage->contains )) errors.log_error( COMMAND_REPORT_FAIL, manage->target );
+					if( !console.print( buf->contains )) errors.log_error( COMMAND_REPORT_FAIL, buf->target );
 				}
 				else if( confirmed ) {
 					//
 					//	Only send confirmation if confirmation was received
 					//
-					if( !console.print( manage->contains )) errors.log_error( COMMAND_REPORT_FAIL, manage->target );
+					if( !console.print( buf->contains )) errors.log_error( COMMAND_REPORT_FAIL, buf->target );
 				}
 			}
 			//
 			//	Now mark empty.
 			//
-			manage->reply = NO_REPLY_REQUIRED;
-			manage->state = TBS_EMPTY;
+			buf->reply = NO_REPLY_REQUIRED;
+			buf->state = TBS_EMPTY;
 
 #ifdef DEBUG_BUFFER_MANAGER
 			console.print( "EMPTY:" );
-			queue_int( manage->target );
+			queue_int( buf->target );
 			console.print( "\n" );
 #endif
 
 		}
 	}
-	//
-	//	Finally, before we finish, remember to move onto the next buffer in the
-	//	circular queue.
-	//
-	manage = manage->next;
+	else if( buf->state == TBS_RELOAD ) {
+		PENDING_PACKET	*pp;
+
+		//
+		//	The IO code has replaced the pending records of a buffer
+		//	which is being transmitted.  We build the first of the new
+		//	packets in the shadow bit string, while the live bit string
+		//	continues to be sent, and then ask the ISR to swap them
+		//	over.
+		//
+		if(( pp = buf->pending )) {
+			//
+			//	Obtain a shadow bit string if we do not already have
+			//	one.  If there are no spares then we try again on
+			//	the next pass (the ISR continues with the live bits).
+			//
+			if(( buf->shadow == NULL )&& spare_bit_strings ) {
+				buf->shadow = spare_bit_string[ --spare_bit_strings ];
+			}
+			if( buf->shadow == NULL ) {
+				//
+				//	Nothing to do until a spare is returned.
+				//
+			}
+			else if( pack_command( pp->command, pp->len, pp->preamble, pp->postamble, buf->shadow, buf->bits )) {
+				//
+				//	The ISR does not use the target or duration of a
+				//	buffer in RELOAD state, so these can be set up
+				//	before the hand over.
+				//
+				set_buffer_target( buf, pp->target );
+				buf->duration = pp->duration;
+				buf->refresh = false;
+				//
+				//	Hand over to the ISR.
+				//
+				buf->state = TBS_SWAP;
+				schedule_buffer( buf );
+				//
+				//	Dispose of the pending record and send any reply
+				//	exactly as with the LOAD state above.
+				//
+				buf->pending = release_pending_recs( buf->pending, true );
+				if(( buf->reply == REPLY_ON_SEND )&&( buf->pending == NULL )) {
+					if( !console.print( buf->contains )) {
+						errors.log_error( COMMAND_REPORT_FAIL, buf->target );
+					}
+					buf->reply = NO_REPLY_REQUIRED;
+				}
+
+#ifdef DEBUG_BUFFER_MANAGER
+				console.print( "SWAP:" );
+				queue_int( buf->target );
+				console.print( "\n" );
+#endif
+
+			}
+			else {
+				//
+				//	Failed to complete as the bit translation failed.
+				//
+				//	As the live bit string may be in the middle of
+				//	transmission we leave it running and scrap the
+				//	pending records.
+				//
+				errors.log_error( BIT_TRANS_OVERFLOW, pp->target );
+				buf->pending = release_pending_recs( buf->pending, false );
+				buf->state = TBS_RUN;
+			}
+		}
+		else {
+			//
+			//	Nothing to replace the live packet with, so just
+			//	let it continue.
+			//
+			buf->state = TBS_RUN;
+		}
+	}
+	//
+	//	Any shadow bit string held by a buffer which is not preparing
+	//	(RELOAD) or waiting to swap in (SWAP) a replacement is the
+	//	previous bit string which is no longer being transmitted, so
+	//	return it to the spare pool.
+	//
+	if( buf->shadow &&( buf->state != TBS_RELOAD )&&( buf->state != TBS_SWAP )) {
+
+#ifdef SIGNAL_DISTRICT_STREAMS
+		//
+		//	Unless another district is still sending it.
+		//
+		if( buffer_in_use( buf )) return;
+#endif
+
+
+		spare_bit_string[ spare_bit_strings++ ] = buf->shadow;
+		buf->shadow = NULL;
+	}
+}
+
+//
+//	The management service routine is given a slice of the CPU on every
+//	pass through the main loop.  It services any buffers which the
+//	interrupt routine has passed through the ready queue, then the
+//	buffers which the interrupt routine will reach next (so that a
+//	buffer is packed before the ISR gets there, rather than an idle or
+//	filler packet having to be sent in its place) and then one further
+//	buffer as it works its way round the circular buffer.
+//
+static void management_service_routine( void ) {
+	TRANS_BUFFER	*ahead;
+
+	while( ready_out != ready_in ) {
+		byte	next;
+
+		ahead = ready_queue[ ready_out ];
+		if(( next = ready_out + 1 ) >= READY_QUEUE ) next = 0;
+		ready_out = next;
+		if( ahead->state == TBS_LOAD ) service_buffer( ahead );
+	}
+	//
+	//	Find where the ISR is in the circular buffer of each
+	//	signal stream.
+	//
+	for( byte t = 0; t < SIGNAL_STREAMS; t++ ) {
+		{
+			Critical code;
+
+			ahead = signal_stream[ t ].refresh;
+		}
+		for( byte i = 0; i < LOOK_AHEAD_BUFFERS; i++ ) {
+#ifdef SIGNAL_DISTRICT_STREAMS
+			{
+				//
+				//	The ISR moves the stream through the shared
+				//	buffers, so this must be read atomically.
+				//
+				Critical code;
+
+				ahead = STREAM_NEXT( signal_stream + t, ahead );
+			}
+#else
+			ahead = ahead->next;
+#endif
+			if(( ahead->state == TBS_LOAD )||( ahead->state == TBS_RELOAD )) service_buffer( ahead );
+		}
+	}
+	service_buffer( manage );
+#if SIGNAL_STREAMS > 1
+	//
+	//	The buffers are not in a single loop, so work through
+	//	them in numerical order.
+	//
+	if(( manage += 1 ) >= circular_buffer + TRANSMISSION_BUFFERS ) manage = circular_buffer;
+#else
+	manage = manage->next;
+#endif
+}
+
+//
+//	Hand a buffer, which has just been given a new list of pending
+//	records by the IO code, to the management code.
+//
+//	An empty buffer is simply loaded.  A buffer which is already
+//	waiting to be loaded will pick up the new records when it is.
+//	Anything else is being transmitted, so the replacement is
+//	prepared alongside the live packet (see TBS_RELOAD).
+//
+//	In all cases the buffer is then serviced straight away rather
+//	than waiting for the management code to come round to it.
+//
+static void load_buffer( TRANS_BUFFER *buf ) {
+	switch( buf->state ) {
+		case TBS_EMPTY: {
+			buf->state = TBS_LOAD;
+			break;
+		}
+		case TBS_LOAD: {
+			break;
+		}
+		default: {
+			buf->state = TBS_RELOAD;
+			break;
+		}
+	}
+	service_buffer( buf );
 }
 
 //
@@ -3818,9 +6515,41 @@ static void link_buffer_chain( void ) {
 		circular_buffer[ i ].state = TBS_EMPTY;
 		circular_buffer[ i ].target = 0;
 		circular_buffer[ i ].duration = 0;
-		circular_buffer[ i ].bits[ 0 ] = 0;
+		circular_buffer[ i ].bits = bit_transitions + i;
+#ifndef SIGNAL_RAW_PACKETS
+		circular_buffer[ i ].bits->bits[ 0 ] = 0;
+#endif
+		circular_buffer[ i ].bits->len = 0;
+		circular_buffer[ i ].shadow = NULL;
+		circular_buffer[ i ].priority = 0;
+		circular_buffer[ i ].refresh = false;
 		circular_buffer[ i ].pending = NULL;
 
+#if SIGNAL_STREAMS > 1
+		//
+		//	Note the streams which will send the buffer.
+		//
+		if( i >= PROGRAMMING_BASE_BUFFER ) {
+			circular_buffer[ i ].streams = bit( PROG_STREAM );
+		}
+#ifdef SIGNAL_DISTRICT_STREAMS
+		else if( i >= REFRESH_BASE_BUFFER ) {
+			circular_buffer[ i ].streams = bit(( i - REFRESH_BASE_BUFFER ) / DISTRICT_REFRESH_BUFFERS );
+		}
+#endif
+		else {
+			circular_buffer[ i ].streams = bit( DISTRICT_STREAMS ) - 1;
+		}
+#endif
+#ifdef SIGNAL_DISTRICT_STREAMS
+		circular_buffer[ i ].owed = circular_buffer[ i ].streams;
+		//
+		//	District refresh buffers are never empty, they wait
+		//	in LOAD for a moving decoder to refresh.
+		//
+		if(( i >= REFRESH_BASE_BUFFER )&&( i < PROGRAMMING_BASE_BUFFER )) circular_buffer[ i ].state = TBS_LOAD;
+#endif
+
 #ifdef LCD_DISPLAY_ENABLE
 		//
 		//	Not really necessary but ensures all buffers
@@ -3833,6 +6562,33 @@ static void link_buffer_chain( void ) {
 #endif
 
 	}
+	//
+	//	The remaining bit transition arrays form the spare pool.
+	//
+	for( i = 0; i < SPARE_BIT_STRINGS; i++ ) {
+		spare_bit_string[ i ] = bit_transitions + ( TRANSMISSION_BUFFERS + i );
+		spare_bit_string[ i ]->len = 0;
+	}
+	spare_bit_strings = SPARE_BIT_STRINGS;
+#if SIGNAL_STREAMS > 1
+	//
+	//	Each stream has its own loop: the operations track
+	//	buffers in numerical order (the refresh buffers of each
+	//	district stream in a loop of their own) and the programming
+	//	track buffer linked to itself.  This is the only time the
+	//	circular buffers are formed.
+	//
+	for( i = 0; i < REFRESH_BASE_BUFFER-1; i++ ) circular_buffer[ i ].next = circular_buffer + ( i + 1 );
+	circular_buffer[ REFRESH_BASE_BUFFER-1 ].next = circular_buffer;
+#ifdef SIGNAL_DISTRICT_STREAMS
+	for( i = REFRESH_BASE_BUFFER; i < PROGRAMMING_BASE_BUFFER; i++ ) {
+		circular_buffer[ i ].next = circular_buffer + ((( i + 1 - REFRESH_BASE_BUFFER ) % DISTRICT_REFRESH_BUFFERS )? ( i + 1 ): ( i + 1 - DISTRICT_REFRESH_BUFFERS ));
+	}
+#endif
+#ifdef SIGNAL_PROG_STREAM
+	circular_buffer[ PROGRAMMING_BASE_BUFFER ].next = circular_buffer + PROGRAMMING_BASE_BUFFER;
+#endif
+#else
 	//
 	//	Link up *all* the buffers into a loop in numerical order.
 	//
@@ -3845,6 +6601,7 @@ static void link_buffer_chain( void ) {
 	//	point the tail to the head
 	//
 	circular_buffer[ TRANSMISSION_BUFFERS-1 ].next = circular_buffer;
+#endif
 }
 
 //
@@ -3862,11 +6619,19 @@ static void link_buffer_chain( void ) {
 //	possibility the assignments need to be bracketed between noInterrupts()
 //	and interrupts().
 //
+//	As the priority queue could hold buffers from the other set
+//	it is emptied at the same time, and the refresh is moved to the
+//	buffer which now links to the start of the new set so that no
+//	more packets from the old set are sent.
+//
 //	These routines are only called when one or other track is being power up.
 //
 //	These routines are *only* required when the firmware is required to support
-//	a programming track in addition to the main operations track.
+//	a programming track in addition to the main operations track, and
+//	then only when both tracks share the one signal stream.
 //
+#ifndef SIGNAL_PROG_STREAM
+
 static void link_main_buffers( void ) {
 	//
 	//	This routine is called to shape the circular buffers
@@ -3876,11 +6641,15 @@ static void link_main_buffers( void ) {
 	noInterrupts();
 	circular_buffer[ PROGRAMMING_BASE_BUFFER-1 ].next = circular_buffer;
 	circular_buffer[ TRANSMISSION_BUFFERS-1 ].next = circular_buffer;
+	signal_stream[ MAIN_STREAM ].refresh = circular_buffer + ( TRANSMISSION_BUFFERS-1 );
+	signal_stream[ MAIN_STREAM ].priority_out = priority_in;
 	interrupts();
 #endif
 }
 
-#ifdef PROGRAMMING_TRACK
+#endif
+
+#if defined( PROGRAMMING_TRACK )&&!defined( SIGNAL_PROG_STREAM )
 
 static void link_prog_buffers( void ) {
 	//
@@ -3890,6 +6659,8 @@ static void link_prog_buffers( void ) {
 	noInterrupts();
 	circular_buffer[ PROGRAMMING_BASE_BUFFER-1 ].next = circular_buffer + PROGRAMMING_BASE_BUFFER;
 	circular_buffer[ TRANSMISSION_BUFFERS-1 ].next = circular_buffer + PROGRAMMING_BASE_BUFFER;
+	signal_stream[ MAIN_STREAM ].refresh = circular_buffer + ( PROGRAMMING_BASE_BUFFER-1 );
+	signal_stream[ MAIN_STREAM ].priority_out = priority_in;
 	interrupts();
 }
 
@@ -3914,6 +6685,7 @@ static void initialise_data_structures( void ) {
 	//	(optional) programming track, only the programming track
 	//	packet (there is only 1) is linked to itself.
 	//
+	init_target_hash();
 	link_buffer_chain();
 	//
 	//	Initialise the pending packets structures.
@@ -3927,28 +6699,88 @@ static void initialise_data_structures( void ) {
 		pending_dcc_packet[ i ].next = free_pending_packets;
 		free_pending_packets = &( pending_dcc_packet[ i ]);
 	}
+	accessory_queue = NULL;
+	accessory_queue_tail = &accessory_queue;
+	accessory_queued = 0;
 	//
 	//	Now prime the transmission interrupt routine state variables.
 	//
-	current = circular_buffer;
+	priority_in = 0;
+	ready_in = 0;
+	ready_out = 0;
 
-	//
-	//	Make sure the "pin out" data is empty as we are initially not
-	//	driving current to any track.
-	//
+	for( i = 0; i < SIGNAL_STREAMS; i++ ) {
+		SIGNAL_STREAM	*s;
+
+		s = signal_stream + i;
+#ifdef SIGNAL_PROG_STREAM
+		s->current = s->refresh = circular_buffer + (( i == PROG_STREAM )? PROGRAMMING_BASE_BUFFER: 0 );
+#else
+		s->current = s->refresh = circular_buffer;
+#endif
+#ifdef SIGNAL_DISTRICT_STREAMS
+		if( i < DISTRICT_STREAMS ) {
+			//
+			//	A district stream starts with its own buffers,
+			//	the first shared buffer it sends being buffer 0.
+			//
+			s->branch = circular_buffer + ( REFRESH_BASE_BUFFER + i * DISTRICT_REFRESH_BUFFERS );
+			s->fork = s->branch + ( DISTRICT_REFRESH_BUFFERS-1 );
+			s->shared = circular_buffer + ( REFRESH_BASE_BUFFER-1 );
+			s->current = s->refresh = s->branch;
+		}
+		else {
+			s->branch = s->fork = s->shared = NULL;
+		}
+#endif
+		s->priority_out = 0;
+		s->priority_run = 0;
+#if SIGNAL_STREAMS > 1
+		s->bit = bit( i );
+#endif
+		//
+		//	Make sure the "pin out" data is empty as we are initially not
+		//	driving current to any track.
+		//
 #ifdef SHIELD_PORT_DIRECT
-	output_mask_on = 0;
-	output_mask_off = 0;
+		s->mask_on = 0;
+		s->mask_off = 0;
+#if SIGNAL_STREAMS > 1
+		//
+		//	The stream leaves all pins other than the direction
+		//	pins of its own drivers unchanged.
+		//
+		s->keep = 0xff;
+		for( byte d = 0; d < SHIELD_OUTPUT_DRIVERS; d++ ) {
+			if( driver_stream( d ) == i ) s->keep &= ~pgm_read_byte( &( shield_output[ d ].direction ));
+		}
+#endif
 #else
-	output_pins = 0;
+		s->ports = 0;
 #endif
 
-	side = true;
-	remaining = 1;
-	bit_string = dcc_idle_packet;
-	one = true;
-	reload = TICKS_FOR_ONE;
-	left = *bit_string++;
+		s->side = true;
+#ifndef SIGNAL_HALF_BIT_TIMER
+		//
+		//	Multiple streams are started a tick apart so that
+		//	they do not all change buffers in the same tick.
+		//
+		s->remaining = 1 + i;
+#endif
+		s->bit_string = dcc_idle_packet;
+#ifdef SIGNAL_RAW_PACKETS
+		s->bit_data = s->bit_string->packet;
+		s->bit_count = 0;
+		s->byte_count = s->bit_string->len;
+		s->bit_tail = s->bit_string->trailer;
+		s->reload = TICKS_FOR_ONE;
+		s->left = s->bit_string->preamble - 1;
+#else
+		s->one = true;
+		s->reload = TICKS_FOR_ONE;
+		s->left = *s->bit_string++;
+#endif
+	}
 	//
 	//	Now prime the management code
 	//
@@ -4021,7 +6853,8 @@ void setup( void ) {
 	//	Set up the data structures.
 	//
 	initialise_data_structures();
-	init_function_cache();
+	init_roster();
+	init_accessory_shadow();
 
 	//
 	//	Set up the Interrupt Service Routine
@@ -4036,11 +6869,19 @@ void setup( void ) {
 	HW_TCCRnA = 0;	//	Set entire HW_TCCRnA register to 0
 	HW_TCCRnB = 0;	//	Same for HW_TCCRnB
 	HW_TCNTn  = 0;	//	Initialize counter value to 0
+#ifdef SIGNAL_HALF_BIT_TIMER
+	//
+	//		Set compare match register to the
+	//		duration of the first half bit.
+	//
+	HW_OCRnA = TICKS_FOR_ONE;
+#else
 	//
 	//		Set compare match register to
 	//		generate the correct tick duration.
 	//
 	HW_OCRnA = TIMER_INTERRUPT_CYCLES;
+#endif
 	//
 	//		Turn on CTC mode
 	//
@@ -4307,6 +7148,10 @@ static void display_lcd_updates( void ) {
 					buffer[ 1 ] = '2';
 					break;
 				}
+				case GLOBAL_POWER_BOTH: {
+					buffer[ 1 ] = '3';
+					break;
+				}
 				default: {
 					buffer[ 1 ] = HASH;
 					break;
@@ -4523,7 +7368,7 @@ static void display_lcd_updates( void ) {
 
 		r = 0;
 		for( byte i = 0; i < TRANSMISSION_BUFFERS; i++ ) {
-				if(( circular_buffer[ i ].state == TBS_RUN )||( circular_buffer[ i ].state == TBS_RELOAD )) {
+				if(( circular_buffer[ i ].state == TBS_RUN )||( circular_buffer[ i ].state == TBS_RELOAD )||( circular_buffer[ i ].state == TBS_SWAP )) {
 					lcd.setPosn( LCD_DISPLAY_BUFFER_COLUMN, r );
 					lcd.writeBuf( circular_buffer[ i ].display, LCD_DISPLAY_BUFFER_WIDTH );
 					if(( r += 1 ) >= LCD_DISPLAY_ROWS ) break;
@@ -4579,89 +7424,6 @@ static void display_lcd_updates( void ) {
 //	basically the same structure.
 //
 
-//
-//	Define simple "in string" number parsing routine.  This
-//	effectively does the bulk of the syntax parsing for the
-//	commands so it a little more fiddly than strictly
-//	necessary.
-//
-//	Return the address of the next unparsed character, this
-//	be EOS if at the end of the string.
-//
-static char *parse_number( char *buf, bool *found, int *value ) {
-	int	v, n, c;
-
-	//
-	//	Skip any leading white space
-	//
-	while( isspace( *buf )) buf++;
-	//
-	//	Intentional assignment, remember if we are handling
-	//	a negative number.
-	//
-	if(( n = ( *buf == '-' ))) buf++;
-	//
-	//	gather up a decimal number
-	//
-	c = 0;
-	v = 0;
-	while( isdigit( *buf )) {
-		v = v * 10 + ( *buf++ - '0' );
-		c++;
-	}
-	if( n ) v = -v;
-	//
-	//	Skip any trailing white space
-	//
-	while( isspace( *buf )) buf++;
-	//
-	//	Set up returned data
-	//
-	*found = ( c > 0 );
-	*value = v;
-	//
-	//	Return address of next unprocessed character.
-	//
-	return( buf );
-}
-
-//
-//	Define a routine which scans the input text and returns the
-//	command character and a series of numeric arguments
-//
-//	Routine returns the number of arguments (after the command).
-//
-static int parse_input( char *buf, char *cmd, int *arg, int max ) {
-	int	args,
-		value;
-	bool	found;
-
-	ASSERT( max > 0 );
-
-	//
-	//	Copy out the command character and verify
-	//
-	*cmd  = *buf++;
-	if( !isalnum( *cmd )) return( ERROR );
-	//
-	//	Step through remainder of string looking for
-	//	numbers.
-	//
-	args = 0;
-	found = true;
-	while( found ) {
-		buf = parse_number( buf, &found, &value );
-		if( found ) {
-			if( args >= max ) return( ERROR );
-			arg[ args++ ] = value;
-		}
-	}
-	//
-	//	Done.
-	//
-	return( args );
-}
-
 //
 //	Define a routine for finding an available buffer within
 //	a specified range and return its address, or return NULL.
@@ -4678,10 +7440,21 @@ static TRANS_BUFFER *find_available_buffer( byte base, byte count, int target )
 	//	Look for possible buffer *already* sending to this
 	//	target.
 	//
-	b = circular_buffer + base;
-	for( i = 0; i < count; i++ ) {
-		if( b->target == target ) return( b );
-		b++;
+	if(( base + count ) <= HASHED_BUFFERS ) {
+		TARGET_SLOT	*cell;
+
+		//
+		//	Accessory and mobile buffers are in the target
+		//	lookup table.
+		//
+		if(( cell = find_target((( base < MOBILE_BASE_BUFFER )? TARGET_ACCESSORY: TARGET_MOBILE ), target ))) return( circular_buffer + ( *cell - ROSTER_SIZE ));
+	}
+	else {
+		b = circular_buffer + base;
+		for( i = 0; i < count; i++ ) {
+			if( b->target == target ) return( b );
+			b++;
+		}
 	}
 	//
 	//	Nothing found so far, look for an empty one.
@@ -4697,6 +7470,33 @@ static TRANS_BUFFER *find_available_buffer( byte base, byte count, int target )
 	return( NULL );
 }
 
+//
+//	Find a mobile buffer to send a new command to the target.  As
+//	well as a buffer already sending to the target, or an empty
+//	one, any buffer which is only refreshing a decoder from the
+//	roster (or sending to a moving decoder) can be taken over (the
+//	roster will see the decoder refreshed again later).  A buffer
+//	still waiting to be sent out of turn, or sending to a decoder
+//	which is not moving (such as a stop command), is left alone.
+//	Returns NULL if all of the mobile buffers are busy with new
+//	commands.
+//
+static TRANS_BUFFER *find_mobile_buffer( int target ) {
+	TRANS_BUFFER	*b;
+	ROSTER_ENTRY	*r;
+
+	if(( b = find_available_buffer( MOBILE_BASE_BUFFER, MOBILE_TRANS_BUFFERS, target ))) return( b );
+	b = circular_buffer + MOBILE_BASE_BUFFER;
+	for( byte i = 0; i < MOBILE_TRANS_BUFFERS; i++ ) {
+		if(( b->pending == NULL )&&( b->reply == NO_REPLY_REQUIRED )&&( !b->priority )) {
+			if( b->refresh ) return( b );
+			if(( r = find_roster( b->target, false )) && ROSTER_MOVING( r->speed )) return( b );
+		}
+		b++;
+	}
+	return( NULL );
+}
+
 //
 //	DCC composition routines
 //	------------------------
@@ -4704,48 +7504,9 @@ static TRANS_BUFFER *find_available_buffer( byte base, byte count, int target )
 //	The following routines are used to create individual byte oriented
 //	DCC commands.
 //
-
-//
-//	Create a speed and direction packet for a specified target.
-//	Returns the number of bytes in the buffer.
+//	(The speed and direction and function group packets are composed
+//	alongside the roster as they are also used to refresh decoders.)
 //
-static byte compose_motion_packet( byte *command, int adrs, int speed, int dir ) {
-	byte	len;
-
-	ASSERT( command != NULL );
-	ASSERT(( adrs >= MINIMUM_DCC_ADDRESS )&&( adrs <= MAXIMUM_DCC_ADDRESS ));
-	ASSERT(( speed == EMERGENCY_STOP )||(( speed >= MINIMUM_DCC_SPEED )&&( speed <= MAXIMUM_DCC_SPEED )));
-	ASSERT(( dir == DCC_FORWARDS )||( dir == DCC_BACKWARDS ));
-
-	if( adrs > MAXIMUM_SHORT_ADDRESS ) {
-		command[ 0 ] = 0b11000000 | ( adrs >> 8 );
-		command[ 1 ] = adrs & 0b11111111;
-		len = 2;
-	}
-	else {
-		command[ 0 ] = adrs;
-		len = 1;
-	}
-	command[ len++ ] = 0b00111111;
-	switch( speed ) {
-		case 0: {
-			command[ len++ ] = ( dir << 7 );
-			break;
-		}
-		case EMERGENCY_STOP: {
-			command[ len++ ] = ( dir << 7 ) | 1;
-			break;
-		}
-		default: {
-			command[ len++ ] = ( dir << 7 )|( speed + 1 );
-			break;
-		}
-	}
-	//
-	//	Done.
-	//
-	return( len );
-}
 
 //
 //	Create an accessory modification packet.  Return number of bytes
@@ -4769,10 +7530,6 @@ static byte compose_accessory_change( byte *command, int adrs, int subadrs, int
 //
 //	Create a Function set/reset command, return number of bytes used.
 //
-//	Until I can find a more focused mechanism for modifying the functions
-//	this routine has to be this way.  I guess a smarter data driven approach
-//	could be used to generate the same output, but at least this is clear.
-//
 static byte compose_function_change( byte *command, int adrs, int func, int state ) {
 
 	ASSERT( command != NULL );
@@ -4781,81 +7538,15 @@ static byte compose_function_change( byte *command, int adrs, int func, int stat
 	ASSERT(( state == FUNCTION_ON )||( state == FUNCTION_OFF ));
 
 	if( update_function( adrs, func, ( state == FUNCTION_ON ))) {
-		byte	len;
+		byte	g;
 
 		//
-		//	Function has changed value, update the corresponding decoder.
+		//	Function has changed value, update the corresponding decoder
+		//	by sending the group containing the function, with the
+		//	states recorded in the roster.
 		//
-		if( adrs > MAXIMUM_SHORT_ADDRESS ) {
-			command[ 0 ] = 0b11000000 | ( adrs >> 8 );
-			command[ 1 ] = adrs & 0b11111111;
-			len = 2;
-		}
-		else {
-			command[ 0 ] = adrs;
-			len = 1;
-		}
-		//
-		//	We have to build up the packets depending on the
-		//	function number to modify.
-		//
-		if( func <= 4 ) {
-			//
-			//	F0-F4		100[F0][F4][F3][F2][F1]
-			//
-			command[ len++ ] =	0x80	| get_function( adrs, 0, 0x10 )
-							| get_function( adrs, 1, 0x01 )
-							| get_function( adrs, 2, 0x02 )
-							| get_function( adrs, 3, 0x04 )
-							| get_function( adrs, 4, 0x08 );
-		}
-		else if( func <= 8 ) {
-			//
-			//	F5-F8		1011[F8][F7][F6][F5]
-			//
-			command[ len++ ] =	0xb0	| get_function( adrs, 5, 0x01 )
-							| get_function( adrs, 6, 0x02 )
-							| get_function( adrs, 7, 0x04 )
-							| get_function( adrs, 8, 0x08 );
-		}
-		else if( func <= 12 ) {
-			//
-			//	F9-F12		1010[F12][F11][F10][F9]
-			//
-			command[ len++ ] =	0xa0	| get_function( adrs, 9, 0x01 )
-							| get_function( adrs, 10, 0x02 )
-							| get_function( adrs, 11, 0x04 )
-							| get_function( adrs, 12, 0x08 );
-		}
-		else if( func <= 20 ) {
-			//
-			//	F13-F20		11011110, [F20][F19][F18][F17][F16][F15][F14][F13]
-			//
-			command[ len++ ] =	0xde;
-			command[ len++ ] =		  get_function( adrs, 13, 0x01 )
-							| get_function( adrs, 14, 0x02 )
-							| get_function( adrs, 15, 0x04 )
-							| get_function( adrs, 16, 0x08 )
-							| get_function( adrs, 17, 0x10 )
-							| get_function( adrs, 18, 0x20 )
-							| get_function( adrs, 19, 0x40 )
-							| get_function( adrs, 20, 0x80 );
-		}
-		else {
-			//
-			//	F21-F28		11011111, [F28][F27][F26][F25][F24][F23][F22][F21]
-			//
-			command[ len++ ] =	0xdf;
-			command[ len++ ] =		  get_function( adrs, 21, 0x01 )
-							| get_function( adrs, 22, 0x02 )
-							| get_function( adrs, 23, 0x04 )
-							| get_function( adrs, 24, 0x08 )
-							| get_function( adrs, 25, 0x10 )
-							| get_function( adrs, 26, 0x20 )
-							| get_function( adrs, 27, 0x40 )
-							| get_function( adrs, 28, 0x80 );
-		}
-		return( len );
+		for( g = 0; func > pgm_read_byte( &( function_group[ g ].last )); g++ );
+		return( compose_function_packet( command, adrs, g, find_roster( adrs, false )->bits ));
 	}
 	//
 	//	We have to "do" something..
@@ -4874,109 +7565,23 @@ static byte compose_function_change( byte *command, int adrs, int func, int stat
 //	0 is returned
 //
 static byte compose_function_block( byte *command, int *state, int adrs, int *fn, int count ) {
-	byte	len;
+	byte	bits[ FUNCTION_BIT_ARRAY ];
 
 	ASSERT( command != NULL );
 	ASSERT( state != NULL );
 	ASSERT( *state >= 0  );
 	ASSERT(( adrs >= MINIMUM_DCC_ADDRESS )&&( adrs <= MAXIMUM_DCC_ADDRESS ));
 	ASSERT( fn != NULL );
-	ASSERT( count >= 0 );
-	ASSERT(( count * 8 ) > MAX_FUNCTION_NUMBER );
+	ASSERT( count >= FUNCTION_BIT_ARRAY );
 	
 	//
-	//	Function has changed value, update the corresponding decoder.
-	//
-	if( adrs > MAXIMUM_SHORT_ADDRESS ) {
-		command[ 0 ] = 0b11000000 | ( adrs >> 8 );
-		command[ 1 ] = adrs & 0b11111111;
-		len = 2;
-	}
-	else {
-		command[ 0 ] = adrs;
-		len = 1;
-	}
-	//
-	//	Now the value of the state variable tells us which DCC funciton
-	//	setting command we need to create (which we also auto increment
-	//	in preparationn for the next call).
-	//
-	switch( (*state)++ ) {
-		//
-		//	I know the bit manipulation code in the following is
-		//	really inefficient, but it is clear and easy to see that
-		//	it's correct.  For the time being this is more important
-		//	than fast code which is wrong.
-		//
-		case 0: {
-			//
-			//	F0-F4		100[F0][F4][F3][F2][F1]
-			//
-			command[ len++ ] =	0x80	| (( fn[0] & 0x01 )? 0x10: 0 )
-							| (( fn[0] & 0x02 )? 0x01: 0 )
-							| (( fn[0] & 0x04 )? 0x02: 0 )
-							| (( fn[0] & 0x08 )? 0x04: 0 )
-							| (( fn[0] & 0x10 )? 0x08: 0 );
-			break;
-		}
-		case 1: {
-			//
-			//	F5-F8		1011[F8][F7][F6][F5]
-			//
-			command[ len++ ] =	0xb0	| (( fn[0] & 0x20 )? 0x01: 0 )
-							| (( fn[0] & 0x40 )? 0x02: 0 )
-							| (( fn[0] & 0x80 )? 0x04: 0 )
-							| (( fn[1] & 0x01 )? 0x08: 0 );
-			break;
-		}
-		case 2: {
-			//
-			//	F9-F12		1010[F12][F11][F10][F9]
-			//
-			command[ len++ ] =	0xa0	| (( fn[1] & 0x02 )? 0x01: 0 )
-							| (( fn[1] & 0x04 )? 0x02: 0 )
-							| (( fn[1] & 0x08 )? 0x04: 0 )
-							| (( fn[1] & 0x10 )? 0x08: 0 );
-			break;
-		}
-		case 3: {
-			//
-			//	F13-F20		11011110, [F20][F19][F18][F17][F16][F15][F14][F13]
-			//
-			command[ len++ ] =	0xde;
-			command[ len++ ] =		  (( fn[1] & 0x20 )? 0x01: 0 )
-							| (( fn[1] & 0x40 )? 0x02: 0 )
-							| (( fn[1] & 0x80 )? 0x04: 0 )
-							| (( fn[2] & 0x01 )? 0x08: 0 )
-							| (( fn[2] & 0x02 )? 0x10: 0 )
-							| (( fn[2] & 0x04 )? 0x20: 0 )
-							| (( fn[2] & 0x08 )? 0x40: 0 )
-							| (( fn[2] & 0x10 )? 0x80: 0 );
-			break;
-		}
-		case 4: {
-			//
-			//	F21-F28		11011111, [F28][F27][F26][F25][F24][F23][F22][F21]
-			//
-			command[ len++ ] =	0xdf;
-			command[ len++ ] =		  (( fn[2] & 0x20 )? 0x01: 0 )
-							| (( fn[2] & 0x40 )? 0x02: 0 )
-							| (( fn[2] & 0x80 )? 0x04: 0 )
-							| (( fn[3] & 0x01 )? 0x08: 0 )
-							| (( fn[3] & 0x02 )? 0x10: 0 )
-							| (( fn[3] & 0x04 )? 0x20: 0 )
-							| (( fn[3] & 0x08 )? 0x40: 0 )
-							| (( fn[3] & 0x10 )? 0x80: 0 );
-			break;
-		}
-		default: {
-			return( 0 );
-		}
-	}
-	//
-	//	Done!
+	//	Now the value of the state variable tells us which DCC function
+	//	group command we need to create (which we also auto increment
+	//	in preparation for the next call).
 	//
-	return( len );
+	if( *state >= FUNCTION_GROUPS ) return( 0 );
+	for( byte i = 0; i < FUNCTION_BIT_ARRAY; i++ ) bits[ i ] = fn[ i ];
+	return( compose_function_packet( command, adrs, (*state)++, bits ));
 }
 
 //
@@ -5371,6 +7976,55 @@ static void lcd_summary_readcv( char *buffer, int cv, int bnum, int value ) {
 
 #endif
 
+//
+//	Accessory Command Queue
+//	-----------------------
+//
+//	Move queued accessory commands into the accessory buffers
+//	until the queue is empty, the buffers are all busy, or the
+//	command at the head must wait for an earlier command to the
+//	same accessory to be sent.
+//
+static void service_accessory_queue( void ) {
+	PENDING_PACKET	*pp;
+	TRANS_BUFFER	*buf;
+
+	while(( pp = accessory_queue )) {
+		if(( buf = find_available_buffer( ACCESSORY_BASE_BUFFER, ACCESSORY_TRANS_BUFFERS, pp->target )) == NULL ) return;
+		//
+		//	The buffer found may be the one already sending to
+		//	this accessory, with an earlier command still to
+		//	load, its reply still owed or its packet not yet
+		//	sent once.  The queue waits for that to finish, so
+		//	commands to one accessory are all sent (and replied
+		//	to) in the order received.
+		//
+		if(( buf->pending != NULL )||( buf->reply != NO_REPLY_REQUIRED )|| buf->priority ) return;
+		//
+		//	Unlink the record and give it to the buffer.
+		//
+		if(( accessory_queue = pp->next ) == NULL ) accessory_queue_tail = &accessory_queue;
+		accessory_queued--;
+		pp->next = NULL;
+		buf->pending = pp;
+
+#ifdef LCD_DISPLAY_ENABLE
+		//
+		//	Complete LCD summary.
+		//
+		lcd_summary_accessory( buf->display, internal_acc_adrs( -pp->target ), internal_acc_subadrs( -pp->target ), pp->command[ 1 ] & ACCESSORY_ON );
+#endif
+
+		//
+		//	Construct the future reply, recovering the state from
+		//	the command, and hand the buffer over.
+		//
+		reply_2( buf->contains, 'A', -pp->target, pp->command[ 1 ] & ACCESSORY_ON );
+		buf->reply = REPLY_ON_SEND;
+		load_buffer( buf );
+	}
+}
+
 	
 //
 //	DCC Generator Command Summary
@@ -5393,8 +8047,39 @@ static void lcd_summary_readcv( char *buffer, int cv, int bnum, int value ) {
 //
 //	[A ADRS STATE] -> [A ADRS STATE]
 //
-//		ADRS:	The combined address of the decoder (1-2048)
-//		STATE:	1=on (set), 0=off (clear)
+//		ADRS:	The combined address of the decoder (1-2048)
+//		STATE:	1=on (set), 0=off (clear)
+//
+//	Commands wait in a queue while the accessory buffers are busy
+//	and are replied to once sent, so a route can be sent in one
+//	burst.  A command is only rejected (TRANSMISSION_BUSY) once the
+//	queue is full or, with ACCESSORY_STATE_STORE, while the EEPROM
+//	is being written and the accessory's state is not to hand.
+//
+//	Accessory state table
+//	---------------------
+//
+//	Read back the state last commanded for each accessory, so
+//	a host can resynchronise with the firmware.  Each reply covers
+//	a page of accessories.
+//
+//	[Y] -> [Y COUNT PAGE]
+//	[Y FIRST] -> [Y FIRST STATES KNOWN]
+//	[Y 0] -> [Y 0]
+//
+//		COUNT:	Number of accessories covered by the table
+//		PAGE:	Number of accessories in each reply
+//		FIRST:	First accessory of the reply (rounded
+//			down to 1 more than a multiple of 8)
+//		STATES:	Hex digits, two per 8 accessories,
+//			bit 0 of each pair for the lowest
+//		KNOWN:	As STATES, 1 where a state has
+//			been recorded
+//
+//	[Y 0] forgets every recorded state.  The states are kept
+//	across a restart with firmware built with ACCESSORY_STATE_STORE,
+//	when [Y FIRST] is rejected (TRANSMISSION_BUSY) while the EEPROM
+//	is being written.
 //
 //	Mobile decoder set function state
 //	---------------------------------
@@ -5432,12 +8117,32 @@ static void lcd_summary_readcv( char *buffer, int cv, int bnum, int value ) {
 //		FNC:	... Functions 16 through 23
 //		FND:	... Functions 24 through 28 (bit positions for 29 through 31 ignored)
 //
+//	Place mobile decoder in districts (Operations Track)
+//	----------------------------------------------------
+//
+//	Only with firmware built with SIGNAL_DISTRICT_STREAMS, where
+//	each district has its own DCC signal.  Restrict the refresh of
+//	the speed and direction of a decoder to the districts it is in.
+//	New commands are always sent to every district.
+//
+//	[T ADRS DISTRICTS] -> [T ADRS DISTRICTS]
+//
+//		ADRS:		The short (1-127) or long (128-10239) address of the engine decoder
+//		DISTRICTS:	Bit mask (in decimal) of the districts, in the
+//				order reported by [D] (bit 0 for A), 0 for all
+//				districts (the default)
+//
 //	Enable/Disable Power to track
 //	-----------------------------
 //
 //	[P STATE] -> [P STATE]
 //
-//		STATE: 1=On, 0=Off
+//		STATE: 0=Off, 1=Main, 2=Prog, 3=Both
+//
+//		With SIGNAL_PROG_STREAM the operations and programming
+//		tracks are driven independently, so Both is available
+//		and any state can be selected directly.  Otherwise the
+//		tracks must be turned Off before selecting Main or Prog.
 //
 //	Set CV value (Programming track)
 //	--------------------------------
@@ -5495,6 +8200,103 @@ static void lcd_summary_readcv( char *buffer, int cv, int bnum, int value ) {
 //						update.
 //		[Q -1 -1] -> [Q -1 -1]		Reset all constants to default.
 //
+//	Signal jitter histogram
+//	-----------------------
+//
+//	Return, and reset, the histogram of how late the edges of the
+//	DCC signal have been generated (the result of other interrupts
+//	delaying the signal generator).
+//
+//	[J] -> [J WIDTH MAX B0 B1 B2 B3 B4 B5 B6 B7]
+//
+//		WIDTH:	Width of each histogram bucket (CPU clock cycles)
+//		MAX:	Largest lateness observed (CPU clock cycles)
+//		Bn:	Number of edges with a lateness of at least
+//			n x WIDTH cycles (but less than (n+1) x WIDTH),
+//			with B7 including all later edges.  Counts
+//			stop at 65535.
+//
+//	Packet statistics
+//	-----------------
+//
+//	Return, and reset, the number of DCC packets sent and how
+//	many of those were idle or filler packets sent because the
+//	transmission buffer reached was still waiting to be loaded.
+//	Also the number of commands acknowledged but not sent as
+//	they would not change the state of the decoder (such as a
+//	throttle repeating the speed of a moving decoder).
+//
+//	[I] -> [I PACKETS IDLES WAITIDLES WAITFILLERS SUPPRESSED]
+//
+//		PACKETS:	Total number of packets sent
+//		IDLES:		Number of idle packets sent
+//		WAITIDLES:	Idle packets sent in place of a
+//				buffer waiting to be loaded
+//		WAITFILLERS:	Filler data sent in place of the
+//				next packet of a series
+//		SUPPRESSED:	Commands acknowledged without
+//				being sent
+//
+//		All counts stop at 65535.
+//
+//	Binary command frames
+//	---------------------
+//
+//	Enable (or disable) binary command frames, which are accepted
+//	alongside the text commands.  Replies are always text.
+//
+//	[X] -> [X MODE]
+//	[X MODE] -> [X MODE]
+//
+//		MODE:	0=Text commands only (the default),
+//			1=Binary command frames also accepted
+//
+//	A binary frame carries the same command letter and arguments
+//	as a text command:
+//
+//		0x80	Start of frame
+//		N	Number of arguments (0-7)
+//		CMD	Command letter
+//		ARGS	N arguments, each 16 bits signed, least
+//			significant byte first
+//		CHECK	Exclusive or of N, CMD and the ARGS bytes
+//
+//	So [M 1000 35 1] can be sent as the 10 bytes
+//
+//		80 03 4D E8 03 23 00 01 00 87
+//
+//	A frame with a bad N or CHECK is dropped and reported as
+//	error 30 (with N or CMD).  After a bad N the following bytes
+//	are discarded up to the next 0x80.  The bytes of a frame must
+//	follow each other within 100 ms; a frame left unfinished for
+//	longer is dropped and reported as error 30 (with the number
+//	of bytes received after the 0x80), and any discarding stops.
+//
+//	Change the line speed
+//	---------------------
+//
+//	The reply is sent at the current speed, after which the
+//	firmware changes to the new one.  The host must then send a
+//	command (such as [B]) at the new speed within 2 seconds, or
+//	the firmware returns to the previous speed and sends [B RATE]
+//	with that speed.
+//
+//	[B] -> [B RATE]
+//	[B RATE] -> [B RATE]
+//
+//		RATE:	Line speed in hundreds of baud: 3, 6, 12, 24,
+//			48, 96, 144, 192, 288, 384 (the default), 576,
+//			1152, 2500, 5000 or 10000
+//
+//	At 2500 and above the console input queue (CONSOLE_INPUT,
+//	32 bytes on the ATmega328, 64 on the ATmega32U4 and 128 on
+//	larger parts) fills in a millisecond or two, less than a
+//	main loop pass may take.  Input arriving while it is full
+//	is lost and reported as error 97 (USART_IO_ERR_DROPPED).  At
+//	these speeds a host should wait for the reply to a command
+//	before sending more than a queue's worth of input.  These
+//	speeds have not been tested on hardware.
+//
 //
 //	Asynchronous data returned from the firmware
 //	============================================
@@ -5553,1025 +8355,1475 @@ static void lcd_summary_readcv( char *buffer, int cv, int bnum, int value ) {
 //
 #define MAXIMUM_REPLY_SIZE	32
 //
-//	The command interpreting routine.
+//	Set when binary command frames are accepted alongside the
+//	text commands.
 //
-static void scan_line( char *buf ) {
-	//
-	//	Where we build the command
-	//
-	char	cmd;
-	int	arg[ MAX_DCC_ARGS ], args;
+static bool binary_commands = false;
+
+//
+//	Line speed changes (the 'B' command).
+//
+//	The line speeds the host can select, indexed by the
+//	USART_line_speed value, in hundreds of baud.
+//
+static const word line_speed_rate[ B_EOT ] PROGMEM = {
+	3,	6,	12,	24,
+	48,	96,	144,	192,
+	288,	384,	576,	1152,
+	2500,	5000,	10000
+};
+
+//
+//	line_speed		The speed in use.
+//	line_speed_previous	The speed to return to if the change
+//				is not confirmed.
+//	line_speed_change	Where a change has got to (below).
+//	line_speed_timeout	When an unconfirmed change lapses.
+//
+#define LINE_SPEED_STEADY	0	// No change in progress.
+#define LINE_SPEED_PENDING	1	// Waiting for the reply to be sent.
+#define LINE_SPEED_TRIAL	2	// Waiting for a command at the new speed.
+
+static USART_line_speed	line_speed = SERIAL_BAUD_RATE,
+			line_speed_previous;
+static byte		line_speed_change = LINE_SPEED_STEADY;
+static unsigned long	line_speed_timeout;
+
+//
+//	Send the [B RATE] reply for the speed in use.
+//
+static void report_line_speed( void ) {
+	console.print( PROT_IN_CHAR );
+	console.print( 'B' );
+	console.print( (word)pgm_read_word( &( line_speed_rate[ line_speed ])));
+	console.print( PROT_OUT_CHAR );
+	console.println();
+}
+
+//
+//	Called on every pass through the main loop to move a
+//	line speed change on.
+//
+static void service_line_speed( void ) {
+	switch( line_speed_change ) {
+		case LINE_SPEED_PENDING: {
+			//
+			//	Change speed once the reply has gone.
+			//
+			if( console.sending()) break;
+			(void)console.baud( line_speed );
+			line_speed_timeout = now + LINE_SPEED_CONFIRM;
+			line_speed_change = LINE_SPEED_TRIAL;
+			break;
+		}
+		case LINE_SPEED_TRIAL: {
+			//
+			//	Nothing received at the new speed, so go back
+			//	to the old one and say so.
+			//
+			if( now < line_speed_timeout ) break;
+			line_speed = line_speed_previous;
+			(void)console.baud( line_speed );
+			line_speed_change = LINE_SPEED_STEADY;
+			report_line_speed();
+			break;
+		}
+		default: {
+			break;
+		}
+	}
+}
+
+//
+//	The command executing routine, given the command letter and
+//	its arguments (however these have been received).
+//
+static void execute_command( char cmd, int *arg, int args ) {
 	//
 	//	Where we construct the DCC packet data.
 	//
 	byte	command[ MAXIMUM_DCC_COMMAND ];
 
-#if defined( DEBUG_CONFIRMATION )
 	//
-	//	When debugging the command confirmation code
-	//	we need to see both the command sent as well
-	//	as the reply.
+	//	Any command arriving confirms a change of line speed.
 	//
-	console.println( buf );
-#endif
+	if( line_speed_change == LINE_SPEED_TRIAL ) line_speed_change = LINE_SPEED_STEADY;
+
+	switch( cmd ) {
 
-	//
-	//	Take the data proved and parse it into useful pieces.
-	//
-	if(( args = parse_input( buf, &cmd, arg, MAX_DCC_ARGS )) != ERROR ) {
 		//
-		//	We have at least a command and (possibly) some arguments.
+		//	Power management commands
+		//	-------------------------
 		//
-		switch( cmd ) {
+		case 'P': {
+			char	reply[ 8 ];
 
+			//	
+			//	Enable/Disable Power to track
+			//	-----------------------------
 			//
-			//	Power management commands
-			//	-------------------------
+			//	[P STATE] -> [P STATE]
 			//
-			case 'P': {
-				char	reply[ 8 ];
-
-				//	
-				//	Enable/Disable Power to track
-				//	-----------------------------
-				//
-				//	[P STATE] -> [P STATE]
-				//
-				//		STATE: 0=Off, 1=Main, 2=Prog
-				//
-				if( args != 1 ) {
-					errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
+			//		STATE: 0=Off, 1=Main, 2=Prog, 3=Both
+			//
+			//	Both (3) is only available with SIGNAL_PROG_STREAM.
+			//
+			if( args != 1 ) {
+				errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
+				break;
+			}
+#ifdef SIGNAL_PROG_STREAM
+			//
+			//	Each track has its own signal stream so any
+			//	combination can be selected directly.
+			//
+			if(( arg[ 0 ] < GLOBAL_POWER_OFF )||( arg[ 0 ] > GLOBAL_POWER_BOTH )) {
+				errors.log_error( INVALID_STATE, cmd );
+				break;
+			}
+			(void)set_track_power( (POWER_STATE)arg[ 0 ]);
+			reply_1( reply, 'P', arg[ 0 ]);
+			if( !console.print( reply )) errors.log_error( COMMAND_REPORT_FAIL, cmd );
+#else
+			switch( arg[ 0 ]) {
+				case 0: {	// Power track off
+					(void)set_track_power( GLOBAL_POWER_OFF );
+					reply_1( reply, 'P', 0 );
+					if( !console.print( reply )) errors.log_error( COMMAND_REPORT_FAIL, cmd );
 					break;
 				}
-				switch( arg[ 0 ]) {
-					case 0: {	// Power track off
-						(void)power_off_tracks();
-						reply_1( reply, 'P', 0 );
-						if( !console.print( reply )) errors.log_error( COMMAND_REPORT_FAIL, cmd );
+				case 1: {
+					//
+					//	Power Main Track on
+					//
+					if( global_power_state != GLOBAL_POWER_OFF ) {
+						errors.log_error( POWER_NOT_OFF, cmd );
 						break;
 					}
-					case 1: {
-						//
-						//	Power Main Track on
-						//
-						if( global_power_state != GLOBAL_POWER_OFF ) {
-							errors.log_error( POWER_NOT_OFF, cmd );
-							break;
-						}
-						if( power_on_main_track()) link_main_buffers();
-						reply_1( reply, 'P', 1 );
-						if( !console.print( reply )) errors.log_error( COMMAND_REPORT_FAIL, cmd );
+					if( set_track_power( GLOBAL_POWER_MAIN )) link_main_buffers();
+					reply_1( reply, 'P', 1 );
+					if( !console.print( reply )) errors.log_error( COMMAND_REPORT_FAIL, cmd );
+					break;
+				}
+				case 2: {
+					//
+					//	Power Prog Track on
+					//
+#ifdef PROGRAMMING_TRACK
+					if( global_power_state != GLOBAL_POWER_OFF ) {
+						errors.log_error( POWER_NOT_OFF, cmd );
 						break;
 					}
-					case 2: {
-						//
-						//	Power Prog Track on
-						//
-#ifdef PROGRAMMING_TRACK
-						if( global_power_state != GLOBAL_POWER_OFF ) {
-							errors.log_error( POWER_NOT_OFF, cmd );
-							break;
-						}
-						if( power_on_prog_track()) link_prog_buffers();
-						reply_1( reply, 'P', 2 );
-						if( !console.print( reply )) errors.log_error( COMMAND_REPORT_FAIL, cmd );
+					if( set_track_power( GLOBAL_POWER_PROG )) link_prog_buffers();
+					reply_1( reply, 'P', 2 );
+					if( !console.print( reply )) errors.log_error( COMMAND_REPORT_FAIL, cmd );
 #else
-						errors.log_error( NO_PROGRAMMING_TRACK, cmd );
+					errors.log_error( NO_PROGRAMMING_TRACK, cmd );
 #endif
-						break;
-					}
-					default: {
-						errors.log_error( INVALID_STATE, cmd );
-						break;
-					}
+					break;
+				}
+				default: {
+					errors.log_error( INVALID_STATE, cmd );
+					break;
 				}
+			}
+#endif
+			break;
+		}
+		
+		//
+		//	Cab/Mobile decoder commands
+		//	---------------------------
+		//
+		case 'M': {
+			PENDING_PACKET	**tail;
+			TRANS_BUFFER	*buf;
+			ROSTER_ENTRY	*loco;
+			int		target,
+					speed,
+					dir;
+
+			//
+			//	Mobile decoder set speed and direction
+			//	--------------------------------------
+			//
+			//	[M ADRS SPEED DIR] -> [M ADRS SPEED DIR]
+			//
+			//		ADRS:	The short (1-127) or long (128-10239) address of the engine decoder
+			//		SPEED:	Throttle speed from 0-126, or -1 for emergency stop
+			//		DIR:	1=Forward, 0=Reverse
+			//
+			if( args != 3 ) {
+				errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
+				break;
+			}
+			//
+			//	Save command arguments.
+			//
+			target = arg[ 0 ];
+			speed = arg[ 1 ];
+			dir = arg[ 2 ];
+			//
+			//	Verify ranges
+			//
+			if(( target < MINIMUM_DCC_ADDRESS )||( target > MAXIMUM_DCC_ADDRESS )) {
+				errors.log_error( INVALID_ADDRESS, target );
+				break;
+			}
+			if((( speed < MINIMUM_DCC_SPEED )||( speed > MAXIMUM_DCC_SPEED ))&&( speed != EMERGENCY_STOP )) {
+				errors.log_error( INVALID_SPEED, speed );
+				break;
+			}
+			if(( dir != DCC_FORWARDS )&&( dir != DCC_BACKWARDS )) {
+				errors.log_error( INVALID_DIRECTION, dir );
+				break;
+			}
+			//
+			//	A decoder already moving at this speed and direction
+			//	is being refreshed from the roster, so there is nothing
+			//	to send.  (A stop is always sent again, as nothing
+			//	refreshes it.)
+			//
+			if(( loco = find_roster( target, false )) && ROSTER_MOVING( loco->speed )&&( loco->speed == ROSTER_SPEED( speed, dir ))) {
+				char	reply[ MAXIMUM_DCC_REPLY ];
+
+				reply_3( reply, 'M', target, speed, dir );
+				reply_unchanged( reply, cmd );
+				break;
+			}
+			//
+			//	Find a destination buffer and the decoder in the
+			//	roster (in that order, so that a command which is
+			//	refused does not forget another decoder).
+			//
+			if((( buf = find_mobile_buffer( target )) == NULL )||(( loco = find_roster( target, true )) == NULL )) {
+				//
+				//	No available buffers
+				//
+				errors.log_error( TRANSMISSION_BUSY, cmd );
+				break;
+			}
+			buf->pending = release_pending_recs( buf->pending, false );
+			tail = &( buf->pending );
+			//
+			//	Now create and append the command to the pending list.
+			//	A moving decoder is only sent this command briefly as
+			//	it will be refreshed from the roster after that.
+			//
+			if( !create_pending_rec( &tail, target, ((( speed == EMERGENCY_STOP )||( speed == MINIMUM_DCC_SPEED ))? TRANSIENT_COMMAND_REPEATS: ROSTER_REFRESH_REPEATS ), DCC_SHORT_PREAMBLE, 1, compose_motion_packet( command, target, speed, dir ), command )) {
+				//
+				//	Report that no pending record has been created.
+				//
+				errors.log_error( COMMAND_QUEUE_FAILED, cmd );
+				break;
+			}
+			loco->speed = ROSTER_SPEED( speed, dir );
+#ifdef SIGNAL_DISTRICT_STREAMS
+			drop_refresh( target );
+#endif
+
+#ifdef LCD_DISPLAY_ENABLE
+			//
+			//	Complete LCD summary.
+			//
+			lcd_summary_motion( buf->display, target, speed, dir );
+#endif
+
+			//
+			//	Construct the reply to send when we get send
+			//	confirmation and pass to the manager code to
+			//	insert the new packet into the transmission
+			//	process.
+			//
+			reply_3( buf->contains, 'M', target, speed, dir );
+			buf->reply = REPLY_ON_SEND;
+			load_buffer( buf );
+			break;
+		}
+
+		//
+		//	Accessory Commands
+		//	------------------
+		//
+		case 'A': {
+			int		target,
+					state;
+
+			//
+			//	Accessory decoder set state
+			//	---------------------------
+			//
+			//	[A ADRS STATE] -> [A ADRS STATE]
+			//
+			//		ADRS:	The combined address of the decoder (1-2048)
+			//		STATE:	1=on (set), 0=off (clear)
+			//
+			if( args != 2 ) {
+				errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
+				break;
+			}
+			//
+			//	Save arguments.
+			//
+			target = arg[ 0 ];
+			state = arg[ 1 ];
+			//
+			//	Verify ranges
+			//
+			if(( target < MIN_ACCESSORY_EXT_ADDRESS )||( target > MAX_ACCESSORY_EXT_ADDRESS )) {
+				errors.log_error( INVALID_ADDRESS, target );
+				break;
+			}
+			if(( state != ACCESSORY_ON )&&( state != ACCESSORY_OFF )) {
+				errors.log_error( INVALID_STATE, state );
+				break;
+			}
+			//
+			//	With the EEPROM store the recorded state cannot
+			//	be checked while the EEPROM is being written, or
+			//	recorded until earlier changes have been written;
+			//	the host must wait.
+			//
+			if( !accessory_shadow_room( target )) {
+				errors.log_error( TRANSMISSION_BUSY, cmd );
+				break;
+			}
+			//
+			//	Nothing to send if the accessory has been set
+			//	to this state already.
+			//
+			if( accessory_unchanged( target, state )) {
+				char	reply[ MAXIMUM_DCC_REPLY ];
+
+				reply_2( reply, 'A', target, state );
+				reply_unchanged( reply, cmd );
+				break;
+			}
+			//
+			//	The queue is full; the host must wait.
+			//
+			if( accessory_queued >= ACCESSORY_QUEUE ) {
+				errors.log_error( TRANSMISSION_BUSY, cmd );
+				break;
+			}
+			//
+			//	Append the command to the accessory queue,
+			//	remembering to invert the external target number
+			//	since we use negative numbers to represent
+			//	accessories internally.
+			//
+			if( !create_pending_rec( &accessory_queue_tail, -target, TRANSIENT_COMMAND_REPEATS, DCC_SHORT_PREAMBLE, 1, compose_accessory_change( command, internal_acc_adrs( target ), internal_acc_subadrs( target ), state ), command )) {
+				//
+				//	Report that no pending has been record created.
+				//
+				errors.log_error( COMMAND_QUEUE_FAILED, cmd );
+				break;
+			}
+			accessory_queued++;
+			record_accessory( target, state );
+			//
+			//	Send it straight away if there is a buffer free.
+			//
+			service_accessory_queue();
+			break;
+		}
+
+		//
+		//	Accessory state table
+		//	---------------------
+		//
+		case 'Y': {
+			int	first;
+
+			//
+			//	Read back accessory states
+			//	--------------------------
+			//
+			//	[Y] -> [Y COUNT PAGE]
+			//	[Y FIRST] -> [Y FIRST STATES KNOWN]
+			//	[Y 0] -> [Y 0]
+			//
+			//		COUNT:	Number of accessories covered by the table
+			//		PAGE:	Number of accessories in each reply
+			//		FIRST:	First accessory of the reply (rounded
+			//			down to 1 more than a multiple of 8)
+			//		STATES:	Hex digits, two per 8 accessories,
+			//			bit 0 of each pair for the lowest
+			//		KNOWN:	As STATES, 1 where a state has
+			//			been recorded
+			//
+			//	[Y 0] forgets every recorded state.
+			//
+			if( args == 0 ) {
+				console.print( PROT_IN_CHAR );
+				console.print( 'Y' );
+				console.print( (word)ACCESSORY_SHADOW );
+				console.print( SPACE );
+				console.print( (word)ACCESSORY_PAGE );
+				console.print( PROT_OUT_CHAR );
+				console.println();
+				break;
+			}
+			if( args != 1 ) {
+				errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
+				break;
+			}
+			if(( first = arg[ 0 ]) == 0 ) {
+				clear_accessory_shadow();
+				console.print( PROT_IN_CHAR );
+				console.print( 'Y' );
+				console.print( 0 );
+				console.print( PROT_OUT_CHAR );
+				console.println();
+				break;
+			}
+			if(( first < MIN_ACCESSORY_EXT_ADDRESS )||( first > MAX_ACCESSORY_EXT_ADDRESS )) {
+				errors.log_error( INVALID_ADDRESS, first );
+				break;
+			}
+#ifdef ACCESSORY_STATE_STORE
+			//
+			//	Groups not in the cache are read from the
+			//	EEPROM, which must not be part way through
+			//	a write.
+			//
+			if( !eeprom_is_ready()) {
+				errors.log_error( TRANSMISSION_BUSY, cmd );
+				break;
+			}
+#endif
+			first = ( first - MIN_ACCESSORY_EXT_ADDRESS ) >> 3;
+			console.print( PROT_IN_CHAR );
+			console.print( 'Y' );
+			console.print(( first << 3 ) + MIN_ACCESSORY_EXT_ADDRESS );
+			console.print( SPACE );
+			for( int i = first; i < first + ( ACCESSORY_PAGE >> 3 ); i++ ) {
+				console.print_hex(( i < ACCESSORY_SHADOW_BYTES )? (byte)( get_accessory_shadow( ACCESSORY_STATE, i ) & get_accessory_shadow( ACCESSORY_KNOWN, i )): (byte)0 );
+			}
+			console.print( SPACE );
+			for( int i = first; i < first + ( ACCESSORY_PAGE >> 3 ); i++ ) {
+				console.print_hex(( i < ACCESSORY_SHADOW_BYTES )? get_accessory_shadow( ACCESSORY_KNOWN, i ): (byte)0 );
+			}
+			console.print( PROT_OUT_CHAR );
+			console.println();
+			break;
+		}
+
+		//
+		//	Mobile decoder functions
+		//	------------------------
+		//
+		case 'F': {
+			PENDING_PACKET	**tail;
+			TRANS_BUFFER	*buf;
+			int		target,
+					func,
+					state;
+
+			//
+			//	Mobile decoder set function state
+			//	---------------------------------
+			//
+			//	[F ADRS FUNC STATE] -> [F ADRS FUNC STATE]
+			//
+			//		ADRS:	The short (1-127) or long (128-10239) address of the engine decoder
+			//		FUNC:	The function number to be modified (0-21)
+			//		STATE:	1=Enable, 0=Disable, 2=Toggle
+			//
+			//	Encoding a new "state": 2.  This is the act of turning
+			//	on a function then almost immediately turning it off
+			//	again (as a mnemonic this is, in binary, a 1 followed
+			//	by a 0)
+			//	
+			if( args != 3 ) {
+				errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
+				break;
+			}
+			//
+			//	Gather arguments
+			//
+			target = arg[ 0 ];
+			func = arg[ 1 ];
+			state = arg[ 2 ];
+			//
+			//	Verify ranges
+			//
+			if(( target < MINIMUM_DCC_ADDRESS )||( target > MAXIMUM_DCC_ADDRESS )) {
+				errors.log_error( INVALID_ADDRESS, target);
+				break;
+			}
+			if(( func < MIN_FUNCTION_NUMBER )||( func > MAX_FUNCTION_NUMBER )) {
+				errors.log_error( INVALID_FUNC_NUMBER, func );
+				break;
+			}
+			if(( state != FUNCTION_ON )&&( state != FUNCTION_OFF )&&( state != FUNCTION_TOGGLE )) {
+				errors.log_error( INVALID_STATE, state );
+				break;
+			}
+			//
+			//	Nothing to send if the function is in this state
+			//	already (a toggle is always sent).
+			//
+			if(( state != FUNCTION_TOGGLE )&& function_unchanged( target, func, ( state == FUNCTION_ON ))) {
+				char	reply[ MAXIMUM_DCC_REPLY ];
+
+				reply_3( reply, 'F', target, func, state );
+				reply_unchanged( reply, cmd );
 				break;
 			}
-			
 			//
-			//	Cab/Mobile decoder commands
-			//	---------------------------
+			//	Find a destination buffer.
 			//
-			case 'M': {
-				PENDING_PACKET	**tail;
-				TRANS_BUFFER	*buf;
-				int		target,
-						speed,
-						dir;
-
-				//
-				//	Mobile decoder set speed and direction
-				//	--------------------------------------
-				//
-				//	[M ADRS SPEED DIR] -> [M ADRS SPEED DIR]
-				//
-				//		ADRS:	The short (1-127) or long (128-10239) address of the engine decoder
-				//		SPEED:	Throttle speed from 0-126, or -1 for emergency stop
-				//		DIR:	1=Forward, 0=Reverse
-				//
-				if( args != 3 ) {
-					errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
-					break;
-				}
-				//
-				//	Save command arguments.
+			if(( buf = find_available_buffer( ACCESSORY_BASE_BUFFER, ACCESSORY_TRANS_BUFFERS, arg[ 0 ])) == NULL ) {
 				//
-				target = arg[ 0 ];
-				speed = arg[ 1 ];
-				dir = arg[ 2 ];
+				//	No available buffers
 				//
-				//	Verify ranges
-				//
-				if(( target < MINIMUM_DCC_ADDRESS )||( target > MAXIMUM_DCC_ADDRESS )) {
-					errors.log_error( INVALID_ADDRESS, target );
-					break;
-				}
-				if((( speed < MINIMUM_DCC_SPEED )||( speed > MAXIMUM_DCC_SPEED ))&&( speed != EMERGENCY_STOP )) {
-					errors.log_error( INVALID_SPEED, speed );
-					break;
-				}
-				if(( dir != DCC_FORWARDS )&&( dir != DCC_BACKWARDS )) {
-					errors.log_error( INVALID_DIRECTION, dir );
-					break;
-				}
+				errors.log_error( TRANSMISSION_BUSY, cmd );
+				break;
+			}
+			buf->pending = release_pending_recs( buf->pending, false );
+			tail = &( buf->pending );
+			//
+			//	Composing the packets records the new function
+			//	state in the roster, so make sure the packets can
+			//	be queued first; a command which is refused must
+			//	not change the roster.
+			//
+			if( !pending_recs_free(( state == FUNCTION_TOGGLE )? 2: 1 )) {
+				errors.log_error( COMMAND_QUEUE_FAILED, cmd );
+				break;
+			}
+			//
+			//	Find the decoder in the roster (to hold the function
+			//	states), only now that the command will be accepted
+			//	as this can forget another decoder.
+			//
+			if( find_roster( target, true ) == NULL ) {
+				errors.log_error( TRANSMISSION_BUSY, cmd );
+				break;
+			}
+			if( state == FUNCTION_TOGGLE ) {
+				bool		ok;
+				
 				//
-				//	Find a destination buffer
+				//	Create a pair of DCC commands to turn the function
+				//	on then off:- the toggle option.
 				//
-				if(( buf = find_available_buffer( MOBILE_BASE_BUFFER, MOBILE_TRANS_BUFFERS, target )) == NULL ) {
+				ok = create_pending_rec( &tail, target, TRANSIENT_COMMAND_REPEATS, DCC_SHORT_PREAMBLE, 1, compose_function_change( command, target, func, FUNCTION_ON ), command );
+				ok &= create_pending_rec( &tail, target, TRANSIENT_COMMAND_REPEATS, DCC_SHORT_PREAMBLE, 1, compose_function_change( command, target, func, FUNCTION_OFF ), command );
+				if( !ok ) {
 					//
-					//	No available buffers
+					//	Report that no pending has been record created.
 					//
-					errors.log_error( TRANSMISSION_BUSY, cmd );
+					buf->pending = release_pending_recs( buf->pending, false );
+					errors.log_error( COMMAND_QUEUE_FAILED, cmd );
 					break;
 				}
-				buf->pending = release_pending_recs( buf->pending, false );
-				tail = &( buf->pending );
+			}
+			else {
 				//
 				//	Now create and append the command to the pending list.
 				//
-				if( !create_pending_rec( &tail, target, ((( speed == EMERGENCY_STOP )||( speed == MINIMUM_DCC_SPEED ))? TRANSIENT_COMMAND_REPEATS: 0 ), DCC_SHORT_PREAMBLE, 1, compose_motion_packet( command, target, speed, dir ), command )) {
+				if( !create_pending_rec( &tail, target, TRANSIENT_COMMAND_REPEATS, DCC_SHORT_PREAMBLE, 1, compose_function_change( command, target, func, state ), command )) {
 					//
-					//	Report that no pending record has been created.
+					//	Report that no pending has been record created.
 					//
 					errors.log_error( COMMAND_QUEUE_FAILED, cmd );
 					break;
 				}
-
+			}
 #ifdef LCD_DISPLAY_ENABLE
-				//
-				//	Complete LCD summary.
-				//
-				lcd_summary_motion( buf->display, target, speed, dir );
+			//
+			//	Complete LCD summary.
+			//
+			lcd_summary_function( buf->display, target, func, state );
 #endif
 
-				//
-				//	Construct the reply to send when we get send
-				//	confirmation and pass to the manager code to
-				//	insert the new packet into the transmission
-				//	process.
-				//
-				reply_3( buf->contains, 'M', target, speed, dir );
-				buf->reply = REPLY_ON_SEND;
-				buf->state = ( buf->state == TBS_EMPTY )? TBS_LOAD: TBS_RELOAD;
-				break;
+			//
+			//	Prepare the future reply and set new state.
+			//
+			if( state == FUNCTION_TOGGLE ) {
+				reply_3( buf->contains, 'F', target, func, FUNCTION_OFF );
 			}
-
+			else {
+				reply_3( buf->contains, 'F', target, func, state );
+			}
+			buf->reply = REPLY_ON_SEND;
+			load_buffer( buf );
 			//
-			//	Accessory Commands
-			//	------------------
+			//	The function refresh must not follow
+			//	with the old states.
 			//
-			case 'A': {
-				PENDING_PACKET	**tail;
-				TRANS_BUFFER	*buf;
-				int		target,
-						adrs,
-						subadrs,
-						state;
+			if( FUNCTION_REFRESH_INTERVAL ) drop_refresh( target );
+			break;
+		}
 
-				//
-				//	Accessory decoder set state
-				//	---------------------------
-				//
-				//	[A ADRS STATE] -> [A ADRS STATE]
-				//
-				//		ADRS:	The combined address of the decoder (1-2048)
-				//		STATE:	1=on (set), 0=off (clear)
-				//
-				if( args != 2 ) {
-					errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
-					break;
-				}
-				//
-				//	Save arguments.
-				//
-				target = arg[ 0 ];
-				state = arg[ 1 ];
-				//
-				//	Verify ranges
-				//
-				if(( target < MIN_ACCESSORY_EXT_ADDRESS )||( target > MAX_ACCESSORY_EXT_ADDRESS )) {
-					errors.log_error( INVALID_ADDRESS, target );
-					break;
-				}
-				if(( state != ACCESSORY_ON )&&( state != ACCESSORY_OFF )) {
-					errors.log_error( INVALID_STATE, state );
+		//	Write Mobile State (Operations Track)
+		//	-------------------------------------
+		//
+		//	Overwrite the entire "state" of a specific mobile decoder
+		//	with the information provided in the arguments.
+		//
+		//	While this is provided as a single DCC Generator command
+		//	there is no single DCC command which implements this functionality
+		//	so consequently the command has to be implemented as a tightly
+		//	coupled sequence of commands.  This being said, thhe implementation
+		//	of the commannd should ensure that either *all* of these commands
+		//	are transmitted or *none* of them are.  While this does not
+		//	guarantee that the target decoder gets all of the updates
+		//	it does increase the likelihood that an incomplete update is
+		//	successful.
+		//
+		//	[W ADRS SPEED DIR FNA FNB FNC FND] -> [W ADRS SPEED DIR]
+		//
+		//		ADRS:	The short (1-127) or long (128-10239) address of the engine decoder
+		//		SPEED:	Throttle speed from 0-126, or -1 for emergency stop
+		//		DIR:	1=Forward, 0=Reverse
+		//		FNA:	Bit mask (in decimal) for Functions 0 through 7
+		//		FNB:	... Functions 8 through 15
+		//		FNC:	... Functions 16 through 23
+		//		FND:	... Functions 24 through 28 (bit positions for 29 through 31 ignored)
+		//
+		case 'W': {
+			//
+			//	Define how many function bit block there will be.
+			//
+			const int bit_blocks = 4;
+			
+			PENDING_PACKET	**tail;
+			TRANS_BUFFER	*buf;
+			ROSTER_ENTRY	*loco;
+			int		target,
+					speed,
+					dir,
+					fn[ bit_blocks ],
+					i;
+			byte		l;
+					
+			//
+			//	Verify we have all the arguments required.
+			//
+			if( args != ( 3 + bit_blocks )) {
+				errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
+				break;
+			}
+			//
+			//	Save command arguments.
+			//
+			target = arg[ 0 ];
+			speed = arg[ 1 ];
+			dir = arg[ 2 ];
+			for( i = 0; i < bit_blocks; i++ ) fn[ i ] = arg[ 3 + i ];
+			
+			//
+			//	Verify ranges
+			//
+			if(( target < MINIMUM_DCC_ADDRESS )||( target > MAXIMUM_DCC_ADDRESS )) {
+				errors.log_error( INVALID_ADDRESS, target );
+				break;
+			}
+			if(( speed < MINIMUM_DCC_SPEED )||( speed > MAXIMUM_DCC_SPEED )) {
+				errors.log_error( INVALID_SPEED, speed );
+				break;
+			}
+			if(( dir != DCC_FORWARDS )&&( dir != DCC_BACKWARDS )) {
+				errors.log_error( INVALID_DIRECTION, dir );
+				break;
+			}
+			for( i = 0; i < bit_blocks; i++ ) {
+				if(( fn[ i ] < 0 )||( fn[ i ] > 255 )) {
+					errors.log_error( INVALID_BIT_MASK, fn[ i ]);
 					break;
 				}
+			}
+			if( i < bit_blocks ) break; // needed to cascade the above break out of the switch statement.
+			
+			//
+			//	Find a destination buffer and the decoder in the
+			//	roster (in that order, so that a command which is
+			//	refused does not forget another decoder).
+			//
+			if((( buf = find_mobile_buffer( target )) == NULL )||(( loco = find_roster( target, true )) == NULL )) {
 				//
-				//	Convert to internal address and sub-address values and
-				//	remember to invert the external target number since we
-				//	use negative numbers to represent accessories internally.
-				//
-				adrs = internal_acc_adrs( target );
-				subadrs = internal_acc_subadrs( target );
-				target = -target;
-				//
-				//	Find a destination buffer
+				//	No available buffers
 				//
-				if(( buf = find_available_buffer( ACCESSORY_BASE_BUFFER, ACCESSORY_TRANS_BUFFERS, target )) == NULL ) {
-					//
-					//	No available buffers
-					//
-					errors.log_error( TRANSMISSION_BUSY, cmd );
-					break;
-				}
-				buf->pending = release_pending_recs( buf->pending, false );
-				tail = &( buf->pending );
+				errors.log_error( TRANSMISSION_BUSY, cmd );
+				break;
+			}
+			//
+			//	Clear any pending commands.
+			//
+			buf->pending = release_pending_recs( buf->pending, false );
+			tail = &( buf->pending );
+			//
+			//	create the function setting commands through repeatedly calling
+			//	the compose_function_block() function.
+			//
+			i = 0;	// this is the state variable required by compose_function_block()
+			//
+			//	Create a DCC command, and if it is more than 0 bytes long
+			//	add it to the pending set of commands and go round again.
+			//
+			while(( l = compose_function_block( command, &i, target, fn, bit_blocks ))) {
 				//
-				//	Now create and append the command to the pending list.
+				//	... made one, so append it ...
 				//
-				if( !create_pending_rec( &tail, target, TRANSIENT_COMMAND_REPEATS, DCC_SHORT_PREAMBLE, 1, compose_accessory_change( command, adrs, subadrs, state ), command )) {
+				if( !create_pending_rec( &tail, target, TRANSIENT_COMMAND_REPEATS, DCC_SHORT_PREAMBLE, 1, l, command )) {
 					//
-					//	Report that no pending has been record created.
+					//	Report that no pending record has been created.
 					//
+					buf->pending = release_pending_recs( buf->pending, false );
 					errors.log_error( COMMAND_QUEUE_FAILED, cmd );
 					break;
 				}
-
-#ifdef LCD_DISPLAY_ENABLE
-				//
-				//	Complete LCD summary.
-				//
-				lcd_summary_accessory( buf->display, adrs, subadrs, state );
-#endif
-
+			}
+			if( l ) break; // needed to cascade the above break out of the while loop.
+			
+			//
+			//	Now create and append the motion command to the pending list.
+			//
+			if( !create_pending_rec( &tail, target, (( speed == MINIMUM_DCC_SPEED )? TRANSIENT_COMMAND_REPEATS: ROSTER_REFRESH_REPEATS ), DCC_SHORT_PREAMBLE, 1, compose_motion_packet( command, target, speed, dir ), command )) {
 				//
-				//	Construct the future reply and set the state (un-negate
-				//	target value).
+				//	Report that no pending record has been created.
 				//
-				reply_2( buf->contains, 'A', -target, state );
-				buf->reply = REPLY_ON_SEND;
-				buf->state = ( buf->state == TBS_EMPTY )? TBS_LOAD: TBS_RELOAD;
+				buf->pending = release_pending_recs( buf->pending, false );
+				errors.log_error( COMMAND_QUEUE_FAILED, cmd );
 				break;
 			}
-
 			//
-			//	Mobile decoder functions
-			//	------------------------
+			//	Record the new state of the decoder in the roster.
 			//
-			case 'F': {
-				PENDING_PACKET	**tail;
-				TRANS_BUFFER	*buf;
-				int		target,
-						func,
-						state;
+			loco->speed = ROSTER_SPEED( speed, dir );
+#ifdef SIGNAL_DISTRICT_STREAMS
+			drop_refresh( target );
+#endif
+			for( i = 0; i < FUNCTION_BIT_ARRAY; i++ ) loco->bits[ i ] = fn[ i ];
 
-				//
-				//	Mobile decoder set function state
-				//	---------------------------------
-				//
-				//	[F ADRS FUNC STATE] -> [F ADRS FUNC STATE]
-				//
-				//		ADRS:	The short (1-127) or long (128-10239) address of the engine decoder
-				//		FUNC:	The function number to be modified (0-21)
-				//		STATE:	1=Enable, 0=Disable, 2=Toggle
-				//
-				//	Encoding a new "state": 2.  This is the act of turning
-				//	on a function then almost immediately turning it off
-				//	again (as a mnemonic this is, in binary, a 1 followed
-				//	by a 0)
-				//	
-				if( args != 3 ) {
-					errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
-					break;
-				}
-				//
-				//	Gather arguments
-				//
-				target = arg[ 0 ];
-				func = arg[ 1 ];
-				state = arg[ 2 ];
-				//
-				//	Verify ranges
-				//
-				if(( target < MINIMUM_DCC_ADDRESS )||( target > MAXIMUM_DCC_ADDRESS )) {
-					errors.log_error( INVALID_ADDRESS, target);
-					break;
-				}
-				if(( func < MIN_FUNCTION_NUMBER )||( func > MAX_FUNCTION_NUMBER )) {
-					errors.log_error( INVALID_FUNC_NUMBER, func );
-					break;
-				}
-				if(( state != FUNCTION_ON )&&( state != FUNCTION_OFF )&&( state != FUNCTION_TOGGLE )) {
-					errors.log_error( INVALID_STATE, state );
-					break;
-				}
-				//
-				//	Find a destination buffer
-				//
-				if(( buf = find_available_buffer( ACCESSORY_BASE_BUFFER, ACCESSORY_TRANS_BUFFERS, arg[ 0 ])) == NULL ) {
-					//
-					//	No available buffers
-					//
-					errors.log_error( TRANSMISSION_BUSY, cmd );
-					break;
-				}
-				buf->pending = release_pending_recs( buf->pending, false );
-				tail = &( buf->pending );
-				if( state == FUNCTION_TOGGLE ) {
-					bool		ok;
-					
-					//
-					//	Create a pair of DCC commands to turn the function
-					//	on then off:- the toggle option.
-					//
-					ok = create_pending_rec( &tail, target, TRANSIENT_COMMAND_REPEATS, DCC_SHORT_PREAMBLE, 1, compose_function_change( command, target, func, FUNCTION_ON ), command );
-					ok &= create_pending_rec( &tail, target, TRANSIENT_COMMAND_REPEATS, DCC_SHORT_PREAMBLE, 1, compose_function_change( command, target, func, FUNCTION_OFF ), command );
-					if( !ok ) {
-						//
-						//	Report that no pending has been record created.
-						//
-						buf->pending = release_pending_recs( buf->pending, false );
-						errors.log_error( COMMAND_QUEUE_FAILED, cmd );
-						break;
-					}
-				}
-				else {
-					//
-					//	Now create and append the command to the pending list.
-					//
-					if( !create_pending_rec( &tail, target, TRANSIENT_COMMAND_REPEATS, DCC_SHORT_PREAMBLE, 1, compose_function_change( command, target, func, state ), command )) {
-						//
-						//	Report that no pending has been record created.
-						//
-						errors.log_error( COMMAND_QUEUE_FAILED, cmd );
-						break;
-					}
-				}
 #ifdef LCD_DISPLAY_ENABLE
-				//
-				//	Complete LCD summary.
-				//
-				lcd_summary_function( buf->display, target, func, state );
+			//
+			//	Complete LCD summary.
+			//
+			lcd_summary_motion( buf->display, target, speed, dir );
 #endif
 
-				//
-				//	Prepare the future reply and set new state.
-				//
-				if( state == FUNCTION_TOGGLE ) {
-					reply_3( buf->contains, 'F', target, func, FUNCTION_OFF );
-				}
-				else {
-					reply_3( buf->contains, 'F', target, func, state );
-				}
-				buf->reply = REPLY_ON_SEND;
-				buf->state = ( buf->state == TBS_EMPTY )? TBS_LOAD: TBS_RELOAD;
-				break;
-			}
+			//
+			//	Construct the reply to send when we get send
+			//	confirmation and pass to the manager code to
+			//	insert the new packet into the transmission
+			//	process.
+			//
+			reply_3( buf->contains, 'W', target, speed, dir );
+			buf->reply = REPLY_ON_SEND;
+			load_buffer( buf );
+			break;
+		}
+
+		//
+		//	Place a mobile decoder in districts
+		//	-----------------------------------
+		//
+		case 'T': {
+#ifdef SIGNAL_DISTRICT_STREAMS
+			ROSTER_ENTRY	*loco;
+			int		target,
+					mask;
+			byte		streams,
+					d;
+			char		reply[ 16 ];
 
-			//	Write Mobile State (Operations Track)
-			//	-------------------------------------
 			//
-			//	Overwrite the entire "state" of a specific mobile decoder
-			//	with the information provided in the arguments.
+			//	Place a mobile decoder in districts
+			//	-----------------------------------
 			//
-			//	While this is provided as a single DCC Generator command
-			//	there is no single DCC command which implements this functionality
-			//	so consequently the command has to be implemented as a tightly
-			//	coupled sequence of commands.  This being said, thhe implementation
-			//	of the commannd should ensure that either *all* of these commands
-			//	are transmitted or *none* of them are.  While this does not
-			//	guarantee that the target decoder gets all of the updates
-			//	it does increase the likelihood that an incomplete update is
-			//	successful.
+			//	[T ADRS DISTRICTS] -> [T ADRS DISTRICTS]
 			//
-			//	[W ADRS SPEED DIR FNA FNB FNC FND] -> [W ADRS SPEED DIR]
+			//		ADRS:		The short (1-127) or long (128-10239) address of the engine decoder
+			//		DISTRICTS:	Bit mask (in decimal) of the districts, in the
+			//				order reported by [D], which refresh the decoder
+			//				speed and direction, 0 for all districts
 			//
-			//		ADRS:	The short (1-127) or long (128-10239) address of the engine decoder
-			//		SPEED:	Throttle speed from 0-126, or -1 for emergency stop
-			//		DIR:	1=Forward, 0=Reverse
-			//		FNA:	Bit mask (in decimal) for Functions 0 through 7
-			//		FNB:	... Functions 8 through 15
-			//		FNC:	... Functions 16 through 23
-			//		FND:	... Functions 24 through 28 (bit positions for 29 through 31 ignored)
+			if( args != 2 ) {
+				errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
+				break;
+			}
+			target = arg[ 0 ];
+			mask = arg[ 1 ];
+			if(( target < MINIMUM_DCC_ADDRESS )||( target > MAXIMUM_DCC_ADDRESS )) {
+				errors.log_error( INVALID_ADDRESS, target );
+				break;
+			}
+			if(( mask < 0 )||( mask >= ( 1 << SHIELD_OUTPUT_DRIVERS ))) {
+				errors.log_error( INVALID_BIT_MASK, mask );
+				break;
+			}
 			//
-			case 'W': {
-				//
-				//	Define how many function bit block there will be.
-				//
-				const int bit_blocks = 4;
-				
-				PENDING_PACKET	**tail;
-				TRANS_BUFFER	*buf;
-				int		target,
-						speed,
-						dir,
-						fn[ bit_blocks ],
-						i;
-				byte		l;
-						
-				//
-				//	Verify we have all the arguments required.
-				//
-				if( args != ( 3 + bit_blocks )) {
-					errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
-					break;
-				}
-				//
-				//	Save command arguments.
-				//
-				target = arg[ 0 ];
-				speed = arg[ 1 ];
-				dir = arg[ 2 ];
-				for( i = 0; i < bit_blocks; i++ ) fn[ i ] = arg[ 3 + i ];
-				
-				//
-				//	Verify ranges
-				//
-				if(( target < MINIMUM_DCC_ADDRESS )||( target > MAXIMUM_DCC_ADDRESS )) {
-					errors.log_error( INVALID_ADDRESS, target );
-					break;
-				}
-				if(( speed < MINIMUM_DCC_SPEED )||( speed > MAXIMUM_DCC_SPEED )) {
-					errors.log_error( INVALID_SPEED, speed );
-					break;
-				}
-				if(( dir != DCC_FORWARDS )&&( dir != DCC_BACKWARDS )) {
-					errors.log_error( INVALID_DIRECTION, dir );
-					break;
-				}
-				for( i = 0; i < bit_blocks; i++ ) {
-					if(( fn[ i ] < 0 )||( fn[ i ] > 255 )) {
-						errors.log_error( INVALID_BIT_MASK, fn[ i ]);
-						break;
-					}
-				}
-				if( i < bit_blocks ) break; // needed to cascade the above break out of the switch statement.
-				
-				//
-				//	Find a destination buffer
-				//
-				if(( buf = find_available_buffer( MOBILE_BASE_BUFFER, MOBILE_TRANS_BUFFERS, target )) == NULL ) {
-					//
-					//	No available buffers
-					//
-					errors.log_error( TRANSMISSION_BUSY, cmd );
-					break;
-				}
-				//
-				//	Clear any pending commands.
-				//
-				buf->pending = release_pending_recs( buf->pending, false );
-				tail = &( buf->pending );
-				//
-				//	create the function setting commands through repeatedly calling
-				//	the compose_function_block() function.
-				//
-				i = 0;	// this is the state variable required by compose_function_block()
-				//
-				//	Create a DCC command, and if it is more than 0 bytes long
-				//	add it to the pending set of commands and go round again.
-				//
-				while(( l = compose_function_block( command, &i, target, fn, bit_blocks ))) {
-					//
-					//	... made one, so append it ...
-					//
-					if( !create_pending_rec( &tail, target, TRANSIENT_COMMAND_REPEATS, DCC_SHORT_PREAMBLE, 1, l, command )) {
-						//
-						//	Report that no pending record has been created.
-						//
-						buf->pending = release_pending_recs( buf->pending, false );
-						errors.log_error( COMMAND_QUEUE_FAILED, cmd );
-						break;
-					}
-				}
-				if( l ) break; // needed to cascade the above break out of the while loop.
-				
-				//
-				//	Now create and append the motion command to the pending list.
-				//
-				if( !create_pending_rec( &tail, target, (( speed == MINIMUM_DCC_SPEED )? TRANSIENT_COMMAND_REPEATS: 0 ), DCC_SHORT_PREAMBLE, 1, compose_motion_packet( command, target, speed, dir ), command )) {
-					//
-					//	Report that no pending record has been created.
-					//
-					buf->pending = release_pending_recs( buf->pending, false );
-					errors.log_error( COMMAND_QUEUE_FAILED, cmd );
-					break;
+			//	Convert the districts to district streams,
+			//	rejecting the programming track.
+			//
+			streams = 0;
+			for( d = 0; d < SHIELD_OUTPUT_DRIVERS; d++ ) {
+				if( mask & bit( d )) {
+					if( driver_stream( d ) == PROG_STREAM ) break;
+					streams |= bit( driver_stream( d ));
 				}
-
-#ifdef LCD_DISPLAY_ENABLE
-				//
-				//	Complete LCD summary.
-				//
-				lcd_summary_motion( buf->display, target, speed, dir );
+			}
+			if( d < SHIELD_OUTPUT_DRIVERS ) {
+				errors.log_error( INVALID_BIT_MASK, mask );
+				break;
+			}
+			if(( loco = find_roster( target, true )) == NULL ) {
+				errors.log_error( TRANSMISSION_BUSY, cmd );
+				break;
+			}
+			loco->districts = streams;
+			reply_2( reply, 'T', target, mask );
+			if( !console.print( reply )) errors.log_error( COMMAND_REPORT_FAIL, cmd );
+#else
+			errors.log_error( NO_DISTRICT_STREAMS, cmd );
 #endif
+			break;
+		}
 
-				//
-				//	Construct the reply to send when we get send
-				//	confirmation and pass to the manager code to
-				//	insert the new packet into the transmission
-				//	process.
-				//
-				reply_3( buf->contains, 'W', target, speed, dir );
-				buf->reply = REPLY_ON_SEND;
-				buf->state = ( buf->state == TBS_EMPTY )? TBS_LOAD: TBS_RELOAD;
+		//
+		//	Modify CV values on the programming track
+		//	-----------------------------------------
+		//
+		case 'S': {
+#ifdef PROGRAMMING_TRACK
+			PENDING_PACKET	**tail;
+			TRANS_BUFFER	*buf;
+			int		cv,
+					value;
+			bool		ok;
+
+			//
+			//	Set CV value (Programming track)
+			//	--------------------------------
+			//
+			//	[S CV VALUE] -> [S CV VALUE STATE]
+			//
+			//		CV:	Number of CV to set (1-1024)
+			//		VALUE:	8 bit value to apply (0-255)
+			//		STATE:	1=Confirmed, 0=Failed
+			//
+			if( args != 2 ) {
+				errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
 				break;
 			}
-
 			//
-			//	Modify CV values on the programming track
-			//	-----------------------------------------
+			//	Save arguments
 			//
-			case 'S': {
-#ifdef PROGRAMMING_TRACK
-				PENDING_PACKET	**tail;
-				TRANS_BUFFER	*buf;
-				int		cv,
-						value;
-				bool		ok;
-
-				//
-				//	Set CV value (Programming track)
-				//	--------------------------------
-				//
-				//	[S CV VALUE] -> [S CV VALUE STATE]
-				//
-				//		CV:	Number of CV to set (1-1024)
-				//		VALUE:	8 bit value to apply (0-255)
-				//		STATE:	1=Confirmed, 0=Failed
-				//
-				if( args != 2 ) {
-					errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
-					break;
-				}
-				//
-				//	Save arguments
-				//
-				cv = arg[ 0 ];
-				value = arg[ 1 ];
+			cv = arg[ 0 ];
+			value = arg[ 1 ];
+			//
+			//	verify ranges
+			//
+			if(( cv < MINIMUM_CV_ADDRESS )||( cv > MAXIMUM_CV_ADDRESS )) {
+				errors.log_error( INVALID_CV_NUMBER, cv );
+				break;
+			}
+			if(( value < 0 )||( value > 255 )) {
+				errors.log_error( INVALID_BYTE_VALUE, value );
+				break;
+			}
+			//
+			//	Find a destination buffer
+			//
+			if(( buf = find_available_buffer( PROGRAMMING_BASE_BUFFER, PROGRAMMING_BUFFERS, 0 )) == NULL ) {
 				//
-				//	verify ranges
+				//	No available buffers
 				//
-				if(( cv < MINIMUM_CV_ADDRESS )||( cv > MAXIMUM_CV_ADDRESS )) {
-					errors.log_error( INVALID_CV_NUMBER, cv );
-					break;
-				}
-				if(( value < 0 )||( value > 255 )) {
-					errors.log_error( INVALID_BYTE_VALUE, value );
-					break;
-				}
+				errors.log_error( TRANSMISSION_BUSY, cmd );
+				break;
+			}
+			buf->pending = release_pending_recs( buf->pending, false );
+			tail = &( buf->pending );
+			//
+			//	Build up the command chain..
+			//
+			ok = create_pending_rec( &tail, 0, SERVICE_MODE_RESET_REPEATS, DCC_LONG_PREAMBLE, 1, compose_digital_reset( command ), command );
+			ok &= create_pending_rec( &tail, 0, SERVICE_MODE_COMMAND_REPEATS, DCC_LONG_PREAMBLE, CONFIRMATION_PAUSE, compose_set_cv( command, cv, value ), command );
+			ok &= create_pending_rec( &tail, 0, SERVICE_MODE_COMMAND_REPEATS, DCC_LONG_PREAMBLE, CONFIRMATION_PAUSE, compose_set_cv( command, cv, value ), command );
+			ok &= create_pending_rec( &tail, 0, SERVICE_MODE_RESET_REPEATS, DCC_LONG_PREAMBLE, 1, compose_digital_reset( command ), command );
+			if( !ok ) {
 				//
-				//	Find a destination buffer
+				//	Report that no pending has been record created.
 				//
-				if(( buf = find_available_buffer( PROGRAMMING_BASE_BUFFER, PROGRAMMING_BUFFERS, 0 )) == NULL ) {
-					//
-					//	No available buffers
-					//
-					errors.log_error( TRANSMISSION_BUSY, cmd );
-					break;
-				}
 				buf->pending = release_pending_recs( buf->pending, false );
-				tail = &( buf->pending );
-				//
-				//	Build up the command chain..
-				//
-				ok = create_pending_rec( &tail, 0, SERVICE_MODE_RESET_REPEATS, DCC_LONG_PREAMBLE, 1, compose_digital_reset( command ), command );
-				ok &= create_pending_rec( &tail, 0, SERVICE_MODE_COMMAND_REPEATS, DCC_LONG_PREAMBLE, CONFIRMATION_PAUSE, compose_set_cv( command, cv, value ), command );
-				ok &= create_pending_rec( &tail, 0, SERVICE_MODE_COMMAND_REPEATS, DCC_LONG_PREAMBLE, CONFIRMATION_PAUSE, compose_set_cv( command, cv, value ), command );
-				ok &= create_pending_rec( &tail, 0, SERVICE_MODE_RESET_REPEATS, DCC_LONG_PREAMBLE, 1, compose_digital_reset( command ), command );
-				if( !ok ) {
-					//
-					//	Report that no pending has been record created.
-					//
-					buf->pending = release_pending_recs( buf->pending, false );
-					errors.log_error( COMMAND_QUEUE_FAILED, cmd );
-					break;
-				}
+				errors.log_error( COMMAND_QUEUE_FAILED, cmd );
+				break;
+			}
 
 #ifdef LCD_DISPLAY_ENABLE
-				//
-				//	Complete LCD summary.
-				//
-				lcd_summary_setcv( buf->display, cv, value );
+			//
+			//	Complete LCD summary.
+			//
+			lcd_summary_setcv( buf->display, cv, value );
 #endif
 
-				//
-				//	Construct the future reply and set the state. Use the confirmation version
-				//	of the reply routine.
-				//
-				reply_2c( buf->contains, 'S', cv, value );
-				reset_confirmation( false );
-				buf->reply = REPLY_ON_CONFIRM;
-				buf->state = ( buf->state == TBS_EMPTY )? TBS_LOAD: TBS_RELOAD;
+			//
+			//	Construct the future reply and set the state. Use the confirmation version
+			//	of the reply routine.
+			//
+			reply_2c( buf->contains, 'S', cv, value );
+			reset_confirmation( false );
+			buf->reply = REPLY_ON_CONFIRM;
+			load_buffer( buf );
 #else
-				errors.log_error( NO_PROGRAMMING_TRACK, cmd );
+			errors.log_error( NO_PROGRAMMING_TRACK, cmd );
 #endif
+			break;
+		}
+
+		//
+		//	Verify CV Value
+		//	---------------
+		//
+		case 'V': {
+#ifdef PROGRAMMING_TRACK
+			PENDING_PACKET	**tail;
+			TRANS_BUFFER	*buf;
+			int		cv,
+					value;
+			bool		ok;
+
+			//
+			//	Verify CV value (Programming track)
+			//	-----------------------------------
+			//
+			//	[V CV VALUE] -> [V CV VALUE STATE]
+			//
+			//		CV:	Number of CV to set (1-1024)
+			//		VALUE:	8 bit value to apply (0-255)
+			//		STATE:	1=Confirmed, 0=Failed
+			//
+			if( args != 2 ) {
+				errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
 				break;
 			}
-
 			//
-			//	Verify CV Value
-			//	---------------
+			//	Save arguments
 			//
-			case 'V': {
-#ifdef PROGRAMMING_TRACK
-				PENDING_PACKET	**tail;
-				TRANS_BUFFER	*buf;
-				int		cv,
-						value;
-				bool		ok;
-
-				//
-				//	Verify CV value (Programming track)
-				//	-----------------------------------
-				//
-				//	[V CV VALUE] -> [V CV VALUE STATE]
-				//
-				//		CV:	Number of CV to set (1-1024)
-				//		VALUE:	8 bit value to apply (0-255)
-				//		STATE:	1=Confirmed, 0=Failed
-				//
-				if( args != 2 ) {
-					errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
-					break;
-				}
-				//
-				//	Save arguments
-				//
-				cv = arg[ 0 ];
-				value = arg[ 1 ];
+			cv = arg[ 0 ];
+			value = arg[ 1 ];
+			//
+			//	verify ranges
+			//
+			if(( cv < MINIMUM_CV_ADDRESS )||( cv > MAXIMUM_CV_ADDRESS )) {
+				errors.log_error( INVALID_CV_NUMBER, cv );
+				break;
+			}
+			if(( value < 0 )||( value > 255 )) {
+				errors.log_error( INVALID_BYTE_VALUE, value );
+				break;
+			}
+			//
+			//	Find a destination buffer
+			//
+			if(( buf = find_available_buffer( PROGRAMMING_BASE_BUFFER, PROGRAMMING_BUFFERS, 0 )) == NULL ) {
 				//
-				//	verify ranges
+				//	No available buffers
 				//
-				if(( cv < MINIMUM_CV_ADDRESS )||( cv > MAXIMUM_CV_ADDRESS )) {
-					errors.log_error( INVALID_CV_NUMBER, cv );
-					break;
-				}
-				if(( value < 0 )||( value > 255 )) {
-					errors.log_error( INVALID_BYTE_VALUE, value );
-					break;
-				}
+				errors.log_error( TRANSMISSION_BUSY, cmd );
+				break;
+			}
+			buf->pending = release_pending_recs( buf->pending, false );
+			tail = &( buf->pending );
+			//
+			//	Build up the command chain..
+			//
+			ok = create_pending_rec( &tail, 0, SERVICE_MODE_RESET_REPEATS, DCC_LONG_PREAMBLE, 1, compose_digital_reset( command ), command );
+			ok &= create_pending_rec( &tail, 0, SERVICE_MODE_COMMAND_REPEATS, DCC_LONG_PREAMBLE, CONFIRMATION_PAUSE, compose_verify_cv( command, cv, value ), command );
+			ok &= create_pending_rec( &tail, 0, SERVICE_MODE_COMMAND_REPEATS, DCC_LONG_PREAMBLE, CONFIRMATION_PAUSE, compose_verify_cv( command, cv, value ), command );
+			ok &= create_pending_rec( &tail, 0, SERVICE_MODE_RESET_REPEATS, DCC_LONG_PREAMBLE, 1, compose_digital_reset( command ), command );
+			if( !ok ) {
 				//
-				//	Find a destination buffer
+				//	Report that no pending has been record created.
 				//
-				if(( buf = find_available_buffer( PROGRAMMING_BASE_BUFFER, PROGRAMMING_BUFFERS, 0 )) == NULL ) {
-					//
-					//	No available buffers
-					//
-					errors.log_error( TRANSMISSION_BUSY, cmd );
-					break;
-				}
 				buf->pending = release_pending_recs( buf->pending, false );
-				tail = &( buf->pending );
-				//
-				//	Build up the command chain..
-				//
-				ok = create_pending_rec( &tail, 0, SERVICE_MODE_RESET_REPEATS, DCC_LONG_PREAMBLE, 1, compose_digital_reset( command ), command );
-				ok &= create_pending_rec( &tail, 0, SERVICE_MODE_COMMAND_REPEATS, DCC_LONG_PREAMBLE, CONFIRMATION_PAUSE, compose_verify_cv( command, cv, value ), command );
-				ok &= create_pending_rec( &tail, 0, SERVICE_MODE_COMMAND_REPEATS, DCC_LONG_PREAMBLE, CONFIRMATION_PAUSE, compose_verify_cv( command, cv, value ), command );
-				ok &= create_pending_rec( &tail, 0, SERVICE_MODE_RESET_REPEATS, DCC_LONG_PREAMBLE, 1, compose_digital_reset( command ), command );
-				if( !ok ) {
-					//
-					//	Report that no pending has been record created.
-					//
-					buf->pending = release_pending_recs( buf->pending, false );
-					errors.log_error( COMMAND_QUEUE_FAILED, cmd );
-					break;
-				}
+				errors.log_error( COMMAND_QUEUE_FAILED, cmd );
+				break;
+			}
 
 #ifdef LCD_DISPLAY_ENABLE
-				//
-				//	Complete LCD summary.
-				//
-				lcd_summary_verifycv( buf->display, cv, value );
+			//
+			//	Complete LCD summary.
+			//
+			lcd_summary_verifycv( buf->display, cv, value );
 #endif
 
-				//
-				//	Construct the future reply and set the state. The '#' in the reply
-				//	will be replaced by a 1 or 0 to reflect confirmation.
-				//
-				reply_2c( buf->contains, 'V', cv, value );
-				reset_confirmation( false );
-				buf->reply = REPLY_ON_CONFIRM;
-				buf->state = ( buf->state == TBS_EMPTY )? TBS_LOAD: TBS_RELOAD;
+			//
+			//	Construct the future reply and set the state. The '#' in the reply
+			//	will be replaced by a 1 or 0 to reflect confirmation.
+			//
+			reply_2c( buf->contains, 'V', cv, value );
+			reset_confirmation( false );
+			buf->reply = REPLY_ON_CONFIRM;
+			load_buffer( buf );
 #else
-				errors.log_error( NO_PROGRAMMING_TRACK, cmd );
+			errors.log_error( NO_PROGRAMMING_TRACK, cmd );
 #endif
+			break;
+		}
+
+		//
+		//	Set (Update) CV bit value
+		//	-------------------------
+		//
+		case 'U': {
+#ifdef PROGRAMMING_TRACK
+			PENDING_PACKET	**tail;
+			TRANS_BUFFER	*buf;
+			int		cv,
+					bnum,
+					value;
+			bool		ok;
+
+			//
+			//	Set CV bit value (Programming track)
+			//	------------------------------------
+			//
+			//	Set the specified CV bit with the supplied
+			//	value.
+			//
+			//	[U CV BIT VALUE] -> [U CV BIT VALUE]
+			//
+			//		CV:	Number of CV to set (1-1024)
+			//		BIT:	Bit number (0 LSB - 7 MSB)
+			//		VALUE:	0 or 1
+			//
+			if( args != 3 ) {
+				errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
 				break;
 			}
-
 			//
-			//	Set (Update) CV bit value
-			//	-------------------------
+			//	Save arguments
 			//
-			case 'U': {
-#ifdef PROGRAMMING_TRACK
-				PENDING_PACKET	**tail;
-				TRANS_BUFFER	*buf;
-				int		cv,
-						bnum,
-						value;
-				bool		ok;
-
-				//
-				//	Set CV bit value (Programming track)
-				//	------------------------------------
-				//
-				//	Set the specified CV bit with the supplied
-				//	value.
-				//
-				//	[U CV BIT VALUE] -> [U CV BIT VALUE]
-				//
-				//		CV:	Number of CV to set (1-1024)
-				//		BIT:	Bit number (0 LSB - 7 MSB)
-				//		VALUE:	0 or 1
-				//
-				if( args != 3 ) {
-					errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
-					break;
-				}
-				//
-				//	Save arguments
-				//
-				cv = arg[ 0 ];
-				bnum = arg[ 1 ];
-				value = arg[ 2 ];
+			cv = arg[ 0 ];
+			bnum = arg[ 1 ];
+			value = arg[ 2 ];
+			//
+			//	verify ranges
+			//
+			if(( cv < MINIMUM_CV_ADDRESS )||( cv > MAXIMUM_CV_ADDRESS )) {
+				errors.log_error( INVALID_CV_NUMBER, cv );
+				break;
+			}
+			if(( bnum < 0 )||( bnum > 7 )) {
+				errors.log_error( INVALID_BIT_NUMBER, bnum );
+				break;
+			}
+			if(( value != 0 )&&( value != 1 )) {
+				errors.log_error( INVALID_BIT_VALUE, value );
+				break;
+			}
+			//
+			//	Find a destination buffer
+			//
+			if(( buf = find_available_buffer( PROGRAMMING_BASE_BUFFER, PROGRAMMING_BUFFERS, 0 )) == NULL ) {
 				//
-				//	verify ranges
+				//	No available buffers
 				//
-				if(( cv < MINIMUM_CV_ADDRESS )||( cv > MAXIMUM_CV_ADDRESS )) {
-					errors.log_error( INVALID_CV_NUMBER, cv );
-					break;
-				}
-				if(( bnum < 0 )||( bnum > 7 )) {
-					errors.log_error( INVALID_BIT_NUMBER, bnum );
-					break;
-				}
-				if(( value != 0 )&&( value != 1 )) {
-					errors.log_error( INVALID_BIT_VALUE, value );
-					break;
-				}
+				errors.log_error( TRANSMISSION_BUSY, cmd );
+				break;
+			}
+			buf->pending = release_pending_recs( buf->pending, false );
+			tail = &( buf->pending );
+			//
+			//	Build up the command chain..
+			//
+			ok = create_pending_rec( &tail, 0, SERVICE_MODE_RESET_REPEATS, DCC_LONG_PREAMBLE, 1, compose_digital_reset( command ), command );
+			ok &= create_pending_rec( &tail, 0, SERVICE_MODE_COMMAND_REPEATS, DCC_LONG_PREAMBLE, CONFIRMATION_PAUSE, compose_set_cv_bit( command, cv, bnum, value ), command );
+			ok &= create_pending_rec( &tail, 0, SERVICE_MODE_COMMAND_REPEATS, DCC_LONG_PREAMBLE, CONFIRMATION_PAUSE, compose_set_cv_bit( command, cv, bnum, value ), command );
+			ok &= create_pending_rec( &tail, 0, SERVICE_MODE_RESET_REPEATS, DCC_LONG_PREAMBLE, 1, compose_digital_reset( command ), command );
+			if( !ok ) {
 				//
-				//	Find a destination buffer
+				//	Report that no pending has been record created.
 				//
-				if(( buf = find_available_buffer( PROGRAMMING_BASE_BUFFER, PROGRAMMING_BUFFERS, 0 )) == NULL ) {
-					//
-					//	No available buffers
-					//
-					errors.log_error( TRANSMISSION_BUSY, cmd );
-					break;
-				}
 				buf->pending = release_pending_recs( buf->pending, false );
-				tail = &( buf->pending );
-				//
-				//	Build up the command chain..
-				//
-				ok = create_pending_rec( &tail, 0, SERVICE_MODE_RESET_REPEATS, DCC_LONG_PREAMBLE, 1, compose_digital_reset( command ), command );
-				ok &= create_pending_rec( &tail, 0, SERVICE_MODE_COMMAND_REPEATS, DCC_LONG_PREAMBLE, CONFIRMATION_PAUSE, compose_set_cv_bit( command, cv, bnum, value ), command );
-				ok &= create_pending_rec( &tail, 0, SERVICE_MODE_COMMAND_REPEATS, DCC_LONG_PREAMBLE, CONFIRMATION_PAUSE, compose_set_cv_bit( command, cv, bnum, value ), command );
-				ok &= create_pending_rec( &tail, 0, SERVICE_MODE_RESET_REPEATS, DCC_LONG_PREAMBLE, 1, compose_digital_reset( command ), command );
-				if( !ok ) {
-					//
-					//	Report that no pending has been record created.
-					//
-					buf->pending = release_pending_recs( buf->pending, false );
-					errors.log_error( COMMAND_QUEUE_FAILED, cmd );
-					break;
-				}
+				errors.log_error( COMMAND_QUEUE_FAILED, cmd );
+				break;
+			}
 
 #ifdef LCD_DISPLAY_ENABLE
-				//
-				//	Complete LCD summary.
-				//
-				lcd_summary_setcvbit( buf->display, cv, bnum, value );
+			//
+			//	Complete LCD summary.
+			//
+			lcd_summary_setcvbit( buf->display, cv, bnum, value );
 #endif
 
-				//
-				//	Construct the future reply and set the state. The '#' in the reply
-				//	will be replaced by a 1 or 0 to reflect confirmation.
-				//
-				reply_3c( buf->contains, 'U', cv, bnum, value );
-				reset_confirmation( false );
-				buf->reply = REPLY_ON_CONFIRM;
-				buf->state = ( buf->state == TBS_EMPTY )? TBS_LOAD: TBS_RELOAD;
+			//
+			//	Construct the future reply and set the state. The '#' in the reply
+			//	will be replaced by a 1 or 0 to reflect confirmation.
+			//
+			reply_3c( buf->contains, 'U', cv, bnum, value );
+			reset_confirmation( false );
+			buf->reply = REPLY_ON_CONFIRM;
+			load_buffer( buf );
 #else
-				errors.log_error( NO_PROGRAMMING_TRACK, cmd );
+			errors.log_error( NO_PROGRAMMING_TRACK, cmd );
 #endif
+			break;
+		}
+
+		//
+		//	Read CV bit value
+		//	-----------------
+		//
+		case 'R': {
+#ifdef PROGRAMMING_TRACK
+			PENDING_PACKET	**tail;
+			TRANS_BUFFER	*buf;
+			int		cv,
+					bnum,
+					value;
+			bool		ok;
+
+			//
+			//	Read CV bit value (Programming track)
+			//	-------------------------------------
+			//
+			//	Compare the specified CV bit with the supplied
+			//	value, if they are the same, return 1, otherwise
+			//	(or in the case of failure) return 0.
+			//
+			//	[R CV BIT VALUE] -> [R CV BIT STATE]
+			//
+			//		CV:	Number of CV to set (1-1024)
+			//		BIT:	Bit number (0 LSB - 7 MSB)
+			//		VALUE:	0 or 1
+			//		STATE:	1=Confirmed, 0=Failed
+			//
+			//
+			if( args != 3 ) {
+				errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
 				break;
 			}
-
 			//
-			//	Read CV bit value
-			//	-----------------
+			//	Save arguments
 			//
-			case 'R': {
-#ifdef PROGRAMMING_TRACK
-				PENDING_PACKET	**tail;
-				TRANS_BUFFER	*buf;
-				int		cv,
-						bnum,
-						value;
-				bool		ok;
-
-				//
-				//	Read CV bit value (Programming track)
-				//	-------------------------------------
-				//
-				//	Compare the specified CV bit with the supplied
-				//	value, if they are the same, return 1, otherwise
-				//	(or in the case of failure) return 0.
-				//
-				//	[R CV BIT VALUE] -> [R CV BIT STATE]
-				//
-				//		CV:	Number of CV to set (1-1024)
-				//		BIT:	Bit number (0 LSB - 7 MSB)
-				//		VALUE:	0 or 1
-				//		STATE:	1=Confirmed, 0=Failed
-				//
-				//
-				if( args != 3 ) {
-					errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
-					break;
-				}
-				//
-				//	Save arguments
-				//
-				cv = arg[ 0 ];
-				bnum = arg[ 1 ];
-				value = arg[ 2 ];
-				//
-				//	verify ranges
-				//
-				if(( cv < MINIMUM_CV_ADDRESS )||( cv > MAXIMUM_CV_ADDRESS )) {
-					errors.log_error( INVALID_CV_NUMBER, cv );
-					break;
-				}
-				if(( bnum < 0 )||( bnum > 7 )) {
-					errors.log_error( INVALID_BIT_NUMBER, bnum );
-					break;
-				}
-				if(( value != 0 )&&( value != 1 )) {
-					errors.log_error( INVALID_BIT_VALUE, value );
-					break;
-				}
+			cv = arg[ 0 ];
+			bnum = arg[ 1 ];
+			value = arg[ 2 ];
+			//
+			//	verify ranges
+			//
+			if(( cv < MINIMUM_CV_ADDRESS )||( cv > MAXIMUM_CV_ADDRESS )) {
+				errors.log_error( INVALID_CV_NUMBER, cv );
+				break;
+			}
+			if(( bnum < 0 )||( bnum > 7 )) {
+				errors.log_error( INVALID_BIT_NUMBER, bnum );
+				break;
+			}
+			if(( value != 0 )&&( value != 1 )) {
+				errors.log_error( INVALID_BIT_VALUE, value );
+				break;
+			}
+			//
+			//	Find a destination buffer
+			//
+			if(( buf = find_available_buffer( PROGRAMMING_BASE_BUFFER, PROGRAMMING_BUFFERS, 0 )) == NULL ) {
 				//
-				//	Find a destination buffer
+				//	No available buffers
 				//
-				if(( buf = find_available_buffer( PROGRAMMING_BASE_BUFFER, PROGRAMMING_BUFFERS, 0 )) == NULL ) {
-					//
-					//	No available buffers
-					//
-					errors.log_error( TRANSMISSION_BUSY, cmd );
-					break;
-				}
-				buf->pending = release_pending_recs( buf->pending, false );
-				tail = &( buf->pending );
+				errors.log_error( TRANSMISSION_BUSY, cmd );
+				break;
+			}
+			buf->pending = release_pending_recs( buf->pending, false );
+			tail = &( buf->pending );
+			//
+			//	Build up the command chain..
+			//
+			ok = create_pending_rec( &tail, 0, SERVICE_MODE_RESET_REPEATS, DCC_LONG_PREAMBLE, 1, compose_digital_reset( command ), command );
+			ok &= create_pending_rec( &tail, 0, SERVICE_MODE_COMMAND_REPEATS, DCC_LONG_PREAMBLE, CONFIRMATION_PAUSE, compose_verify_cv_bit( command, cv, bnum, value ), command );
+			ok &= create_pending_rec( &tail, 0, SERVICE_MODE_COMMAND_REPEATS, DCC_LONG_PREAMBLE, CONFIRMATION_PAUSE, compose_verify_cv_bit( command, cv, bnum, value ), command );
+			ok &= create_pending_rec( &tail, 0, SERVICE_MODE_RESET_REPEATS, DCC_LONG_PREAMBLE, 1, compose_digital_reset( command ), command );
+			if( !ok ) {
 				//
-				//	Build up the command chain..
+				//	Report that no pending has been record created.
 				//
-				ok = create_pending_rec( &tail, 0, SERVICE_MODE_RESET_REPEATS, DCC_LONG_PREAMBLE, 1, compose_digital_reset( command ), command );
-				ok &= create_pending_rec( &tail, 0, SERVICE_MODE_COMMAND_REPEATS, DCC_LONG_PREAMBLE, CONFIRMATION_PAUSE, compose_verify_cv_bit( command, cv, bnum, value ), command );
-				ok &= create_pending_rec( &tail, 0, SERVICE_MODE_COMMAND_REPEATS, DCC_LONG_PREAMBLE, CONFIRMATION_PAUSE, compose_verify_cv_bit( command, cv, bnum, value ), command );
-				ok &= create_pending_rec( &tail, 0, SERVICE_MODE_RESET_REPEATS, DCC_LONG_PREAMBLE, 1, compose_digital_reset( command ), command );
-				if( !ok ) {
-					//
-					//	Report that no pending has been record created.
-					//
-					buf->pending = release_pending_recs( buf->pending, false );
-					errors.log_error( COMMAND_QUEUE_FAILED, cmd );
-					break;
-				}
+				buf->pending = release_pending_recs( buf->pending, false );
+				errors.log_error( COMMAND_QUEUE_FAILED, cmd );
+				break;
+			}
 
 #ifdef LCD_DISPLAY_ENABLE
-				//
-				//	Complete LCD summary.
-				//
-				lcd_summary_readcv( buf->display, cv, bnum, value );
+			//
+			//	Complete LCD summary.
+			//
+			lcd_summary_readcv( buf->display, cv, bnum, value );
 #endif
 
-				//
-				//	Construct the future reply and set the state. The '#' in the reply
-				//	will be replaced by a 1 or 0 to reflect confirmation.
-				//
-				reply_3c( buf->contains, 'R', cv, bnum, value );
-				reset_confirmation( false );
-				buf->reply = REPLY_ON_CONFIRM;
-				buf->state = ( buf->state == TBS_EMPTY )? TBS_LOAD: TBS_RELOAD;
+			//
+			//	Construct the future reply and set the state. The '#' in the reply
+			//	will be replaced by a 1 or 0 to reflect confirmation.
+			//
+			reply_3c( buf->contains, 'R', cv, bnum, value );
+			reset_confirmation( false );
+			buf->reply = REPLY_ON_CONFIRM;
+			load_buffer( buf );
 #else
-				errors.log_error( NO_PROGRAMMING_TRACK, cmd );
+			errors.log_error( NO_PROGRAMMING_TRACK, cmd );
 #endif
-				break;
-			}
+			break;
+		}
 
+		//
+		//	EEPROM configurable constants
+		//
+		case 'Q': {
+			char	*n;
+			word	*w;
+			byte	*b;
+			
 			//
-			//	EEPROM configurable constants
+			//	Accessing EEPROM configurable constants
 			//
-			case 'Q': {
-				char	*n;
-				word	*w;
-				byte	*b;
-				
-				//
-				//	Accessing EEPROM configurable constants
-				//
-				//	[Q] -> [Q N]			Return number of tunable constants
-				//	[Q C] ->[Q C V NAME]		Access a specific constant C (range 0..N-1)
-				//	[Q C V V] -> [Q C V NAME]	Set a specific constant C to value V,
-				//					second V is to prevent accidental
-				//					update.
-				//	[Q -1 -1] -> [Q -1 -1]		Reset all constants to default.
-				//
-				switch( args ) {
-					case 0: {
+			//	[Q] -> [Q N]			Return number of tunable constants
+			//	[Q C] ->[Q C V NAME]		Access a specific constant C (range 0..N-1)
+			//	[Q C V V] -> [Q C V NAME]	Set a specific constant C to value V,
+			//					second V is to prevent accidental
+			//					update.
+			//	[Q -1 -1] -> [Q -1 -1]		Reset all constants to default.
+			//
+			switch( args ) {
+				case 0: {
+					console.print( PROT_IN_CHAR );
+					console.print( 'Q' );
+					console.print( CONSTANTS );
+					console.print( PROT_OUT_CHAR );
+					console.println();
+					break;
+				}
+				case 1: {
+					if( find_constant( arg[ 0 ], &n, &b, &w ) != ERROR ) {
 						console.print( PROT_IN_CHAR );
 						console.print( 'Q' );
-						console.print( CONSTANTS );
+						console.print( arg[ 0 ]);
+						console.print( SPACE );
+						if( b ) {
+							console.print( (word)(*b ));
+						}
+						else {
+							console.print( *w );
+						}
+						console.print( SPACE );
+						console.print_PROGMEM( n );
 						console.print( PROT_OUT_CHAR );
 						console.println();
-						break;
 					}
-					case 1: {
-						if( find_constant( arg[ 0 ], &n, &b, &w ) != ERROR ) {
-							console.print( PROT_IN_CHAR );
-							console.print( 'Q' );
-							console.print( arg[ 0 ]);
-							console.print( SPACE );
-							if( b ) {
-								console.print( (word)(*b ));
-							}
-							else {
-								console.print( *w );
-							}
-							console.print( SPACE );
-							console.print_PROGMEM( n );
-							console.print( PROT_OUT_CHAR );
-							console.println();
-						}
-						break;
+					break;
+				}
+				case 2: {
+					if(( arg[ 0 ] == -1 )&&( arg[ 1 ] == -1 )) {
+						reset_constants();
+						console.print( PROT_IN_CHAR );
+						console.print( 'Q' );
+						console.print( -1 );
+						console.print( SPACE );
+						console.print( -1 );
+						console.print( PROT_OUT_CHAR );
+						console.println();
 					}
-					case 2: {
-						if(( arg[ 0 ] == -1 )&&( arg[ 1 ] == -1 )) {
-							reset_constants();
-							console.print( PROT_IN_CHAR );
-							console.print( 'Q' );
-							console.print( -1 );
-							console.print( SPACE );
-							console.print( -1 );
-							console.print( PROT_OUT_CHAR );
-							console.println();
+					break;
+				}
+				case 3: {
+					if(( arg[ 1 ] == arg[ 2 ])&&( find_constant( arg[ 0 ], &n, &b, &w ) != ERROR )) {
+						if( b ) {
+							*b = (byte)arg[ 1 ];
 						}
-						break;
-					}
-					case 3: {
-						if(( arg[ 1 ] == arg[ 2 ])&&( find_constant( arg[ 0 ], &n, &b, &w ) != ERROR )) {
-							if( b ) {
-								*b = (byte)arg[ 1 ];
-							}
-							else {
-								*w = arg[ 1 ];
-							}
-							record_constants();
-							console.print( PROT_IN_CHAR );
-							console.print( 'Q' );
-							console.print( arg[ 0 ]);
-							console.print( SPACE );
-							if( b ) {
-								console.print( (word)( *b ));
-							}
-							else {
-								console.print( *w );
-							}
-							console.print( SPACE );
-							console.print_PROGMEM( n );
-							console.print( PROT_OUT_CHAR );
-							console.println();
+						else {
+							*w = arg[ 1 ];
 						}
-						break;
-					}
-					default: {
-						errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
-						break;
+						record_constants();
+						console.print( PROT_IN_CHAR );
+						console.print( 'Q' );
+						console.print( arg[ 0 ]);
+						console.print( SPACE );
+						if( b ) {
+							console.print( (word)( *b ));
+						}
+						else {
+							console.print( *w );
+						}
+						console.print( SPACE );
+						console.print_PROGMEM( n );
+						console.print( PROT_OUT_CHAR );
+						console.println();
 					}
+					break;
+				}
+				default: {
+					errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
+					break;
 				}
+			}
+			break;
+		}
+		//
+		//	Signal jitter histogram
+		//
+		case 'J': {
+			word	bucket[ JITTER_BUCKETS ];
+			byte	late;
+
+			//
+			//	Signal jitter histogram
+			//
+			//	[J] -> [J WIDTH MAX B0 B1 B2 B3 B4 B5 B6 B7]
+			//
+			if( args != 0 ) {
+				errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
 				break;
 			}
-			default: {
-				//
-				//	Here we capture any unrecognised command letters.
-				//
-				errors.log_error( UNRECOGNISED_COMMAND, cmd );
+			//
+			//	Take a copy of (and reset) the figures
+			//	in one step.
+			//
+			{
+				Critical code;
+
+				for( byte i = 0; i < JITTER_BUCKETS; i++ ) {
+					bucket[ i ] = jitter_bucket[ i ];
+					jitter_bucket[ i ] = 0;
+				}
+				late = jitter_max;
+				jitter_max = 0;
+			}
+			console.print( PROT_IN_CHAR );
+			console.print( 'J' );
+			console.print( (word)(( 1 << JITTER_SHIFT ) * TIMER_CLOCK_PRESCALER ));
+			console.print( SPACE );
+			console.print( (word)( late * TIMER_CLOCK_PRESCALER ));
+			for( byte i = 0; i < JITTER_BUCKETS; i++ ) {
+				console.print( SPACE );
+				console.print( bucket[ i ]);
+			}
+			console.print( PROT_OUT_CHAR );
+			console.println();
+			break;
+		}
+		case 'I': {
+			word	stats[ 5 ];
+
+			//
+			//	Packet statistics
+			//
+			//	[I] -> [I PACKETS IDLES WAITIDLES WAITFILLERS SUPPRESSED]
+			//
+			if( args != 0 ) {
+				errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
+				break;
+			}
+			//
+			//	Take a copy of (and reset) the figures
+			//	in one step.
+			//
+			{
+				Critical code;
+
+				stats[ 0 ] = packets_sent;
+				stats[ 1 ] = idles_sent;
+				stats[ 2 ] = waiting_idles;
+				stats[ 3 ] = waiting_fillers;
+				stats[ 4 ] = suppressed_commands;
+				packets_sent = 0;
+				idles_sent = 0;
+				waiting_idles = 0;
+				waiting_fillers = 0;
+				suppressed_commands = 0;
+			}
+			console.print( PROT_IN_CHAR );
+			console.print( 'I' );
+			console.print( stats[ 0 ]);
+			for( byte i = 1; i < 5; i++ ) {
+				console.print( SPACE );
+				console.print( stats[ i ]);
+			}
+			console.print( PROT_OUT_CHAR );
+			console.println();
+			break;
+		}
+		//
+		//	Binary command frames
+		//
+		case 'X': {
+			//
+			//	Enable/Disable binary command frames
+			//	------------------------------------
+			//
+			//	[X] -> [X MODE]
+			//	[X MODE] -> [X MODE]
+			//
+			//		MODE:	0=Text commands only, 1=Binary
+			//			command frames also accepted
+			//
+			if( args > 1 ) {
+				errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
+				break;
+			}
+			if( args == 1 ) {
+				if(( arg[ 0 ] != 0 )&&( arg[ 0 ] != 1 )) {
+					errors.log_error( INVALID_STATE, arg[ 0 ]);
+					break;
+				}
+				binary_commands = ( arg[ 0 ] == 1 );
+			}
+			console.print( PROT_IN_CHAR );
+			console.print( 'X' );
+			console.print( (word)binary_commands );
+			console.print( PROT_OUT_CHAR );
+			console.println();
+			break;
+		}
+		//
+		//	Line speed
+		//
+		case 'B': {
+			byte	i;
+
+			//
+			//	Change the line speed
+			//	---------------------
+			//
+			//	[B] -> [B RATE]
+			//	[B RATE] -> [B RATE]
+			//
+			//		RATE:	Line speed in hundreds of baud
+			//
+			if( args > 1 ) {
+				errors.log_error( INVALID_ARGUMENT_COUNT, cmd );
+				break;
+			}
+			if( args == 0 ) {
+				report_line_speed();
+				break;
+			}
+			if( line_speed_change != LINE_SPEED_STEADY ) {
+				errors.log_error( TRANSMISSION_BUSY, cmd );
+				break;
+			}
+			for( i = 0; i < B_EOT; i++ ) if( (int)pgm_read_word( &( line_speed_rate[ i ])) == arg[ 0 ]) break;
+			if( i == B_EOT ) {
+				errors.log_error( INVALID_LINE_SPEED, arg[ 0 ]);
 				break;
 			}
+			//
+			//	Reply at the current speed, then change.
+			//
+			line_speed_previous = line_speed;
+			line_speed = (USART_line_speed)i;
+			line_speed_change = LINE_SPEED_PENDING;
+			report_line_speed();
+			break;
+		}
+		default: {
+			//
+			//	Here we capture any unrecognised command letters.
+			//
+			errors.log_error( UNRECOGNISED_COMMAND, cmd );
+			break;
 		}
 	}
 	//
@@ -6580,82 +9832,293 @@ static void scan_line( char *buf ) {
 }
 
 //
-//	The command buffer:
-//
-static char cmd_buf[ MAXIMUM_DCC_CMD+1 ];	// "+1" to allow for EOS with checking code.
-static byte cmd_used = 0;
-static bool in_cmd_packet = false;
+//	The command parser:
+//
+//	Text commands are parsed a character at a time as they arrive,
+//	gathering the command letter and numeric arguments directly,
+//	so the command is ready to execute as soon as PROT_OUT_CHAR
+//	arrives.  The syntax accepted is a letter or digit followed
+//	by numbers (optionally negative) separated by spaces; anything
+//	else after the command letter ends the arguments and is
+//	ignored up to PROT_OUT_CHAR.
+//
+//	parse_state	Where the parser is in a command:
+//
+#define PARSE_IDLE	0	// Outside a command.
+#define PARSE_COMMAND	1	// Expecting the command letter.
+#define PARSE_GAP	2	// Between arguments.
+#define PARSE_SIGN	3	// After a minus sign.
+#define PARSE_NUMBER	4	// Within the digits of an argument.
+#define PARSE_SKIP	5	// Ignoring the rest of the command.
+#define PARSE_ERROR	6	// Ignoring an invalid command.
+//
+//	parse_cmd	The command letter.
+//	parse_arg	The arguments gathered so far, parse_args of
+//	parse_args	them, with the argument being gathered in
+//	parse_value	parse_value (negated if parse_negative).
+//	parse_negative
+//
+static byte	parse_state = PARSE_IDLE;
+static char	parse_cmd;
+static int	parse_arg[ MAX_DCC_ARGS ];
+static byte	parse_args;
+static int	parse_value;
+static bool	parse_negative;
+
+//
+//	Complete the argument being gathered, returning false if
+//	there are too many.
+//
+static bool parse_complete( void ) {
+	if( parse_args >= MAX_DCC_ARGS ) {
+		errors.log_error( DCC_COMMAND_OVERFLOW, MAX_DCC_ARGS );
+		parse_state = PARSE_ERROR;
+		return( false );
+	}
+	parse_arg[ parse_args++ ] = parse_negative? -parse_value: parse_value;
+	return( true );
+}
 
 //
-//	The character input routine.
+//	Pass the next character of text input to the parser, returning
+//	true when a command is ready to execute.
 //
-static void process_input( byte count ) {
-	while( count-- ) {
-		char	c;
-
-		switch(( c = console.read())) {
-			case PROT_IN_CHAR: {
-				//
-				//	Found the start of a command, regardless of what we thought
-				//	we were doing we clear out the buffer and start collecting
-				//	the content of the packet.
-				//
-				cmd_used = 0;
-				in_cmd_packet =  true;
-				break;
+static bool parse_input( char c ) {
+	//
+	//	The start and end characters are handled the same
+	//	whatever the parser is doing.
+	//
+	if( c == PROT_IN_CHAR ) {
+		//
+		//	Found the start of a command, regardless of what we
+		//	thought we were doing we start a new command.
+		//
+		parse_state = PARSE_COMMAND;
+		return( false );
+	}
+	if( c == PROT_OUT_CHAR ) {
+		byte	s;
+
+		s = parse_state;
+		parse_state = PARSE_IDLE;
+		switch( s ) {
+			case PARSE_NUMBER: {
+				return( parse_complete());
 			}
-			case PROT_OUT_CHAR: {
-				//
-				//	If we got here and we were in a command packet then we have
-				//	something to work with, maybe.
-				//
-				if( in_cmd_packet ) {
-					//
-					//	Process line and reset buffer.
-					//
-					cmd_buf[ cmd_used ] = EOS;
-					scan_line( cmd_buf );
-					//
-					//	Now reset the buffer space.
-					//
-					cmd_used = 0;
-					in_cmd_packet =  false;
-				}
-				break;
+			case PARSE_GAP:
+			case PARSE_SIGN:
+			case PARSE_SKIP: {
+				return( true );
 			}
 			default: {
 				//
-				//	If we are inside a command packet then we save character, if there is space.
+				//	No command (or an invalid one).
 				//
-				if( in_cmd_packet ) {
-					if(( c < SPACE )||( c >= DELETE )) {
-						//
-						//	Invalid character for a command - abandon the current command.
-						//
-						cmd_used = 0;
-						in_cmd_packet =  false;
-					}
-					else {
-						//
-						//	"Valid" character (at least it is a normal character), so
-						//	save it if possible.
-						//
-						if( cmd_used < MAXIMUM_DCC_CMD-1 ) {
-							cmd_buf[ cmd_used++ ] = c;
-						}
-						else {
-							//
-							//	we have lost some part of the command.  Report error and
-							//	drop the malformed command.
-							//
-							errors.log_error( DCC_COMMAND_OVERFLOW, MAXIMUM_DCC_CMD );
-							cmd_used = 0;
-							in_cmd_packet =  false;
-						}
-					}
-				}
+				return( false );
+			}
+		}
+	}
+	if(( c < SPACE )||( c >= DELETE )) {
+		//
+		//	Invalid character for a command - abandon the current
+		//	command.
+		//
+		parse_state = PARSE_IDLE;
+		return( false );
+	}
+	if( parse_state == PARSE_NUMBER ) {
+		if( isdigit( c )) {
+			parse_value = parse_value * 10 + ( c - '0' );
+			return( false );
+		}
+		//
+		//	The end of the number; this character is then
+		//	handled as if between arguments.
+		//
+		if( !parse_complete()) return( false );
+		parse_state = PARSE_GAP;
+	}
+	switch( parse_state ) {
+		case PARSE_COMMAND: {
+			if( isalnum( c )) {
+				parse_cmd = c;
+				parse_args = 0;
+				parse_state = PARSE_GAP;
+			}
+			else {
+				parse_state = PARSE_ERROR;
+			}
+			break;
+		}
+		case PARSE_GAP: {
+			if( c == SPACE ) break;
+			if( c == '-' ) {
+				parse_value = 0;
+				parse_negative = true;
+				parse_state = PARSE_SIGN;
+				break;
+			}
+			if( isdigit( c )) {
+				parse_value = c - '0';
+				parse_negative = false;
+				parse_state = PARSE_NUMBER;
 				break;
 			}
+			parse_state = PARSE_SKIP;
+			break;
+		}
+		case PARSE_SIGN: {
+			if( isdigit( c )) {
+				parse_value = c - '0';
+				parse_state = PARSE_NUMBER;
+			}
+			else {
+				parse_state = PARSE_SKIP;
+			}
+			break;
+		}
+		default: {
+			//
+			//	Outside a command, or ignoring the rest of one.
+			//
+			break;
+		}
+	}
+	return( false );
+}
+
+//
+//	The binary frame buffer:
+//
+//	A binary command frame is the PROT_BINARY_CHAR byte followed
+//	by the number of arguments (N), the command letter, the N
+//	arguments (each 16 bits, signed, least significant byte
+//	first) and a check byte which makes the exclusive or of every
+//	byte after PROT_BINARY_CHAR zero.
+//
+//	binary_expect is the number of bytes of the current frame
+//	still to arrive (0 outside a frame).
+//
+//	binary_skip is set after a frame with a bad argument count,
+//	when nothing can be known of where the frame ends, to discard
+//	everything up to the next PROT_BINARY_CHAR.
+//
+//	binary_last is the time the last byte arrived.  A frame (or a
+//	skip) not continued within BINARY_TIMEOUT milliseconds is
+//	abandoned, so a lost byte cannot leave the firmware waiting
+//	for the rest of a frame indefinitely.
+//
+#define BINARY_FRAME	( 3 + 2 * MAX_DCC_ARGS )
+#define BINARY_TIMEOUT	100
+static byte binary_frame[ BINARY_FRAME ];
+static byte binary_used = 0;
+static byte binary_expect = 0;
+static bool binary_skip = false;
+static unsigned long binary_last;
+
+//
+//	Add a byte to the binary frame, returning true when the frame
+//	is complete, with the command unpacked into parse_cmd,
+//	parse_arg and parse_args ready to execute.
+//
+static bool binary_input( byte b ) {
+	ASSERT( binary_expect > 0 );
+	ASSERT( binary_used < BINARY_FRAME );
+
+	binary_frame[ binary_used++ ] = b;
+	if( binary_used == 1 ) {
+		//
+		//	The argument count gives the rest of the frame length.
+		//
+		if( b > MAX_DCC_ARGS ) {
+			errors.log_error( INVALID_BINARY_FRAME, b );
+			binary_expect = 0;
+			binary_skip = true;
+			return( false );
+		}
+		binary_expect = 2 + 2 * b + 1;
+	}
+	if( --binary_expect ) return( false );
+	//
+	//	Frame complete, check and unpack it.
+	//
+	{
+		byte	check;
+
+		check = 0;
+		for( byte i = 0; i < binary_used; check ^= binary_frame[ i++ ]);
+		if( check ) {
+			errors.log_error( INVALID_BINARY_FRAME, binary_frame[ 1 ]);
+			return( false );
+		}
+		parse_cmd = (char)binary_frame[ 1 ];
+		parse_args = binary_frame[ 0 ];
+		for( byte i = 0; i < parse_args; i++ ) parse_arg[ i ] = (int)( binary_frame[ 2 + 2 * i ] | ( binary_frame[ 3 + 2 * i ] << 8 ));
+	}
+	return( true );
+}
+
+//
+//	The character input routine, taking everything waiting
+//	in the console input queue in one block read.
+//
+static void process_input( void ) {
+	byte	input[ CONSOLE_INPUT ],
+		count;
+
+	count = console.read( input, CONSOLE_INPUT );
+	//
+	//	Abandon a binary frame, or skip, which has stalled.
+	//
+	if(( binary_expect || binary_skip )&&(( now - binary_last ) >= BINARY_TIMEOUT )) {
+		if( binary_expect ) errors.log_error( INVALID_BINARY_FRAME, binary_used );
+		binary_expect = 0;
+		binary_skip = false;
+	}
+	binary_last = now;
+	for( byte i = 0; i < count; i++ ) {
+		char	c;
+
+		c = input[ i ];
+		//
+		//	Every byte of a binary frame is frame data.
+		//
+		if( binary_expect ) {
+			if( binary_input( c )) execute_command( parse_cmd, parse_arg, parse_args );
+			continue;
+		}
+		if( binary_commands &&( (byte)c == PROT_BINARY_CHAR )) {
+			//
+			//	The start of a binary frame, which abandons any
+			//	partial text command (or ends a skip).
+			//
+			binary_used = 0;
+			binary_expect = 1;
+			binary_skip = false;
+			parse_state = PARSE_IDLE;
+			continue;
+		}
+		//
+		//	Discarding the remains of a bad frame.
+		//
+		if( binary_skip ) continue;
+		if( parse_input( c )) {
+
+#if defined( DEBUG_CONFIRMATION )
+			//
+			//	When debugging the command confirmation code
+			//	we need to see both the command sent as well
+			//	as the reply.
+			//
+			console.print( parse_cmd );
+			for( byte i = 0; i < parse_args; i++ ) {
+				console.print( SPACE );
+				console.print( parse_arg[ i ]);
+			}
+			console.println();
+#endif
+
+			execute_command( parse_cmd, parse_arg, parse_args );
 		}
 	}
 }
@@ -6675,8 +10138,6 @@ static unsigned long dynamic_loading = 0;
 //	Finally, the main event loop:
 //
 void loop( void ) {
-	byte		ready;
-
 	//
 	//	Grab a copy of the time "now" as several routines
 	//	require a notion of how time has passed.
@@ -6693,7 +10154,7 @@ void loop( void ) {
 	//
 	//	Is there Serial data to be processed...
 	//
-	if(( ready = console.available())) process_input( ready );
+	if( console.available()) process_input();
 	
 	//
 	//	Every time we spin through the loop we give the
@@ -6702,6 +10163,14 @@ void loop( void ) {
 	//	synchronised correctly.
 	//
 	management_service_routine();
+	if( accessory_queue ) service_accessory_queue();
+	service_line_speed();
+#if FUNCTION_STORE_RECORDS > 0
+	service_function_store();
+#endif
+#ifdef ACCESSORY_STATE_STORE
+	service_accessory_store();
+#endif
 
 	//
 	//	Power related actions triggered only when data is ready
@@ -6731,6 +10200,13 @@ void loop( void ) {
 	display_lcd_updates();
 #endif
 
+#ifdef DEBUG_ISR_CYCLES
+	//
+	//	Output interrupt timing figures.
+	//
+	report_isr_cycles();
+#endif
+
 	//
 	//	Then we give the Error management system an
 	//	opportunity to queue some output data.
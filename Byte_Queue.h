@@ -23,11 +23,38 @@ class Byte_Queue_API {
 		//
 		//	Note this value MUST be at least as large
 		//	as the maximum number of decimal digits
-		//	it takes to display a maximal word value.
+		//	it takes to display a maximal word value,
+		//	plus one for a minus sign.
 		//
-		//	This is 65535, so five is the minimum value.
+		//	This is -65535, so six is the minimum value.
 		//
 		static const byte number_buffer = 6;
+
+		//
+		//	Return the hexadecimal digit for the bottom
+		//	four bits of b.
+		//
+		static char hex_digit( byte b ) {
+			b &= 0x0f;
+			return(( b < 10 )? ( '0' + b ): (( 'A' - 10 ) + b ));
+		}
+
+		//
+		//	Output the decimal value of w (with a minus
+		//	sign if negative is true) in one write.
+		//
+		bool print_number( word w, bool negative ) {
+			char	b[ number_buffer ];
+			byte	i;
+
+			i = number_buffer;
+			do {
+				b[ --i ] = '0' + ( w % 10 );
+				w /= 10;
+			} while( w );
+			if( negative ) b[ --i ] = '-';
+			return( write( (const byte *)( b + i ), number_buffer - i ) == (data_size)( number_buffer - i ));
+		}
 		
 	public:
 		//
@@ -56,6 +83,69 @@ class Byte_Queue_API {
 		//
 		virtual data_size available( void ) = 0;
 
+		//
+		//	Contiguous Span Access
+		//	======================
+		//
+		//	reserve() sets span to where the next bytes
+		//	written should be placed and returns how many
+		//	can be placed there one after another (zero if
+		//	the queue is full).  commit() then adds the
+		//	first len of them to the queue.
+		//
+		//	peek() sets span to the next bytes queued and
+		//	returns how many can be read from there one
+		//	after another (zero if the queue is empty).
+		//	consume() then removes the first len of them.
+		//
+		//	As the queue wraps round a span may be shorter
+		//	than the space or data available, so a second
+		//	span may follow the first.
+		//
+		virtual data_size reserve( byte **span ) = 0;
+		virtual void commit( data_size len ) = 0;
+		virtual data_size peek( const byte **span ) = 0;
+		virtual void consume( data_size len ) = 0;
+
+		//
+		//	Block Data Transfer
+		//	===================
+		//
+
+		//
+		//	Insert up to len bytes from data into the queue,
+		//	returning the number actually inserted.
+		//
+		data_size write( const byte *data, data_size len ) {
+			data_size	done, n;
+			byte		*span;
+
+			for( done = 0; done < len; done += n ) {
+				if(( n = reserve( &span )) == 0 ) break;
+				if( n > (data_size)( len - done )) n = len - done;
+				memcpy( span, data + done, n );
+				commit( n );
+			}
+			return( done );
+		}
+
+		//
+		//	Remove up to max bytes from the queue into data,
+		//	returning the number actually removed.
+		//
+		data_size read( byte *data, data_size max ) {
+			data_size	done, n;
+			const byte	*span;
+
+			for( done = 0; done < max; done += n ) {
+				if(( n = peek( &span )) == 0 ) break;
+				if( n > (data_size)( max - done )) n = max - done;
+				memcpy( data + done, span, n );
+				consume( n );
+			}
+			return( done );
+		}
+
 		//
 		//	Data Output Support
 		//	===================
@@ -70,6 +160,9 @@ class Byte_Queue_API {
 		//	this, but fits with the console device
 		//	being based on this API, for the moment.
 		//
+		//	Each routine queues its text with a single
+		//	block write, rather than a byte at a time.
+		//
 		//	I will need to implement some form of blocking
 		//	output here as printing too much at once
 		//	simply drops anything which does not fit the
@@ -80,7 +173,7 @@ class Byte_Queue_API {
 		}
 		
 		bool println( void ) {
-			return( print( '\r' ) && print( '\n' ));
+			return( write( (const byte *)"\r\n", 2 ) == 2 );
 		}
 
 		bool print( byte b ) {
@@ -88,18 +181,15 @@ class Byte_Queue_API {
 		}
 
 		bool print_nybble( byte b ) {
-			b &= 0x0f;
-			if( b < 10 ) {
-				return( print((char)( '0' + b )));
-			}
-			else {
-				return( print((char)(( 'A' -10 ) + b )));
-			}
-			return( false );
+			return( print( hex_digit( b )));
 		}
 		
 		bool print_hex( byte b ) {
-			return( print_nybble( b >> 4 ) && print_nybble( b ));
+			char	h[ 2 ];
+
+			h[ 0 ] = hex_digit( b >> 4 );
+			h[ 1 ] = hex_digit( b );
+			return( write( (const byte *)h, 2 ) == 2 );
 		}
 		
 		bool print( bool b ) {
@@ -107,37 +197,40 @@ class Byte_Queue_API {
 		}
 		
 		bool print( word w ) {
-			if( w ) {
-				char	b[ number_buffer ];
-				byte	i;
-
-				for( i = 0; w; i++ ) {
-					b[ i ] = '0' + ( w % 10 );
-					w /= 10;
-				}
-				while( i ) if( !print( b[ --i ])) return( false );
-				return( true );
-			}
-			return( print( '0' ));
+			return( print_number( w, false ));
 		}
 		
 		bool print_hex( word w ) {
-			return( print_hex((byte)( w >> 8 )) && print_hex((byte)( w & 0xff )));
+			char	h[ 4 ];
+
+			h[ 0 ] = hex_digit( w >> 12 );
+			h[ 1 ] = hex_digit( w >> 8 );
+			h[ 2 ] = hex_digit( w >> 4 );
+			h[ 3 ] = hex_digit( w );
+			return( write( (const byte *)h, 4 ) == 4 );
 		}
 		
 		bool print( int i ) {
-			if( i < 0 ) {
-				if( !print( '-' )) return( false );
-				i = -i;
-			}
-			return( print( (word)i ));
+			if( i < 0 ) return( print_number( (word)0 - (word)i, true ));
+			return( print_number( (word)i, false ));
 		}
 		bool println( int i ) {
 			return( print( i ) && println());
 		}
 		
+		//
+		//	Strings are copied straight into the queue
+		//	spans, so are not scanned twice.
+		//
 		bool print( const char *s ) {
-			while( *s != EOS ) if( !write( *s++ )) return( false );
+			data_size	n, i;
+			byte		*span;
+
+			while( *s != EOS ) {
+				if(( n = reserve( &span )) == 0 ) return( false );
+				for( i = 0; ( i < n )&&( *s != EOS ); i++ ) span[ i ] = *s++;
+				commit( i );
+			}
 			return( true );
 		}
 		
@@ -150,9 +243,19 @@ class Byte_Queue_API {
 		//	directly out of program memory.
 		//
 		void print_PROGMEM( const char *pm ) {
-			char	c;
+			data_size	n, i;
+			byte		*span;
+			char		c;
 
-			while(( c = progmem_read_byte_at( pm++ )) != EOS ) if( !print( c )) return;
+			c = progmem_read_byte_at( pm++ );
+			while( c != EOS ) {
+				if(( n = reserve( &span )) == 0 ) return;
+				for( i = 0; ( i < n )&&( c != EOS ); i++ ) {
+					span[ i ] = c;
+					c = progmem_read_byte_at( pm++ );
+				}
+				commit( i );
+			}
 		}
 };
 
@@ -249,6 +352,190 @@ class Byte_Queue : public Byte_Queue_API {
 			return( _content );
 		}
 
+		//
+		//	Contiguous Span Access
+		//	======================
+		//
+		virtual data_size reserve( byte **span ) {
+			Critical	code;
+
+			if( _content >= queue_size ) return( 0 );
+			*span = _queue + _in;
+			return(( _in < _out )? ( _out - _in ): ( queue_size - _in ));
+		}
+
+		virtual void commit( data_size len ) {
+			Critical	code;
+
+			if(( _in += len ) >= queue_size ) _in -= queue_size;
+			_content += len;
+		}
+
+		virtual data_size peek( const byte **span ) {
+			Critical	code;
+
+			if( _content == 0 ) return( 0 );
+			*span = _queue + _out;
+			return(( _out < _in )? ( _in - _out ): ( queue_size - _out ));
+		}
+
+		virtual void consume( data_size len ) {
+			Critical	code;
+
+			if(( _out += len ) >= queue_size ) _out -= queue_size;
+			_content -= len;
+		}
+
+		//
+		//	Block transfers come from the API.
+		//
+		using Byte_Queue_API::write;
+		using Byte_Queue_API::read;
+
+};
+
+//
+//	Define a template class for a queue with exactly one writer
+//	and one reader, for example an interrupt routine filling the
+//	queue and the main loop emptying it (or the other way round).
+//
+//	With only one side updating each index no critical section is
+//	required, so interrupts are never held off.  The writer only
+//	stores _in and the reader only stores _out, each a single
+//	data_size (so a single byte on the AVR) store.  Both count
+//	freely, the number of bytes queued being their difference,
+//	which requires the size to be a power of two no larger than
+//	half of the range of data_size.
+//
+//	The queue data is volatile to ensure each byte is stored
+//	before the index which makes it visible to the other side.
+//
+template< data_size QUEUE_SIZE >
+class SPSC_Byte_Queue : public Byte_Queue_API {
+	private:
+		//
+		//	Declare a constant for the size of the queue area
+		//	and the mask applied to the indexes.
+		//
+		static const data_size	queue_size = QUEUE_SIZE;
+		static const data_size	queue_mask = QUEUE_SIZE - 1;
+
+		static_assert(( QUEUE_SIZE & ( QUEUE_SIZE - 1 )) == 0, "SPSC_Byte_Queue size must be a power of two" );
+		static_assert( QUEUE_SIZE <= (( DATA_SIZE_MAX >> 1 ) + 1 ), "SPSC_Byte_Queue size too large for data_size" );
+
+		//
+		//	Create the memory that is used for the queue area
+		//
+		volatile byte		_queue[ queue_size ];
+
+		//
+		//	Define where the data is added (only changed by
+		//	the writer) and removed (only changed by the
+		//	reader).
+		//
+		volatile data_size	_in,
+					_out;
+
+	public:
+		//
+		//	Constructor only.
+		//
+		SPSC_Byte_Queue( void ) {
+			_in = 0;
+			_out = 0;
+		}
+		//
+		//	The Byte Queue API
+		//	==================
+		//
+
+		virtual bool write( byte data ) {
+			data_size	in;
+
+			//
+			//	Is there space for the additional byte?
+			//
+			in = _in;
+			if((data_size)( in - _out ) >= queue_size ) return( false );
+			//
+			//	Store the byte, then make it visible.
+			//
+			_queue[ in & queue_mask ] = data;
+			_in = in + 1;
+			return( true );
+		}
+
+		virtual byte read( void ) {
+			data_size	out;
+			byte		data;
+
+			out = _out;
+			if( out == _in ) return( 0 );
+			//
+			//	Take the byte, then release its space.
+			//
+			data = _queue[ out & queue_mask ];
+			_out = out + 1;
+			return( data );
+		}
+
+		virtual data_size space( void ) {
+			return( queue_size - (data_size)( _in - _out ));
+		}
+
+		virtual data_size available( void ) {
+			return((data_size)( _in - _out ));
+		}
+
+		//
+		//	Contiguous Span Access
+		//	======================
+		//
+		//	The spans point straight into the queue area, so
+		//	the barriers keep the caller's accesses to a span
+		//	between the index read which found it and the
+		//	index update which hands it to the other side.
+		//
+		virtual data_size reserve( byte **span ) {
+			data_size	in, used, i, n;
+
+			in = _in;
+			if(( used = (data_size)( in - _out )) >= queue_size ) return( 0 );
+			i = in & queue_mask;
+			if(( n = queue_size - i ) > (data_size)( queue_size - used )) n = queue_size - used;
+			*span = (byte *)( _queue + i );
+			MEMORY_BARRIER();
+			return( n );
+		}
+
+		virtual void commit( data_size len ) {
+			MEMORY_BARRIER();
+			_in = _in + len;
+		}
+
+		virtual data_size peek( const byte **span ) {
+			data_size	out, used, i, n;
+
+			out = _out;
+			if(( used = (data_size)( _in - out )) == 0 ) return( 0 );
+			i = out & queue_mask;
+			if(( n = queue_size - i ) > used ) n = used;
+			*span = (const byte *)( _queue + i );
+			MEMORY_BARRIER();
+			return( n );
+		}
+
+		virtual void consume( data_size len ) {
+			MEMORY_BARRIER();
+			_out = _out + len;
+		}
+
+		//
+		//	Block transfers come from the API.
+		//
+		using Byte_Queue_API::write;
+		using Byte_Queue_API::read;
+
 };
 				
 #endif
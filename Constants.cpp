@@ -64,6 +64,7 @@ static const char string_dlu[] PROGMEM = "dynamic_load_updates";
 static const char string_tcr[] PROGMEM = "transient_command_repeats";
 static const char string_smrr[] PROGMEM = "service_mode_reset_repeats";
 static const char string_smcr[] PROGMEM = "service_mode_command_repeats";
+static const char string_fri[] PROGMEM = "function_refresh_interval";
 
 //
 //	This is the static table of constants support information.
@@ -86,7 +87,9 @@ static const ConstantValue constant_value[ CONSTANTS ] PROGMEM = {
 	{ string_dlu,	DEFAULT_DYNAMIC_LOAD_UPDATES,		&DYNAMIC_LOAD_UPDATES_VAR,		NULL					},
 	{ string_tcr,	DEFAULT_TRANSIENT_COMMAND_REPEATS,	NULL,					&TRANSIENT_COMMAND_REPEATS_VAR		},
 	{ string_smrr,	DEFAULT_SERVICE_MODE_RESET_REPEATS,	NULL,					&SERVICE_MODE_RESET_REPEATS_VAR		},
-	{ string_smcr,	DEFAULT_SERVICE_MODE_COMMAND_REPEATS,	NULL,					&SERVICE_MODE_COMMAND_REPEATS_VAR	}
+	{ string_smcr,	DEFAULT_SERVICE_MODE_COMMAND_REPEATS,	NULL,					&SERVICE_MODE_COMMAND_REPEATS_VAR	},
+// 15
+	{ string_fri,	DEFAULT_FUNCTION_REFRESH_INTERVAL,	NULL,					&FUNCTION_REFRESH_INTERVAL_VAR		}
 };
 
 //
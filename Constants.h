@@ -40,7 +40,7 @@
 //
 //	Define the number of "int" constants we have to manage:
 //
-#define CONSTANTS	15
+#define CONSTANTS	16
 
 //
 //	The following structure is the variable space definition
@@ -61,7 +61,8 @@ typedef struct {
 		compound_index,
 		transient_command_repeats,
 		service_mode_reset_repeats,
-		service_mode_command_repeats;
+		service_mode_command_repeats,
+		function_refresh_interval;
 } ConstantValues;
 
 static const int ConstantArea = sizeof( ConstantValues );
@@ -99,7 +100,7 @@ extern Constants constant;
 //	The default value is "built" using the MAGIC() macro
 //	defined in "Magic.h".
 //
-#define DEFAULT_IDENTIFICATION_MAGIC	MAGIC(2023,8,18)
+#define DEFAULT_IDENTIFICATION_MAGIC	MAGIC(2026,10,15)
 #define IDENTIFICATION_MAGIC_VAR	constant.var.value.identification_magic
 #define IDENTIFICATION_MAGIC		IDENTIFICATION_MAGIC_VAR
 
@@ -225,6 +226,18 @@ extern Constants constant;
 #define SERVICE_MODE_COMMAND_REPEATS_VAR	constant.var.value.service_mode_command_repeats
 #define SERVICE_MODE_COMMAND_REPEATS		SERVICE_MODE_COMMAND_REPEATS_VAR
 
+//
+//	The number of speed and direction refreshes sent between
+//	each refresh of a function group.  The function states of the
+//	decoders are cycled through in the background so that a decoder
+//	which has lost power recovers them.
+//
+//	A zero value turns off the function refresh.
+//
+#define DEFAULT_FUNCTION_REFRESH_INTERVAL	4
+#define FUNCTION_REFRESH_INTERVAL_VAR		constant.var.value.function_refresh_interval
+#define FUNCTION_REFRESH_INTERVAL		FUNCTION_REFRESH_INTERVAL_VAR
+
 //
 //	Dynamic Load Updates specifies the frequency of
 //	asynchronous load updates the Arduino Generator
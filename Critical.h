@@ -60,6 +60,15 @@ class Critical {
 		}
 };
 
+//
+//	MEMORY_BARRIER() stops the compiler moving memory
+//	accesses across it, so data handed between the main
+//	line code and an interrupt routine (without a Critical
+//	section) is in place before the index publishing it.
+//	The AVR itself does not reorder memory accesses.
+//
+#define MEMORY_BARRIER()	__asm__ __volatile__ ( "" ::: "memory" )
+
 #else
 
 #error "Define Class Critical for your architecture."
@@ -107,6 +107,11 @@ public:
 #define NO_PROGRAMMING_TRACK		24
 #define POWER_OVERLOAD			25
 #define POWER_SPIKE			26
+#define ISR_OVER_BUDGET			27
+#define NO_DISTRICT_STREAMS		28
+#define FUNCTION_STORE_FULL		29
+#define INVALID_BINARY_FRAME		30
+#define INVALID_LINE_SPEED		31
 //
 //	Resource errors.
 //
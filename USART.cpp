@@ -136,6 +136,7 @@ bool USART_Device::baud( USART_line_speed speed ) {
 		//
 		if(( ticks >>= 1 ) > 0x0FFF ) ticks = 0x0FFF;
 		ticks -= 1;
+		_dev->clear_baud_x2();
 		_dev->set_baud_h( W_TO_H( ticks ));
 		_dev->set_baud_l( W_TO_L( ticks ));
 	}
@@ -162,13 +163,28 @@ void USART_Device::dettach_io( void ) {
 	*_vec = NULL;
 }
 void USART_Device::write( byte value ) {
+	_dev->clear_tx_complete();
 	_dev->data_write( value );
 }
 byte USART_Device::read( void ) {
 	return( _dev->data_read());
 }
+bool USART_Device::sent( void ) {
+	return( _dev->tx_complete());
+}
 
 
+//
+//	Define the interrupt routine for a USART vector,
+//	passing the interrupt on to the attached IO object
+//	(if any), with timing calls if requested.
+//
+#ifdef USART_ISR_TIMING
+#define USART_ISR(v,io,call,isr)	ISR( v ) { word s = usart_isr_enter(); if( io ) io->call(); usart_isr_leave( isr, s ); }
+#else
+#define USART_ISR(v,io,call,isr)	ISR( v ) { if( io ) io->call(); }
+#endif
+
 //////////////////////////////////////////////////
 //						//
 //	Arduino Uno and Nano			//
@@ -191,8 +207,8 @@ static const byte usart_devices = 1;
 
 static USART_IO *usart0_vector;
 
-ISR( USART_RX_vect ) { if( usart0_vector ) usart0_vector->input_ready(); }
-ISR( USART_UDRE_vect ) { if( usart0_vector ) usart0_vector->output_ready(); }
+USART_ISR( USART_RX_vect, usart0_vector, input_ready, USART_ISR_RX )
+USART_ISR( USART_UDRE_vect, usart0_vector, output_ready, USART_ISR_TX )
 
 //
 //	Declare the only USART the Uno/Nano has.
@@ -236,14 +252,14 @@ static USART_IO *usart1_vector;
 static USART_IO *usart2_vector;
 static USART_IO *usart3_vector;
 
-ISR( USART0_RX_vect ) { if( usart0_vector ) usart0_vector->input_ready(); }
-ISR( USART0_UDRE_vect ) { if( usart0_vector ) usart0_vector->output_ready(); }
-ISR( USART1_RX_vect ) { if( usart1_vector ) usart1_vector->input_ready(); }
-ISR( USART1_UDRE_vect ) { if( usart1_vector ) usart1_vector->output_ready(); }
-ISR( USART2_RX_vect ) { if( usart2_vector ) usart2_vector->input_ready(); }
-ISR( USART2_UDRE_vect ) { if( usart2_vector ) usart2_vector->output_ready(); }
-ISR( USART3_RX_vect ) { if( usart3_vector ) usart3_vector->input_ready(); }
-ISR( USART3_UDRE_vect ) { if( usart3_vector ) usart3_vector->output_ready(); }
+USART_ISR( USART0_RX_vect, usart0_vector, input_ready, USART_ISR_RX )
+USART_ISR( USART0_UDRE_vect, usart0_vector, output_ready, USART_ISR_TX )
+USART_ISR( USART1_RX_vect, usart1_vector, input_ready, USART_ISR_RX )
+USART_ISR( USART1_UDRE_vect, usart1_vector, output_ready, USART_ISR_TX )
+USART_ISR( USART2_RX_vect, usart2_vector, input_ready, USART_ISR_RX )
+USART_ISR( USART2_UDRE_vect, usart2_vector, output_ready, USART_ISR_TX )
+USART_ISR( USART3_RX_vect, usart3_vector, input_ready, USART_ISR_RX )
+USART_ISR( USART3_UDRE_vect, usart3_vector, output_ready, USART_ISR_TX )
 
 //
 //	Declare the Mega2560 USARTs.
@@ -258,6 +274,46 @@ static USART_Device usart3( (USART_Registers *)0x0130, &usart3_vector );
 //
 static USART_Device *usart[ usart_devices ] = { &usart0, &usart1, &usart2, &usart3 };
 
+
+//////////////////////////////////////////////////
+//						//
+//	Arduino Leonardo and Micro		//
+//	==========================		//
+//						//
+//////////////////////////////////////////////////
+#elif defined( ARDUINO_AVR_LEONARDO ) || defined( ARDUINO_AVR_MICRO )
+
+//
+//	Declare how many USARTs these devices have
+//
+static const byte usart_devices = 1;
+
+//
+//	Interrupt Vectors taken over by this module:
+//
+//		USART1_RX_vect(_num)		Serial hardware receive data ready
+//		USART1_UDRE_vect(_num)		Serial hardware send buffer empty
+//
+//	The ATmega32U4 has no USART0 (the USB port takes its
+//	place), so its only USART (USART1, on pins 0 and 1) is
+//	presented as device 0.
+//
+
+static USART_IO *usart0_vector;
+
+USART_ISR( USART1_RX_vect, usart0_vector, input_ready, USART_ISR_RX )
+USART_ISR( USART1_UDRE_vect, usart0_vector, output_ready, USART_ISR_TX )
+
+//
+//	Declare the only USART the Leonardo/Micro has.
+//
+static USART_Device usart0( (USART_Registers *)0x00C8, &usart0_vector );
+
+//
+//	Define the array of pointers to drivers.
+//
+static USART_Device *usart[ usart_devices ] = { &usart0 };
+
 #else
 #error "Specific AVR Board not recognised (definitions required)"
 #endif
@@ -277,9 +333,14 @@ static USART_Device *usart[ usart_devices ] = { &usart0, &usart1, &usart2, &usar
 //
 //	Calculate the speed table we work against.
 //
+//	At 16 MHz the three fastest speeds are exact (with X2 set
+//	the UBRR values are 7, 3 and 1), unlike 57600 and 115200
+//	which are 2% out.
+//
 const USART_Device::speed_setting USART_Device::_configuration[] PROGMEM = {
 	{	B300,		BAUD_TICKS( 300 )	},
 	{	B600,		BAUD_TICKS( 600 )	},
+	{	B1200,		BAUD_TICKS( 1200 )	},
 	{	B2400,		BAUD_TICKS( 2400 )	},
 	{	B4800,		BAUD_TICKS( 4800 )	},
 	{	B9600,		BAUD_TICKS( 9600 )	},
@@ -289,6 +350,9 @@ const USART_Device::speed_setting USART_Device::_configuration[] PROGMEM = {
 	{	B38400,		BAUD_TICKS( 38400 )	},
 	{	B57600,		BAUD_TICKS( 57600 )	},
 	{	B115200,	BAUD_TICKS( 115200 )	},
+	{	B250000,	BAUD_TICKS( 250000 )	},
+	{	B500000,	BAUD_TICKS( 500000 )	},
+	{	B1000000,	BAUD_TICKS( 1000000 )	},
 	{	B_EOT,		0			}
 };
 
@@ -358,6 +422,22 @@ bool USART_IO::initialise( byte inst, USART_line_speed speed, USART_char_size bi
 	return( true );
 }
 
+//
+//	Change the line speed.
+//
+bool USART_IO::baud( USART_line_speed speed ) {
+	Critical code;
+
+	return( _dev->baud( speed ));
+}
+
+//
+//	Output still queued or being sent?
+//
+bool USART_IO::sending( void ) {
+	return( _async || !_dev->sent());
+}
+
 //
 //	The Byte Queue API
 //	==================
@@ -408,26 +488,59 @@ byte USART_IO::read( void ) {
 //
 bool USART_IO::write( byte data ) {
 	//
-	//	Add to the output queue..
+	//	Add to the output queue then make sure
+	//	it is being sent.
 	//
 	if( _output->write( data )) {
-		//
-		//	then, if the async is false we kick off
-		//	the data register empty interrupts.
-		//
-		if( !_async ) {
-			//
-			//	This should immediately cause an
-			//	interrupt.
-			//
-			_async = true;
-			_dev->dre_irq( true );
-		}
+		start_output();
 		return( true );
 	}
 	return( false );
 }
 
+//
+//	Contiguous Span Access
+//	----------------------
+//
+//	Output spans are in the output queue and input
+//	spans in the input queue.
+//
+data_size USART_IO::reserve( byte **span ) {
+	return( _output->reserve( span ));
+}
+
+void USART_IO::commit( data_size len ) {
+	if( len ) {
+		_output->commit( len );
+		start_output();
+	}
+}
+
+data_size USART_IO::peek( const byte **span ) {
+	return( _input->peek( span ));
+}
+
+void USART_IO::consume( data_size len ) {
+	_input->consume( len );
+}
+
+//
+//	void start_output( void )
+//	-------------------------
+//
+//	If the async is false we kick off the data
+//	register empty interrupts.
+//
+void USART_IO::start_output( void ) {
+	if( !_async ) {
+		//
+		//	This should immediately cause an
+		//	interrupt.
+		//
+		_async = true;
+		_dev->dre_irq( true );
+	}
+}
 
 //
 //	Interrupts
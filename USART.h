@@ -25,6 +25,7 @@ typedef enum {
 	B300,	B600,	B1200,	B2400,
 	B4800,	B9600,	B14400,	B19200,
 	B28800,	B38400,	B57600,	B115200,
+	B250000, B500000, B1000000,
 	B_EOT
 } USART_line_speed;
 typedef enum {
@@ -43,6 +44,32 @@ typedef enum {
 	SBTwo	= 2
 } USART_stop_bits;
 
+//
+//	Interrupt Timing
+//	================
+//
+//	Defining USART_ISR_TIMING has every USART interrupt routine
+//	call usart_isr_enter() as it starts and usart_isr_leave() as
+//	it finishes.  These must be supplied by the application (the
+//	DCC Generator supplies them with DEBUG_ISR_CYCLES) and allow
+//	the time spent in the USART interrupts to be measured.
+//
+//	usart_isr_enter() returns a time stamp which is handed back
+//	to usart_isr_leave() along with which of the interrupt
+//	routines (USART_ISR_RX or USART_ISR_TX) is finishing.
+//
+//#define USART_ISR_TIMING
+
+#ifdef USART_ISR_TIMING
+
+#define USART_ISR_RX	0
+#define USART_ISR_TX	1
+
+extern word usart_isr_enter( void );
+extern void usart_isr_leave( byte isr, word stamp );
+
+#endif
+
 //////////////////////////////////////////////////////////
 //							//
 //	Basic AVR Architecture: Uno, Mega2560 etc	//
@@ -347,6 +374,14 @@ class USART_Registers {
 		inline void set_baud_h( byte v ) { _UBRRnH = v; }
 		inline void set_baud_l( byte v ) { _UBRRnL = v; }
 		inline void set_baud_x2( void ) { _UCSRnA |= bit( U2Xn ); }
+		inline void clear_baud_x2( void ) { _UCSRnA &= ~bit( U2Xn ); }
+		//
+		//	Transmit complete; cleared (by writing a one) as each
+		//	byte is sent, leaving the other writable bits as they
+		//	are and writing zero to the error flags.
+		//
+		inline bool tx_complete( void ) { return( _UCSRnA & bit( TXCn )); }
+		inline void clear_tx_complete( void ) { _UCSRnA = ( _UCSRnA & ( bit( U2Xn ) | bit( MPCMn ))) | bit( TXCn ); }
 		//
 		//	IO access to the USART.
 		//
@@ -421,6 +456,7 @@ class USART_Device {
 		//
 		void write( byte value );
 		byte read( void );
+		bool sent( void );
 };
 
 //
@@ -445,6 +481,12 @@ class USART_IO : public Byte_Queue_API {
 		//	we are currently spooling stuff out).
 		//
 		volatile bool		_async;	
+
+		//
+		//	Start the data register empty interrupts if
+		//	they are not already running.
+		//
+		void start_output( void );
 		
 	public:
 		//
@@ -457,6 +499,27 @@ class USART_IO : public Byte_Queue_API {
 		//
 		bool initialise( byte inst, USART_line_speed speed, USART_char_size bits, USART_data_parity parity, USART_stop_bits sbits, Byte_Queue_API *in_queue, Byte_Queue_API *out_queue );
 
+		//
+		//	bool baud( USART_line_speed speed )
+		//	-----------------------------------
+		//
+		//	Change the line speed.  Anything still being
+		//	sent (see sending()) will be garbled.
+		//
+		//	Returns true if the speed is supported (and
+		//	has been set), false otherwise.
+		//
+		bool baud( USART_line_speed speed );
+
+		//
+		//	bool sending( void )
+		//	--------------------
+		//
+		//	Return true while there is output queued or
+		//	still being shifted out of the USART.
+		//
+		bool sending( void );
+
 		//
 		//	The Byte Queue API
 		//	==================
@@ -501,6 +564,25 @@ class USART_IO : public Byte_Queue_API {
 		//
 		virtual bool write( byte data );
 
+		//
+		//	Contiguous Span Access
+		//	======================
+		//
+		//	reserve() and commit() work on the output
+		//	queue (commit() starting the transmission),
+		//	peek() and consume() on the input queue.
+		//
+		virtual data_size reserve( byte **span );
+		virtual void commit( data_size len );
+		virtual data_size peek( const byte **span );
+		virtual void consume( data_size len );
+
+		//
+		//	Block transfers come from the API.
+		//
+		using Byte_Queue_API::write;
+		using Byte_Queue_API::read;
+
 		//
 		//	These are the interrupt routines used to asynchronously
 		//	fill the input buffer and drain the output buffer.
@@ -0,0 +1,88 @@
+#!/bin/sh
+#
+#	Host build of the DCC Generator sketch
+#	======================================
+#
+#	Compiles the sketch with the host C++ compiler against the stub
+#	Arduino environment in stub/, together with a driver program
+#	which #includes the sketch (copied as ArduinoGenerator.cpp) and
+#	so can reach all of its static functions and data.  See
+#	README.md for the drivers provided.
+#
+#	The host build is a functional model: it runs the real sketch
+#	code, but host timings are not AVR cycle counts (for those see
+#	extras/isr_bench).
+#
+#	Usage:
+#
+#		sh extras/host_sim/build.sh OUTPUT DRIVER.cpp [g++ options]
+#
+#	Environment:
+#
+#		SRC	Source tree to build (default this repository).
+#			Any revision can be built from a checkout, for
+#			example "git worktree add /tmp/old <commit>".
+#		BUILD	Working directory (default extras/host_sim/build).
+#		PART	"mega" builds the ATmega2560 configuration
+#			(default the ATmega328).
+#		SHIELD	"gen" selects the generator driver shield.
+#		DEFS	Sketch options to turn on (commented out
+#			#defines in the sketch).
+#		UNDEFS	Sketch options to turn off.
+#
+HERE=$(cd "$(dirname "$0")" && pwd)
+SRC=${SRC:-$(cd "$HERE/../.." && pwd)}
+BUILD=${BUILD:-$HERE/build}
+
+if [ $# -lt 2 ]; then
+	echo "usage: build.sh OUTPUT DRIVER.cpp [g++ options]" >&2
+	exit 2
+fi
+OUTPUT=$1
+DRIVER=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+shift 2
+
+rm -rf "$BUILD/src"
+mkdir -p "$BUILD/src" || exit 1
+cp "$SRC"/*.h "$SRC"/*.cpp "$BUILD/src/" || exit 1
+cp "$SRC/ArduinoGenerator.ino" "$BUILD/src/ArduinoGenerator.cpp" || exit 1
+S="$BUILD/src/ArduinoGenerator.cpp"
+
+#
+#	There is no TWI hardware (or LCD) on the host.
+#
+rm -f "$BUILD/src/TWI_IO.cpp" "$BUILD/src/LCD_TWI_IO.cpp"
+sed -i 's|^#define LCD_DISPLAY_ENABLE|//&|; s|^#define SPLASH_ENABLE|//&|' "$S"
+sed -i 's|^\(\s*\)twi_eventProcessing();|//|; s|^\(\s*\)lcd.service();|//|' "$S"
+
+#
+#	Configuration.
+#
+if [ "$SHIELD" = gen ]; then
+	sed -i 's|^#define SHIELD_DEFAULT_ARDUINO|//&|; s|^//\(#define SHIELD_GENERATOR_DRIVER\)|\1|' "$S"
+fi
+for d in $DEFS; do
+	sed -i "s|^//\(#define $d\b\)|\1|" "$S"
+done
+for d in $UNDEFS; do
+	sed -i "s|^#define $d\b|//&|" "$S"
+done
+case "$PART" in
+	mega)	TARGET="-D__AVR_ATmega2560__" ;;
+	*)	TARGET="-D__AVR_ATmega328P__" ;;
+esac
+
+#
+#	Host differences: int is 32 bits, so the EEPROM layout check
+#	(which assumes 16 bit records) cannot hold; program memory
+#	addresses are ordinary pointers; the USART registers live in
+#	the simulated register file.
+#
+sed -i 's|^static_assert( FUNCTION_STORE_ADRS|//&|' "$S"
+sed -i 's|^#define progmem_read_address(v)\t\tpgm_read_word(&(v))|#define progmem_read_address(v) (v)|; s|^#define progmem_read_address_at(a)\tpgm_read_word(a)|#define progmem_read_address_at(a) (*(a))|' "$BUILD/src/Environment.h"
+sed -i 's|(USART_Registers \*)0x00C0|(USART_Registers *)(__regs+0xC0)|' "$BUILD/src/USART.cpp"
+
+${CXX:-g++} -std=gnu++11 -O1 -g -fpermissive -w -I"$HERE/stub" -I"$BUILD/src" -I"$HERE" \
+	-DARDUINO=10819 -DARDUINO_ARCH_AVR -DARDUINO_AVR_UNO $TARGET -D__ORDER_LITTLE_ENDIAN__ \
+	-include Arduino.h "$@" -o "$OUTPUT" "$DRIVER" \
+	"$BUILD/src/USART.cpp" "$BUILD/src/Errors.cpp" "$BUILD/src/Constants.cpp"
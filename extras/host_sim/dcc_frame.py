@@ -0,0 +1,93 @@
+#
+#	Binary command frames
+#	=====================
+#
+#	A host side codec for the firmware's binary command frames (see
+#	the 'X' command), and a comparison of the bytes each command
+#	takes on the wire as text and as a frame.
+#
+#	As a module:
+#
+#		text(cmd, args)		The text command, as bytes.
+#		frame(cmd, args)	The binary frame, as bytes.
+#		unframe(data)		The (cmd, args) of a frame.
+#
+#	As a program, compare the wire cost of every command in a
+#	session (a simulator script, or any file of text commands):
+#
+#		python3 dcc_frame.py SESSION [BAUD]
+#
+#	The firmware must be sent [X 1] before it accepts frames.
+#
+import sys, re
+
+PROT_BINARY_CHAR = 0x80
+MAX_DCC_ARGS = 7
+
+def text(cmd, args):
+	return ('[' + ' '.join([cmd] + [str(a) for a in args]) + ']').encode('ascii')
+
+def frame(cmd, args):
+	if len(args) > MAX_DCC_ARGS:
+		raise ValueError('too many arguments')
+	body = [len(args), ord(cmd)]
+	for a in args:
+		if not -32768 <= a <= 32767:
+			raise ValueError('argument out of range: %d' % a)
+		body += [a & 0xff, (a >> 8) & 0xff]
+	check = 0
+	for b in body:
+		check ^= b
+	return bytes([PROT_BINARY_CHAR] + body + [check])
+
+def unframe(data):
+	if len(data) < 4 or data[0] != PROT_BINARY_CHAR:
+		raise ValueError('not a frame')
+	n = data[1]
+	if n > MAX_DCC_ARGS or len(data) != 2 * n + 4:
+		raise ValueError('bad argument count')
+	check = 0
+	for b in data[1:]:
+		check ^= b
+	if check:
+		raise ValueError('bad check byte')
+	args = []
+	for i in range(n):
+		a = data[3 + 2 * i] | (data[4 + 2 * i] << 8)
+		args.append(a - 65536 if a & 0x8000 else a)
+	return chr(data[2]), args
+
+if __name__ == '__main__':
+	if len(sys.argv) < 2:
+		sys.stderr.write('usage: dcc_frame.py SESSION [BAUD]\n')
+		sys.exit(2)
+	baud = int(sys.argv[2]) if len(sys.argv) > 2 else 38400
+	per_cmd = {}
+	for line in open(sys.argv[1]):
+		m = re.match(r'\s*\[(\w)((?:\s+-?\d+)*)\s*\]', line)
+		if not m:
+			continue
+		cmd, args = m.group(1), [int(a) for a in m.group(2).split()]
+		t, f = text(cmd, args), frame(cmd, args)
+		if unframe(f) != (cmd, args):
+			sys.stderr.write('codec mismatch: %s\n' % line.strip())
+			sys.exit(1)
+		c = per_cmd.setdefault(cmd, [0, 0, 0])
+		c[0] += 1
+		c[1] += len(t)
+		c[2] += len(f)
+	if not per_cmd:
+		print('no commands found')
+		sys.exit(1)
+	#
+	#	Ten bits per byte on the wire (start, 8 data, stop).
+	#
+	print('cmd  count  text bytes  frame bytes  ratio')
+	total = [0, 0, 0]
+	for cmd in sorted(per_cmd):
+		c = per_cmd[cmd]
+		print('%-3s %6d %11d %12d %6.2f' % (cmd, c[0], c[1], c[2], c[2] / c[1]))
+		total = [x + y for x, y in zip(total, c)]
+	print('all %6d %11d %12d %6.2f' % (total[0], total[1], total[2], total[2] / total[1]))
+	print('at %d baud: text %.0f commands/s, frames %.0f commands/s' % (
+		baud, total[0] * baud / 10 / total[1], total[0] * baud / 10 / total[2]))
@@ -0,0 +1,104 @@
+//
+//	Command parsing benchmark
+//	=========================
+//
+//	Times the firmware taking in the commands of a session as text
+//	(parse_input(), a character at a time) and as binary frames
+//	(binary_input(), a byte at a time), without executing them.
+//
+//	Build and run (from the top of the tree):
+//
+//		sh extras/host_sim/build.sh /tmp/frame_bench extras/host_sim/frame_bench.cpp -O2
+//		/tmp/frame_bench extras/host_sim/sessions/busy.txt
+//
+//	Every line of the session of the form [C N N ...] is used.
+//	Times are host nanoseconds per command: they compare the two
+//	paths, they are not AVR cycle counts.  For the bytes each
+//	form takes on the wire see dcc_frame.py.
+//
+#include <time.h>
+#include <vector>
+#include <string>
+
+#include "host.h"
+
+#define PASSES		20000
+
+static double now_ns( void ) {
+	struct timespec	t;
+
+	clock_gettime( CLOCK_MONOTONIC, &t );
+	return( t.tv_sec * 1e9 + t.tv_nsec );
+}
+
+int main( int argc, char **argv ) {
+	std::vector<std::string>	text,
+					frame;
+	FILE				*f;
+	char				line[ 256 ];
+	long				commands = 0,
+					parsed = 0;
+	double				t0, t1, t2;
+
+	if(( argc < 2 )||(( f = fopen( argv[ 1 ], "r" )) == NULL )) {
+		fprintf( stderr, "usage: frame_bench SESSION\n" );
+		return( 2 );
+	}
+	while( fgets( line, sizeof( line ), f )) {
+		char		*p, *q, *e;
+		std::string	b;
+		byte		check;
+		long		a;
+
+		for( p = line; *p == ' '; p++ );
+		if(( p[ 0 ] != '[' )|| !isalnum( p[ 1 ])|| !( q = strchr( p, ']' ))) continue;
+		text.push_back( std::string( p, q + 1 ));
+		//
+		//	The same command as a frame (without the leading
+		//	PROT_BINARY_CHAR, which process_input() handles).
+		//
+		b += (char)0;
+		b += p[ 1 ];
+		for( p += 2; ( a = strtol( p, &e, 10 )), e != p; p = e ) {
+			b += (char)( a & 0xff );
+			b += (char)(( a >> 8 ) & 0xff );
+			b[ 0 ]++;
+		}
+		check = 0;
+		for( size_t i = 0; i < b.size(); check ^= b[ i++ ]);
+		b += (char)check;
+		frame.push_back( b );
+	}
+	fclose( f );
+	if( text.empty()) {
+		fprintf( stderr, "%s: no commands\n", argv[ 1 ]);
+		return( 1 );
+	}
+
+	t0 = now_ns();
+	for( int pass = 0; pass < PASSES; pass++ ) {
+		for( size_t c = 0; c < text.size(); c++ ) {
+			const std::string &s = text[ c ];
+
+			for( size_t i = 0; i < s.size(); i++ ) if( parse_input( s[ i ])) parsed++;
+		}
+	}
+	t1 = now_ns();
+	for( int pass = 0; pass < PASSES; pass++ ) {
+		for( size_t c = 0; c < frame.size(); c++ ) {
+			const std::string &s = frame[ c ];
+
+			binary_used = 0;
+			binary_expect = 1;
+			for( size_t i = 0; i < s.size(); i++ ) if( binary_input( s[ i ])) parsed++;
+		}
+	}
+	t2 = now_ns();
+	commands = (long)text.size() * PASSES;
+	printf( "%zu commands: text %.1fns, frame %.1fns per command\n", text.size(), ( t1 - t0 ) / commands, ( t2 - t1 ) / commands );
+	if( parsed != 2 * commands ) {
+		printf( "only %ld of %ld commands parsed\n", parsed, 2 * commands );
+		return( 1 );
+	}
+	return( 0 );
+}
@@ -0,0 +1,68 @@
+//
+//	Function packet benchmark
+//	=========================
+//
+//	Times the two routines which build function group packets:
+//
+//		F		compose_function_change(), an 'F' command
+//				setting or clearing a random function of a
+//				decoder in the roster.
+//		W		compose_function_block(), all five group
+//				packets of a 'W' command for random states.
+//
+//	for a short and a long address.  Build and run (from the top
+//	of the tree):
+//
+//		sh extras/host_sim/build.sh /tmp/function_bench extras/host_sim/function_bench.cpp
+//		/tmp/function_bench
+//
+//	Times are host nanoseconds per command: they compare revisions
+//	of the code, they are not AVR cycle counts.  The bit for bit
+//	check of the packets is extras/tests/function_block.cpp.
+//
+#include <time.h>
+
+#include "host.h"
+
+#define ITERATIONS	4000000L
+
+static double now_ns( void ) {
+	struct timespec	t;
+
+	clock_gettime( CLOCK_MONOTONIC, &t );
+	return( t.tv_sec * 1e9 + t.tv_nsec );
+}
+
+int main( void ) {
+	static const int	adrs[ 2 ] = { 3, 1234 };
+	byte			cmd[ MAXIMUM_DCC_COMMAND ],
+				len;
+	int			fn[ FUNCTION_BIT_ARRAY ],
+				state;
+	unsigned		r = 1;
+	volatile long		sink = 0;
+	double			t0, t1, t2;
+
+#ifdef TARGET_HASH_SIZE
+	init_target_hash();
+#endif
+	init_roster();
+	for( int i = 0; i < 2; i++ ) {
+		find_roster( adrs[ i ], true );
+		t0 = now_ns();
+		for( long n = 0; n < ITERATIONS; n++ ) {
+			r = r * 1103515245 + 12345;
+			sink += compose_function_change( cmd, adrs[ i ], ( r >> 8 ) % ( MAX_FUNCTION_NUMBER + 1 ), (( r >> 20 ) & 1 )? FUNCTION_ON: FUNCTION_OFF );
+		}
+		t1 = now_ns();
+		for( long n = 0; n < ITERATIONS; n++ ) {
+			r = r * 1103515245 + 12345;
+			for( int j = 0; j < FUNCTION_BIT_ARRAY; j++ ) fn[ j ] = ( r >> ( j * 5 )) & 0xff;
+			state = 0;
+			while(( len = compose_function_block( cmd, &state, adrs[ i ], fn, FUNCTION_BIT_ARRAY ))) sink += cmd[ len - 1 ];
+		}
+		t2 = now_ns();
+		printf( "adrs %d: F %.1fns  W %.1fns\n", adrs[ i ], ( t1 - t0 ) / ITERATIONS, ( t2 - t1 ) / ITERATIONS );
+	}
+	return( 0 );
+}
@@ -0,0 +1,89 @@
+//
+//	Target hash table benchmark
+//	===========================
+//
+//	Times find_roster() (through the target hash table) against a
+//	linear scan of the roster, with a number of targets active,
+//	for targets which are found (hit) and which are not (miss).
+//
+//	Build and run (from the top of the tree):
+//
+//		PART=mega sh extras/host_sim/build.sh /tmp/hash_bench extras/host_sim/hash_bench.cpp -O2
+//		/tmp/hash_bench
+//
+//	Without PART=mega the ATmega328 configuration (roster of 24)
+//	is built.  Times are host nanoseconds per lookup: they show how
+//	the cost scales, they are not AVR cycle counts.  A word slot
+//	is four bytes on the host, two on the AVR.
+//
+#include <time.h>
+
+#include "host.h"
+
+#define ITERATIONS	4000000L
+
+static double now_ns( void ) {
+	struct timespec	t;
+
+	clock_gettime( CLOCK_MONOTONIC, &t );
+	return( t.tv_sec * 1e9 + t.tv_nsec );
+}
+
+//
+//	The lookup the hash table replaced.
+//
+static ROSTER_ENTRY *linear_roster( int target ) {
+	ROSTER_ENTRY	*p = roster;
+
+	for( int i = 0; i < ROSTER_SIZE; i++, p++ ) if( p->target == target ) return( p );
+	return( NULL );
+}
+
+int main( void ) {
+	static const int	active[] = { 4, 8, 16, 24, 48, 96, 160, 240 };
+	int			adrs[ ROSTER_SIZE ];
+	unsigned		r = 1;
+	volatile long		sink = 0;
+	double			t0, t1, t2, t3, t4;
+
+	printf( "roster size %d, hash cells %d, slot %d bytes\n", ROSTER_SIZE, TARGET_HASH_SIZE, (int)sizeof( TARGET_SLOT ));
+	for( unsigned k = 0; k < sizeof( active ) / sizeof( active[ 0 ]); k++ ) {
+		int n = active[ k ];
+
+		if( n > ROSTER_SIZE ) break;
+		init_target_hash();
+		init_roster();
+		for( int i = 0; i < n; i++ ) find_roster(( adrs[ i ] = 3 + i * 37 ), true );
+
+		//
+		//	Misses use addresses above any in the roster.
+		//
+		t0 = now_ns();
+		for( long i = 0; i < ITERATIONS; i++ ) {
+			r = r * 1103515245 + 12345;
+			sink += ( linear_roster( adrs[( r >> 8 ) % n ]) != NULL );
+		}
+		t1 = now_ns();
+		for( long i = 0; i < ITERATIONS; i++ ) {
+			r = r * 1103515245 + 12345;
+			sink += ( find_roster( adrs[( r >> 8 ) % n ], false ) != NULL );
+		}
+		t2 = now_ns();
+		for( long i = 0; i < ITERATIONS; i++ ) {
+			r = r * 1103515245 + 12345;
+			sink += ( linear_roster( 9240 + ( r >> 8 ) % 1000 ) != NULL );
+		}
+		t3 = now_ns();
+		for( long i = 0; i < ITERATIONS; i++ ) {
+			r = r * 1103515245 + 12345;
+			sink += ( find_roster( 9240 + ( r >> 8 ) % 1000, false ) != NULL );
+		}
+		t4 = now_ns();
+		printf( "active %3d: hit linear %6.1fns hash %5.1fns   miss linear %6.1fns hash %5.1fns\n", n, ( t1 - t0 ) / ITERATIONS, ( t2 - t1 ) / ITERATIONS, ( t3 - t2 ) / ITERATIONS, ( t4 - t3 ) / ITERATIONS );
+		if( sink != 2 * ITERATIONS * ( k + 1 )) {
+			printf( "lookups disagree\n" );
+			return( 1 );
+		}
+	}
+	return( 0 );
+}
@@ -0,0 +1,50 @@
+//
+//	Host environment for the DCC Generator
+//	======================================
+//
+//	Supplies the Arduino functions and the simulated register file
+//	declared by the stub headers, then includes the sketch.  Each
+//	driver program includes this file once, before its own code.
+//
+//	Environment:
+//
+//		EEBUSY		Ready polls an EEPROM write stays busy (3).
+//
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+volatile uint8_t	__regs[ 512 ];
+static double		sim_us = 0;
+
+unsigned long millis( void ) { return((unsigned long)( sim_us / 1000.0 )); }
+unsigned long micros( void ) { return((unsigned long)sim_us ); }
+void delay( unsigned long ms ) { }
+void noInterrupts( void ) { }
+void interrupts( void ) { }
+void pinMode( uint8_t pin, uint8_t mode ) { }
+int analogRead( uint8_t pin ) { return( 0 ); }
+void digitalWrite( uint8_t pin, uint8_t level ) {
+	volatile uint8_t	*r;
+	uint8_t			m;
+
+	if( pin >= 14 ) return;
+	r = ( pin < 8 )? &PORTD: &PORTB;
+	m = 1 << ( pin & 7 );
+	if( level ) *r |= m; else *r &= ~m;
+}
+
+#include <EEPROM.h>
+
+EEPROMClass	EEPROM;
+int		eeprom_busy = 0,
+		eeprom_busy_reload = getenv( "EEBUSY" )? atoi( getenv( "EEBUSY" )): 3;
+
+//
+//	The sketch itself.
+//
+#include "ArduinoGenerator.cpp"
+
+#endif
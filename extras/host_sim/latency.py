@@ -0,0 +1,67 @@
+#
+#	Command latency replay
+#	======================
+#
+#	Measures the time from the end of an [M] command arriving to
+#	the first packet carrying the new speed being decoded on the
+#	main track, with a number of locos already running.
+#
+#	Generate a session for N locos (random speed changes, fixed
+#	seed), run it through the simulator and analyse the output:
+#
+#		python3 latency.py gen N > session.txt
+#		SIM session.txt | python3 latency.py
+#
+#	The first few changes (while the locos are started) are not
+#	counted.
+#
+import sys, random, re
+
+BYTE_MS = 0.26		# Time for one byte at 38400 baud.
+SETTLE = 8		# Changes ignored at the start.
+
+if len(sys.argv) > 1 and sys.argv[1] == 'gen':
+	n = int(sys.argv[2])
+	random.seed(int(sys.argv[3]) if len(sys.argv) > 3 else 1)
+	print('[P 1]')
+	print('run 20')
+	for i in range(n):
+		print('[M %d 10 1]' % (3 + i))
+		print('run 30')
+	print('run 300')
+	for t in range(60):
+		print('[M %d %d 1]' % (3 + random.randrange(n), random.randrange(20, 120)))
+		print('run %d' % random.randrange(15, 90))
+	sys.exit(0)
+
+latency = []
+pending = []
+for line in sys.stdin:
+	#
+	#	A speed command sent: note when its last byte arrives
+	#	and the speed byte expected (forward, 128 step).
+	#
+	m = re.match(r'\s*([\d.]+)ms -> \[M (\d+) (\d+) 1\]', line)
+	if m:
+		t = float(m.group(1)) + len(m.group(0).split('-> ')[1]) * BYTE_MS
+		adrs = int(m.group(2))
+		pending = [p for p in pending if p[1] != adrs]
+		pending.append((t, adrs, 0x80 | (int(m.group(3)) + 1)))
+		continue
+	#
+	#	A packet decoded on the main track.
+	#
+	m = re.match(r'\s*([\d.]+)ms \[A\] (.*)', line)
+	if m:
+		t = float(m.group(1))
+		b = [int(x, 16) for x in m.group(2).split()[:4]]
+		for p in list(pending):
+			if len(b) > 2 and b[0] == p[1] and b[2] == p[2] and t > p[0]:
+				latency.append(t - p[0])
+				pending.remove(p)
+if len(latency) > SETTLE:
+	latency = latency[SETTLE:]
+if not latency:
+	print('no commands matched')
+	sys.exit(1)
+print('n=%d mean=%.1fms max=%.1fms' % (len(latency), sum(latency) / len(latency), max(latency)))
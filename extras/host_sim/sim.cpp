@@ -0,0 +1,471 @@
+//
+//	Host simulation of the DCC Generator
+//	====================================
+//
+//	Runs the sketch on the host: the signal generator interrupt
+//	routine is called once per timer tick, the main loop every
+//	LOOP_EVERY ticks, a script supplies the console input and the
+//	DCC signal on the track outputs is decoded back into packets.
+//
+//	Build and run (from the top of the tree):
+//
+//		sh extras/host_sim/build.sh /tmp/sim extras/host_sim/sim.cpp
+//		/tmp/sim extras/host_sim/sessions/busy.txt
+//
+//	Script lines:
+//
+//		run MS		Run for MS simulated milliseconds.
+//		bin C A1 A2...	Send a binary command frame (command C).
+//		hex XX XX...	Send raw bytes.
+//		dump		Print the transmission buffer states.
+//		anything else	Send the line as text.
+//
+//	Lines starting '#' are ignored.  Console input is fed at
+//	38400 baud.
+//
+//	Output:
+//
+//		T.TTTms -> ...		Console input sent.
+//		T.TTTms <- ...		Console output received.
+//		T.TTTms [A] XX XX..	A (non-idle) packet decoded.
+//
+//	followed by a summary, including how long buffers waited in
+//	the TBS_LOAD state for the manager.
+//
+//	Environment:
+//
+//		LOOP_EVERY	Timer ticks per main loop pass (3).
+//		DEC		Decoders to attach, as PORTB bit numbers
+//				(default A on bit 4 and B on bit 5,
+//				the main and programming tracks of the
+//				default shield).
+//		SHOW_IDLE	Also print idle packets.
+//		EEBUSY		Ready polls an EEPROM write stays busy (3).
+//		EEFILE		EEPROM image loaded before setup() and
+//				saved at the end.
+//		EEWRITES	Print the number of EEPROM bytes written.
+//		HASHCHECK	Check the target hash table after every
+//				main loop pass.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <string>
+
+#include "host.h"
+
+//
+//	The buffer being transmitted on the main track, which moved
+//	into the signal stream structure with the programming track
+//	stream.
+//
+#ifdef SIGNAL_STREAMS
+#define SIM_CURRENT	signal_stream[ 0 ].current
+#else
+#define SIM_CURRENT	current
+#endif
+
+//
+//	DCC decoder
+//	-----------
+//
+//	Decodes the level of one output pin back into packets.
+//
+struct Decoder {
+	const char		*name;
+	int			bitno,
+				last;
+	double			last_t;
+	int			ones,
+				state,
+				cur,
+				nbits,
+				pending_half;
+	std::vector<int>	bytes;
+	long			packets,
+				idles,
+				bad;
+
+	Decoder( const char *n, int b ) : name( n ), bitno( b ), last( -1 ), last_t( 0 ), ones( 0 ), state( 0 ), cur( 0 ), nbits( 0 ), pending_half( -1 ), packets( 0 ), idles( 0 ), bad( 0 ) {}
+
+	//
+	//	Sample the output, decoding half bits from the time
+	//	between edges: a short half is a 1, a long half a 0.
+	//
+	void sample( int level, double t ) {
+		double	d;
+		int	h;
+
+		if( last < 0 ) {
+			last = level;
+			last_t = t;
+			return;
+		}
+		if( level == last ) return;
+		d = t - last_t;
+		last = level;
+		last_t = t;
+		if(( d > 52 )&&( d < 64 )) h = 1;
+		else if(( d > 90 )&&( d < 10000 )) h = 0;
+		else {
+			bad++;
+			pending_half = -1;
+			return;
+		}
+		if( pending_half < 0 ) {
+			pending_half = h;
+			return;
+		}
+		if( pending_half != h ) {
+			pending_half = h;
+			bad++;
+			return;
+		}
+		pending_half = -1;
+		take_bit( h, t );
+	}
+
+	//
+	//	Assemble packets from bits: a preamble of at least ten
+	//	ones, then bytes separated by 0 bits and ended by a 1.
+	//
+	void take_bit( int v, double t );
+};
+
+static int show_idle = 0;
+
+void Decoder::take_bit( int v, double t ) {
+	switch( state ) {
+		case 0: {
+			if( v ) {
+				ones++;
+				break;
+			}
+			if( ones >= 10 ) {
+				state = 1;
+				bytes.clear();
+				cur = 0;
+				nbits = 0;
+			}
+			ones = 0;
+			break;
+		}
+		case 1: {
+			cur = ( cur << 1 ) | v;
+			if( ++nbits == 8 ) {
+				bytes.push_back( cur );
+				cur = 0;
+				nbits = 0;
+				state = 2;
+			}
+			break;
+		}
+		case 2: {
+			int	x;
+			bool	idle;
+
+			if( v == 0 ) {
+				state = 1;
+				break;
+			}
+			x = 0;
+			for( size_t i = 0; i < bytes.size(); i++ ) x ^= bytes[ i ];
+			packets++;
+			idle = ( bytes.size() == 3 )&&( bytes[ 0 ] == 0xff )&&( bytes[ 1 ] == 0 );
+			if( idle ) idles++;
+			if( !idle || show_idle ) {
+				printf( "%10.3fms [%s]", t / 1000.0, name );
+				for( size_t i = 0; i < bytes.size(); i++ ) printf( " %02X", bytes[ i ]);
+				printf( "%s\n", x? "  BADCHK": "" );
+			}
+			state = 0;
+			ones = 1;
+			break;
+		}
+	}
+}
+
+static std::vector<Decoder *> decoders;
+
+static void sample_outputs( void ) {
+	for( size_t i = 0; i < decoders.size(); i++ ) decoders[ i ]->sample(( PORTB >> decoders[ i ]->bitno ) & 1, sim_us );
+}
+
+//
+//	Console
+//	-------
+//
+static std::string	output_line,
+			input_pending;
+static double		input_next = 0;
+static const double	input_byte_us = 260.0;
+
+//
+//	Print the console output a line at a time, and report any
+//	change of line speed.
+//
+static void drain_console( void ) {
+	static int	last_baud = -1;
+	int		b;
+
+	while( console_out.available()) {
+		char c = console_out.read();
+
+		if( c == '\n' ) {
+			printf( "%10.3fms <- %s\n", sim_us / 1000.0, output_line.c_str());
+			output_line.clear();
+		}
+		else if( c != '\r' ) {
+			output_line += c;
+		}
+	}
+	console.output_ready();
+	__regs[ 0xC0 ] |= 0x40;
+	b = __regs[ 0xC4 ] | ( __regs[ 0xC5 ] << 8 ) | (( __regs[ 0xC0 ] & 2 ) << 15 );
+	if( b != last_baud ) {
+		if( last_baud >= 0 ) printf( "%10.3fms BAUD ubrr=%d u2x=%d -> %.0f\n", sim_us / 1000.0, b & 0xfff, ( b >> 16 ) & 1, 16e6 / ((( b >> 16 ) & 1? 8: 16 ) * (( b & 0xfff ) + 1 )));
+		last_baud = b;
+	}
+}
+
+//
+//	Feed the next input byte once its time on the wire is up.
+//
+static void feed_console( void ) {
+	if( input_pending.empty() ||( sim_us < input_next )) return;
+	if( console_in.space()) {
+		console_in.write( input_pending[ 0 ]);
+		input_pending.erase( 0, 1 );
+		input_next = sim_us + input_byte_us;
+	}
+	else {
+		printf( "INPUT OVERRUN\n" );
+	}
+}
+
+//
+//	Measurements
+//	------------
+//
+//	How long each buffer spends in TBS_LOAD waiting for the manager.
+//
+static double	load_since[ TRANSMISSION_BUFFERS ],
+		load_total = 0,
+		load_max = 0;
+static long	load_count = 0;
+
+static void track_load( void ) {
+	for( int i = 0; i < TRANSMISSION_BUFFERS; i++ ) {
+		bool	l = circular_buffer[ i ].state == TBS_LOAD;
+
+		if( l &&( load_since[ i ] < 0 )) load_since[ i ] = sim_us;
+		if( !l &&( load_since[ i ] >= 0 )) {
+			double d = sim_us - load_since[ i ];
+
+			load_total += d;
+			if( d > load_max ) load_max = d;
+			load_count++;
+			load_since[ i ] = -1;
+		}
+	}
+}
+
+#ifdef TARGET_HASH_SIZE
+//
+//	Check every hash table entry can be found, and that every
+//	roster record and buffer with a target is in the table.
+//
+static long	hash_checks = 0,
+		hash_bad = 0;
+
+static void check_hash( void ) {
+	hash_checks++;
+	for( int i = 0; i < TARGET_HASH_SIZE; i++ ) {
+		if( target_hash[ i ] != NO_TARGET_SLOT ) {
+			TARGET_SLOT	s = target_hash[ i ],
+					*c = find_target( slot_kind( s ), slot_target( s ));
+
+			if( !c ||( *c != s )) {
+				hash_bad++;
+				printf( "HASH unreachable slot %d\n", (int)s );
+			}
+		}
+	}
+	for( int i = 0; i < ROSTER_SIZE; i++ ) {
+		if( roster[ i ].target ) {
+			TARGET_SLOT *c = find_target( TARGET_ROSTER, roster[ i ].target );
+
+			if( !c ||( *c != i )) {
+				hash_bad++;
+				printf( "HASH roster %d missing\n", i );
+			}
+		}
+	}
+	for( int i = 0; i < HASHED_BUFFERS; i++ ) {
+		if( circular_buffer[ i ].target &&( find_target( slot_kind( ROSTER_SIZE + i ), circular_buffer[ i ].target ) == NULL )) {
+			hash_bad++;
+			printf( "HASH buffer %d missing\n", i );
+		}
+	}
+}
+#endif
+
+//
+//	Running
+//	-------
+//
+static int	loop_every = 3;
+static long	isr_calls = 0;
+static bool	hash_check = false;
+
+//
+//	The time to the next interrupt.
+//
+static double tick_us( void ) {
+#ifdef SIGNAL_HALF_BIT_TIMER
+	return(( HW_OCRnA + 1 ) * 8 / 16.0 );
+#else
+	return( 14.5 );
+#endif
+}
+
+static void run_ms( double ms ) {
+	static int	ticks = 0;
+	double		end = sim_us + ms * 1000.0;
+
+	while( sim_us < end ) {
+		double dt = tick_us();
+
+		HW_TCNTn = 0;
+		HW_TIMERn_COMPA_vect();
+		isr_calls++;
+		sample_outputs();
+		track_load();
+		sim_us += dt;
+		feed_console();
+		if( ++ticks >= loop_every ) {
+			ticks = 0;
+			loop();
+			drain_console();
+			track_load();
+#ifdef TARGET_HASH_SIZE
+			if( hash_check ) check_hash();
+#endif
+		}
+	}
+}
+
+static void dump_state( void ) {
+	printf( "DUMP t=%.3f current=%d\n", sim_us / 1000, (int)( SIM_CURRENT - circular_buffer ));
+	for( int i = 0; i < TRANSMISSION_BUFFERS; i++ ) {
+		TRANS_BUFFER *b = circular_buffer + i;
+
+		printf( "  buf %d state=%d target=%d\n", i, b->state, b->target );
+	}
+}
+
+//
+//	Queue a binary command frame: "bin C A1 A2 ..."
+//
+static void send_binary( const char *p ) {
+	std::string		frame;
+	std::vector<int>	arg;
+	char			c, *q;
+	unsigned char		x;
+
+	c = p[ 0 ];
+	q = (char *)p + 1;
+	while( *q ) {
+		while( *q == ' ' ) q++;
+		if( !*q ) break;
+		arg.push_back( strtol( q, &q, 10 ));
+	}
+	frame += (char)0x80;
+	x = arg.size();
+	frame += (char)arg.size();
+	x ^= c;
+	frame += c;
+	for( size_t i = 0; i < arg.size(); i++ ) {
+		frame += (char)( arg[ i ] & 0xff );
+		frame += (char)(( arg[ i ] >> 8 ) & 0xff );
+		x ^= ( arg[ i ] & 0xff )^(( arg[ i ] >> 8 ) & 0xff );
+	}
+	frame += (char)x;
+	printf( "%10.3fms -> bin %s (%zu bytes)\n", sim_us / 1000.0, p, frame.size());
+	input_pending += frame;
+}
+
+int main( int argc, char **argv ) {
+	FILE	*f;
+	char	line[ 256 ];
+
+	if( getenv( "DEC" )) {
+		static const char *name[ 8 ] = { "0", "1", "2", "3", "4", "5", "6", "7" };
+
+		for( const char *q = getenv( "DEC" ); *q; q++ ) if(( *q >= '0' )&&( *q <= '7' )) decoders.push_back( new Decoder( name[ *q - '0' ], *q - '0' ));
+	}
+	else {
+		decoders.push_back( new Decoder( "A", 4 ));
+		decoders.push_back( new Decoder( "B", 5 ));
+	}
+	if( getenv( "LOOP_EVERY" )) loop_every = atoi( getenv( "LOOP_EVERY" ));
+	if( getenv( "SHOW_IDLE" )) show_idle = 1;
+	if( getenv( "HASHCHECK" )) hash_check = true;
+	for( int i = 0; i < TRANSMISSION_BUFFERS; i++ ) load_since[ i ] = -1;
+	if( getenv( "EEFILE" )&&(( f = fopen( getenv( "EEFILE" ), "rb" )) != NULL )) {
+		if( fread( EEPROM.mem, 1, sizeof( EEPROM.mem ), f )) { }
+		fclose( f );
+	}
+
+	setup();
+	drain_console();
+
+	if(( f = ( argc > 1 )? fopen( argv[ 1 ], "r" ): stdin ) == NULL ) {
+		perror( argv[ 1 ]);
+		return( 1 );
+	}
+	while( fgets( line, sizeof( line ), f )) {
+		char *p = line;
+
+		while( *p == ' ' ) p++;
+		line[ strcspn( line, "\n" )] = '\0';
+		if(( *p == '#' )||( *p == '\0' )) continue;
+		if( strncmp( p, "run ", 4 ) == 0 ) {
+			run_ms( atof( p + 4 ));
+		}
+		else if( strncmp( p, "dump", 4 ) == 0 ) {
+			dump_state();
+		}
+		else if( strncmp( p, "bin ", 4 ) == 0 ) {
+			send_binary( p + 4 );
+		}
+		else if( strncmp( p, "hex ", 4 ) == 0 ) {
+			char *q = p + 4;
+
+			printf( "%10.3fms -> hex %s\n", sim_us / 1000.0, q );
+			while( *q ) {
+				while( *q == ' ' ) q++;
+				if( !*q ) break;
+				input_pending += (char)strtol( q, &q, 16 );
+			}
+		}
+		else {
+			printf( "%10.3fms -> %s\n", sim_us / 1000.0, p );
+			input_pending += p;
+		}
+	}
+	run_ms( 1 );
+
+	for( size_t i = 0; i < decoders.size(); i++ ) printf( "decoder %s: packets=%ld idles=%ld bad=%ld\n", decoders[ i ]->name, decoders[ i ]->packets, decoders[ i ]->idles, decoders[ i ]->bad );
+	printf( "LOAD state: n=%ld mean=%.0fus max=%.0fus\n", load_count, load_count? load_total / load_count: 0, load_max );
+#ifdef TARGET_HASH_SIZE
+	if( hash_check ) printf( "hash checks=%ld bad=%ld\n", hash_checks, hash_bad );
+#endif
+	printf( "isr calls=%ld simulated=%.1fms\n", isr_calls, sim_us / 1000 );
+	if( getenv( "EEFILE" )&&(( f = fopen( getenv( "EEFILE" ), "wb" )) != NULL )) {
+		fwrite( EEPROM.mem, 1, sizeof( EEPROM.mem ), f );
+		fclose( f );
+	}
+	if( getenv( "EEWRITES" )) printf( "eeprom writes=%ld\n", EEPROM.writes );
+	return( 0 );
+}
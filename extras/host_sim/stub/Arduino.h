@@ -0,0 +1,65 @@
+//
+//	Host stand in for the Arduino core.
+//	===================================
+//
+//	Just enough of the Arduino environment for the sketch to
+//	compile with the host C++ compiler.  The functions declared
+//	here are supplied by the driver program (see sim.cpp).
+//
+#ifndef _STUB_ARDUINO_H_
+#define _STUB_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+//
+//	The AVR types: note that int (and so word) is 32 bits on
+//	the host, not 16.
+//
+typedef uint8_t byte;
+typedef unsigned int word;
+typedef bool boolean;
+
+#define HIGH		1
+#define LOW		0
+#define INPUT		0
+#define OUTPUT		1
+#define INPUT_PULLUP	2
+
+//
+//	Pin numbers of an Uno.
+//
+#define A0		14
+#define A1		15
+#define A2		16
+#define A3		17
+#define A6		20
+#define A7		21
+#define SDA		18
+#define SCL		19
+
+#define bit(b)		(1UL<<(b))
+#define F_CPU		16000000UL
+
+extern void pinMode( uint8_t pin, uint8_t mode );
+extern void digitalWrite( uint8_t pin, uint8_t level );
+extern int analogRead( uint8_t pin );
+extern unsigned long millis( void );
+extern unsigned long micros( void );
+extern void delay( unsigned long ms );
+extern void noInterrupts( void );
+extern void interrupts( void );
+
+//
+//	Pins 0-7 are on PORTD, the rest on PORTB.
+//
+#define digitalPinToPort(p)		((uint8_t)(((p)<8)?4:2))
+#define digitalPinToBitMask(p)		((uint8_t)(1<<((p)&7)))
+#define portOutputRegister(p)		((volatile uint8_t *)(__regs+(((p)==2)?0x25:0x2b)))
+
+#endif
@@ -0,0 +1,55 @@
+//
+//	Host stand in for the Arduino EEPROM library.
+//	=============================================
+//
+//	Every byte written makes eeprom_is_ready() return false for
+//	the next eeprom_busy_reload calls, standing in for the time
+//	an AVR EEPROM write takes.  The driver program defines both
+//	counters, the EEPROM object and may load or save its image.
+//
+#ifndef _STUB_EEPROM_H_
+#define _STUB_EEPROM_H_
+
+#include <stdint.h>
+#include <string.h>
+
+extern int eeprom_busy, eeprom_busy_reload;
+
+#define eeprom_is_ready()	( eeprom_busy? ( eeprom_busy--, false ): true )
+
+struct EEPROMClass {
+	uint8_t		mem[ 8192 ];
+	long		writes;
+
+	EEPROMClass() : writes( 0 ) {
+		memset( mem, 0xff, sizeof( mem ));
+	}
+	template< class T > T &get( int a, T &t ) {
+		memcpy( &t, mem + a, sizeof( t ));
+		return( t );
+	}
+	template< class T > const T &put( int a, const T &t ) {
+		const uint8_t *p = (const uint8_t *)&t;
+
+		for( unsigned i = 0; i < sizeof( t ); i++ ) update( a + i, p[ i ]);
+		return( t );
+	}
+	uint8_t read( int a ) {
+		return( mem[ a ]);
+	}
+	void write( int a, uint8_t v ) {
+		mem[ a ] = v;
+		writes++;
+		eeprom_busy = eeprom_busy_reload;
+	}
+	void update( int a, uint8_t v ) {
+		if( mem[ a ] != v ) write( a, v );
+	}
+	int length( void ) {
+		return( E2END + 1 );
+	}
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
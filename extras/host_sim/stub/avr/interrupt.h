@@ -0,0 +1,22 @@
+//
+//	Host stand in for <avr/interrupt.h>: interrupt routines become
+//	plain functions which the driver program calls.
+//
+#ifndef _STUB_AVR_INTERRUPT_H_
+#define _STUB_AVR_INTERRUPT_H_
+
+#define ISR(v)			extern "C" void v( void )
+
+#define TIMER2_COMPA_vect	__vec_timer2_compa
+#define TIMER0_COMPA_vect	__vec_timer0_compa
+#define ADC_vect		__vec_adc
+#define USART_RX_vect		__vec_usart_rx
+#define USART_UDRE_vect		__vec_usart_udre
+#define USART1_RX_vect		__vec_usart1_rx
+#define USART1_UDRE_vect	__vec_usart1_udre
+#define TWI_vect		__vec_twi
+
+#define cli()
+#define sei()
+
+#endif
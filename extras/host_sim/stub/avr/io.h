@@ -0,0 +1,92 @@
+//
+//	Host stand in for <avr/io.h>.
+//	=============================
+//
+//	The registers the sketch uses, laid out at their ATmega328
+//	data addresses within __regs[] (supplied by the driver), so
+//	that the driver can read the signal outputs and drive the
+//	timer and USART.
+//
+#ifndef _STUB_AVR_IO_H_
+#define _STUB_AVR_IO_H_
+
+#include <stdint.h>
+
+extern volatile uint8_t __regs[ 512 ];
+
+#define _REG(a)		(*(volatile uint8_t *)(__regs+(a)))
+
+#define SREG		_REG(0x5f)
+#define GPIOR0		_REG(0x3e)
+
+#define PINB		_REG(0x23)
+#define DDRB		_REG(0x24)
+#define PORTB		_REG(0x25)
+#define DDRD		_REG(0x2a)
+#define PORTD		_REG(0x2b)
+
+#define TIFR2		_REG(0x37)
+#define TCCR0A		_REG(0x44)
+#define TCCR0B		_REG(0x45)
+#define TCNT0		_REG(0x46)
+#define OCR0A		_REG(0x47)
+#define TIMSK0		_REG(0x6e)
+#define TIMSK2		_REG(0x70)
+#define TCCR2A		_REG(0xb0)
+#define TCCR2B		_REG(0xb1)
+#define TCNT2		_REG(0xb2)
+#define OCR2A		_REG(0xb3)
+#define OCR2B		_REG(0xb4)
+
+#define WGM01		1
+#define WGM20		0
+#define WGM21		1
+#define WGM22		3
+#define COM2A0		6
+#define COM2A1		7
+#define COM2B0		4
+#define COM2B1		5
+#define CS00		0
+#define CS01		1
+#define CS20		0
+#define CS21		1
+#define CS22		2
+#define OCIE0A		1
+#define OCIE2A		1
+#define OCF2A		1
+
+#define ADCL		_REG(0x78)
+#define ADCH		_REG(0x79)
+#define ADCSRA		_REG(0x7a)
+#define ADMUX		_REG(0x7c)
+
+#define ADSC		6
+#define ADIE		3
+#define REFS0		6
+
+#define TWBR		_REG(0xb8)
+#define TWSR		_REG(0xb9)
+#define TWAR		_REG(0xba)
+#define TWDR		_REG(0xbb)
+#define TWCR		_REG(0xbc)
+
+#define TWINT		7
+#define TWEA		6
+#define TWSTA		5
+#define TWSTO		4
+#define TWWC		3
+#define TWEN		2
+#define TWIE		0
+
+//
+//	EEPROM size (may be overridden on the command line).
+//
+#ifndef E2END
+#if defined( __AVR_ATmega2560__ )
+#define E2END		0xFFF
+#else
+#define E2END		0x3FF
+#endif
+#endif
+
+#endif
@@ -0,0 +1,15 @@
+//
+//	Host stand in for <avr/pgmspace.h>: program memory is
+//	ordinary memory.
+//
+#ifndef _STUB_AVR_PGMSPACE_H_
+#define _STUB_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(a)	(*(const uint8_t *)(a))
+#define pgm_read_word(a)	(*(const uint16_t *)(a))
+#define pgm_read_dword(a)	(*(const uint32_t *)(a))
+
+#endif
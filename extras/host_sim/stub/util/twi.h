@@ -0,0 +1,3 @@
+//
+//	Empty host stand in (the sketch includes this header).
+//
@@ -0,0 +1,396 @@
+//
+//	isr_bench - DCC Generator interrupt cycle benchmark
+//	===================================================
+//
+//	Runs a firmware ELF file under simavr (cycle accurate), feeds
+//	a command session into the console USART and measures the
+//	machine cycles spent in every interrupt routine taken.
+//
+//	Each routine is timed from the moment its vector is entered
+//	to the return from interrupt, plus the hardware interrupt
+//	response (4 cycles, 5 on parts with a 3 byte program
+//	counter).  The signal generator routine is further split by
+//	the path it took (mid bit, bit change or buffer change), which
+//	the firmware leaves in GPIOR0 when built with DEBUG_ISR_PATH.
+//
+//	Every routine is held to the same budget, a percentage of the
+//	signal generator interrupt window, as any of them can delay
+//	the generation of the next DCC signal edge.
+//
+//	Usage:
+//
+//		isr_bench [options] firmware.elf
+//
+//		-m mcu		simavr core name (eg atmega328p)
+//		-f hz		clock frequency (default 16000000)
+//		-u n		console USART number (default 0)
+//		-s vector	vector number of the signal generator
+//		-V bytes	size of the vector table (_VECTORS_SIZE)
+//		-n file		vector names, one "number name" per line
+//		-i file		command session to feed (default none)
+//		-t ms		simulated time to run after the session
+//				has been sent (default 3000)
+//		-w cycles	signal generator window (default 232)
+//		-b percent	budget as a percentage of the window
+//				(default 75)
+//		-v		copy the console output to stderr
+//
+//	A session file holds one command per line, sent with a
+//	trailing newline.  Blank lines and lines starting '#' are
+//	ignored, and "wait MS" pauses the session for MS simulated
+//	milliseconds.
+//
+//	Exit status is 0 if every routine is within budget, 1 if any
+//	exceeded it and 2 for a usage or simulation error.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_irq.h"
+#include "avr_uart.h"
+
+//
+//	Limits of the measurements.
+//
+#define MAX_VECTORS	128
+#define MAX_PATHS	3
+#define MAX_NESTING	8
+#define MAX_SESSION	65536
+
+//
+//	Where GPIOR0 is found in the data address space of the
+//	supported parts, and the paths the firmware records there.
+//
+#define GPIOR0_ADRS	0x3E
+static const char *path_name[ MAX_PATHS ] = { "mid bit", "bit change", "buffer change" };
+
+//
+//	The figures gathered for each routine (and path).
+//
+typedef struct {
+	uint64_t	count,
+			total;
+	uint32_t	min,
+			max;
+} isr_stats;
+
+static isr_stats	stats[ MAX_VECTORS ][ MAX_PATHS ];
+static char		*vector_name[ MAX_VECTORS ];
+
+//
+//	The interrupt routines currently executing: the vector
+//	entered, the stack pointer after the return address was
+//	pushed and the cycle count on entry.
+//
+typedef struct {
+	int		vector;
+	uint16_t	sp;
+	avr_cycle_count_t start;
+} isr_frame;
+
+static isr_frame	frame[ MAX_NESTING ];
+static int		nested = 0;
+
+static int		signal_vector = -1;
+static int		bad_paths = 0;
+static uint32_t		response;
+
+//
+//	The session being fed into the console.
+//
+static char		session[ MAX_SESSION ];
+static int		session_len = 0,
+			session_pos = 0;
+static avr_cycle_count_t session_wait = 0;
+static int		uart_xoff = 0;
+static int		verbose = 0;
+
+static void usage( void ) {
+	fprintf( stderr, "usage: isr_bench [-m mcu] [-f hz] [-u n] -s vector -V bytes [-n names] [-i session] [-t ms] [-w cycles] [-b percent] [-v] firmware.elf\n" );
+	exit( 2 );
+}
+
+//
+//	Read the vector names file.
+//
+static void read_names( const char *file ) {
+	FILE	*f;
+	char	name[ 64 ];
+	int	v;
+
+	if(( f = fopen( file, "r" )) == NULL ) {
+		perror( file );
+		exit( 2 );
+	}
+	while( fscanf( f, "%d %63s", &v, name ) == 2 ) {
+		if(( v > 0 )&&( v < MAX_VECTORS )) vector_name[ v ] = strdup( name );
+	}
+	fclose( f );
+}
+
+//
+//	Read the session file, converting "wait MS" lines into
+//	a marker byte (0) followed by the delay as text.
+//
+static void read_session( const char *file ) {
+	FILE	*f;
+	char	line[ 256 ];
+	int	n;
+
+	if(( f = fopen( file, "r" )) == NULL ) {
+		perror( file );
+		exit( 2 );
+	}
+	while( fgets( line, sizeof( line ), f )) {
+		line[ strcspn( line, "\r\n" )] = '\0';
+		if(( line[ 0 ] == '\0' )||( line[ 0 ] == '#' )) continue;
+		if( strncmp( line, "wait ", 5 ) == 0 ) {
+			n = snprintf( session + session_len, MAX_SESSION - session_len, "%c%s%c", 0, line + 5, 0 );
+		}
+		else {
+			n = snprintf( session + session_len, MAX_SESSION - session_len, "%s\n", line );
+		}
+		if(( n < 0 )||( session_len + n >= MAX_SESSION )) {
+			fprintf( stderr, "%s: session too long\n", file );
+			exit( 2 );
+		}
+		session_len += n;
+	}
+	fclose( f );
+}
+
+//
+//	USART callbacks: console output and input flow control.
+//
+static void uart_output( struct avr_irq_t *irq, uint32_t value, void *param ) {
+	if( verbose ) fputc( value, stderr );
+}
+static void uart_xon( struct avr_irq_t *irq, uint32_t value, void *param ) {
+	uart_xoff = 0;
+}
+static void uart_xoff_hook( struct avr_irq_t *irq, uint32_t value, void *param ) {
+	uart_xoff = 1;
+}
+
+//
+//	Push the next part of the session into the USART while it
+//	will accept it.
+//
+static void feed_session( avr_t *avr, avr_irq_t *input ) {
+	while(( session_pos < session_len )&& !uart_xoff &&( avr->cycle >= session_wait )) {
+		if( session[ session_pos ] == '\0' ) {
+			session_pos++;
+			session_wait = avr->cycle + ( avr->frequency / 1000 ) * (avr_cycle_count_t)atol( session + session_pos );
+			session_pos += strlen( session + session_pos ) + 1;
+			continue;
+		}
+		avr_raise_irq( input, (uint8_t)session[ session_pos++ ]);
+	}
+}
+
+//
+//	Record the end of the innermost routine.
+//
+static void leave_isr( avr_t *avr ) {
+	isr_frame	*f;
+	isr_stats	*s;
+	uint32_t	cycles;
+	int		path;
+
+	f = &frame[ --nested ];
+	cycles = (uint32_t)( avr->cycle - f->start ) + response;
+	path = 0;
+	if( f->vector == signal_vector ) {
+		path = avr->data[ GPIOR0_ADRS ];
+		if( path >= MAX_PATHS ) {
+			bad_paths++;
+			path = 0;
+		}
+	}
+	s = &stats[ f->vector ][ path ];
+	if(( s->count == 0 )||( cycles < s->min )) s->min = cycles;
+	if( cycles > s->max ) s->max = cycles;
+	s->total += cycles;
+	s->count++;
+}
+
+//
+//	Called after every instruction to track entry to, and return
+//	from, the interrupt routines.
+//
+//	A routine is entered when the program counter lands on its
+//	entry in the vector table.  As the routine can never pop more
+//	than it has pushed, it has returned once the stack pointer
+//	rises above the value it had on entry.
+//
+static void track_isr( avr_t *avr, uint32_t vector_size, uint32_t vector_table ) {
+	uint16_t	sp;
+	uint32_t	pc;
+
+	sp = avr->data[ R_SPL ] | ( avr->data[ R_SPH ] << 8 );
+	while( nested &&( sp > frame[ nested-1 ].sp )) leave_isr( avr );
+	pc = avr->pc;
+	if(( pc == 0 )||( pc >= vector_table )||( pc % vector_size )) return;
+	//
+	//	A return immediately followed by the next interrupt
+	//	leaves the stack pointer where it was.
+	//
+	if( nested &&( sp == frame[ nested-1 ].sp )) leave_isr( avr );
+	if( nested == MAX_NESTING ) {
+		fprintf( stderr, "isr_bench: interrupts nested too deeply\n" );
+		exit( 2 );
+	}
+	frame[ nested ].vector = pc / vector_size;
+	frame[ nested ].sp = sp;
+	frame[ nested ].start = avr->cycle;
+	nested++;
+}
+
+//
+//	Print the figures for one routine (and path), returning true
+//	if it is over budget.
+//
+static int report( int vector, int path, uint32_t limit ) {
+	isr_stats	*s;
+	char		name[ 96 ];
+	int		over;
+
+	s = &stats[ vector ][ path ];
+	if( s->count == 0 ) return( 0 );
+	if( vector_name[ vector ]) {
+		snprintf( name, sizeof( name ), "%s", vector_name[ vector ]);
+	}
+	else {
+		snprintf( name, sizeof( name ), "vector %d", vector );
+	}
+	if( vector == signal_vector ) {
+		strncat( name, " ", sizeof( name ) - strlen( name ) - 1 );
+		strncat( name, path_name[ path ], sizeof( name ) - strlen( name ) - 1 );
+	}
+	over = s->max > limit;
+	printf( "  %-32s %10llu %6u %8.1f %6u%s\n", name, (unsigned long long)s->count, s->min, (double)s->total / s->count, s->max, over? "  OVER BUDGET": "" );
+	return( over );
+}
+
+int main( int argc, char **argv ) {
+	elf_firmware_t	firmware;
+	avr_t		*avr;
+	const char	*mcu = NULL,
+			*names = NULL,
+			*input = NULL;
+	char		uart = '0';
+	uint32_t	frequency = 16000000,
+			window = 232,
+			budget = 75,
+			run_ms = 3000,
+			vector_table = 0,
+			limit;
+	avr_cycle_count_t finish = 0;
+	avr_irq_t	*uart_input;
+	int		opt,
+			state,
+			over;
+
+	while(( opt = getopt( argc, argv, "m:f:u:s:V:n:i:t:w:b:v" )) != -1 ) {
+		switch( opt ) {
+			case 'm': mcu = optarg; break;
+			case 'f': frequency = strtoul( optarg, NULL, 0 ); break;
+			case 'u': uart = optarg[ 0 ]; break;
+			case 's': signal_vector = atoi( optarg ); break;
+			case 'V': vector_table = strtoul( optarg, NULL, 0 ); break;
+			case 'n': names = optarg; break;
+			case 'i': input = optarg; break;
+			case 't': run_ms = strtoul( optarg, NULL, 0 ); break;
+			case 'w': window = strtoul( optarg, NULL, 0 ); break;
+			case 'b': budget = strtoul( optarg, NULL, 0 ); break;
+			case 'v': verbose = 1; break;
+			default: usage();
+		}
+	}
+	if(( optind != argc - 1 )||( signal_vector <= 0 )||( signal_vector >= MAX_VECTORS )||( vector_table == 0 )) usage();
+	if( names ) read_names( names );
+	if( input ) read_session( input );
+
+	memset( &firmware, 0, sizeof( firmware ));
+	if( elf_read_firmware( argv[ optind ], &firmware ) != 0 ) {
+		fprintf( stderr, "isr_bench: unable to read %s\n", argv[ optind ]);
+		return( 2 );
+	}
+	if( mcu ) snprintf( firmware.mmcu, sizeof( firmware.mmcu ), "%s", mcu );
+	firmware.frequency = frequency;
+	if(( avr = avr_make_mcu_by_name( firmware.mmcu )) == NULL ) {
+		fprintf( stderr, "isr_bench: simavr does not support '%s'\n", firmware.mmcu );
+		return( 2 );
+	}
+	avr_init( avr );
+	avr_load_firmware( avr, &firmware );
+
+	//
+	//	All of the supported parts have 4 byte vectors.  Parts
+	//	with more than 128 KBytes of flash push a 3 byte return
+	//	address and take a cycle longer to respond.
+	//
+	response = ( avr->flashend > 0x1FFFF )? 5: 4;
+	limit = ( window * budget ) / 100;
+
+	//
+	//	Take over the console USART.
+	//
+	{
+		uint32_t	flags = 0;
+
+		avr_ioctl( avr, AVR_IOCTL_UART_GET_FLAGS( uart ), &flags );
+		flags &= ~AVR_UART_FLAG_STDIO;
+		avr_ioctl( avr, AVR_IOCTL_UART_SET_FLAGS( uart ), &flags );
+	}
+	avr_irq_register_notify( avr_io_getirq( avr, AVR_IOCTL_UART_GETIRQ( uart ), UART_IRQ_OUTPUT ), uart_output, NULL );
+	avr_irq_register_notify( avr_io_getirq( avr, AVR_IOCTL_UART_GETIRQ( uart ), UART_IRQ_OUT_XON ), uart_xon, NULL );
+	avr_irq_register_notify( avr_io_getirq( avr, AVR_IOCTL_UART_GETIRQ( uart ), UART_IRQ_OUT_XOFF ), uart_xoff_hook, NULL );
+	uart_input = avr_io_getirq( avr, AVR_IOCTL_UART_GETIRQ( uart ), UART_IRQ_INPUT );
+
+	//
+	//	Run the session, then run on for the time requested.
+	//
+	for(;;) {
+		state = avr_run( avr );
+		if(( state == cpu_Done )||( state == cpu_Crashed )) {
+			fprintf( stderr, "isr_bench: firmware stopped (state %d) at pc 0x%05x\n", state, (unsigned)avr->pc );
+			return( 2 );
+		}
+		track_isr( avr, 4, vector_table );
+		feed_session( avr, uart_input );
+		if( finish == 0 ) {
+			if(( session_pos >= session_len )&&( avr->cycle >= session_wait )) finish = avr->cycle + ( frequency / 1000 ) * (avr_cycle_count_t)run_ms;
+		}
+		else if( avr->cycle >= finish ) {
+			break;
+		}
+	}
+
+	//
+	//	Report.
+	//
+	printf( "  %-32s %10s %6s %8s %6s\n", "routine", "count", "min", "mean", "max" );
+	over = 0;
+	for( int p = 0; p < MAX_PATHS; p++ ) over |= report( signal_vector, p, limit );
+	for( int v = 1; v < MAX_VECTORS; v++ ) if( v != signal_vector ) over |= report( v, 0, limit );
+	printf( "  budget %u%% of %u cycles = %u cycles\n", budget, window, limit );
+	if( stats[ signal_vector ][ 0 ].count + stats[ signal_vector ][ 1 ].count + stats[ signal_vector ][ 2 ].count == 0 ) {
+		fprintf( stderr, "isr_bench: the signal generator never ran\n" );
+		return( 2 );
+	}
+	if( bad_paths ) {
+		fprintf( stderr, "isr_bench: %d signal generator exits without a valid path (built without DEBUG_ISR_PATH?)\n", bad_paths );
+		return( 2 );
+	}
+	if( over ) {
+		printf( "FAIL: interrupt routine over budget\n" );
+		return( 1 );
+	}
+	return( 0 );
+}
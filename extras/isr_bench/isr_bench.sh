@@ -0,0 +1,191 @@
+#!/bin/sh
+#
+#	DCC Generator interrupt cycle budget benchmark
+#	==============================================
+#
+#	Builds the firmware for each SELECT_SML part (ATmega328,
+#	ATmega32U4 and ATmega2560), with and without SHIELD_PORT_DIRECT
+#	(the generator driver shield) and PROGRAMMING_TRACK, runs every
+#	build under simavr while feeding it a command session, and
+#	reports min/mean/max cycles for each interrupt routine (the
+#	signal generator split into its mid bit, bit change and buffer
+#	change paths).
+#
+#	The script exits non-zero if any configuration fails to build
+#	or run, or if any interrupt routine exceeds BUDGET percent of
+#	the signal generator's interrupt window.
+#
+#	Requirements:
+#
+#		arduino-cli with the arduino:avr core installed
+#		simavr (library and headers) and a host C compiler
+#
+#	Usage (from anywhere in the tree):
+#
+#		sh extras/isr_bench/isr_bench.sh
+#
+#	Environment:
+#
+#		BUDGET		Percentage of the window allowed (75).
+#		PARTS		Parts to build, any of "uno leonardo mega".
+#		HALF_BIT	Set to 1 to build with SIGNAL_HALF_BIT_TIMER.
+#		SESSION		Command session to feed (session.txt).
+#		RUN_MS		Simulated time to run on after the
+#				session (3000).
+#		WORK		Build directory (a temporary directory).
+#		VERBOSE		Set to 1 to show the console output.
+#		SIMAVR_CFLAGS	Compiler flags for simavr
+#				(pkg-config simavr, or -I/usr/include/simavr).
+#		SIMAVR_LIBS	Linker flags for simavr
+#				(pkg-config simavr, or -lsimavr -lelf).
+#
+HERE=$(cd "$(dirname "$0")" && pwd)
+REPO=$(cd "$HERE/../.." && pwd)
+
+BUDGET=${BUDGET:-75}
+PARTS=${PARTS:-"uno leonardo mega"}
+SESSION=${SESSION:-$HERE/session.txt}
+RUN_MS=${RUN_MS:-3000}
+
+#
+#	The signal generator window in machine cycles.  All of the
+#	supported boards run at 16 MHz: TIMER_INTERRUPT_CYCLES (232)
+#	with a pre-scaler of 1, or with the half bit timer the
+#	shortest half bit, (TICKS_FOR_ONE+1) x 8 = 928.
+#
+if [ "$HALF_BIT" = 1 ]; then
+	WINDOW=928
+else
+	WINDOW=232
+fi
+
+fail() {
+	echo "isr_bench: $*" >&2
+	exit 2
+}
+
+command -v arduino-cli > /dev/null || fail "arduino-cli not found"
+
+#
+#	avr-gcc is used to read the vector numbers from the avr-libc
+#	headers.  Use the one on the path, or the one arduino-cli
+#	installed with the arduino:avr core.
+#
+if [ -z "$AVR_GCC" ]; then
+	AVR_GCC=$(command -v avr-gcc || ls -d "$HOME"/.arduino15/packages/arduino/tools/avr-gcc/*/bin/avr-gcc 2> /dev/null | tail -1)
+fi
+[ -x "$AVR_GCC" ] || fail "avr-gcc not found (set AVR_GCC)"
+
+if [ -z "$SIMAVR_CFLAGS$SIMAVR_LIBS" ]; then
+	if pkg-config --exists simavr 2> /dev/null; then
+		SIMAVR_CFLAGS=$(pkg-config --cflags simavr)
+		SIMAVR_LIBS=$(pkg-config --libs simavr)
+	else
+		SIMAVR_CFLAGS="-I/usr/include/simavr -I/usr/local/include/simavr"
+		SIMAVR_LIBS="-lsimavr -lelf"
+	fi
+fi
+
+if [ -z "$WORK" ]; then
+	WORK=$(mktemp -d)
+	trap 'rm -rf "$WORK"' EXIT
+fi
+mkdir -p "$WORK" || fail "cannot create $WORK"
+
+${CC:-cc} -O2 -o "$WORK/isr_bench" "$HERE/isr_bench.c" $SIMAVR_CFLAGS $SIMAVR_LIBS || fail "unable to build the simulator driver"
+
+#
+#	Edit a copy of the sketch: $1 is the file, the rest are
+#	sed substitutions each of which must match exactly one
+#	line, so that changes to the sketch are noticed.
+#
+configure() {
+	file=$1
+	shift
+	for edit in "$@"; do
+		before=$(md5sum < "$file")
+		sed -i "$edit" "$file"
+		[ "$before" != "$(md5sum < "$file")" ] || fail "edit '$edit' matched nothing in the sketch"
+	done
+}
+
+FAILED=""
+
+for part in $PARTS; do
+	case $part in
+		uno)		FQBN=arduino:avr:uno; MCU=atmega328p; UART=0; SIGNAL=TIMER2_COMPA ;;
+		leonardo)	FQBN=arduino:avr:leonardo; MCU=atmega32u4; UART=1; SIGNAL=TIMER0_COMPA ;;
+		mega)		FQBN=arduino:avr:mega:cpu=atmega2560; MCU=atmega2560; UART=0; SIGNAL=TIMER2_COMPA ;;
+		*)		fail "unknown part '$part'" ;;
+	esac
+
+	#
+	#	Vector numbers and the size of the vector table.
+	#
+	echo '#include <avr/io.h>' | "$AVR_GCC" -mmcu=$MCU -dM -E -x c - > "$WORK/$MCU.h" || fail "unable to read the $MCU headers"
+	sed -n 's/^#define \([A-Za-z0-9_]*\)_vect_num \([0-9]*\)$/\2 \1/p' "$WORK/$MCU.h" > "$WORK/$MCU.names"
+	VECTOR=$(sed -n "s/^\([0-9]*\) $SIGNAL\$/\1/p" "$WORK/$MCU.names")
+	TABLE=$(sed -n 's/^#define _VECTORS_SIZE \(.*\)$/\1/p' "$WORK/$MCU.h")
+	[ -n "$VECTOR" ] && [ -n "$TABLE" ] || fail "no vector information for $MCU"
+	TABLE=$(( $TABLE ))
+
+	for direct in 0 1; do
+		for prog in 1 0; do
+			name="$part"
+			[ $direct = 1 ] && name="$name port-direct" || name="$name pin-write"
+			[ $prog = 1 ] && name="$name programming" || name="$name no-programming"
+			dir="$WORK/$part-$direct-$prog"
+			rm -rf "$dir"
+			mkdir -p "$dir/ArduinoGenerator" || fail "cannot create $dir"
+			cp "$REPO"/*.h "$REPO"/*.cpp "$REPO"/ArduinoGenerator.ino "$dir/ArduinoGenerator/"
+			sketch="$dir/ArduinoGenerator/ArduinoGenerator.ino"
+			#
+			#	The LCD is not simulated, and the
+			#	path marker is always needed.
+			#
+			configure "$sketch" \
+				's|^#define LCD_DISPLAY_ENABLE|//&|' \
+				's|^//\(#define DEBUG_ISR_PATH\)|\1|'
+			[ $direct = 1 ] && configure "$sketch" \
+				's|^#define SHIELD_DEFAULT_ARDUINO|//&|' \
+				's|^//\(#define SHIELD_GENERATOR_DRIVER\)|\1|'
+			[ $prog = 0 ] && configure "$sketch" \
+				's|^#define PROGRAMMING_TRACK 1|//&|'
+			[ "$HALF_BIT" = 1 ] && configure "$sketch" \
+				's|^//\(#define SIGNAL_HALF_BIT_TIMER\)|\1|'
+
+			echo "== $name"
+			if ! arduino-cli compile --fqbn $FQBN --output-dir "$dir/out" "$dir/ArduinoGenerator" > "$dir/build.log" 2>&1; then
+				cat "$dir/build.log"
+				echo "FAIL: $name does not build"
+				FAILED="$FAILED
+  $name (build)"
+				continue
+			fi
+			if [ "$VERBOSE" = 1 ]; then
+				opts=-v
+			else
+				opts=
+			fi
+			"$WORK/isr_bench" $opts -m $MCU -u $UART -s $VECTOR -V $TABLE -n "$WORK/$MCU.names" \
+				-i "$SESSION" -t $RUN_MS -w $WINDOW -b $BUDGET \
+				"$dir/out/ArduinoGenerator.ino.elf"
+			case $? in
+				0)	;;
+				1)	FAILED="$FAILED
+  $name (over budget)" ;;
+				*)	FAILED="$FAILED
+  $name (simulation)" ;;
+			esac
+		done
+	done
+done
+
+if [ -n "$FAILED" ]; then
+	echo
+	echo "FAILED:$FAILED"
+	exit 1
+fi
+echo
+echo "All configurations within ${BUDGET}% of ${WINDOW} cycles."
+exit 0
@@ -0,0 +1,285 @@
+//
+//	Text command parser test
+//	========================
+//
+//	Checks parse_input(), which parses text commands a character
+//	at a time, against a copy of the code it replaced (which
+//	buffered the command up to PROT_OUT_CHAR, then scanned it
+//	with parse_number()).  Random strings of command characters
+//	are fed through both, and the commands each would execute
+//	are compared.  Strings which overflow the old 31 character
+//	command buffer are not compared, as the new parser has no
+//	such limit.
+//
+//	Given a session (any file of text commands) it also times
+//	both over the commands of the session, without executing
+//	them.
+//
+//	Build and run (from the top of the tree):
+//
+//		sh extras/host_sim/build.sh /tmp/command_parser extras/tests/command_parser.cpp -O2
+//		/tmp/command_parser [SESSION]
+//
+//	Exits with status 1 on any difference.  Times are host
+//	nanoseconds per command, not AVR cycle counts.
+//
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "host.h"
+
+#define STRINGS		3000000L
+#define PASSES		20000
+
+//
+//	The previous parser, unchanged but for its names and for
+//	returning the command instead of executing it.
+//
+#define OLD_MAXIMUM_DCC_CMD	32
+
+static char *old_parse_number( char *buf, bool *found, int *value ) {
+	int	v, n, c;
+
+	//
+	//	Skip any leading white space
+	//
+	while( isspace( *buf )) buf++;
+	//
+	//	Intentional assignment, remember if we are handling
+	//	a negative number.
+	//
+	if(( n = ( *buf == '-' ))) buf++;
+	//
+	//	gather up a decimal number
+	//
+	c = 0;
+	v = 0;
+	while( isdigit( *buf )) {
+		v = v * 10 + ( *buf++ - '0' );
+		c++;
+	}
+	if( n ) v = -v;
+	//
+	//	Skip any trailing white space
+	//
+	while( isspace( *buf )) buf++;
+	//
+	//	Set up returned data
+	//
+	*found = ( c > 0 );
+	*value = v;
+	//
+	//	Return address of next unprocessed character.
+	//
+	return( buf );
+}
+
+static int old_parse_input( char *buf, char *cmd, int *arg, int max ) {
+	int	args,
+		value;
+	bool	found;
+
+	//
+	//	Copy out the command character and verify
+	//
+	*cmd  = *buf++;
+	if( !isalnum( *cmd )) return( ERROR );
+	//
+	//	Step through remainder of string looking for
+	//	numbers.
+	//
+	args = 0;
+	found = true;
+	while( found ) {
+		buf = old_parse_number( buf, &found, &value );
+		if( found ) {
+			if( args >= max ) return( ERROR );
+			arg[ args++ ] = value;
+		}
+	}
+	//
+	//	Done.
+	//
+	return( args );
+}
+
+static char	old_cmd_buf[ OLD_MAXIMUM_DCC_CMD+1 ];
+static byte	old_cmd_used = 0;
+static bool	old_in_cmd_packet = false,
+		old_overflow = false;
+static char	old_cmd;
+static int	old_arg[ MAX_DCC_ARGS ],
+		old_args;
+
+static bool old_input( char c ) {
+	switch( c ) {
+		case PROT_IN_CHAR: {
+			old_cmd_used = 0;
+			old_in_cmd_packet =  true;
+			break;
+		}
+		case PROT_OUT_CHAR: {
+			if( old_in_cmd_packet ) {
+				old_cmd_buf[ old_cmd_used ] = EOS;
+				old_cmd_used = 0;
+				old_in_cmd_packet =  false;
+				return(( old_args = old_parse_input( old_cmd_buf, &old_cmd, old_arg, MAX_DCC_ARGS )) != ERROR );
+			}
+			break;
+		}
+		default: {
+			if( old_in_cmd_packet ) {
+				if(( c < SPACE )||( c >= DELETE )) {
+					old_cmd_used = 0;
+					old_in_cmd_packet =  false;
+				}
+				else {
+					if( old_cmd_used < OLD_MAXIMUM_DCC_CMD-1 ) {
+						old_cmd_buf[ old_cmd_used++ ] = c;
+					}
+					else {
+						old_overflow = true;
+						old_cmd_used = 0;
+						old_in_cmd_packet =  false;
+					}
+				}
+			}
+			break;
+		}
+	}
+	return( false );
+}
+
+//
+//	The commands each parser finds in a string, as text.
+//
+static std::string old_commands( const char *s, size_t len ) {
+	std::string	r;
+	char		num[ 16 ];
+
+	old_in_cmd_packet = false;
+	old_overflow = false;
+	for( size_t i = 0; i < len; i++ ) {
+		if( old_input( s[ i ])) {
+			r += old_cmd;
+			for( int a = 0; a < old_args; a++ ) {
+				snprintf( num, sizeof( num ), " %d", old_arg[ a ]);
+				r += num;
+			}
+			r += ';';
+		}
+	}
+	return( r );
+}
+
+static std::string new_commands( const char *s, size_t len ) {
+	std::string	r;
+	char		num[ 16 ];
+
+	parse_state = PARSE_IDLE;
+	for( size_t i = 0; i < len; i++ ) {
+		if( parse_input( s[ i ])) {
+			r += parse_cmd;
+			for( int a = 0; a < parse_args; a++ ) {
+				snprintf( num, sizeof( num ), " %d", parse_arg[ a ]);
+				r += num;
+			}
+			r += ';';
+		}
+	}
+	return( r );
+}
+
+static double now_ns( void ) {
+	struct timespec	t;
+
+	clock_gettime( CLOCK_MONOTONIC, &t );
+	return( t.tv_sec * 1e9 + t.tv_nsec );
+}
+
+int main( int argc, char **argv ) {
+	//
+	//	Weighted towards digits, spaces and signs so that most
+	//	strings hold plausible commands.
+	//
+	static const char	alphabet[] = "[[]]]  --0123456789012345678901234567890123456789MAFWx_#\t\x7f";
+	char			s[ 64 ];
+	unsigned		r = 1;
+	long			compared = 0,
+				skipped = 0,
+				differ = 0;
+
+	for( long n = 0; n < STRINGS; n++ ) {
+		size_t		len;
+		std::string	o, w;
+
+		r = r * 1103515245 + 12345;
+		len = 1 + ( r >> 16 ) % 48;
+		s[ 0 ] = '[';
+		for( size_t i = 1; i < len; i++ ) {
+			r = r * 1103515245 + 12345;
+			s[ i ] = alphabet[( r >> 16 ) % ( sizeof( alphabet ) - 1 )];
+		}
+		o = old_commands( s, len );
+		if( old_overflow ) {
+			skipped++;
+			continue;
+		}
+		w = new_commands( s, len );
+		compared++;
+		if( o != w ) {
+			if( differ++ < 10 ) printf( "\"%.*s\": old \"%s\", new \"%s\"\n", (int)len, s, o.c_str(), w.c_str());
+		}
+	}
+	printf( "compared %ld strings (%ld overflowed the old buffer), %ld differences\n", compared, skipped, differ );
+
+	if( argc > 1 ) {
+		std::vector<std::string>	session;
+		FILE				*f;
+		char				line[ 256 ];
+		long				commands = 0,
+						found = 0;
+		double				t0, t1, t2;
+
+		if(( f = fopen( argv[ 1 ], "r" )) == NULL ) {
+			perror( argv[ 1 ]);
+			return( 2 );
+		}
+		while( fgets( line, sizeof( line ), f )) {
+			char	*p, *q;
+
+			for( p = line; *p == ' '; p++ );
+			if(( *p == '[' )&&( q = strchr( p, ']' ))) session.push_back( std::string( p, q + 1 ));
+		}
+		fclose( f );
+		if( session.empty()) {
+			fprintf( stderr, "%s: no commands\n", argv[ 1 ]);
+			return( 2 );
+		}
+		t0 = now_ns();
+		for( int pass = 0; pass < PASSES; pass++ ) {
+			for( size_t c = 0; c < session.size(); c++ ) {
+				const std::string &cmd = session[ c ];
+
+				for( size_t i = 0; i < cmd.size(); i++ ) if( old_input( cmd[ i ])) found++;
+			}
+		}
+		t1 = now_ns();
+		for( int pass = 0; pass < PASSES; pass++ ) {
+			for( size_t c = 0; c < session.size(); c++ ) {
+				const std::string &cmd = session[ c ];
+
+				for( size_t i = 0; i < cmd.size(); i++ ) if( parse_input( cmd[ i ])) found++;
+			}
+		}
+		t2 = now_ns();
+		commands = (long)session.size() * PASSES;
+		printf( "%zu commands: old %.1fns, new %.1fns per command\n", session.size(), ( t1 - t0 ) / commands, ( t2 - t1 ) / commands );
+		if( found != 2 * commands ) {
+			printf( "only %ld of %ld commands parsed\n", found, 2 * commands );
+			return( 1 );
+		}
+	}
+	return( differ? 1: 0 );
+}
@@ -0,0 +1,195 @@
+//
+//	Function group packet test
+//	==========================
+//
+//	Checks compose_function_block() against a copy of the routine
+//	it replaced (which tested one function bit at a time), bit for
+//	bit, over every combination of the 29 function states F0-F28:
+//	all five group packets for each, with a short address, and
+//	also with a long address for the first 2^20 combinations.  The
+//	group compose_function_change() picks for each function is
+//	checked against the old if/else chain.
+//
+//	This guards function_group_bits(), which reads the group bits
+//	from two adjacent bytes of the function bit array.
+//
+//	Build and run (from the top of the tree):
+//
+//		sh extras/host_sim/build.sh /tmp/function_block extras/tests/function_block.cpp -O2
+//		/tmp/function_block [BITS]
+//
+//	BITS (default 29) limits the run to the combinations of the
+//	lowest BITS functions.  Exits with status 1 on any difference.
+//
+#include "host.h"
+
+//
+//	The previous compose_function_block(), unchanged but for
+//	its name.
+//
+static byte old_function_block( byte *command, int *state, int adrs, int *fn, int count ) {
+	byte	len;
+
+	ASSERT( command != NULL );
+	ASSERT( state != NULL );
+	ASSERT( *state >= 0  );
+	ASSERT(( adrs >= MINIMUM_DCC_ADDRESS )&&( adrs <= MAXIMUM_DCC_ADDRESS ));
+	ASSERT( fn != NULL );
+	ASSERT( count >= 0 );
+	ASSERT(( count * 8 ) > MAX_FUNCTION_NUMBER );
+	
+	//
+	//	Function has changed value, update the corresponding decoder.
+	//
+	if( adrs > MAXIMUM_SHORT_ADDRESS ) {
+		command[ 0 ] = 0b11000000 | ( adrs >> 8 );
+		command[ 1 ] = adrs & 0b11111111;
+		len = 2;
+	}
+	else {
+		command[ 0 ] = adrs;
+		len = 1;
+	}
+	//
+	//	Now the value of the state variable tells us which DCC funciton
+	//	setting command we need to create (which we also auto increment
+	//	in preparationn for the next call).
+	//
+	switch( (*state)++ ) {
+		//
+		//	I know the bit manipulation code in the following is
+		//	really inefficient, but it is clear and easy to see that
+		//	it's correct.  For the time being this is more important
+		//	than fast code which is wrong.
+		//
+		case 0: {
+			//
+			//	F0-F4		100[F0][F4][F3][F2][F1]
+			//
+			command[ len++ ] =	0x80	| (( fn[0] & 0x01 )? 0x10: 0 )
+							| (( fn[0] & 0x02 )? 0x01: 0 )
+							| (( fn[0] & 0x04 )? 0x02: 0 )
+							| (( fn[0] & 0x08 )? 0x04: 0 )
+							| (( fn[0] & 0x10 )? 0x08: 0 );
+			break;
+		}
+		case 1: {
+			//
+			//	F5-F8		1011[F8][F7][F6][F5]
+			//
+			command[ len++ ] =	0xb0	| (( fn[0] & 0x20 )? 0x01: 0 )
+							| (( fn[0] & 0x40 )? 0x02: 0 )
+							| (( fn[0] & 0x80 )? 0x04: 0 )
+							| (( fn[1] & 0x01 )? 0x08: 0 );
+			break;
+		}
+		case 2: {
+			//
+			//	F9-F12		1010[F12][F11][F10][F9]
+			//
+			command[ len++ ] =	0xa0	| (( fn[1] & 0x02 )? 0x01: 0 )
+							| (( fn[1] & 0x04 )? 0x02: 0 )
+							| (( fn[1] & 0x08 )? 0x04: 0 )
+							| (( fn[1] & 0x10 )? 0x08: 0 );
+			break;
+		}
+		case 3: {
+			//
+			//	F13-F20		11011110, [F20][F19][F18][F17][F16][F15][F14][F13]
+			//
+			command[ len++ ] =	0xde;
+			command[ len++ ] =		  (( fn[1] & 0x20 )? 0x01: 0 )
+							| (( fn[1] & 0x40 )? 0x02: 0 )
+							| (( fn[1] & 0x80 )? 0x04: 0 )
+							| (( fn[2] & 0x01 )? 0x08: 0 )
+							| (( fn[2] & 0x02 )? 0x10: 0 )
+							| (( fn[2] & 0x04 )? 0x20: 0 )
+							| (( fn[2] & 0x08 )? 0x40: 0 )
+							| (( fn[2] & 0x10 )? 0x80: 0 );
+			break;
+		}
+		case 4: {
+			//
+			//	F21-F28		11011111, [F28][F27][F26][F25][F24][F23][F22][F21]
+			//
+			command[ len++ ] =	0xdf;
+			command[ len++ ] =		  (( fn[2] & 0x20 )? 0x01: 0 )
+							| (( fn[2] & 0x40 )? 0x02: 0 )
+							| (( fn[2] & 0x80 )? 0x04: 0 )
+							| (( fn[3] & 0x01 )? 0x08: 0 )
+							| (( fn[3] & 0x02 )? 0x10: 0 )
+							| (( fn[3] & 0x04 )? 0x20: 0 )
+							| (( fn[3] & 0x08 )? 0x40: 0 )
+							| (( fn[3] & 0x10 )? 0x80: 0 );
+			break;
+		}
+		default: {
+			return( 0 );
+		}
+	}
+	//
+	//	Done!
+	//
+	return( len );
+}
+
+//
+//	The previous choice of group for a function.
+//
+static int old_function_group( int func ) {
+	if( func <= 4 ) return( 0 );
+	if( func <= 8 ) return( 1 );
+	if( func <= 12 ) return( 2 );
+	if( func <= 20 ) return( 3 );
+	return( 4 );
+}
+
+int main( int argc, char **argv ) {
+	static const int	adrs[ 2 ] = { 3, 1234 };
+	unsigned long		limit,
+				compared = 0,
+				differ = 0;
+	int			width;
+
+	width = ( argc > 1 )? atoi( argv[ 1 ]): 29;
+	if(( width < 1 )||( width > 29 )) {
+		fprintf( stderr, "BITS must be 1 to 29\n" );
+		return( 2 );
+	}
+	limit = 1UL << width;
+
+	for( int f = MIN_FUNCTION_NUMBER; f <= MAX_FUNCTION_NUMBER; f++ ) {
+		byte	g;
+
+		for( g = 0; f > pgm_read_byte( &( function_group[ g ].last )); g++ );
+		if( g != old_function_group( f )) {
+			printf( "F%d: group %d, was %d\n", f, g, old_function_group( f ));
+			differ++;
+		}
+	}
+
+	for( unsigned long m = 0; m < limit; m++ ) {
+		int	fn[ FUNCTION_BIT_ARRAY ];
+
+		for( int i = 0; i < FUNCTION_BIT_ARRAY; i++ ) fn[ i ] = ( m >> ( i * 8 )) & 0xff;
+		for( int a = 0; a < (( m < ( 1UL << 20 ))? 2: 1 ); a++ ) {
+			int	s1 = 0,
+				s2 = 0;
+			byte	c1[ MAXIMUM_DCC_COMMAND ],
+				c2[ MAXIMUM_DCC_COMMAND ],
+				l1,
+				l2;
+
+			do {
+				l1 = old_function_block( c1, &s1, adrs[ a ], fn, FUNCTION_BIT_ARRAY );
+				l2 = compose_function_block( c2, &s2, adrs[ a ], fn, FUNCTION_BIT_ARRAY );
+				compared++;
+				if(( l1 != l2 )|| memcmp( c1, c2, l1 )) {
+					if( differ++ < 10 ) printf( "functions %08lx adrs %d group %d differ\n", m, adrs[ a ], s1 - 1 );
+				}
+			} while( l1 && l2 );
+		}
+	}
+	printf( "compared %lu packets, %lu differences\n", compared, differ );
+	return( differ? 1: 0 );
+}
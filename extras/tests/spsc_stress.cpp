@@ -0,0 +1,107 @@
+//
+//	Single producer/consumer queue stress test
+//	==========================================
+//
+//	Runs the sketch's SPSC_Byte_Queue<> (Byte_Queue.h) with a
+//	writer and a reader on two threads, standing in for the
+//	USART interrupt and the main loop.  Each side passes the same
+//	sequence of bytes through the console queue sizes, one byte
+//	at a time and in blocks of random length (through reserve()
+//	and commit(), peek() and consume()), and the reader checks
+//	that nothing is lost, repeated or reordered.  Neither side
+//	should ever see more than the queue size in use.
+//
+//	Build and run (from the top of the tree):
+//
+//		sh extras/host_sim/build.sh /tmp/spsc_stress extras/tests/spsc_stress.cpp -O2 -pthread && /tmp/spsc_stress
+//
+//	Exits with status 1 on any failure.
+//
+#include <stdio.h>
+#include <thread>
+#include <atomic>
+
+#include "host.h"
+
+#define BYTES		20000000L
+#define BLOCK		40
+
+//
+//	The byte expected at position i: not a simple count, so that
+//	a stale byte in the queue area shows up.
+//
+static byte expected( long i ) {
+	return((byte)( i * 7 + ( i >> 8 )));
+}
+
+template< data_size SIZE >
+static long stress( bool blocks ) {
+	static SPSC_Byte_Queue< SIZE >	q;
+	std::atomic<long>		bad( 0 );
+
+	std::thread writer( [ & ] {
+		byte		buf[ BLOCK ];
+		unsigned	r = 1;
+		long		i = 0;
+
+		while( i < BYTES ) {
+			data_size	n;
+
+			if( q.space() > SIZE ) bad++;
+			if( blocks ) {
+				r = r * 1103515245 + 12345;
+				n = 1 + ( r >> 16 ) % BLOCK;
+				if( n > BYTES - i ) n = BYTES - i;
+				for( data_size j = 0; j < n; j++ ) buf[ j ] = expected( i + j );
+				n = q.write( buf, n );
+			}
+			else {
+				n = q.write( expected( i ))? 1: 0;
+			}
+			if( n ) i += n; else std::this_thread::yield();
+		}
+	});
+	std::thread reader( [ & ] {
+		byte		buf[ BLOCK ];
+		unsigned	r = 2;
+		long		i = 0;
+
+		while( i < BYTES ) {
+			data_size	n;
+
+			if( q.available() > SIZE ) bad++;
+			if( blocks ) {
+				r = r * 1103515245 + 12345;
+				n = q.read( buf, 1 + ( r >> 16 ) % BLOCK );
+				for( data_size j = 0; j < n; j++ ) if( buf[ j ] != expected( i + j )) bad++;
+			}
+			else if(( n = ( q.available()? 1: 0 ))) {
+				if( q.read() != expected( i )) bad++;
+			}
+			if( n ) i += n; else std::this_thread::yield();
+		}
+	});
+	writer.join();
+	reader.join();
+	//
+	//	The queue is now empty: fill it and check that it holds
+	//	exactly SIZE bytes.
+	//
+	if( q.available() != 0 ) bad++;
+	for( long j = 0; j < SIZE + 2; j++ ) (void)q.write((byte)j );
+	if(( q.space() != 0 )||( q.available() != SIZE )) bad++;
+	while( q.available()) (void)q.read();
+	printf( "SPSC_Byte_Queue<%d> %s: %ld bytes, %ld errors\n", (int)SIZE, ( blocks? "blocks": "bytes" ), BYTES, bad.load());
+	return( bad );
+}
+
+int main( void ) {
+	long	bad = 0;
+
+	bad += stress< 32 >( false );
+	bad += stress< 32 >( true );
+	bad += stress< 64 >( true );
+	bad += stress< 128 >( false );
+	bad += stress< 128 >( true );
+	return( bad? 1: 0 );
+}